@@ -158,6 +158,22 @@ class MainActivity : FragmentActivity() {
 
         ModelUpdateWorker.schedule(this)
 
+        // Warm the default model in the background so the first reply skips the cold load
+        if (extFilesDir != null) {
+            lifecycleScope.launch {
+                val defaultModel = preferencesRepository.getDefaultModelName()
+                val modelFile = File(extFilesDir, defaultModel)
+                if (defaultModel.isNotEmpty() && modelFile.exists()) {
+                    val started = LLamaAndroid.instance().preload(
+                        modelFile.absolutePath,
+                        userThreads = preferencesRepository.getModelThreadCount(),
+                        gpuLayers = preferencesRepository.getModelGpuLayers()
+                    )
+                    android.util.Log.d("MainActivity", "Preload of $defaultModel started: $started")
+                }
+            }
+        }
+
         val content = @Composable {
             val themeViewModel: ThemeViewModel = viewModel(
                 factory = ThemeViewModelFactory(preferencesRepository, applicationContext)
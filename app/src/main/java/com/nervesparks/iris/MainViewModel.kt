@@ -531,13 +531,23 @@ class MainViewModel @Inject constructor(
         return out
     }
 
-    suspend fun quantizeModel(model: String, quantizeType: String): Int {
+    suspend fun quantizeModel(
+        model: String,
+        quantizeType: String,
+        onProgress: ((LLamaAndroid.QuantizeProgress) -> Unit)? = null
+    ): Int {
         val inputFile = File(getApplication<Application>().getExternalFilesDir(null), model)
         val outputFile = File(
             getApplication<Application>().getExternalFilesDir(null),
             "${model.substringBeforeLast(".")}-$quantizeType.gguf"
         )
-        return llamaAndroid.quantize(inputFile.absolutePath, outputFile.absolutePath, quantizeType)
+        return llamaAndroid.quantize(
+            inputFile.absolutePath,
+            outputFile.absolutePath,
+            quantizeType,
+            LLamaAndroid.QuantizeOptions(keepOutputHighPrecision = true),
+            onProgress
+        )
     }
 
     private var template by mutableStateOf("")
@@ -1066,16 +1076,17 @@ class MainViewModel @Inject constructor(
 
         var wasPruned = false
 
-        // Strategy 1: Remove oldest non-system messages first
-        while (currentContextLimit + additionalTokens > modelContextLength && workingMessages.size > 1) {
-            val oldestNonSystemIndex = workingMessages.indexOfFirst { it["role"] != "system" }
-            if (oldestNonSystemIndex >= 0) {
-                workingMessages.removeAt(oldestNonSystemIndex)
-                currentContextLimit = calculateContextLimit(workingMessages)
-                wasPruned = true
-            } else {
-                break
-            }
+        // Strategy 1: Remove oldest non-system messages first, picked natively in one pass
+        val window = llamaAndroid.fitContextWindow(
+            workingMessages.map { mapOf("role" to it["role"].toString(), "content" to it["content"].toString()) },
+            modelChatFormat,
+            modelContextLength,
+            additionalTokens
+        )
+        if (window.dropped > 0) {
+            workingMessages = window.kept.map { workingMessages[it] }.toMutableList()
+            currentContextLimit = calculateContextLimit(workingMessages)
+            wasPruned = true
         }
 
         // Strategy 2: If still over limit, summarize the conversation
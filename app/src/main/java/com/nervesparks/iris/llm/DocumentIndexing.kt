@@ -13,6 +13,16 @@ suspend fun performDocumentIndexing(
         throw ValidationException("Document is empty")
     }
 
-    val embedding = embeddingService.embed(sanitizedText)
-    documentRepository.addDocument(sanitizedText, embedding)
+    // one entry per chunk, stored while later chunks are still being embedded
+    var stored = 0
+    embeddingService.embedDocument(sanitizedText).collect { (chunk, embedding) ->
+        val chunkText = chunk.trim()
+        if (chunkText.isNotBlank()) {
+            documentRepository.addDocument(chunkText, embedding)
+            stored++
+        }
+    }
+    if (stored == 0) {
+        throw ValidationException("Document produced no indexable text")
+    }
 }
@@ -2,6 +2,8 @@ package com.nervesparks.iris.llm
 
 import android.llama.cpp.LLamaAndroid
 import kotlinx.coroutines.CoroutineDispatcher
+import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.map
 import kotlinx.coroutines.withContext
 import javax.inject.Inject
 import javax.inject.Named
@@ -13,4 +15,11 @@ class EmbeddingService @Inject constructor(
     suspend fun embed(text: String): List<Float> = withContext(dispatcher) {
         llamaAndroid.getEmbeddings(text).toList()
     }
+
+    /**
+     * Splits [text] into token-exact overlapping chunks and embeds them natively in batches.
+     * Emits (chunk text, embedding) pairs as they become ready.
+     */
+    fun embedDocument(text: String): Flow<Pair<String, List<Float>>> =
+        llamaAndroid.indexDocument(text).map { it.text to it.embedding.toList() }
 }
@@ -32,8 +32,8 @@ import com.nervesparks.iris.viewmodel.ModelViewModel
 import com.nervesparks.iris.ui.theme.ComponentStyles
 import com.nervesparks.iris.ui.theme.PrimaryButton
 import java.io.File
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Job
-import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
 
 @OptIn(ExperimentalMaterial3Api::class)
@@ -154,16 +154,14 @@ fun QuantizeScreen(
                 } else {
                     showProgress = true
                     progress = 0f
-                    progressText = "Downloading model..."
+                    progressText = "Preparing..."
                     quantizeJob = coroutineScope.launch {
                         try {
-                            delay(100)
-                            progress = 0.33f
-                            progressText = "Converting model..."
-                            val result = viewModel.quantizeModel(selectedModel, selectedQuantization)
+                            val result = viewModel.quantizeModel(selectedModel, selectedQuantization) { p ->
+                                progress = p.fraction
+                                progressText = "Tensor ${p.tensorsDone}/${p.tensorsTotal}: ${p.tensor}"
+                            }
                             if (result == 0) {
-                                progress = 0.66f
-                                progressText = "Saving model..."
                                 progress = 1f
                                 showProgress = false
                                 Toast.makeText(context, "Quantization successful", Toast.LENGTH_SHORT).show()
@@ -171,6 +169,8 @@ fun QuantizeScreen(
                                 showProgress = false
                                 errorMessage = "Quantization failed with code $result"
                             }
+                        } catch (e: CancellationException) {
+                            showProgress = false
                         } catch (e: Exception) {
                             showProgress = false
                             errorMessage = "Quantization failed: ${e.message}"
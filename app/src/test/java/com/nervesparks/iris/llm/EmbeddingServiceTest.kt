@@ -4,6 +4,8 @@ import android.llama.cpp.LLamaAndroid
 import io.mockk.every
 import io.mockk.mockk
 import kotlinx.coroutines.ExperimentalCoroutinesApi
+import kotlinx.coroutines.flow.flowOf
+import kotlinx.coroutines.flow.toList
 import kotlinx.coroutines.test.StandardTestDispatcher
 import kotlinx.coroutines.test.runTest
 import org.junit.Assert.assertEquals
@@ -24,4 +26,23 @@ class EmbeddingServiceTest {
 
         assertEquals(listOf(1.0f, 2.0f, 3.0f), result)
     }
+
+    @Test
+    fun embedDocumentEmitsChunksFromNativeIndexer() = runTest {
+        val dispatcher = StandardTestDispatcher(testScheduler)
+        val llamaAndroid = mockk<LLamaAndroid>()
+        every { llamaAndroid.indexDocument("a long document", any(), any()) } returns flowOf(
+            LLamaAndroid.IndexedChunk(0, "a long", floatArrayOf(1.0f, 0.0f)),
+            LLamaAndroid.IndexedChunk(1, "long document", floatArrayOf(0.0f, 1.0f))
+        )
+
+        val service = EmbeddingService(llamaAndroid, dispatcher)
+
+        val result = service.embedDocument("a long document").toList()
+
+        assertEquals(
+            listOf("a long" to listOf(1.0f, 0.0f), "long document" to listOf(0.0f, 1.0f)),
+            result
+        )
+    }
 }
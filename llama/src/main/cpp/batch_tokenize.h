@@ -0,0 +1,97 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Tokenizes a list of texts in one call. Each worker claims texts in order and
+// tokenizes into its own scratch buffer, which grows to the longest text it sees and is
+// then reused, so a batch costs a handful of allocations instead of one per text. Small
+// batches run on the calling thread; spawning workers costs more than they would save.
+
+struct token_batch {
+    std::vector<int32_t> counts;    // tokens per text
+    std::vector<int32_t> offsets;   // text i is ids[offsets[i] .. offsets[i + 1]); with ids only
+    std::vector<int32_t> ids;       // flattened, in text order; with ids only
+};
+
+// Tokenizes `text` into `out` (out.size() tokens of room) and returns the token count,
+// or minus the room it needs when `out` is too small (llama_tokenize's contract).
+using tokenize_fn = std::function<int32_t(const std::string & text, int32_t * out, int32_t n_max)>;
+
+// Below this many bytes in total the batch is tokenized on the calling thread.
+constexpr size_t BATCH_TOKENIZE_PARALLEL_BYTES = 16 * 1024;
+
+inline token_batch batch_tokenize(const std::vector<std::string> & texts, bool with_ids, int n_threads,
+                                  const tokenize_fn & tokenize) {
+    token_batch result;
+    result.counts.assign(texts.size(), 0);
+
+    size_t total_bytes = 0;
+    for (const auto & t : texts) total_bytes += t.size();
+    if (total_bytes < BATCH_TOKENIZE_PARALLEL_BYTES) {
+        n_threads = 1;
+    }
+    n_threads = std::max(1, std::min(n_threads, (int) texts.size()));
+
+    // per worker: ids of the texts it claimed and (text index, start in tokens) per text
+    struct worker_out {
+        std::vector<int32_t>                   tokens;
+        std::vector<std::pair<size_t, size_t>> spans;
+    };
+    std::vector<worker_out> outs(n_threads);
+    std::atomic<size_t> next{0};
+
+    auto work = [&](worker_out & out) {
+        std::vector<int32_t> scratch;
+        for (size_t i; (i = next.fetch_add(1)) < texts.size();) {
+            const std::string & text = texts[i];
+            if (scratch.size() < text.size() + 2) {
+                scratch.resize(text.size() + 2);   // a token covers at least one byte, plus BOS/EOS
+            }
+            int32_t n = tokenize(text, scratch.data(), (int32_t) scratch.size());
+            if (n < 0) {
+                scratch.resize((size_t) -n);
+                n = tokenize(text, scratch.data(), (int32_t) scratch.size());
+            }
+            n = std::max(0, n);
+            result.counts[i] = n;
+            if (with_ids) {
+                out.spans.emplace_back(i, out.tokens.size());
+                out.tokens.insert(out.tokens.end(), scratch.begin(), scratch.begin() + n);
+            }
+        }
+    };
+
+    if (n_threads == 1) {
+        work(outs[0]);
+    } else {
+        std::vector<std::thread> workers;
+        for (int t = 1; t < n_threads; ++t) {
+            workers.emplace_back(work, std::ref(outs[t]));
+        }
+        work(outs[0]);
+        for (auto & w : workers) w.join();
+    }
+
+    if (!with_ids) {
+        return result;
+    }
+    result.offsets.assign(texts.size() + 1, 0);
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result.offsets[i + 1] = result.offsets[i] + result.counts[i];
+    }
+    result.ids.resize((size_t) result.offsets.back());
+    for (const auto & out : outs) {
+        for (const auto & span : out.spans) {
+            const size_t i = span.first;
+            std::copy_n(out.tokens.begin() + span.second, result.counts[i], result.ids.begin() + result.offsets[i]);
+        }
+    }
+    return result;
+}
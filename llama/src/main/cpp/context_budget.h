@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Picks the chat history that fits the context window without rendering the template or
+// tokenizing the prompt: every message costs its own token count plus what the template
+// wraps around a message of its role, and the prompt as a whole costs a fixed overhead
+// (generation prompt, BOS). Counting messages separately can only miss merges across
+// message boundaries, which special tokens mostly prevent, so the estimate errs high.
+
+enum budget_role {
+    BUDGET_ROLE_SYSTEM    = 0,
+    BUDGET_ROLE_USER      = 1,   // also tool results and unknown roles
+    BUDGET_ROLE_ASSISTANT = 2,
+};
+
+inline int budget_role_of(const std::string & role) {
+    if (role == "system")    return BUDGET_ROLE_SYSTEM;
+    if (role == "assistant") return BUDGET_ROLE_ASSISTANT;
+    return BUDGET_ROLE_USER;
+}
+
+// Template tokens, measured once per template (see measure_budget_overhead).
+struct budget_overhead {
+    int32_t base        = 0;   // generation prompt, BOS
+    int32_t per_role[3] = { 0, 0, 0 };
+};
+
+// Overheads from the token counts of four renders with empty contents:
+// [user], [user, assistant], [user, assistant, user] and [system, user].
+inline budget_overhead measure_budget_overhead(int32_t n_u, int32_t n_ua, int32_t n_uau, int32_t n_su) {
+    budget_overhead o;
+    o.per_role[BUDGET_ROLE_ASSISTANT] = std::max(0, n_ua - n_u);
+    o.per_role[BUDGET_ROLE_USER]      = std::max(0, n_uau - n_ua);
+    o.per_role[BUDGET_ROLE_SYSTEM]    = std::max(0, n_su - n_u);
+    o.base = std::max(0, n_u - o.per_role[BUDGET_ROLE_USER]);
+    return o;
+}
+
+struct budget_message {
+    int     role;     // budget_role
+    int32_t tokens;   // content tokens
+};
+
+struct budget_window {
+    std::vector<int32_t> kept;         // message indices, ascending
+    int32_t              tokens = 0;   // estimated prompt tokens of the kept messages
+    bool                 fits   = false;
+};
+
+// Keeps every system message and the longest run of latest other messages that fits in
+// n_ctx - n_reserve, in one pass from the newest: the app's old pruning loop, which dropped
+// the oldest non-system message until the prompt fit, without rendering per drop. The
+// newest non-system message is always kept (fits is false when even it does not fit).
+// With `start_with_user`, assistant messages left at the front of the run are dropped
+// too, for templates that require a user turn there.
+inline budget_window fit_context_window(const std::vector<budget_message> & messages, const budget_overhead & overhead,
+                                        int32_t n_ctx, int32_t n_reserve, bool start_with_user = false) {
+    budget_window w;
+    const int32_t budget = n_ctx - n_reserve;
+    auto cost = [&](const budget_message & m) {
+        return m.tokens + overhead.per_role[std::min(std::max(m.role, 0), 2)];
+    };
+
+    w.tokens = overhead.base;
+    for (const auto & m : messages) {
+        if (m.role == BUDGET_ROLE_SYSTEM) {
+            w.tokens += cost(m);
+        }
+    }
+    // non-system messages from index `start` on are kept
+    size_t start = messages.size();
+    bool any = false;
+    for (size_t i = messages.size(); i-- > 0;) {
+        if (messages[i].role == BUDGET_ROLE_SYSTEM) {
+            continue;
+        }
+        const int32_t c = cost(messages[i]);
+        if (any && w.tokens + c > budget) {
+            break;
+        }
+        w.tokens += c;
+        start = i;
+        any = true;
+    }
+    if (start_with_user) {
+        size_t newest = messages.size();
+        while (newest > 0 && messages[newest - 1].role == BUDGET_ROLE_SYSTEM) newest--;
+        while (start + 1 < newest && messages[start].role != BUDGET_ROLE_USER) {
+            if (messages[start].role == BUDGET_ROLE_ASSISTANT) {
+                w.tokens -= cost(messages[start]);
+            }
+            start++;
+        }
+    }
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (messages[i].role == BUDGET_ROLE_SYSTEM || i >= start) {
+            w.kept.push_back((int32_t) i);
+        }
+    }
+    w.fits = w.tokens <= budget;
+    return w;
+}
+
+// Token counts of message texts, keyed by the tokenizer they were counted with and the
+// text's hash, so a growing chat only tokenizes its new messages. Entries keep their text
+// and a hit compares it, so a hash collision is a miss, not a wrong count. Oldest entries
+// go first once `capacity` is reached. Thread-safe.
+template <typename Owner>
+class token_count_cache {
+public:
+    explicit token_count_cache(size_t capacity) : capacity_(capacity) {}
+
+    bool lookup(const Owner * owner, const std::string & text, int32_t & n) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = counts_.find(key_of(owner, text));
+        if (it == counts_.end() || it->second.text != text) {
+            return false;
+        }
+        n = it->second.n;
+        return true;
+    }
+
+    void store(const Owner * owner, const std::string & text, int32_t n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const key k = key_of(owner, text);
+        auto inserted = counts_.emplace(k, entry{ text, n });
+        if (inserted.second) {
+            order_.push_back(k);
+        } else {
+            inserted.first->second = entry{ text, n };   // same text again, or a colliding one
+        }
+        while (order_.size() > capacity_) {
+            counts_.erase(order_.front());
+            order_.pop_front();
+        }
+    }
+
+    void forget_owner(const Owner * owner) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = order_.begin(); it != order_.end();) {
+            if (it->owner == owner) {
+                counts_.erase(*it);
+                it = order_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return counts_.size();
+    }
+
+private:
+    struct key {
+        const Owner * owner;
+        uint64_t      hash;
+        size_t        length;
+        bool operator==(const key & o) const { return owner == o.owner && hash == o.hash && length == o.length; }
+    };
+    struct key_hash {
+        size_t operator()(const key & k) const { return (size_t) (k.hash ^ (uint64_t) (uintptr_t) k.owner); }
+    };
+    struct entry {
+        std::string text;
+        int32_t     n;
+    };
+
+    static key key_of(const Owner * owner, const std::string & text) {
+        uint64_t h = 0xcbf29ce484222325ull;   // FNV-1a
+        for (unsigned char c : text) {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        return { owner, h, text.size() };
+    }
+
+    size_t                                     capacity_;
+    mutable std::mutex                         mutex_;
+    std::unordered_map<key, entry, key_hash>   counts_;
+    std::deque<key>                            order_;
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Big.LITTLE aware core counting from cpufreq sysfs. `sysfs_cpu_root` is
+// normally /sys/devices/system/cpu and only overridden by tests.
+
+// Max frequency (kHz) of every CPU that exposes cpufreq, or an empty vector when none does.
+inline std::vector<long> cpu_max_frequencies(const std::string & sysfs_cpu_root = "/sys/devices/system/cpu") {
+    std::vector<long> freqs;
+    struct stat st{};
+    for (int cpu = 0; stat((sysfs_cpu_root + "/cpu" + std::to_string(cpu)).c_str(), &st) == 0; ++cpu) {
+        std::ifstream f(sysfs_cpu_root + "/cpu" + std::to_string(cpu) + "/cpufreq/cpuinfo_max_freq");
+        long khz = 0;
+        if (f >> khz && khz > 0) {
+            freqs.push_back(khz);
+        }
+    }
+    return freqs;
+}
+
+// Number of cores outside the slowest cluster. On a homogeneous CPU, or when
+// the frequencies are unknown, every online core counts.
+inline int cpu_performance_core_count(const std::string & sysfs_cpu_root = "/sys/devices/system/cpu") {
+    const int n_online = std::max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    const auto freqs = cpu_max_frequencies(sysfs_cpu_root);
+    if (freqs.empty()) {
+        return n_online;
+    }
+    const long slowest = *std::min_element(freqs.begin(), freqs.end());
+    const int n_fast = (int) std::count_if(freqs.begin(), freqs.end(), [&](long f) { return f > slowest; });
+    return std::min(n_online, n_fast > 0 ? n_fast : (int) freqs.size());
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Building blocks of the native document indexing pipeline: the document is cut into
+// segments that worker threads tokenize in parallel, the token stream is cut into
+// overlapping chunks of an exact token count, and chunks reach the embedding thread
+// through a bounded queue.
+
+// Cuts `text` into segments of about `target` bytes for parallel tokenization. Cuts go
+// right before a whitespace run (paragraph break preferred, then line break, then any
+// space) so that no word is split; text without whitespace is cut at a UTF-8 boundary.
+// Returns (offset, length) pairs that cover the text.
+inline std::vector<std::pair<size_t, size_t>> split_segments(const std::string & text, size_t target) {
+    auto is_space = [](char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f'; };
+    std::vector<std::pair<size_t, size_t>> out;
+    target = std::max<size_t>(target, 16);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = pos + target;
+        if (end >= text.size()) {
+            out.emplace_back(pos, text.size() - pos);
+            break;
+        }
+        size_t cut[3] = { 0, 0, 0 };   // paragraph, line, space
+        for (size_t p = end; p > pos + target / 2; --p) {
+            if (!is_space(text[p]) || is_space(text[p - 1])) continue;
+            const bool line = text[p] == '\n' || text[p] == '\f';
+            const bool para = line && p + 1 < text.size() && (text[p + 1] == '\n' || text[p + 1] == '\f');
+            const int tier = para ? 0 : (line ? 1 : 2);
+            if (!cut[tier]) cut[tier] = p;
+            if (tier == 0) break;
+        }
+        size_t at = cut[0] ? cut[0] : (cut[1] ? cut[1] : cut[2]);
+        if (!at) {
+            at = end;
+            while (at > pos + 1 && (static_cast<unsigned char>(text[at]) & 0xC0) == 0x80) --at;
+        }
+        out.emplace_back(pos, at - pos);
+        pos = at;
+    }
+    return out;
+}
+
+// Pages of a text dump: form feeds separate pages in pdftotext output; without them a
+// page is counted as 3000 characters.
+inline double count_pages(const std::string & text) {
+    const size_t ff = (size_t) std::count(text.begin(), text.end(), '\f');
+    if (ff > 0) {
+        return (double) ff + (text.back() == '\f' ? 0 : 1);
+    }
+    return text.empty() ? 0.0 : std::max(1.0, text.size() / 3000.0);
+}
+
+// Cuts a token stream into chunks of `chunk` tokens where consecutive chunks share
+// `overlap` tokens. The last chunk holds whatever is left and may be shorter.
+template <typename T>
+class token_chunker {
+public:
+    token_chunker(size_t chunk, size_t overlap)
+        : chunk_(std::max<size_t>(1, chunk)), overlap_(std::min(overlap, chunk_ - 1)) {}
+
+    // Appends tokens and moves every completed chunk to `out`.
+    void push(const T * tokens, size_t n, std::vector<std::vector<T>> & out) {
+        buf_.insert(buf_.end(), tokens, tokens + n);
+        while (buf_.size() >= chunk_) {
+            out.emplace_back(buf_.begin(), buf_.begin() + chunk_);
+            buf_.erase(buf_.begin(), buf_.begin() + (chunk_ - overlap_));
+            emitted_ = true;
+        }
+    }
+
+    // Moves the final partial chunk to `out`, unless it holds only overlap tokens.
+    void finish(std::vector<std::vector<T>> & out) {
+        if (!buf_.empty() && (!emitted_ || buf_.size() > overlap_)) {
+            out.push_back(std::move(buf_));
+        }
+        buf_.clear();
+    }
+
+private:
+    size_t         chunk_;
+    size_t         overlap_;
+    std::vector<T> buf_;
+    bool           emitted_ = false;
+};
+
+// Blocking FIFO of at most `capacity` items between a producer and a consumer.
+template <typename T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {}
+
+    // Waits for room; false when the queue was closed.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Waits for an item; false once the queue is closed and drained.
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Takes whatever is queued without waiting, up to `max` items.
+    size_t try_pop_many(std::vector<T> & out, size_t max) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t n = 0;
+        while (n < max && !items_.empty()) {
+            out.push_back(std::move(items_.front()));
+            items_.pop_front();
+            ++n;
+        }
+        if (n) not_full_.notify_all();
+        return n;
+    }
+
+    // Wakes both sides; queued items can still be popped.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t                  capacity_;
+    std::deque<T>           items_;
+    bool                    closed_ = false;
+    std::mutex              mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <vector>
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Post-processing options of an embeddings context: which pooling the context runs with,
+// whether vectors come back L2-normalized, and Matryoshka truncation to the first `dim`
+// components for models trained to keep their prefix meaningful.
+
+// Same values as llama_pooling_type; MODEL keeps what the GGUF declares.
+enum embedding_pooling {
+    EMBD_POOL_MODEL = -1,
+    EMBD_POOL_NONE  = 0,   // no pooling: the last token's row
+    EMBD_POOL_MEAN  = 1,
+    EMBD_POOL_CLS   = 2,
+    EMBD_POOL_LAST  = 3,
+};
+
+struct embedding_options {
+    int  pooling   = EMBD_POOL_MODEL;
+    bool normalize = false;
+    int  dim       = 0;   // 0 = full n_embd
+};
+
+// "model", "none", "mean", "cls" or "last"; false for anything else.
+inline bool parse_embedding_pooling(const std::string & name, int & out) {
+    static const char * names[] = { "model", "none", "mean", "cls", "last" };
+    for (int i = 0; i < 5; ++i) {
+        if (name == names[i]) {
+            out = i - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline float l2_norm(const float * v, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        const float32x4_t a = vld1q_f32(v + i);
+        const float32x4_t b = vld1q_f32(v + i + 4);
+        acc0 = vfmaq_f32(acc0, a, a);
+        acc1 = vfmaq_f32(acc1, b, b);
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+    for (; i < n; ++i) {
+        sum += v[i] * v[i];
+    }
+    return std::sqrt(sum);
+}
+
+// Scales `v` to unit length in place; zero vectors are left as they are. Returns the old norm.
+inline float l2_normalize(float * v, size_t n) {
+    const float norm = l2_norm(v, n);
+    if (norm == 0.0f) {
+        return norm;
+    }
+    const float inv = 1.0f / norm;
+    size_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(v + i, vmulq_n_f32(vld1q_f32(v + i), inv));
+    }
+#endif
+    for (; i < n; ++i) {
+        v[i] *= inv;
+    }
+    return norm;
+}
+
+// Truncates to opts.dim (when smaller than the vector) and then normalizes: a truncated
+// Matryoshka prefix is only comparable after renormalization.
+inline void finish_embedding(std::vector<float> & v, const embedding_options & opts) {
+    if (opts.dim > 0 && (size_t) opts.dim < v.size()) {
+        v.resize((size_t) opts.dim);
+    }
+    if (opts.normalize) {
+        l2_normalize(v.data(), v.size());
+    }
+}
@@ -0,0 +1,504 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <queue>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Append-only embedding store in one memory-mapped file, searched in place.
+//
+// Layout (version 1, little endian):
+//   [0, 4096)      two header slots of 2048 bytes; the valid one with the higher seq wins
+//   vectors        capacity x stride bytes, 64-byte aligned, f32 or f16
+//   norms          capacity x f32 (L2 norm of each vector, for cosine scores)
+//   ids            capacity x i64
+//   tombstones     capacity bits
+//
+// Appends write the records past `count` first and then commit a new header into the
+// other slot, syncing in between, so a crash leaves either the old or the new state.
+// Bytes past `count` are ignored on open. The tombstone bitmap is authoritative: a delete
+// interrupted by a crash may or may not have happened, but never half. When the sections
+// are full, compact() copies the live records into a larger file next to this one,
+// renames it over the original and syncs the directory.
+
+enum embedding_dtype : uint32_t { EMBEDDING_F32 = 0, EMBEDDING_F16 = 1 };
+
+inline uint16_t embedding_fp32_to_fp16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t absx = x & 0x7fffffff;
+    if (absx >= 0x7f800000) {   // inf / nan
+        return (uint16_t) (sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0));
+    }
+    if (absx >= 0x477ff000) {   // rounds to >= 65520: overflow
+        return (uint16_t) (sign | 0x7c00);
+    }
+    if (absx < 0x38800000) {    // subnormal half: units of 2^-24
+        const uint32_t mant = (absx & 0x7fffff) | 0x800000;
+        const int shift = 126 - (int) (absx >> 23);
+        if (shift > 24) return (uint16_t) sign;
+        uint32_t r = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1);
+        const uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (r & 1))) r++;
+        return (uint16_t) (sign | r);
+    }
+    uint32_t h = ((absx - 0x38000000) >> 13);
+    const uint32_t rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return (uint16_t) (sign | h);
+}
+
+inline float embedding_fp16_to_fp32(uint16_t h) {
+    const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    const uint32_t exp  = (h >> 10) & 0x1f;
+    const uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            // subnormal: normalize
+            int e = -1;
+            uint32_t m = mant;
+            do { m <<= 1; e++; } while (!(m & 0x400));
+            x = sign | ((uint32_t) (112 - e) << 23) | ((m & 0x3ff) << 13);
+        }
+    } else if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+class embedding_store {
+public:
+    static constexpr uint32_t VERSION     = 1;
+    static constexpr size_t   HEADER_SLOT = 2048;
+    static constexpr size_t   DATA_START  = 4096;
+
+    struct hit {
+        int64_t id;
+        float   score;   // cosine similarity
+    };
+
+    // Opens `path`, creating it when missing. An existing file must have the same model id,
+    // dimension and dtype. Returns nullptr and sets `error` on failure.
+    static std::unique_ptr<embedding_store> open(const std::string & path, const std::string & model_id,
+                                                 uint32_t dim, embedding_dtype dtype, std::string * error = nullptr) {
+        auto fail = [&](const std::string & msg) -> std::unique_ptr<embedding_store> {
+            if (error) *error = msg;
+            return nullptr;
+        };
+        if (dim == 0 || model_id.size() >= sizeof(header::model_id)) {
+            return fail("bad dimension or model id");
+        }
+        ::unlink((path + ".compact").c_str());   // left over by a crash during compaction
+
+        std::unique_ptr<embedding_store> store(new embedding_store());
+        store->path_ = path;
+        store->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (store->fd_ < 0) {
+            return fail("cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat st{};
+        fstat(store->fd_, &st);
+        if (st.st_size == 0) {
+            header h = make_header(model_id, dim, dtype, 64);
+            if (!write_file(store->fd_, h) || !store->load_header()) {
+                return fail("cannot initialize " + path);
+            }
+        } else if (!store->load_header()) {
+            return fail(path + " is not a valid embedding store");
+        }
+        const header & h = store->hdr_;
+        if (h.dim != dim || h.dtype != (uint32_t) dtype || model_id != h.model_id) {
+            return fail(path + " holds embeddings of another model (" + std::string(h.model_id) + ", dim " +
+                        std::to_string(h.dim) + ")");
+        }
+        if (!store->map()) {
+            return fail("cannot map " + path);
+        }
+        store->index_ids();
+        return store;
+    }
+
+    ~embedding_store() {
+        unmap();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    embedding_store(const embedding_store &) = delete;
+    embedding_store & operator=(const embedding_store &) = delete;
+
+    // Appends `n` vectors of dim() floats with their ids. An id that is already present is
+    // replaced: its old record is tombstoned once the new one is committed, and open()
+    // repairs the duplicate if a crash comes in between.
+    bool append(const int64_t * ids, const float * vectors, size_t n) {
+        if (!is_open()) return false;
+        if (n == 0) return true;
+        if (hdr_.count + n > hdr_.capacity &&
+            !compact(std::max<uint64_t>(hdr_.capacity * 2, live() + n + n / 2))) {
+            return false;
+        }
+        const uint64_t first = hdr_.count;
+        std::vector<uint8_t> recs(n * hdr_.stride);
+        std::vector<float>   norms(n);
+        for (size_t i = 0; i < n; ++i) {
+            const float * v = vectors + i * hdr_.dim;
+            encode(v, recs.data() + i * hdr_.stride);
+            double sq = 0.0;
+            for (uint32_t d = 0; d < hdr_.dim; ++d) sq += (double) v[d] * v[d];
+            norms[i] = (float) std::sqrt(sq);
+        }
+        if (!pwrite_all(recs.data(), recs.size(), hdr_.vec_off + first * hdr_.stride) ||
+            !pwrite_all(norms.data(), n * sizeof(float), hdr_.norm_off + first * sizeof(float)) ||
+            !pwrite_all(ids, n * sizeof(int64_t), hdr_.id_off + first * sizeof(int64_t))) {
+            return false;
+        }
+        // slots past `count` may carry bits of an append that never committed
+        for (size_t i = 0; i < n; ++i) {
+            if (!set_tombstone(first + i, false)) return false;
+        }
+        header next = hdr_;
+        next.count += n;
+        if (::fdatasync(fd_) != 0 || !commit(next)) {
+            return false;
+        }
+
+        // old records of replaced ids, and duplicates within this batch (last one wins)
+        std::vector<uint64_t> dead;
+        for (size_t i = 0; i < n; ++i) {
+            auto it = slots_.find(ids[i]);
+            if (it != slots_.end()) dead.push_back(it->second);
+            slots_[ids[i]] = first + i;
+        }
+        if (dead.empty()) return true;
+        for (uint64_t slot : dead) {
+            if (!set_tombstone(slot, true)) return false;
+        }
+        next.n_deleted += dead.size();
+        return ::fdatasync(fd_) == 0 && commit(next);
+    }
+
+    // Tombstones the record of `id`; false when it is not present.
+    bool remove(int64_t id) {
+        auto it = slots_.find(id);
+        if (it == slots_.end()) return false;
+        if (!set_tombstone(it->second, true)) return false;
+        header next = hdr_;
+        next.n_deleted++;
+        if (::fdatasync(fd_) != 0 || !commit(next)) return false;
+        slots_.erase(it);
+        return true;
+    }
+
+    // The `k` live records most similar to `query` (cosine), best first.
+    std::vector<hit> search(const float * query, size_t k) const {
+        std::vector<hit> out;
+        if (k == 0 || hdr_.count == 0) return out;
+        double qsq = 0.0;
+        for (uint32_t d = 0; d < hdr_.dim; ++d) qsq += (double) query[d] * query[d];
+        const float qnorm = (float) std::sqrt(qsq);
+        if (qnorm == 0.0f) return out;
+
+        auto worse = [](const hit & a, const hit & b) { return a.score > b.score; };
+        std::priority_queue<hit, std::vector<hit>, decltype(worse)> top(worse);
+        const float   * norms = reinterpret_cast<const float *>(base_ + hdr_.norm_off);
+        const int64_t * ids   = reinterpret_cast<const int64_t *>(base_ + hdr_.id_off);
+        std::vector<float> tmp(hdr_.dtype == EMBEDDING_F16 ? hdr_.dim : 0);
+        for (uint64_t slot = 0; slot < hdr_.count; ++slot) {
+            if (is_deleted(slot) || norms[slot] == 0.0f) continue;
+            const float score = dot(query, slot, tmp.data()) / (qnorm * norms[slot]);
+            if (top.size() < k) {
+                top.push({ ids[slot], score });
+            } else if (score > top.top().score) {
+                top.pop();
+                top.push({ ids[slot], score });
+            }
+        }
+        out.resize(top.size());
+        for (size_t i = out.size(); i-- > 0;) {
+            out[i] = top.top();
+            top.pop();
+        }
+        return out;
+    }
+
+    // Copies the live records into a new file with room for `min_capacity` records (at
+    // least the live count) and atomically replaces this one. If the replacement cannot be
+    // reopened the store is closed: is_open() turns false and every call fails or finds nothing.
+    bool compact(uint64_t min_capacity = 0) {
+        if (!is_open()) return false;
+        const uint64_t cap = std::max<uint64_t>({ min_capacity, live(), 64 });
+        const std::string tmp_path = path_ + ".compact";
+        const int tmp = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (tmp < 0) return false;
+        header h = make_header(hdr_.model_id, hdr_.dim, (embedding_dtype) hdr_.dtype, cap);
+        bool ok = write_file(tmp, h);
+        uint64_t out_slot = 0;
+        for (uint64_t slot = 0; ok && slot < hdr_.count; ++slot) {
+            if (is_deleted(slot)) continue;
+            ok = pwrite_fd(tmp, base_ + hdr_.vec_off + slot * hdr_.stride, hdr_.stride, h.vec_off + out_slot * h.stride) &&
+                 pwrite_fd(tmp, base_ + hdr_.norm_off + slot * sizeof(float), sizeof(float), h.norm_off + out_slot * sizeof(float)) &&
+                 pwrite_fd(tmp, base_ + hdr_.id_off + slot * sizeof(int64_t), sizeof(int64_t), h.id_off + out_slot * sizeof(int64_t));
+            out_slot++;
+        }
+        h.count = out_slot;
+        h.seq = hdr_.seq + 1;
+        ok = ok && write_header_slot(tmp, h, 0) && ::fsync(tmp) == 0;
+        ::close(tmp);
+        if (!ok || ::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            ::unlink(tmp_path.c_str());
+            return false;
+        }
+        // the rename itself is only durable once the directory entry is
+        const bool synced = sync_parent_dir(path_);
+        unmap();
+        ::close(fd_);
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd_ < 0 || !load_header() || !map()) {
+            close_store();
+            return false;
+        }
+        index_ids();
+        return synced;
+    }
+
+    // Compacts when tombstones take more than `max_dead_ratio` of the records.
+    bool maybe_compact(double max_dead_ratio = 0.25) {
+        if (hdr_.count == 0 || (double) hdr_.n_deleted / hdr_.count <= max_dead_ratio) return true;
+        return compact(hdr_.capacity);
+    }
+
+    uint64_t    live()       const { return hdr_.count - hdr_.n_deleted; }
+    uint64_t    count()      const { return hdr_.count; }
+    uint64_t    deleted()    const { return hdr_.n_deleted; }
+    uint64_t    capacity()   const { return hdr_.capacity; }
+    uint32_t    dim()        const { return hdr_.dim; }
+    uint64_t    file_bytes() const { return hdr_.file_size; }
+    std::string model_id()   const { return hdr_.model_id; }
+    bool        contains(int64_t id) const { return slots_.count(id) != 0; }
+    // False once a failed compaction has closed the store.
+    bool        is_open()    const { return base_ != nullptr; }
+
+private:
+    struct header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t dim;
+        uint32_t dtype;
+        uint32_t stride;
+        uint64_t capacity;
+        uint64_t count;
+        uint64_t n_deleted;
+        uint64_t seq;
+        uint64_t vec_off;
+        uint64_t norm_off;
+        uint64_t id_off;
+        uint64_t tomb_off;
+        uint64_t file_size;
+        char     model_id[128];
+        uint64_t checksum;
+    };
+    static_assert(sizeof(header) <= HEADER_SLOT, "header slot too small");
+
+    embedding_store() = default;
+
+    static uint64_t align_up(uint64_t v, uint64_t a) { return (v + a - 1) / a * a; }
+
+    static uint64_t checksum_of(const header & h) {
+        const auto * p = reinterpret_cast<const uint8_t *>(&h);
+        uint64_t x = 1469598103934665603ULL;
+        for (size_t i = 0; i < offsetof(header, checksum); ++i) {
+            x = (x ^ p[i]) * 1099511628211ULL;
+        }
+        return x;
+    }
+
+    static header make_header(const std::string & model_id, uint32_t dim, embedding_dtype dtype, uint64_t capacity) {
+        header h{};
+        std::memcpy(h.magic, "EMBSTORE", 8);
+        h.version  = VERSION;
+        h.dim      = dim;
+        h.dtype    = dtype;
+        h.stride   = (uint32_t) align_up((uint64_t) dim * (dtype == EMBEDDING_F16 ? 2 : 4), 64);
+        h.capacity = capacity;
+        h.vec_off  = DATA_START;
+        h.norm_off = align_up(h.vec_off + capacity * h.stride, 64);
+        h.id_off   = align_up(h.norm_off + capacity * sizeof(float), 64);
+        h.tomb_off = align_up(h.id_off + capacity * sizeof(int64_t), 64);
+        h.file_size = align_up(h.tomb_off + (capacity + 7) / 8, 4096);
+        std::strncpy(h.model_id, model_id.c_str(), sizeof(h.model_id) - 1);
+        return h;
+    }
+
+    static bool pwrite_fd(int fd, const void * data, size_t n, uint64_t off) {
+        const auto * p = static_cast<const uint8_t *>(data);
+        while (n > 0) {
+            const ssize_t w = ::pwrite(fd, p, n, (off_t) off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            p += w;
+            n -= (size_t) w;
+            off += (uint64_t) w;
+        }
+        return true;
+    }
+
+    bool pwrite_all(const void * data, size_t n, uint64_t off) { return pwrite_fd(fd_, data, n, off); }
+
+    static bool write_header_slot(int fd, header h, int slot) {
+        h.checksum = checksum_of(h);
+        return pwrite_fd(fd, &h, sizeof(h), (uint64_t) slot * HEADER_SLOT);
+    }
+
+    // Sizes a fresh file and writes its first header (seq 1, slot 0).
+    static bool write_file(int fd, header & h) {
+        if (::ftruncate(fd, (off_t) h.file_size) != 0) return false;
+        h.seq = 1;
+        return write_header_slot(fd, h, 0) && ::fsync(fd) == 0;
+    }
+
+    bool load_header() {
+        header slots[2];
+        bool valid[2];
+        for (int i = 0; i < 2; ++i) {
+            valid[i] = ::pread(fd_, &slots[i], sizeof(header), (off_t) (i * HEADER_SLOT)) == (ssize_t) sizeof(header) &&
+                       std::memcmp(slots[i].magic, "EMBSTORE", 8) == 0 &&
+                       slots[i].version == VERSION &&
+                       slots[i].checksum == checksum_of(slots[i]) &&
+                       slots[i].count <= slots[i].capacity &&
+                       slots[i].n_deleted <= slots[i].count;
+        }
+        if (!valid[0] && !valid[1]) return false;
+        const int best = !valid[1] ? 0 : (!valid[0] ? 1 : (slots[1].seq > slots[0].seq ? 1 : 0));
+        hdr_ = slots[best];
+        hdr_slot_ = best;
+        hdr_.model_id[sizeof(hdr_.model_id) - 1] = '\0';
+        struct stat st{};
+        return fstat(fd_, &st) == 0 && (uint64_t) st.st_size >= hdr_.file_size;
+    }
+
+    // Writes `next` into the slot not holding the current header.
+    bool commit(header next) {
+        next.seq = hdr_.seq + 1;
+        const int slot = 1 - hdr_slot_;
+        if (!write_header_slot(fd_, next, slot) || ::fdatasync(fd_) != 0) return false;
+        hdr_ = next;
+        hdr_slot_ = slot;
+        return true;
+    }
+
+    bool map() {
+        void * p = ::mmap(nullptr, hdr_.file_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) return false;
+        base_ = static_cast<const uint8_t *>(p);
+        map_size_ = hdr_.file_size;
+        return true;
+    }
+
+    void unmap() {
+        if (base_) ::munmap(const_cast<uint8_t *>(base_), map_size_);
+        base_ = nullptr;
+        map_size_ = 0;
+    }
+
+    // Leaves an empty, unmapped store behind, so searches find nothing and writes fail.
+    void close_store() {
+        unmap();
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        hdr_ = header{};
+        slots_.clear();
+    }
+
+    static bool sync_parent_dir(const std::string & path) {
+        const size_t slash = path.rfind('/');
+        const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        const bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+
+    // Rebuilds the id map. The deleted count follows the bitmap, which may be ahead of the
+    // header after a crash; an id left live twice by a crash during a replace keeps its
+    // newest record.
+    void index_ids() {
+        slots_.clear();
+        hdr_.n_deleted = 0;
+        const int64_t * ids = reinterpret_cast<const int64_t *>(base_ + hdr_.id_off);
+        for (uint64_t slot = 0; slot < hdr_.count; ++slot) {
+            if (is_deleted(slot)) {
+                hdr_.n_deleted++;
+                continue;
+            }
+            auto it = slots_.find(ids[slot]);
+            if (it != slots_.end() && set_tombstone(it->second, true)) {
+                hdr_.n_deleted++;
+            }
+            slots_[ids[slot]] = slot;
+        }
+    }
+
+    bool is_deleted(uint64_t slot) const {
+        return (base_[hdr_.tomb_off + slot / 8] >> (slot % 8)) & 1;
+    }
+
+    bool set_tombstone(uint64_t slot, bool deleted) {
+        const uint8_t bit  = (uint8_t) (1u << (slot % 8));
+        const uint8_t old  = base_[hdr_.tomb_off + slot / 8];
+        const uint8_t byte = deleted ? (uint8_t) (old | bit) : (uint8_t) (old & ~bit);
+        if (byte == old) return true;
+        return pwrite_all(&byte, 1, hdr_.tomb_off + slot / 8);
+    }
+
+    void encode(const float * v, uint8_t * out) const {
+        std::memset(out, 0, hdr_.stride);
+        if (hdr_.dtype == EMBEDDING_F16) {
+            auto * h = reinterpret_cast<uint16_t *>(out);
+            for (uint32_t d = 0; d < hdr_.dim; ++d) h[d] = embedding_fp32_to_fp16(v[d]);
+        } else {
+            std::memcpy(out, v, (size_t) hdr_.dim * sizeof(float));
+        }
+    }
+
+    float dot(const float * q, uint64_t slot, float * tmp) const {
+        const uint8_t * rec = base_ + hdr_.vec_off + slot * hdr_.stride;
+        const float * v = reinterpret_cast<const float *>(rec);
+        if (hdr_.dtype == EMBEDDING_F16) {
+            const auto * h = reinterpret_cast<const uint16_t *>(rec);
+            for (uint32_t d = 0; d < hdr_.dim; ++d) tmp[d] = embedding_fp16_to_fp32(h[d]);
+            v = tmp;
+        }
+        float sum = 0.0f;
+        for (uint32_t d = 0; d < hdr_.dim; ++d) sum += q[d] * v[d];
+        return sum;
+    }
+
+    std::string     path_;
+    int             fd_ = -1;
+    header          hdr_{};
+    int             hdr_slot_ = 0;
+    const uint8_t * base_ = nullptr;
+    size_t          map_size_ = 0;
+    std::unordered_map<int64_t, uint64_t> slots_;   // live id -> slot, rebuilt from the id table on open
+};
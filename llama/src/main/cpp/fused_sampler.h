@@ -0,0 +1,308 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Single-pass replacement for the penalties -> top_k -> top_p -> min_p -> temp -> dist
+// sampler chain. Instead of copying and sorting the whole vocabulary for every token,
+// it selects the top-k straight from the logits (skipping blocks whose SIMD max cannot
+// beat the current k-th best) into a buffer that is reused between tokens. Every later
+// stage runs on those k candidates with the same float arithmetic and RNG use as the
+// llama.cpp samplers (the dist sampler's single-pass inverse-CDF draw included), so for
+// the same seed it picks the same tokens as the chain without allocating per token.
+// The only tie-break difference is that equal logits keep the lower token id.
+
+struct fused_sampler_params {
+    int32_t  top_k          = 40;     // <= 0 keeps the whole vocabulary
+    float    top_p          = 1.0f;   // >= 1 disables
+    float    min_p          = 0.0f;   // <= 0 disables
+    float    temp           = 0.8f;   // <= 0 is greedy
+    float    repeat_penalty = 1.0f;   // 1 disables
+    int32_t  repeat_last_n  = 64;     // 0 disables penalty tracking
+    uint32_t seed           = 1234;
+};
+
+// Same layout as llama_token_data.
+struct fused_candidate {
+    int32_t id;
+    float   logit;
+    float   p;
+};
+
+// Maximum of x[0..n), vectorized where available.
+inline float fused_block_max(const float * x, size_t n) {
+    float r = -INFINITY;
+    size_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t m = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        m = vmaxq_f32(m, vld1q_f32(x + i));
+    }
+    r = vmaxvq_f32(m);
+#elif defined(__SSE__)
+    __m128 m = _mm_set1_ps(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        m = _mm_max_ps(m, _mm_loadu_ps(x + i));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, m);
+    r = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#endif
+    for (; i < n; ++i) {
+        r = std::max(r, x[i]);
+    }
+    return r;
+}
+
+class fused_sampler {
+public:
+    explicit fused_sampler(const fused_sampler_params & params)
+        : params_(params), rng_(params.seed) {
+        if (params_.repeat_last_n > 0) {
+            prev_.resize(params_.repeat_last_n);
+            saved_.reserve(params_.repeat_last_n);
+        }
+        if (params_.top_k > 0) {
+            cand_.reserve(params_.top_k);
+        }
+    }
+
+    const fused_sampler_params & params() const { return params_; }
+
+    // Candidates that survived filtering in the last sample(), best first, with the
+    // final (temperature-scaled) probabilities.
+    const fused_candidate * candidates() const { return cand_.data(); }
+    size_t n_candidates() const { return n_cand_; }
+
+    // Keeps the ids of the best `n` top-k candidates of every pick(), before top-p, min-p
+    // and temperature touch them (for log-probability reporting).
+    void set_keep_top(size_t n) {
+        keep_top_ = n;
+        top_ids_.reserve(n);
+    }
+    size_t keep_top() const { return keep_top_; }
+    const std::vector<int32_t> & top_ids() const { return top_ids_; }
+
+    // Picks the next token from `logits` (n_vocab entries) and records it for the
+    // repetition penalty. `logits` is modified temporarily and restored before returning.
+    int32_t sample(float * logits, int32_t n_vocab) {
+        const int32_t token = pick(logits, n_vocab);
+        accept(token);
+        return token;
+    }
+
+    // sample() without recording the token; for callers that accept() separately.
+    int32_t pick(float * logits, int32_t n_vocab) {
+        ensure_vocab(n_vocab);
+        apply_penalties(logits, n_vocab);
+        select_top_k(logits, n_vocab);
+        restore_penalties(logits);
+        top_ids_.clear();
+        for (size_t i = 0; i < std::min(keep_top_, cand_.size()); ++i) {
+            top_ids_.push_back(cand_[i].id);
+        }
+
+        size_t n = cand_.size();
+        if (params_.top_p < 1.0f) {
+            // normalizes only up to the cut; the dist draw recomputes every probability
+            const float sum = exp_sum(n);
+            float cum_sum = 0.0f;
+            size_t last_idx = n;
+            for (size_t i = 0; i < n; ++i) {
+                cum_sum += cand_[i].p / sum;
+                if (cum_sum >= params_.top_p && i + 1 >= MIN_KEEP) {
+                    last_idx = i + 1;
+                    break;
+                }
+            }
+            n = last_idx;
+        }
+        if (params_.min_p > 0.0f && n > 0) {
+            const float min_logit = cand_[0].logit + logf(params_.min_p);
+            size_t i = 1;
+            for (; i < n; ++i) {
+                if (cand_[i].logit < min_logit && i >= MIN_KEEP) break;
+            }
+            n = i;
+        }
+        if (params_.temp <= 0.0f) {
+            size_t max_i = 0;
+            float max_l = cand_[0].logit;
+            for (size_t i = 1; i < n; ++i) {
+                if (cand_[i].logit > max_l) {
+                    cand_[max_i].logit = -INFINITY;
+                    max_i = i;
+                    max_l = cand_[i].logit;
+                } else {
+                    cand_[i].logit = -INFINITY;
+                }
+            }
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                cand_[i].logit /= params_.temp;
+            }
+        }
+
+        n_cand_ = n;
+        return cand_[draw(n)].id;
+    }
+
+    // Records a token for the repetition penalty window (also for prompt tokens).
+    void accept(int32_t token) {
+        if (params_.repeat_last_n <= 0) {
+            return;
+        }
+        if (prev_size_ >= prev_.size()) {
+            prev_head_ = (prev_head_ + 1) % prev_.size();
+            prev_size_--;
+        }
+        prev_[(prev_head_ + prev_size_) % prev_.size()] = token;
+        prev_size_++;
+    }
+
+    void reset() {
+        rng_.seed(params_.seed);
+        prev_head_ = 0;
+        prev_size_ = 0;
+        n_cand_ = 0;
+    }
+
+private:
+    static constexpr size_t BLOCK    = 64;
+    static constexpr size_t MIN_KEEP = 1;   // min_keep of the top_p/min_p samplers in new_sampler
+
+    // Sets p to exp(logit - max) on an already sorted array and returns the sum, as the
+    // first pass of llama_sampler_softmax_impl.
+    float exp_sum(size_t n) {
+        const float max_l = cand_[0].logit;
+        float cum_sum = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            const float p = expf(cand_[i].logit - max_l);
+            cand_[i].p = p;
+            cum_sum += p;
+        }
+        return cum_sum;
+    }
+
+    // The dist sampler: one uniform draw against the running sum of the unnormalized
+    // probabilities, normalizing them in the same pass.
+    size_t draw(size_t n) {
+        if (n == 1) {
+            cand_[0].p = 1.0f;
+            return 0;
+        }
+        const float max_l = cand_[0].logit;
+        double sum_cum = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            const float p = expf(cand_[i].logit - max_l);
+            cand_[i].p = p;
+            sum_cum += p;
+        }
+        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        const double sum_tgt = sum_cum * dist(rng_);
+        double sum_run = 0.0;
+        size_t selected = n - 1;   // rounding fallback, as in llama.cpp
+        bool found = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (!found) {
+                sum_run += cand_[i].p;
+                if (sum_run >= sum_tgt) {
+                    selected = i;
+                    found = true;
+                }
+            }
+            cand_[i].p /= sum_cum;
+        }
+        return selected;
+    }
+
+    static bool better(const fused_candidate & a, const fused_candidate & b) {
+        return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+    }
+
+    // Grows the per-token table once; no allocation once the vocabulary size is known.
+    void ensure_vocab(int32_t n_vocab) {
+        if (params_.repeat_last_n > 0 && (int32_t) stamps_.size() < n_vocab) {
+            stamps_.resize(n_vocab, 0);
+        }
+    }
+
+    void apply_penalties(float * logits, int32_t n_vocab) {
+        saved_.clear();
+        if (params_.repeat_last_n <= 0 || params_.repeat_penalty == 1.0f) {
+            return;
+        }
+        epoch_++;
+        for (size_t i = 0; i < prev_size_; ++i) {
+            const int32_t t = prev_[(prev_head_ + i) % prev_.size()];
+            if (t < 0 || t >= n_vocab || stamps_[t] == epoch_) {
+                continue;
+            }
+            stamps_[t] = epoch_;
+            saved_.push_back({ t, logits[t], 0.0f });
+            if (logits[t] <= 0) {
+                logits[t] *= params_.repeat_penalty;
+            } else {
+                logits[t] /= params_.repeat_penalty;
+            }
+        }
+    }
+
+    void restore_penalties(float * logits) {
+        for (const auto & s : saved_) {
+            logits[s.id] = s.logit;
+        }
+    }
+
+    void select_top_k(const float * logits, int32_t n_vocab) {
+        const size_t k = params_.top_k > 0 ? std::min<size_t>(params_.top_k, n_vocab) : (size_t) n_vocab;
+        cand_.clear();
+        size_t i = 0;
+        for (; i < (size_t) n_vocab && cand_.size() < k; ++i) {
+            cand_.push_back({ (int32_t) i, logits[i], 0.0f });
+        }
+        if (i < (size_t) n_vocab) {
+            // min-heap on quality: front is the worst of the current top-k
+            std::make_heap(cand_.begin(), cand_.end(), better);
+            float threshold = cand_.front().logit;
+            for (; i < (size_t) n_vocab; i += BLOCK) {
+                const size_t n = std::min(BLOCK, (size_t) n_vocab - i);
+                if (fused_block_max(logits + i, n) <= threshold) {
+                    continue;
+                }
+                for (size_t j = i; j < i + n; ++j) {
+                    if (logits[j] > threshold) {
+                        std::pop_heap(cand_.begin(), cand_.end(), better);
+                        cand_.back() = { (int32_t) j, logits[j], 0.0f };
+                        std::push_heap(cand_.begin(), cand_.end(), better);
+                        threshold = cand_.front().logit;
+                    }
+                }
+            }
+        }
+        std::sort(cand_.begin(), cand_.end(), better);
+    }
+
+    fused_sampler_params         params_;
+    std::mt19937                 rng_;
+    std::vector<fused_candidate> cand_;
+    size_t                       n_cand_ = 0;
+    size_t                       keep_top_ = 0;
+    std::vector<int32_t>         top_ids_;
+
+    // repetition penalty window
+    std::vector<int32_t>         prev_;
+    size_t                       prev_head_ = 0;
+    size_t                       prev_size_ = 0;
+    std::vector<uint32_t>        stamps_;   // epoch a token was last penalized in
+    uint32_t                     epoch_ = 0;
+    std::vector<fused_candidate> saved_;
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Stable 64-bit FNV-1a hash of a grammar source and the kind of source it is
+// (GBNF, JSON schema, tool list), used as the compiled-grammar cache key.
+inline uint64_t grammar_source_hash(const std::string & kind, const std::string & source) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&h](const std::string & s) {
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        h ^= 0xff;   // separator so ("ab", "c") and ("a", "bc") differ
+        h *= 0x100000001b3ull;
+    };
+    mix(kind);
+    mix(source);
+    return h;
+}
+
+// Small LRU of compiled grammars. Compiling (schema conversion plus GBNF parsing)
+// happens once per (owner, key); every acquire() hands out a clone of the cached
+// prototype so callers can advance and free their copy independently. `Owner` is
+// what the grammar was compiled against (a vocabulary) and must be forgotten
+// before it is destroyed.
+template <typename T, typename Owner>
+class compiled_grammar_cache {
+public:
+    using make_fn  = std::function<T *()>;
+    using clone_fn = std::function<T *(const T *)>;
+    using free_fn  = std::function<void(T *)>;
+
+    compiled_grammar_cache(clone_fn clone, free_fn free, size_t capacity)
+        : clone_(std::move(clone)), free_(std::move(free)), capacity_(capacity) {}
+
+    ~compiled_grammar_cache() { clear(); }
+
+    compiled_grammar_cache(const compiled_grammar_cache &) = delete;
+    compiled_grammar_cache & operator=(const compiled_grammar_cache &) = delete;
+
+    // Returns a new copy of the grammar for (owner, key), calling `make` on a miss.
+    // Returns nullptr (and caches nothing) when `make` fails. The caller frees the copy.
+    T * acquire(const Owner * owner, uint64_t key, const make_fn & make, bool * hit = nullptr) {
+        if (hit) *hit = false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto & e : entries_) {
+            if (e.owner == owner && e.key == key) {
+                e.last_use = ++clock_;
+                hits_++;
+                if (hit) *hit = true;
+                return clone_(e.proto);
+            }
+        }
+        misses_++;
+        T * proto = make();
+        if (!proto) {
+            return nullptr;
+        }
+        if (capacity_ > 0 && entries_.size() >= capacity_) {
+            size_t lru = 0;
+            for (size_t i = 1; i < entries_.size(); ++i) {
+                if (entries_[i].last_use < entries_[lru].last_use) lru = i;
+            }
+            free_(entries_[lru].proto);
+            entries_.erase(entries_.begin() + lru);
+        }
+        entries_.push_back({ owner, key, proto, ++clock_ });
+        return clone_(proto);
+    }
+
+    // Drops every grammar compiled against `owner`.
+    void forget_owner(const Owner * owner) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < entries_.size();) {
+            if (entries_[i].owner == owner) {
+                free_(entries_[i].proto);
+                entries_.erase(entries_.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto & e : entries_) {
+            free_(e.proto);
+        }
+        entries_.clear();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+    uint64_t hits()   { std::lock_guard<std::mutex> lock(mutex_); return hits_; }
+    uint64_t misses() { std::lock_guard<std::mutex> lock(mutex_); return misses_; }
+
+private:
+    struct entry {
+        const Owner * owner;
+        uint64_t      key;
+        T *           proto;
+        uint64_t      last_use;
+    };
+
+    clone_fn           clone_;
+    free_fn            free_;
+    size_t             capacity_;
+    std::vector<entry> entries_;
+    uint64_t           clock_  = 0;
+    uint64_t           hits_   = 0;
+    uint64_t           misses_ = 0;
+    std::mutex         mutex_;
+};
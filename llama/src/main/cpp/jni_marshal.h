@@ -0,0 +1,89 @@
+#pragma once
+#include <jni.h>
+#include <string>
+#include "nlohmann/json.hpp"
+#include "jni_utils.h"
+
+// Marshaling of chat messages from the JVM. Templated on the JNI environment like
+// LocalRef, so benchmarks can drive it with a fake one.
+
+// printf-style error log; define before including (llama-android.cpp maps it to LOGe).
+// Silent by default, e.g. in the benchmarks.
+#ifndef JNI_MARSHAL_LOGE
+#define JNI_MARSHAL_LOGE(...) ((void) 0)
+#endif
+
+// Converts a Java Map<String, String>[] of chat messages to a JSON array of
+// {"role", "content"} objects. Entries that are null or not maps are skipped.
+template <typename Env>
+std::string mapListToJSONString(Env *env, jobjectArray allMessages) {
+    nlohmann::ordered_json jsonArray = nlohmann::ordered_json::array();
+
+    LocalRef<jclass, Env> mapClass(env, env->FindClass("java/util/Map"));
+    if (checkAndClearException(env) || !mapClass.get()) {
+        JNI_MARSHAL_LOGE("Error: Could not find java/util/Map class");
+        return jsonArray.dump();
+    }
+
+    jmethodID getMethod = env->GetMethodID(mapClass.get(), "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
+    jmethodID keySetMethod = env->GetMethodID(mapClass.get(), "keySet", "()Ljava/util/Set;");
+    if (checkAndClearException(env) || !getMethod || !keySetMethod) {
+        JNI_MARSHAL_LOGE("Error: Could not find Map methods");
+        return jsonArray.dump();
+    }
+
+    jsize arrayLength = env->GetArrayLength(allMessages);
+    if (checkAndClearException(env)) {
+        return jsonArray.dump();
+    }
+    for (jsize i = 0; i < arrayLength; ++i) {
+        LocalRef<jobject, Env> messageObj(env, env->GetObjectArrayElement(allMessages, i));
+        if (checkAndClearException(env) || !messageObj.get()) {
+            JNI_MARSHAL_LOGE("Error: Received null jobject at index %d", i);
+            continue;
+        }
+
+        if (!env->IsInstanceOf(messageObj.get(), mapClass.get())) {
+            checkAndClearException(env);
+            JNI_MARSHAL_LOGE("Error: Object is not a Map at index %d", i);
+            continue;
+        }
+
+        nlohmann::ordered_json jsonMsg;
+
+        LocalRef<jstring, Env> roleKey(env, env->NewStringUTF("role"));
+        checkAndClearException(env);
+        LocalRef<jobject, Env> roleObj(env, env->CallObjectMethod(messageObj.get(), getMethod, roleKey.get()));
+        if (checkAndClearException(env)) {
+            // if an exception occurred, skip this message
+            continue;
+        }
+        if (roleObj.get()) {
+            const char* roleStr = env->GetStringUTFChars((jstring)roleObj.get(), nullptr);
+            checkAndClearException(env);
+            jsonMsg["role"] = roleStr;
+            env->ReleaseStringUTFChars((jstring)roleObj.get(), roleStr);
+            checkAndClearException(env);
+        }
+
+        LocalRef<jstring, Env> contentKey(env, env->NewStringUTF("content"));
+        checkAndClearException(env);
+        LocalRef<jobject, Env> contentObj(env, env->CallObjectMethod(messageObj.get(), getMethod, contentKey.get()));
+        if (checkAndClearException(env)) {
+            continue;
+        }
+        if (contentObj.get()) {
+            const char* contentStr = env->GetStringUTFChars((jstring)contentObj.get(), nullptr);
+            checkAndClearException(env);
+            jsonMsg["content"] = contentStr;
+            env->ReleaseStringUTFChars((jstring)contentObj.get(), contentStr);
+            checkAndClearException(env);
+        }
+
+        if (!jsonMsg.empty()) {
+            jsonArray.push_back(jsonMsg);
+        }
+    }
+
+    return jsonArray.dump();
+}
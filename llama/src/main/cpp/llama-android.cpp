@@ -9,13 +9,42 @@
 #include <algorithm>
 #include <cstdlib>
 #include <mutex>
+#include <future>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <deque>
+#include <shared_mutex>
 #include "llama.h"
 #include "ggml-backend.h"
+#include "gguf.h"
 #include "common.h"
 #include "chat.h"
 #define JSON_ASSERT GGML_ASSERT
 #include "nlohmann/json.hpp"
+#include "json-schema-to-grammar.h"
 #include "jni_utils.h"
+#include "token_text.h"
+#include "page_cache.h"
+#include "model_cache.h"
+#include "model_scan.h"
+#include "cpu_topology.h"
+#include "quantize_job.h"
+#include "quant_sweep.h"
+#include "fused_sampler.h"
+#include "sampler_chain.h"
+#include "grammar_cache.h"
+#include "prefix_cache.h"
+#include "thermal_governor.h"
+#include "ngram_draft.h"
+#include "seq_pack.h"
+#include "doc_index.h"
+#include "embedding_store.h"
+#include "embedding_pool.h"
+#include "lora_cache.h"
+#include "token_logprobs.h"
+#include "batch_tokenize.h"
+#include "context_budget.h"
 
 using json = nlohmann::ordered_json;
 
@@ -56,150 +85,54 @@ static T json_value(const json & body, const std::string & key, const T & defaul
 #define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 #define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
+// malformed chat messages from the JVM are reported to logcat
+#define JNI_MARSHAL_LOGE LOGe
+#include "jni_marshal.h"
+
 #include <dlfcn.h>
 #include <climits>
 #include <atomic>
 
-jclass la_int_var;
-jmethodID la_int_var_value;
-jmethodID la_int_var_inc;
-
-std::string cached_token_chars;
-
 // user-configured GPU layer offload. INT_MIN == unspecified (auto)
-static int  g_user_gpu_layers     = INT_MIN;
-static bool g_force_cpu_session   = false;    // set true when offload 0/N detected
-static bool g_strip_think_default = false;    // native stream filtering toggle
-static int  g_offloaded_layers    = -1;
-static int  g_total_layers        = -1;
+static std::atomic<int>  g_user_gpu_layers{INT_MIN};
+static std::atomic<bool> g_force_cpu_session{false};   // offload 0/N detected for the foreground model
+static bool g_strip_think_default = false;    // native stream filtering toggle (new sessions)
+static std::atomic<int>  g_offloaded_layers{-1};       // of the foreground model
+static std::atomic<int>  g_total_layers{-1};
 static long long g_kv_size_bytes  = -1;       // last reported KV cache size
 static long long g_last_tokenize_us = -1;     // last prompt tokenize duration
-static int  g_dynamic_ubatch      = 64;       // adaptive prefill ubatch
 static std::atomic<int> g_active_contexts{0}; // number of live contexts
-static bool g_verbose_tokens = false;         // verbose token logging gate
+static bool g_verbose_tokens = false;         // verbose token logging gate (new sessions)
 static std::mutex g_backend_mutex;            // guard backend switches
 static std::string g_backend_selection = "cpu"; // requested backend
 
-bool is_valid_utf8(const char * string) {
-    if (!string) {
-        return true;
-    }
-
-    const unsigned char * bytes = (const unsigned char *)string;
-    int num;
-
-    while (*bytes != 0x00) {
-        if ((*bytes & 0x80) == 0x00) {
-            // U+0000 to U+007F
-            num = 1;
-        } else if ((*bytes & 0xE0) == 0xC0) {
-            // U+0080 to U+07FF
-            num = 2;
-        } else if ((*bytes & 0xF0) == 0xE0) {
-            // U+0800 to U+FFFF
-            num = 3;
-        } else if ((*bytes & 0xF8) == 0xF0) {
-            // U+10000 to U+10FFFF
-            num = 4;
-        } else {
-            return false;
-        }
-
-        bytes += 1;
-        for (int i = 1; i < num; ++i) {
-            if ((*bytes & 0xC0) != 0x80) {
-                return false;
-            }
-            bytes += 1;
-        }
-    }
-
-    return true;
-}
-
-std::string mapListToJSONString(JNIEnv *env, jobjectArray allMessages) {
-    json jsonArray = json::array();
-
-    LocalRef<jclass> mapClass(env, env->FindClass("java/util/Map"));
-    if (checkAndClearException(env) || !mapClass.get()) {
-        LOGe("Error: Could not find java/util/Map class");
-        return jsonArray.dump();
-    }
-
-    jmethodID getMethod = env->GetMethodID(mapClass.get(), "get", "(Ljava/lang/Object;)Ljava/lang/Object;");
-    jmethodID keySetMethod = env->GetMethodID(mapClass.get(), "keySet", "()Ljava/util/Set;");
-    if (checkAndClearException(env) || !getMethod || !keySetMethod) {
-        LOGe("Error: Could not find Map methods");
-        return jsonArray.dump();
-    }
-
-    jsize arrayLength = env->GetArrayLength(allMessages);
-    if (checkAndClearException(env)) {
-        return jsonArray.dump();
-    }
-    for (jsize i = 0; i < arrayLength; ++i) {
-        LocalRef<jobject> messageObj(env, env->GetObjectArrayElement(allMessages, i));
-        if (checkAndClearException(env) || !messageObj.get()) {
-            LOGe("Error: Received null jobject at index %d", i);
-            continue;
-        }
-
-        if (!env->IsInstanceOf(messageObj.get(), mapClass.get())) {
-            checkAndClearException(env);
-            LOGe("Error: Object is not a Map at index %d", i);
-            continue;
-        }
-
-        json jsonMsg;
-
-        LocalRef<jstring> roleKey(env, env->NewStringUTF("role"));
-        checkAndClearException(env);
-        LocalRef<jobject> roleObj(env, env->CallObjectMethod(messageObj.get(), getMethod, roleKey.get()));
-        if (checkAndClearException(env)) {
-            // if an exception occurred, skip this message
-            continue;
-        }
-        if (roleObj.get()) {
-            const char* roleStr = env->GetStringUTFChars((jstring)roleObj.get(), nullptr);
-            checkAndClearException(env);
-            jsonMsg["role"] = roleStr;
-            env->ReleaseStringUTFChars((jstring)roleObj.get(), roleStr);
-            checkAndClearException(env);
-        }
-
-        LocalRef<jstring> contentKey(env, env->NewStringUTF("content"));
-        checkAndClearException(env);
-        LocalRef<jobject> contentObj(env, env->CallObjectMethod(messageObj.get(), getMethod, contentKey.get()));
-        if (checkAndClearException(env)) {
-            continue;
-        }
-        if (contentObj.get()) {
-            const char* contentStr = env->GetStringUTFChars((jstring)contentObj.get(), nullptr);
-            checkAndClearException(env);
-            jsonMsg["content"] = contentStr;
-            env->ReleaseStringUTFChars((jstring)contentObj.get(), contentStr);
-            checkAndClearException(env);
-        }
+struct quantize_job;
+static thread_local quantize_job * t_quantize_job = nullptr;   // job running on this thread
+static void quantize_job_on_log(quantize_job * job, const char * text);
 
-        if (!jsonMsg.empty()) {
-            jsonArray.push_back(jsonMsg);
-        }
-    }
-
-    return jsonArray.dump();
-}
+// Offload results of one model load, parsed from llama.cpp's log on the loading thread
+struct model_offload_info {
+    int  offloaded = -1;
+    int  total     = -1;
+    bool force_cpu = false;
+};
+static thread_local model_offload_info * t_load_offload = nullptr;   // load running on this thread
 
 static void log_callback(ggml_log_level level, const char * fmt, void * /*data*/) {
     if (fmt == nullptr) return;
+    if (t_quantize_job) {
+        // may throw to abort a cancelled quantization; llama_model_quantize catches it
+        quantize_job_on_log(t_quantize_job, fmt);
+    }
     // Trap offload counts from llama.cpp logs
-    if (strstr(fmt, "offloaded ") && strstr(fmt, " layers to GPU")) {
+    if (t_load_offload && strstr(fmt, "offloaded ") && strstr(fmt, " layers to GPU")) {
         int a = -1, b = -1;
         if (sscanf(fmt, "load_tensors: offloaded %d/%d layers to GPU", &a, &b) == 2 ||
             sscanf(fmt, "offloaded %d/%d layers to GPU", &a, &b) == 2) {
-            g_offloaded_layers = a;
-            g_total_layers     = b;
+            t_load_offload->offloaded = a;
+            t_load_offload->total     = b;
             if (a == 0 && b > 0) {
-                g_force_cpu_session = true;
+                t_load_offload->force_cpu = true;
                 __android_log_print(ANDROID_LOG_INFO, TAG, "Detected zero GPU offload; forcing CPU context for this session");
             }
         }
@@ -217,778 +150,3380 @@ static void log_callback(ggml_log_level level, const char * fmt, void * /*data*/
     else                                   __android_log_print(ANDROID_LOG_DEFAULT, TAG, "%s", fmt);
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename) {
-    // ensure backends are initialized even without OpenCL
-    static bool backend_inited = false;
-    if (!backend_inited) {
-        ggml_time_init();
-        llama_log_set(log_callback, nullptr);
-        // Try to pre-load Vulkan and OpenCL vendor libs so loaders can resolve symbols
-        void *vk1 = dlopen("/system/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
-        void *vk2 = vk1 ? vk1 : dlopen("/vendor/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
-        if (!vk2) {
-            LOGi("Vendor libvulkan.so not preloaded: %s", dlerror());
-        } else {
-            LOGi("Vendor libvulkan.so preloaded");
+// Probes the GPU vendor libraries and backend plugins, then initializes llama.cpp.
+static void init_backends_once() {
+    ggml_time_init();
+    llama_log_set(log_callback, nullptr);
+    // Try to pre-load Vulkan and OpenCL vendor libs so loaders can resolve symbols
+    void *vk1 = dlopen("/system/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
+    void *vk2 = vk1 ? vk1 : dlopen("/vendor/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
+    if (!vk2) {
+        LOGi("Vendor libvulkan.so not preloaded: %s", dlerror());
+    } else {
+        LOGi("Vendor libvulkan.so preloaded");
+    }
+    void *ocl = dlopen("/vendor/lib64/libOpenCL.so", RTLD_NOW | RTLD_GLOBAL);
+    if (!ocl) {
+        LOGi("Vendor libOpenCL.so not preloaded: %s", dlerror());
+    } else {
+        LOGi("Vendor libOpenCL.so preloaded");
+    }
+    // Try to load OpenCL backend if packaged; prefer absolute path next to this .so
+    {
+        Dl_info info{};
+        std::string loaded_path;
+        std::string dir;
+        if (dladdr((void*) &init_backends_once, &info) && info.dli_fname) {
+            loaded_path = info.dli_fname;
+            auto pos = loaded_path.find_last_of('/');
+            if (pos != std::string::npos) {
+                dir = loaded_path.substr(0, pos);
+            }
         }
-        void *ocl = dlopen("/vendor/lib64/libOpenCL.so", RTLD_NOW | RTLD_GLOBAL);
-        if (!ocl) {
-            LOGi("Vendor libOpenCL.so not preloaded: %s", dlerror());
+        if (!dir.empty()) {
+            LOGi("Attempting ggml_backend_load_all_from_path: %s", dir.c_str());
+            ggml_backend_load_all_from_path(dir.c_str());
         } else {
-            LOGi("Vendor libOpenCL.so preloaded");
+            LOGi("Plugin dir unknown; attempting ggml_backend_load_all() default search paths");
+            ggml_backend_load_all();
         }
-        // Try to load OpenCL backend if packaged; prefer absolute path next to this .so
-        {
-            Dl_info info{};
-            std::string loaded_path;
-            std::string dir;
-            if (dladdr((void*) &Java_android_llama_cpp_LLamaAndroid_load_1model, &info) && info.dli_fname) {
-                loaded_path = info.dli_fname;
-                auto pos = loaded_path.find_last_of('/');
-                if (pos != std::string::npos) {
-                    dir = loaded_path.substr(0, pos);
-                }
-            }
-            if (!dir.empty()) {
-                LOGi("Attempting ggml_backend_load_all_from_path: %s", dir.c_str());
-                ggml_backend_load_all_from_path(dir.c_str());
-            } else {
-                LOGi("Plugin dir unknown; attempting ggml_backend_load_all() default search paths");
-                ggml_backend_load_all();
-            }
-            // As a final fallback, try explicit sonames
-            ggml_backend_load("libggml-opencl.so");
-            ggml_backend_load("libggml-vulkan.so");
+        // As a final fallback, try explicit sonames
+        ggml_backend_load("libggml-opencl.so");
+        ggml_backend_load("libggml-vulkan.so");
 
-            LOGi("Backend registry: OpenCL=%s, Vulkan=%s",
-                 ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
-                 ggml_backend_reg_by_name("Vulkan") ? "yes" : "no");
-        }
-        llama_backend_init();
-        backend_inited = true;
+        LOGi("Backend registry: OpenCL=%s, Vulkan=%s",
+             ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
+             ggml_backend_reg_by_name("Vulkan") ? "yes" : "no");
     }
-    llama_model_params model_params = llama_model_default_params();
-    g_force_cpu_session = false; // reset session flag for new model
+    llama_backend_init();
+}
 
-    // configure GPU offload preference if GPU backend present
+// Loads the backend plugins and initializes llama.cpp once per process; safe from any thread.
+static void ensure_backends_initialized() {
+    static std::once_flag backend_once;
+    std::call_once(backend_once, init_backends_once);
+}
+
+// Model load options exposed to Kotlin through load_model_ex
+struct model_load_options {
+    bool use_mmap  = true;
+    bool use_mlock = false;
+    bool prefetch  = false;   // madvise/fadvise the tensor data region before loading
+    int  gpu_layers = INT_MIN; // requested offload; INT_MIN or negative == auto
+    bool chat_model = false;   // the app's chat model (not a reranker or other side model)
+};
+
+// Bridges llama.cpp's progress_callback to a Kotlin LoadProgressListener
+struct load_progress_bridge {
+    JNIEnv *  env         = nullptr;
+    jobject   listener    = nullptr;
+    jmethodID on_progress = nullptr;
+    int       last_pct    = -1;
+    long long t_first_us  = -1;   // first callback marks the end of the metadata phase
+    std::atomic<bool> cancel{false};   // set from any thread to abort this load
+};
+
+// Foreground load that cancel_load aborts. A cancel that arrives before the native load
+// starts is kept pending for it; begin_load clears stale ones when a new load is requested.
+static std::mutex             g_load_cancel_mutex;
+static load_progress_bridge * g_foreground_load    = nullptr;
+static bool                   g_load_cancel_pending = false;
+
+static std::mutex  g_load_stats_mutex;
+static std::string g_load_stats = "{}";         // JSON timing breakdown of the last load
+
+static bool load_progress_callback(float progress, void * user_data) {
+    auto * bridge = static_cast<load_progress_bridge *>(user_data);
+    if (bridge->t_first_us < 0) {
+        bridge->t_first_us = ggml_time_us();
+    }
+    const int pct = (int) (progress * 100.0f);
+    if (bridge->env && bridge->listener && bridge->on_progress && pct != bridge->last_pct) {
+        bridge->last_pct = pct;
+        bridge->env->CallVoidMethod(bridge->listener, bridge->on_progress, (jfloat) progress);
+        checkAndClearException(bridge->env);
+    }
+    // returning false makes llama.cpp abort the load
+    return !bridge->cancel.load(std::memory_order_relaxed);
+}
+
+// Offset of the tensor data region inside a GGUF file, read from the header only.
+static size_t gguf_data_offset(const char * path) {
+    gguf_init_params params = { /*no_alloc*/ true, /*ctx*/ nullptr };
+    gguf_context * gctx = gguf_init_from_file(path, params);
+    if (!gctx) {
+        return 0;
+    }
+    const size_t offset = gguf_get_data_offset(gctx);
+    gguf_free(gctx);
+    return offset;
+}
+
+// configure GPU offload preference if GPU backend present
+static int resolve_gpu_layers(int user_layers) {
     const bool has_vulkan = ggml_backend_reg_by_name("Vulkan") != nullptr;
     const bool has_opencl = ggml_backend_reg_by_name("OpenCL") != nullptr;
     if (has_vulkan || has_opencl) {
-        if (g_user_gpu_layers == INT_MIN || g_user_gpu_layers < 0) {
+        if (user_layers == INT_MIN || user_layers < 0) {
             // Auto: request full offload; loader will cap to supported layers
-            model_params.n_gpu_layers = 999;
-        } else {
-            model_params.n_gpu_layers = g_user_gpu_layers;
+            return 999;
         }
-    } else {
-        model_params.n_gpu_layers = 0; // CPU only
+        return user_layers;
     }
+    return 0; // CPU only
+}
+
+// Loads `path` with the given options. Records the phase timings in g_load_stats and
+// reports through `bridge` (may be null). `cancelled` is set when the bridge's cancel flag
+// aborted it; `offload` (may be null) receives the offload counts of this load.
+static llama_model * load_model_from_path(const std::string & path, const model_load_options & opts,
+                                          load_progress_bridge * bridge, bool * cancelled,
+                                          model_offload_info * offload) {
+    const auto t_start = ggml_time_us();
+    ensure_backends_initialized();
+    const auto t_backend = ggml_time_us();
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = resolve_gpu_layers(opts.gpu_layers);
+    model_params.use_mmap  = opts.use_mmap && llama_supports_mmap();
+    model_params.use_mlock = opts.use_mlock && llama_supports_mlock();
 
-    auto path_to_model = env->GetStringUTFChars(filename, 0);
-    LOGi("Loading model from %s", path_to_model);
+    load_progress_bridge local_bridge;
+    if (!bridge) {
+        bridge = &local_bridge;
+    }
+    model_params.progress_callback = load_progress_callback;
+    model_params.progress_callback_user_data = bridge;
+
+    const char * path_to_model = path.c_str();
+    LOGi("Loading model from %s (mmap=%d, mlock=%d, prefetch=%d)", path_to_model,
+         model_params.use_mmap, model_params.use_mlock, opts.prefetch);
+
+    // Sample page cache residency of the tensor data to tell cold from warm loads
+    const size_t data_offset = gguf_data_offset(path_to_model);
+    const double resident_before = page_cache_residency(path_to_model, data_offset, 0, 1024);
+    if (opts.prefetch) {
+        page_cache_prefetch(path_to_model, data_offset, 0, model_params.use_mmap);
+    }
+    const auto t_prefetch = ggml_time_us();
 
+    model_offload_info info;
+    t_load_offload = &info;
     auto model = llama_model_load_from_file(path_to_model, model_params);
-    env->ReleaseStringUTFChars(filename, path_to_model);
+    t_load_offload = nullptr;
+    const auto t_end = ggml_time_us();
+    if (offload) *offload = info;
+
+    const bool was_cancelled = bridge->cancel.load();
+    if (cancelled) *cancelled = was_cancelled;
+    const auto t_tensors_start = bridge->t_first_us >= 0 ? bridge->t_first_us : t_end;
+    json stats;
+    stats["cold"]              = resident_before >= 0.0 && resident_before < 0.5;
+    stats["resident_before"]   = resident_before;
+    stats["use_mmap"]          = model_params.use_mmap;
+    stats["use_mlock"]         = model_params.use_mlock;
+    stats["prefetch"]          = opts.prefetch;
+    stats["cancelled"]         = was_cancelled;
+    stats["backend_init_ms"]   = (t_backend - t_start) / 1000.0;
+    stats["prefetch_ms"]       = (t_prefetch - t_backend) / 1000.0;
+    stats["metadata_ms"]       = (t_tensors_start - t_prefetch) / 1000.0;
+    stats["tensors_ms"]        = (t_end - t_tensors_start) / 1000.0;
+    stats["total_ms"]          = (t_end - t_start) / 1000.0;
+    {
+        std::lock_guard<std::mutex> lock(g_load_stats_mutex);
+        g_load_stats = stats.dump();
+    }
+    LOGi("load stats: %s", stats.dump().c_str());
 
     if (!model) {
-        LOGe("load_model() failed");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "load_model() failed");
-        return 0;
+        if (was_cancelled) {
+            LOGi("load_model() cancelled");
+        } else {
+            LOGe("load_model() failed");
+        }
     }
 
-    // If zero-offload was detected during loading, we keep the flag; context creation uses CPU settings then
+    return model;
+}
 
-    return reinterpret_cast<jlong>(model);
+// Makes `info` the offload state of the foreground model; context creation uses CPU
+// settings when zero offload was detected.
+static void publish_offload(const model_offload_info & info) {
+    g_offloaded_layers  = info.offloaded;
+    g_total_layers      = info.total;
+    g_force_cpu_session = info.force_cpu;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_set_1gpu_1layers(JNIEnv *, jobject, jint ngl) {
-    // ngl < 0 => Auto
-    g_user_gpu_layers = (int) ngl;
+// Registers the bridge of a foreground load with cancel_load for the scope's lifetime,
+// taking over a cancel that arrived before the load started.
+struct foreground_load_scope {
+    explicit foreground_load_scope(load_progress_bridge & bridge) {
+        std::lock_guard<std::mutex> lock(g_load_cancel_mutex);
+        bridge.cancel = g_load_cancel_pending;
+        g_load_cancel_pending = false;
+        g_foreground_load = &bridge;
+    }
+    ~foreground_load_scope() {
+        std::lock_guard<std::mutex> lock(g_load_cancel_mutex);
+        g_foreground_load = nullptr;
+    }
+};
+
+static void throw_load_failure(JNIEnv * env, bool cancelled) {
+    if (cancelled) {
+        env->ThrowNew(env->FindClass("java/util/concurrent/CancellationException"), "load_model() cancelled");
+    } else {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "load_model() failed");
+    }
 }
 
-extern "C"
-JNIEXPORT jboolean JNICALL
-Java_android_llama_cpp_LLamaAndroid_is_1offload_1zero(JNIEnv *, jobject) {
-    return g_force_cpu_session ? JNI_TRUE : JNI_FALSE;
+static void init_progress_bridge(JNIEnv * env, jobject listener, load_progress_bridge & bridge) {
+    bridge.env = env;
+    if (listener) {
+        LocalRef<jclass> listener_class(env, env->GetObjectClass(listener));
+        bridge.listener = listener;
+        bridge.on_progress = env->GetMethodID(listener_class.get(), "onProgress", "(F)V");
+        if (checkAndClearException(env)) {
+            bridge.on_progress = nullptr;
+        }
+    }
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_set_1strip_1think(JNIEnv *, jobject, jboolean enable) {
-    g_strip_think_default = enable == JNI_TRUE;
+static std::string jstring_to_string(JNIEnv * env, jstring jstr) {
+    const char * cstr = env->GetStringUTFChars(jstr, 0);
+    std::string out(cstr ? cstr : "");
+    env->ReleaseStringUTFChars(jstr, cstr);
+    return out;
+}
+
+static llama_model * load_model_impl(JNIEnv * env, jstring filename, model_load_options opts, jobject listener) {
+    load_progress_bridge bridge;
+    init_progress_bridge(env, listener, bridge);
+    foreground_load_scope scope(bridge);
+    if (bridge.cancel.load()) {
+        throw_load_failure(env, true);   // cancelled while the load was queued
+        return nullptr;
+    }
+    opts.gpu_layers = g_user_gpu_layers;
+    bool cancelled = false;
+    model_offload_info offload;
+    llama_model * model = load_model_from_path(jstring_to_string(env, filename), opts, &bridge, &cancelled, &offload);
+    if (!model) {
+        throw_load_failure(env, cancelled);
+        return nullptr;
+    }
+    publish_offload(offload);
+    return model;
 }
 
 extern "C"
-JNIEXPORT jintArray JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1offload_1counts(JNIEnv * env, jobject) {
-    jint res[2];
-    res[0] = g_offloaded_layers;
-    res[1] = g_total_layers;
-    jintArray arr = env->NewIntArray(2);
-    env->SetIntArrayRegion(arr, 0, 2, res);
-    return arr;
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename) {
+    return reinterpret_cast<jlong>(load_model_impl(env, filename, model_load_options{}, nullptr));
 }
 
 extern "C"
 JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1kv_1size_1bytes(JNIEnv *, jobject) {
-    return (jlong) g_kv_size_bytes;
+Java_android_llama_cpp_LLamaAndroid_load_1model_1ex(
+        JNIEnv *env,
+        jobject,
+        jstring filename,
+        jboolean use_mmap,
+        jboolean use_mlock,
+        jboolean prefetch,
+        jobject listener
+    ) {
+    model_load_options opts;
+    opts.use_mmap  = use_mmap == JNI_TRUE;
+    opts.use_mlock = use_mlock == JNI_TRUE;
+    opts.prefetch  = prefetch == JNI_TRUE;
+    return reinterpret_cast<jlong>(load_model_impl(env, filename, opts, listener));
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1model(JNIEnv *, jobject, jlong model) {
-    llama_model_free(reinterpret_cast<llama_model *>(model));
+Java_android_llama_cpp_LLamaAndroid_cancel_1load(JNIEnv *, jobject) {
+    // Safe from any thread; observed by the next progress callback of the loading thread
+    std::lock_guard<std::mutex> lock(g_load_cancel_mutex);
+    if (g_foreground_load) {
+        g_foreground_load->cancel.store(true, std::memory_order_relaxed);
+    } else {
+        g_load_cancel_pending = true;
+    }
 }
 
 extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads) {
-    auto model = reinterpret_cast<llama_model *>(jmodel);
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_begin_1load(JNIEnv *, jobject) {
+    // a new load was requested: cancels meant for an earlier one no longer apply
+    std::lock_guard<std::mutex> lock(g_load_cancel_mutex);
+    g_load_cancel_pending = false;
+}
 
-    if (!model) {
-        LOGe("new_context(): model cannot be null");
-        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
-        return 0;
-    }
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1load_1stats(JNIEnv *env, jobject) {
+    std::lock_guard<std::mutex> lock(g_load_stats_mutex);
+    return env->NewStringUTF(g_load_stats.c_str());
+}
 
-    int n_threads = std::max(4, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
-    LOGi("Using %d threads", n_threads);
-    int userSpecifiedThreads = (userThreads > 0) ? std::min(9, std::max(4, userThreads))
-                                                 : std::max(4, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
-    LOGi("Using %d threads for computation", userSpecifiedThreads);
-    llama_context_params ctx_params = llama_context_default_params();
+// Offload results captured when a model was loaded, restored when the cache hands it out again
+static std::mutex g_model_offload_mutex;
+static std::unordered_map<const llama_model *, model_offload_info> g_model_offload;
 
-    // Favor stability on mobile GPUs: cap context if GPU backend is present
-    const bool has_vulkan = ggml_backend_reg_by_name("Vulkan") != nullptr;
-    const bool has_opencl = ggml_backend_reg_by_name("OpenCL") != nullptr;
-    if (!g_force_cpu_session && (has_vulkan || has_opencl)) {
-        ctx_params.n_ctx = 2048; // leaner default for chat on mobile GPUs
-        ctx_params.offload_kqv = true;
-        ctx_params.op_offload  = true;
-        ctx_params.n_batch = 256;
-        ctx_params.n_ubatch = 64;
-        ctx_params.kv_unified = true;
-    } else {
-        // keep CPU memory reasonable for chat as well
-        ctx_params.n_ctx = 2048;
-        ctx_params.kv_unified = true;
-        ctx_params.n_batch = 256;
-        ctx_params.n_ubatch = 64;
-    }
-    ctx_params.n_threads       = userSpecifiedThreads;
-    ctx_params.n_threads_batch = n_threads;
-    LOGi("Checking my threads %d", ctx_params.n_threads);
+static size_t default_model_cache_budget() {
+    // keep up to a quarter of physical RAM worth of recently used weights resident
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long page  = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page > 0 ? (size_t) pages * (size_t) page / 4 : (size_t) 2 << 30;
+}
 
-    llama_context * context = llama_init_from_model(model, ctx_params);
+static void forget_model(const llama_model * model);
 
-    if (!context) {
-        LOGe("llama_new_context_with_model() returned null)");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
-                      "llama_new_context_with_model() returned null)");
-        return 0;
+// Never destroyed: models must not be freed from static destructors at process exit
+static model_residency_cache<llama_model> & model_cache() {
+    static auto * cache = new model_residency_cache<llama_model>(
+            [](llama_model * model) {
+                {
+                    std::lock_guard<std::mutex> lock(g_model_offload_mutex);
+                    g_model_offload.erase(model);
+                }
+                forget_model(model);
+                llama_model_free(model);
+            },
+            [](const llama_model * model) { return (size_t) llama_model_size(model); },
+            default_model_cache_budget());
+    return *cache;
+}
+
+// the chat model was handed over by a preload; set on the run loop, read by session threads
+static std::atomic<bool> g_model_preloaded{false};
+static bool release_preload_reference(const llama_model * acquired);
+
+// Loads through the residency cache. Returns the shared handle; release with release_model.
+// `offload` receives the offload counts the model was loaded with, also on a cache hit.
+static llama_model * acquire_model_from_path(const std::string & path, const model_load_options & opts,
+                                             load_progress_bridge * bridge, bool * cancelled,
+                                             model_offload_info * offload) {
+    ensure_backends_initialized();
+
+    char params[64];
+    snprintf(params, sizeof(params), "ngl=%d;mmap=%d;mlock=%d",
+             resolve_gpu_layers(opts.gpu_layers), opts.use_mmap ? 1 : 0, opts.use_mlock ? 1 : 0);
+    model_file_key key;
+    if (!model_file_key_from_path(path, params, key)) {
+        // let the regular loader report the missing file
+        return load_model_from_path(path, opts, bridge, cancelled, offload);
     }
 
-    g_active_contexts.fetch_add(1, std::memory_order_relaxed);
-    return reinterpret_cast<jlong>(context);
+    const auto t_start = ggml_time_us();
+    bool hit = false;
+    llama_model * model = model_cache().acquire(key, [&]() {
+        model_offload_info info;
+        llama_model * loaded = load_model_from_path(path, opts, bridge, cancelled, &info);
+        if (loaded) {
+            std::lock_guard<std::mutex> lock(g_model_offload_mutex);
+            g_model_offload[loaded] = info;
+        }
+        return loaded;
+    }, &hit);
+
+    if (model && offload) {
+        std::lock_guard<std::mutex> lock(g_model_offload_mutex);
+        const auto it = g_model_offload.find(model);
+        if (it != g_model_offload.end()) {
+            *offload = it->second;
+        }
+    }
+    if (model && hit) {
+        json stats;
+        stats["cache_hit"] = true;
+        stats["total_ms"]  = (ggml_time_us() - t_start) / 1000.0;
+        {
+            std::lock_guard<std::mutex> lock(g_load_stats_mutex);
+            g_load_stats = stats.dump();
+        }
+        LOGi("Model %s served from residency cache in %.2f ms", path.c_str(), (ggml_time_us() - t_start) / 1000.0);
+    }
+    return model;
+}
+
+static llama_model * acquire_model_impl(JNIEnv * env, jstring filename, model_load_options opts, jobject listener) {
+    load_progress_bridge bridge;
+    init_progress_bridge(env, listener, bridge);
+    foreground_load_scope scope(bridge);
+    if (bridge.cancel.load()) {
+        throw_load_failure(env, true);   // cancelled while the load was queued
+        return nullptr;
+    }
+    opts.gpu_layers = g_user_gpu_layers;
+    bool cancelled = false;
+    model_offload_info offload;
+    llama_model * model = acquire_model_from_path(jstring_to_string(env, filename), opts, &bridge, &cancelled, &offload);
+    if (!model) {
+        throw_load_failure(env, cancelled);
+        return nullptr;
+    }
+    publish_offload(offload);
+    // the foreground load now owns a reference; drop the one a finished preload was holding
+    const bool preloaded = release_preload_reference(model);
+    if (opts.chat_model) {
+        g_model_preloaded = preloaded;
+    }
+    return model;
 }
 
 extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1context(JNIEnv *, jobject, jlong context) {
-    llama_free(reinterpret_cast<llama_context *>(context));
-    g_active_contexts.fetch_sub(1, std::memory_order_relaxed);
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_acquire_1model(
+        JNIEnv *env,
+        jobject,
+        jstring filename,
+        jboolean use_mmap,
+        jboolean use_mlock,
+        jboolean prefetch,
+        jboolean chat_model,
+        jobject listener
+    ) {
+    model_load_options opts;
+    opts.use_mmap   = use_mmap == JNI_TRUE;
+    opts.use_mlock  = use_mlock == JNI_TRUE;
+    opts.prefetch   = prefetch == JNI_TRUE;
+    opts.chat_model = chat_model == JNI_TRUE;
+    return reinterpret_cast<jlong>(acquire_model_impl(env, filename, opts, listener));
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_backend_1free(JNIEnv *, jobject) {
-    // Only free backend when there are no active contexts
-    if (g_active_contexts.load(std::memory_order_relaxed) == 0) {
-        llama_backend_free();
-    } else {
-        LOGi("backend_free requested but %d contexts still active; skipping", g_active_contexts.load());
+Java_android_llama_cpp_LLamaAndroid_release_1model(JNIEnv *, jobject, jlong jmodel) {
+    auto * model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model) return;
+    if (!model_cache().release(model)) {
+        // not cache-owned (legacy load_model handle)
+        forget_model(model);
+        llama_model_free(model);
     }
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_log_1to_1android(JNIEnv *, jobject) {
-    llama_log_set(log_callback, NULL);
+Java_android_llama_cpp_LLamaAndroid_set_1model_1cache_1budget(JNIEnv *, jobject, jlong bytes) {
+    model_cache().set_budget(bytes > 0 ? (size_t) bytes : 0);
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_set_1verbose_1tokens(JNIEnv *, jobject, jboolean enable) {
-    g_verbose_tokens = enable == JNI_TRUE;
+Java_android_llama_cpp_LLamaAndroid_trim_1model_1cache(JNIEnv *, jobject) {
+    model_cache().trim();
 }
 
 extern "C"
 JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_export_1diag(JNIEnv * env, jobject) {
-    char buf[256];
-    snprintf(buf, sizeof(buf),
-             "backend(OpenCL=%s,Vulkan=%s), contexts=%d, offload=%d/%d, kvMiB=%.2f, ubatch=%d",
-             ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
-             ggml_backend_reg_by_name("Vulkan") ? "yes" : "no",
-             g_active_contexts.load(),
-             g_offloaded_layers, g_total_layers,
-             g_kv_size_bytes > 0 ? (double) g_kv_size_bytes / (1024.0*1024.0) : 0.0,
-             g_dynamic_ubatch);
-    return env->NewStringUTF(buf);
+Java_android_llama_cpp_LLamaAndroid_get_1model_1cache_1stats(JNIEnv *env, jobject) {
+    const auto st = model_cache().get_stats();
+    json stats;
+    stats["entries"]        = st.entries;
+    stats["referenced"]     = st.referenced;
+    stats["resident_bytes"] = st.resident_bytes;
+    stats["budget_bytes"]   = st.budget_bytes;
+    stats["hits"]           = st.hits;
+    stats["misses"]         = st.misses;
+    stats["evictions"]      = st.evictions;
+    return env->NewStringUTF(stats.dump().c_str());
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_set_1backend_1search_1dir(JNIEnv * env, jobject, jstring jdir) {
-    const char * cdir = env->GetStringUTFChars(jdir, 0);
-    if (cdir && cdir[0] != '\0') {
-        LOGi("Manually setting backend search dir: %s", cdir);
-        ggml_backend_load_all_from_path(cdir);
-        LOGi("Backend registry (post manual set): OpenCL=%s, Vulkan=%s",
-             ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
-             ggml_backend_reg_by_name("Vulkan") ? "yes" : "no");
+// Background preload of the last used model: warms the page cache, loads through the
+// residency cache and runs a one-token decode, so the first reply pays for none of it.
+struct preload_job {
+    std::string          path;
+    model_load_options   opts;
+    int                  n_threads = 0;
+    std::shared_future<bool> done;
+    load_progress_bridge bridge;            // own cancel flag; discard_preload aborts a running preload
+    llama_model *        model = nullptr;   // reference held until a foreground load claims it
+    json                 stats;
+};
+
+static std::mutex g_preload_mutex;
+static std::shared_ptr<preload_job> g_preload;
+static std::atomic<long long> g_last_ttft_us{-1};    // last reply of any session
+static std::atomic<long long> g_first_ttft_us{-1};   // first reply of this process
+static std::atomic<bool>      g_first_ttft_preloaded{false};
+// chat template formatting (oaicompat_completion_param_parse) on this thread, not yet
+// taken by a completion_init; the next one on the same thread counts it in its session's
+// TTFT breakdown
+static thread_local long long t_template_us = -1;
+
+// Progress of the prompt prefill in completion_init, readable from any thread while it runs.
+struct prefill_progress {
+    std::atomic<bool>      active{false};
+    std::atomic<int>       total{0};
+    std::atomic<int>       processed{0};          // includes tokens restored from the prefix cache
+    std::atomic<int>       reused{0};
+    std::atomic<long long> t_decode_start_us{0};
+};
+
+static const int DEFAULT_PREFILL_UBATCH = 64;
+
+// Generation state of one context. new_context and session_create attach one to every
+// context, so chats on separate contexts can prefill and decode concurrently. The
+// context-based entry points look it up by context; session_* calls use the handle.
+struct generation_session {
+    llama_context * context = nullptr;
+    llama_batch   * batch   = nullptr;   // set and owned only by session_create
+    llama_sampler * sampler = nullptr;
+
+    // token stream
+    std::string cached_token_chars;      // incomplete UTF-8 bytes (or the whole reply when verbose)
+    int         n_generated    = 0;
+    bool        strip_think    = false;
+    bool        verbose_tokens = false;
+    int         dynamic_ubatch = DEFAULT_PREFILL_UBATCH;   // prefill micro-batch, lowered by throttling
+    jmethodID   int_var_value  = nullptr;
+    jmethodID   int_var_inc    = nullptr;
+
+    // cancellation; llama.cpp polls the flag between graph nodes through the abort callback
+    std::atomic<bool>      cancel_requested{false};
+    std::atomic<long long> cancel_requested_us{-1};
+
+    // TTFT breakdown of the last reply and progress of the running prefill
+    long long              prompt_start_us = -1;
+    bool                   ttft_pending    = false;
+    std::atomic<long long> last_ttft_us{-1};
+    std::atomic<long long> template_us{-1};
+    std::atomic<long long> tokenize_us{-1};
+    std::atomic<long long> prefill_us{-1};
+    std::atomic<long long> sample_us{-1};
+    prefill_progress       prefill;
+
+    // tool-call grammar of the following completions
+    llama_sampler *               tool_grammar       = nullptr;
+    const llama_vocab *           tool_grammar_vocab = nullptr;
+    std::vector<llama_token_data> grammar_candidates;
+
+    // KV snapshots of prompt prefixes
+    std::mutex   prefix_mutex;
+    prefix_cache prefix;
+    int          prefix_reused = 0;
+
+    // prompt-lookup speculation, configured from the process-wide settings at completion_init
+    bool                     lookup_enabled = false;
+    ngram_draft_params       lookup;
+    std::vector<llama_token> history;                       // prompt and emitted tokens, in KV order
+    std::deque<llama_token>  verified;                      // accepted drafts, already in the KV cache
+    llama_token              next_token = LLAMA_TOKEN_NULL; // sampled while verifying, not decoded yet
+    std::atomic<int>         spec_drafted{0};
+    std::atomic<int>         spec_accepted{0};
+    std::atomic<int>         spec_verifies{0};              // decodes that carried a draft
+    std::atomic<long long>   first_token_us{-1};
+    std::atomic<long long>   last_token_us{-1};
+
+    // thermal / latency throttling
+    std::mutex        throttle_mutex;
+    throttle_governor throttle;
+    int               throttle_changes = 0;
+    int               n_threads        = 1;   // unthrottled n_threads / n_threads_batch
+    int               n_threads_batch  = 1;
+
+    // LoRA adapters attached to the context; guarded by g_sessions_mutex
+    lora_set<llama_adapter_lora> loras;
+
+    // per-token log-probabilities, written into the app's direct ByteBuffer as tokens are emitted
+    logprob_ring               logprobs;
+    logprob_pending            logprobs_pending;   // sampled, not emitted yet
+    std::vector<logprob_entry> logprob_alts;
+
+    ~generation_session() {
+        if (tool_grammar) {
+            llama_sampler_free(tool_grammar);
+        }
     }
-    env->ReleaseStringUTFChars(jdir, cdir);
-}
+};
 
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_bench_1model(
-        JNIEnv *env,
-        jobject,
-        jlong context_pointer,
-        jlong model_pointer,
-        jlong batch_pointer,
-        jint pp,
-        jint tg,
-        jint pl,
-        jint nr
-        ) {
-    auto pp_avg = 0.0;
-    auto tg_avg = 0.0;
-    auto pp_std = 0.0;
-    auto tg_std = 0.0;
-
-    const auto context = reinterpret_cast<llama_context *>(context_pointer);
-    const auto model = reinterpret_cast<llama_model *>(model_pointer);
-    const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
-
-    const int n_ctx = llama_n_ctx(context);
+static std::mutex g_sessions_mutex;
+static std::unordered_map<const llama_context *, std::unique_ptr<generation_session>> g_sessions;
+static std::atomic<const llama_context *> g_last_session{nullptr};   // last to run completion_init
 
-    LOGi("n_ctx = %d", n_ctx);
+static generation_session * find_session(const llama_context * context) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(context);
+    return it == g_sessions.end() ? nullptr : it->second.get();
+}
 
-    int i, j;
-    int nri;
-    for (nri = 0; nri < nr; nri++) {
-        LOGi("Benchmark prompt processing (pp)");
+// Runs `fn` on the session that ran the last completion (for the process-wide stats
+// calls); `fn` gets nullptr when there is none. Holds the registry lock.
+template <typename F>
+static void with_last_session(F && fn) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(g_last_session.load());
+    fn(it == g_sessions.end() ? nullptr : it->second.get());
+}
 
-        common_batch_clear(*batch);
+// Runs `fn` on the session of `context` (nullptr when it has none) under the registry lock,
+// for the stats calls that other threads poll while the session may be freed.
+template <typename F>
+static void with_session(const llama_context * context, F && fn) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(context);
+    fn(it == g_sessions.end() ? nullptr : it->second.get());
+}
 
-        const int n_tokens = pp;
-        for (i = 0; i < n_tokens; i++) {
-            common_batch_add(*batch, 0, i, { 0 }, false);
-        }
+// True when `acquired` is the model the preload was holding.
+static bool release_preload_reference(const llama_model * acquired) {
+    std::lock_guard<std::mutex> lock(g_preload_mutex);
+    if (!g_preload || !g_preload->model) {
+        return false;
+    }
+    if (g_preload->done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+    const bool handed_over = g_preload->model == acquired;
+    model_cache().release(g_preload->model);
+    g_preload->model = nullptr;
+    return handed_over;
+}
 
-        batch->logits[batch->n_tokens - 1] = true;
-        llama_memory_clear(llama_get_memory(context), true);
+static bool run_preload(const std::shared_ptr<preload_job> & job) {
+    const auto t_start = ggml_time_us();
+    ensure_backends_initialized();
+
+    // Sequential read of the tensor data ahead of the loader's page faults
+    const size_t data_offset = gguf_data_offset(job->path.c_str());
+    const long long warmed = page_cache_warm(job->path.c_str(), data_offset, 0, &job->bridge.cancel);
+    const auto t_warm = ggml_time_us();
+
+    // offload counts go to the residency cache only; the foreground model's stay as they are
+    bool cancelled = false;
+    llama_model * model = acquire_model_from_path(job->path, job->opts, &job->bridge, &cancelled, nullptr);
+    const auto t_load = ggml_time_us();
+
+    json stats;
+    stats["warmed_bytes"] = warmed;
+    stats["page_warm_ms"] = (t_warm - t_start) / 1000.0;
+    stats["load_ms"]      = (t_load - t_warm) / 1000.0;
+    if (!model) {
+        stats["error"] = cancelled ? "cancelled" : "load failed";
+        std::lock_guard<std::mutex> lock(g_preload_mutex);
+        job->stats = stats;
+        return false;
+    }
 
-        const auto t_pp_start = ggml_time_us();
-        if (llama_decode(context, *batch) != 0) {
-            LOGi("llama_decode() failed during prompt processing");
-        }
-        const auto t_pp_end = ggml_time_us();
+    // One-token decode faults in the mapped weights and builds backend pipelines.
+    // Counted as an active context so set_backend cannot pull the backend from under it.
+    g_active_contexts.fetch_add(1, std::memory_order_relaxed);
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx    = 256;
+    ctx_params.n_batch  = 64;
+    ctx_params.n_ubatch = 64;
+    const int n_threads = job->n_threads > 0 ? job->n_threads
+                                             : std::max(4, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
+    ctx_params.n_threads       = n_threads;
+    ctx_params.n_threads_batch = n_threads;
+    ctx_params.kv_unified      = true;
+    llama_context * ctx = llama_init_from_model(model, ctx_params);
+    bool decoded = false;
+    if (ctx) {
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+        llama_token tok = llama_vocab_bos(vocab);
+        if (tok < 0) tok = 0;
+        decoded = llama_decode(ctx, llama_batch_get_one(&tok, 1)) == 0;
+        llama_free(ctx);
+    }
+    g_active_contexts.fetch_sub(1, std::memory_order_relaxed);
+    const auto t_end = ggml_time_us();
 
-        // bench text generation
+    stats["warmup_decode_ms"] = (t_end - t_load) / 1000.0;
+    stats["warmup_decoded"]   = decoded;
+    stats["total_ms"]         = (t_end - t_start) / 1000.0;
+    LOGi("preload finished: %s", stats.dump().c_str());
 
-        LOGi("Benchmark text generation (tg)");
+    std::lock_guard<std::mutex> lock(g_preload_mutex);
+    job->stats = stats;
+    job->model = model;
+    return true;
+}
 
-        llama_memory_clear(llama_get_memory(context), true);
-        const auto t_tg_start = ggml_time_us();
-        for (i = 0; i < tg; i++) {
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_preload_1model(
+        JNIEnv *env,
+        jobject,
+        jstring filename,
+        jboolean use_mmap,
+        jboolean use_mlock,
+        jint n_threads,
+        jint n_gpu_layers
+    ) {
+    auto job = std::make_shared<preload_job>();
+    job->path = jstring_to_string(env, filename);
+    job->opts.use_mmap   = use_mmap == JNI_TRUE;
+    job->opts.use_mlock  = use_mlock == JNI_TRUE;
+    job->opts.gpu_layers = n_gpu_layers;   // must match the eventual load for the cache key to line up
+    job->n_threads = n_threads;
+
+    std::lock_guard<std::mutex> lock(g_preload_mutex);
+    if (g_preload && g_preload->done.valid() &&
+        g_preload->done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        LOGi("preload_model: a preload is already running");
+        return JNI_FALSE;
+    }
+    if (g_preload && g_preload->model) {
+        // superseded preload: its model stays resident only within the cache budget
+        model_cache().release(g_preload->model);
+        g_preload->model = nullptr;
+    }
+    auto promise = std::make_shared<std::promise<bool>>();
+    job->done = promise->get_future().share();
+    g_preload = job;
+    std::thread([job, promise]() {
+        promise->set_value(run_preload(job));
+    }).detach();
+    LOGi("preload_model: started for %s", job->path.c_str());
+    return JNI_TRUE;
+}
 
-            common_batch_clear(*batch);
-            for (j = 0; j < pl; j++) {
-                common_batch_add(*batch, 0, i, { j }, true);
-            }
+// 1 = preloaded, 0 = still running after timeout, -1 = failed, -2 = no preload requested.
+// A negative timeout waits until the preload finishes.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_await_1preload(JNIEnv *, jobject, jlong timeout_ms) {
+    std::shared_future<bool> done;
+    {
+        std::lock_guard<std::mutex> lock(g_preload_mutex);
+        if (!g_preload) return -2;
+        done = g_preload->done;
+    }
+    if (timeout_ms < 0) {
+        done.wait();
+    } else if (done.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready) {
+        return 0;
+    }
+    return done.get() ? 1 : -1;
+}
 
-            LOGi("llama_decode() text generation: %d", i);
-            if (llama_decode(context, *batch) != 0) {
-                LOGi("llama_decode() failed during text generation");
-            }
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_discard_1preload(JNIEnv *, jobject) {
+    {
+        std::lock_guard<std::mutex> lock(g_preload_mutex);
+        if (g_preload) {
+            g_preload->bridge.cancel.store(true, std::memory_order_relaxed);   // still running: abort it
         }
+    }
+    release_preload_reference(nullptr);
+}
 
-        const auto t_tg_end = ggml_time_us();
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1preload_1stats(JNIEnv *env, jobject) {
+    json stats;
+    {
+        std::lock_guard<std::mutex> lock(g_preload_mutex);
+        if (g_preload) {
+            stats = g_preload->stats;
+            stats["path"] = g_preload->path;
+        }
+    }
+    // TTFT of the first reply in this process, to compare cold starts with and without preload
+    stats["first_ttft_ms"]        = g_first_ttft_us >= 0 ? g_first_ttft_us / 1000.0 : -1.0;
+    stats["first_ttft_preloaded"] = g_first_ttft_preloaded.load();
+    stats["last_ttft_ms"]         = g_last_ttft_us >= 0 ? g_last_ttft_us / 1000.0 : -1.0;
+    return env->NewStringUTF(stats.dump().c_str());
+}
 
-        llama_memory_clear(llama_get_memory(context), true);
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1gpu_1layers(JNIEnv *, jobject, jint ngl) {
+    // ngl < 0 => Auto
+    g_user_gpu_layers = (int) ngl;
+}
 
-        const auto t_pp = double(t_pp_end - t_pp_start) / 1000000.0;
-        const auto t_tg = double(t_tg_end - t_tg_start) / 1000000.0;
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_is_1offload_1zero(JNIEnv *, jobject) {
+    return g_force_cpu_session ? JNI_TRUE : JNI_FALSE;
+}
 
-        const auto speed_pp = double(pp) / t_pp;
-        const auto speed_tg = double(pl * tg) / t_tg;
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1strip_1think(JNIEnv *, jobject, jboolean enable) {
+    g_strip_think_default = enable == JNI_TRUE;
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto & it : g_sessions) {
+        it.second->strip_think = g_strip_think_default;
+    }
+}
 
-        pp_avg += speed_pp;
-        tg_avg += speed_tg;
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1offload_1counts(JNIEnv * env, jobject) {
+    jint res[2];
+    res[0] = g_offloaded_layers;
+    res[1] = g_total_layers;
+    jintArray arr = env->NewIntArray(2);
+    env->SetIntArrayRegion(arr, 0, 2, res);
+    return arr;
+}
 
-        pp_std += speed_pp * speed_pp;
-        tg_std += speed_tg * speed_tg;
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1kv_1size_1bytes(JNIEnv *, jobject) {
+    return (jlong) g_kv_size_bytes;
+}
 
-        LOGi("pp %f t/s, tg %f t/s", speed_pp, speed_tg);
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1model(JNIEnv *, jobject, jlong model) {
+    auto * m = reinterpret_cast<llama_model *>(model);
+    // cache-owned models are only released; the cache decides when to free them
+    if (!model_cache().release(m)) {
+        forget_model(m);
+        llama_model_free(m);
     }
+}
 
-    pp_avg /= double(nr);
-    tg_avg /= double(nr);
+// Cancellation: cancel_generation / session_cancel may be called from any thread. A running
+// llama_decode returns within one graph node. The flag outlives completion_init, so a Stop
+// pressed before the reply reaches native code still stops its prefill; it is cleared when
+// a cancelled call unwinds and when the app ends the reply (end_generation).
+static std::atomic<long long> g_last_cancel_latency_us{-1};   // cancel -> native call returned
+static std::atomic<int>       g_cancel_count{0};
 
-    if (nr > 1) {
-        pp_std = sqrt(pp_std / double(nr - 1) - pp_avg * pp_avg * double(nr) / double(nr - 1));
-        tg_std = sqrt(tg_std / double(nr - 1) - tg_avg * tg_avg * double(nr) / double(nr - 1));
-    } else {
-        pp_std = 0;
-        tg_std = 0;
-    }
+static bool session_abort_callback(void * data) {
+    return static_cast<generation_session *>(data)->cancel_requested.load(std::memory_order_relaxed);
+}
 
-    char model_desc[128];
-    llama_model_desc(model, model_desc, sizeof(model_desc));
+static void request_cancel(generation_session * session) {
+    long long expected = -1;
+    session->cancel_requested_us.compare_exchange_strong(expected, ggml_time_us());
+    session->cancel_requested.store(true, std::memory_order_relaxed);
+}
 
-    const auto model_size     = double(llama_model_size(model)) / 1024.0 / 1024.0 / 1024.0;
-    const auto model_n_params = double(llama_model_n_params(model)) / 1e9;
+static bool cancel_requested(const generation_session * session) {
+    return session->cancel_requested.load(std::memory_order_relaxed);
+}
 
-    // Determine backend based on build flags so benchmarks report the
-    // actual runtime used. This mirrors the backends supported by
-    // ggml/llama.cpp.
-#if defined(GGML_USE_CUDA)
-    const auto backend    = "CUDA";
-#elif defined(GGML_USE_VULKAN)
-    const auto backend    = "Vulkan";
-#elif defined(GGML_USE_METAL) || defined(GGML_USE_MPS)
-    const auto backend    = "Metal";
-#elif defined(GGML_USE_CLBLAST) || defined(GGML_USE_OPENCL)
-    const auto backend    = "OpenCL";
-#else
-    const auto backend    = "CPU";
-#endif
+// Records the cancel-to-idle latency once a cancelled call has unwound and re-arms the
+// context for other work (embeddings, benchmarks) on it.
+static void finish_cancel(generation_session * session) {
+    session->cancel_requested = false;
+    const long long requested_us = session->cancel_requested_us.exchange(-1);
+    if (requested_us >= 0) {
+        g_last_cancel_latency_us = ggml_time_us() - requested_us;
+        g_cancel_count++;
+        LOGi("generation cancelled; idle after %.2f ms", g_last_cancel_latency_us.load() / 1000.0);
+    }
+}
 
-    std::stringstream result;
-    result << std::setprecision(2);
-    result << "| model | size | params | backend | test | t/s |\n";
-    result << "| --- | --- | --- | --- | --- | --- |\n";
-    result << "| " << model_desc << " | " << model_size << "GiB | " << model_n_params << "B | " << backend << " | pp " << pp << " | " << pp_avg << " ± " << pp_std << " |\n";
-    result << "| " << model_desc << " | " << model_size << "GiB | " << model_n_params << "B | " << backend << " | tg " << tg << " | " << tg_avg << " ± " << tg_std << " |\n";
+// Drops a cancel that came too late to interrupt anything, so it cannot abort the next reply.
+static void end_generation(generation_session * session) {
+    session->cancel_requested = false;
+    session->cancel_requested_us = -1;
+}
 
-    return env->NewStringUTF(result.str().c_str());
+// Steps decode down (ubatch, threads, token pacing) when the device heats up or per-token
+// latency degrades, and back up when it recovers. Never touches the KV cache. The
+// temperature is shared by all sessions; each session has its own latency trend.
+static std::mutex  g_thermal_mutex;
+static bool        g_throttle_enabled = true;
+static std::string g_thermal_root     = "/sys";
+static float       g_thermal_temp_c   = NAN;
+static long long   g_thermal_read_us  = 0;     // sysfs is read at most once per second
+
+static float current_temp_c() {
+    std::lock_guard<std::mutex> lock(g_thermal_mutex);
+    const long long now = ggml_time_us();
+    if (now - g_thermal_read_us >= 1000000) {
+        g_thermal_read_us = now;
+        g_thermal_temp_c = thermal_max_temp_c(g_thermal_root);
+    }
+    return g_thermal_temp_c;
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1batch(JNIEnv *, jobject, jint n_tokens, jint embd, jint n_seq_max) {
-    // Use upstream allocator to ensure compatible free
-    llama_batch * batch = new llama_batch;
-    *batch = llama_batch_init(n_tokens, embd, n_seq_max);
-    return reinterpret_cast<jlong>(batch);
+static bool throttle_enabled() {
+    std::lock_guard<std::mutex> lock(g_thermal_mutex);
+    return g_throttle_enabled;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1batch(JNIEnv *, jobject, jlong batch_pointer) {
-    if (batch_pointer == 0) return;
-    llama_batch * batch = reinterpret_cast<llama_batch *>(batch_pointer);
-    // Clear dynamic content, then free using upstream helper and delete wrapper
-    common_batch_clear(*batch);
-    llama_batch_free(*batch);
-    delete batch;
+static void reset_throttle(generation_session * session) {
+    std::lock_guard<std::mutex> lock(session->throttle_mutex);
+    session->n_threads       = std::max(1, (int) llama_n_threads(session->context));
+    session->n_threads_batch = std::max(1, (int) llama_n_threads_batch(session->context));
+    session->throttle.reset(session->n_threads, DEFAULT_PREFILL_UBATCH);
+    session->dynamic_ubatch = DEFAULT_PREFILL_UBATCH;
 }
 
-extern "C"
-JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *, jobject, jfloat top_p, jint top_k, jfloat temp) {
-    LOGi("my params temp=%.1f, top_p=%.1f, top_k=%d", temp, top_p, top_k);
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = true;
-    llama_sampler *smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+static void apply_throttle_limits(generation_session * session, float temp_c) {
+    const auto limits = session->throttle.limits();
+    const int n_threads_batch = std::max(1, session->n_threads_batch * limits.n_threads / session->n_threads);
+    llama_set_n_threads(session->context, limits.n_threads, n_threads_batch);
+    session->dynamic_ubatch = limits.ubatch;
+    session->throttle_changes++;
+    LOGi("throttle level %d: threads=%d/%d ubatch=%d pace=%.1f ms (%.1f C, %.1f ms/token, baseline %.1f)",
+         session->throttle.level(), limits.n_threads, n_threads_batch, limits.ubatch, limits.min_token_ms,
+         temp_c, session->throttle.fast_ms(), session->throttle.baseline_ms());
+}
 
-    // Top K handling
-    if (top_k == 0) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40)); // Default value
-    } else {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k));
+// Feeds one decode latency to the governor. Returns the minimum time the token should
+// take (pacing), 0 when unthrottled.
+static double throttle_on_token(generation_session * session, double decode_ms) {
+    if (!throttle_enabled()) {
+        return 0.0;
     }
-
-    // Top P handling
-    if (top_p == 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1)); // Default value
-    } else {
-        float adjusted_top_p = roundf(top_p * 10) / 10;
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(adjusted_top_p, 1));
+    const float temp_c = current_temp_c();
+    std::lock_guard<std::mutex> lock(session->throttle_mutex);
+    if (session->throttle.on_token(decode_ms, temp_c)) {
+        apply_throttle_limits(session, temp_c);
     }
+    return session->throttle.limits().min_token_ms;
+}
 
-    // Temperature handling
-    if (temp == 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.4f)); // Default value
-    } else {
-        float adjusted_temp = roundf(temp * 10) / 10;
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(adjusted_temp));
+static void throttle_on_stall(generation_session * session) {
+    const bool enabled = throttle_enabled();
+    // read under g_thermal_mutex before taking the session's lock, as in throttle_on_token
+    const float temp_c = enabled ? current_temp_c() : NAN;
+    std::lock_guard<std::mutex> lock(session->throttle_mutex);
+    if (!enabled) {
+        // no governor: only ease the next prefills
+        if (session->dynamic_ubatch > 16) session->dynamic_ubatch = session->dynamic_ubatch / 2;
+        return;
+    }
+    if (session->throttle.on_stall()) {
+        apply_throttle_limits(session, temp_c);
     }
-
-    // Always add dist sampler
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(1234));
-
-    return reinterpret_cast<jlong>(smpl);
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1sampler(JNIEnv *, jobject, jlong sampler_pointer) {
-    llama_sampler_free(reinterpret_cast<llama_sampler *>(sampler_pointer));
+// Prefix cache settings shared by all sessions.
+static std::atomic<bool>   g_prefix_cache_enabled{true};
+static std::atomic<size_t> g_prefix_cache_budget{(size_t) 64 << 20};
+
+static generation_session * attach_session(llama_context * context) {
+    auto session = std::make_unique<generation_session>();
+    session->context        = context;
+    session->strip_think    = g_strip_think_default;
+    session->verbose_tokens = g_verbose_tokens;
+    session->prefix.set_max_bytes(g_prefix_cache_budget.load());
+    llama_set_abort_callback(context, session_abort_callback, session.get());
+    generation_session * raw = session.get();
+    reset_throttle(raw);
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    g_sessions[context] = std::move(session);
+    return raw;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_backend_1init(JNIEnv *, jobject) {
-    llama_backend_init();
-}
+static lora_cache<llama_model, llama_adapter_lora> & lora_adapters();
+static void detach_released_loras(generation_session * session);
 
-extern "C"
-JNIEXPORT jboolean JNICALL
-Java_android_llama_cpp_LLamaAndroid_set_1backend(JNIEnv *env, jobject, jstring jbackend) {
-    const char *backend = env->GetStringUTFChars(jbackend, 0);
-    bool success = true;
+static void detach_session(llama_context * context) {
+    llama_set_abort_callback(context, nullptr, nullptr);
+    std::unique_ptr<generation_session> session;
     {
-        std::lock_guard<std::mutex> lock(g_backend_mutex);
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        auto it = g_sessions.find(context);
+        if (it == g_sessions.end()) return;
+        session = std::move(it->second);
+        g_sessions.erase(it);
+    }
+    llama_clear_adapter_lora(context);
+    lora_adapters().unpin(session->loras);
+}
 
-        if (g_active_contexts.load(std::memory_order_relaxed) != 0) {
-            LOGi("set_backend: contexts active (%d); refusing backend switch", g_active_contexts.load());
-            success = false;
-        } else {
-            if (strcmp(backend, "opencl") == 0) {
-                g_backend_selection = "opencl";
-                LOGi("Set backend to OpenCL (requires env config at startup)");
-            } else if (strcmp(backend, "vulkan") == 0) {
-                g_backend_selection = "vulkan";
-                // Proactively load system Vulkan and the ggml Vulkan backend if present
-                void *vk1 = dlopen("/system/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
-                void *vk2 = vk1 ? vk1 : dlopen("/vendor/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
-                if (!vk2) {
-                    LOGi("Vulkan loader not preloaded: %s", dlerror());
-                } else {
-                    LOGi("Vulkan loader preloaded");
-                }
-                // Try loading backend plugins again to ensure Vulkan is registered
-                ggml_backend_load_all();
-                // Try typical backend sonames and the Android packaged path
-                ggml_backend_load("libggml-vulkan.so");
-                ggml_backend_load("libggml-vulkan-android.so");
-                LOGi("Set backend to Vulkan (requested)");
-            } else {
-                g_backend_selection = "cpu";
-                LOGi("Set backend to CPU");
-            }
+// Creates a chat context with the app's mobile defaults and attaches its generation session.
+// Throws and returns null on failure.
+static llama_context * create_context(JNIEnv *env, llama_model * model, int userThreads) {
+    if (!model) {
+        LOGe("new_context(): model cannot be null");
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "Model cannot be null");
+        return nullptr;
+    }
 
-            llama_backend_free();
-            llama_backend_init();
+    int n_threads = std::max(4, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
+    LOGi("Using %d threads", n_threads);
+    int userSpecifiedThreads = (userThreads > 0) ? std::min(9, std::max(4, userThreads))
+                                                 : std::max(4, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
+    LOGi("Using %d threads for computation", userSpecifiedThreads);
+    llama_context_params ctx_params = llama_context_default_params();
 
-            if (g_backend_selection == "opencl" && !llama_supports_gpu_offload()) {
-                LOGe("OpenCL init failed, falling back to CPU");
-                g_backend_selection = "cpu";
-                llama_backend_free();
-                llama_backend_init();
-                success = false;
-            } else if (g_backend_selection == "vulkan") {
-                if (ggml_backend_reg_by_name("Vulkan") == nullptr) {
-                    LOGe("Vulkan backend not registered after init");
-                    g_backend_selection = "cpu";
-                    llama_backend_free();
-                    llama_backend_init();
-                    success = false;
-                }
-            }
-        }
+    // Favor stability on mobile GPUs: cap context if GPU backend is present
+    const bool has_vulkan = ggml_backend_reg_by_name("Vulkan") != nullptr;
+    const bool has_opencl = ggml_backend_reg_by_name("OpenCL") != nullptr;
+    if (!g_force_cpu_session && (has_vulkan || has_opencl)) {
+        ctx_params.n_ctx = 2048; // leaner default for chat on mobile GPUs
+        ctx_params.offload_kqv = true;
+        ctx_params.op_offload  = true;
+        ctx_params.n_batch = 256;
+        ctx_params.n_ubatch = 64;
+        ctx_params.kv_unified = true;
+    } else {
+        // keep CPU memory reasonable for chat as well
+        ctx_params.n_ctx = 2048;
+        ctx_params.kv_unified = true;
+        ctx_params.n_batch = 256;
+        ctx_params.n_ubatch = 64;
     }
+    ctx_params.n_threads       = userSpecifiedThreads;
+    ctx_params.n_threads_batch = n_threads;
+    LOGi("Checking my threads %d", ctx_params.n_threads);
 
-    env->ReleaseStringUTFChars(jbackend, backend);
-    return success ? JNI_TRUE : JNI_FALSE;
+    llama_context * context = llama_init_from_model(model, ctx_params);
+
+    if (!context) {
+        LOGe("llama_new_context_with_model() returned null)");
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"),
+                      "llama_new_context_with_model() returned null)");
+        return nullptr;
+    }
+
+    attach_session(context);
+    g_active_contexts.fetch_add(1, std::memory_order_relaxed);
+    return context;
+}
+
+static void destroy_context(llama_context * context) {
+    detach_session(context);
+    llama_free(context);
+    g_active_contexts.fetch_sub(1, std::memory_order_relaxed);
 }
 
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_system_1info(JNIEnv *env, jobject) {
-    return env->NewStringUTF(llama_print_system_info());
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel, jint userThreads) {
+    return reinterpret_cast<jlong>(create_context(env, reinterpret_cast<llama_model *>(jmodel), userThreads));
 }
 
 extern "C"
-JNIEXPORT jint JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1n_1ctx(JNIEnv *, jobject, jlong context_pointer) {
-    const auto context = reinterpret_cast<llama_context *>(context_pointer);
-    if (!context) return 0;
-    return (jint) llama_n_ctx(context);
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1context(JNIEnv *, jobject, jlong context) {
+    destroy_context(reinterpret_cast<llama_context *>(context));
 }
 
 extern "C"
-JNIEXPORT jint JNICALL
-Java_android_llama_cpp_LLamaAndroid_completion_1init(
-        JNIEnv *env,
-        jobject,
-        jlong context_pointer,
-        jlong batch_pointer,
-        jstring jtext,
-        jint n_len
-    ) {
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_cancel_1generation(JNIEnv *, jobject, jlong context) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(reinterpret_cast<llama_context *>(context));
+    if (it != g_sessions.end()) {
+        request_cancel(it->second.get());
+    }
+}
 
-    cached_token_chars.clear();
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1cancel_1stats(JNIEnv *env, jobject) {
+    json out;
+    const long long latency_us = g_last_cancel_latency_us.load();
+    out["cancels"]         = g_cancel_count.load();
+    out["last_latency_ms"] = latency_us < 0 ? -1.0 : latency_us / 1000.0;
+    return env->NewStringUTF(out.dump().c_str());
+}
 
-    const auto text = env->GetStringUTFChars(jtext, 0);
-    const auto context = reinterpret_cast<llama_context *>(context_pointer);
-    const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+// Processed/total prompt tokens of the running prefill and the time left at the
+// throughput measured so far.
+static json prefill_progress_json(const generation_session * session) {
+    json out;
+    if (!session) {
+        out["active"] = false;
+        return out;
+    }
+    const prefill_progress & prefill = session->prefill;
+    const bool active    = prefill.active.load();
+    const int  total     = prefill.total.load();
+    const int  processed = prefill.processed.load();
+    const int  decoded   = processed - prefill.reused.load();
+    const double elapsed_s = (ggml_time_us() - prefill.t_decode_start_us.load()) / 1e6;
+    const double tps = decoded > 0 && elapsed_s > 0 ? decoded / elapsed_s : 0.0;
+
+    out["active"]       = active;
+    out["processed"]    = processed;
+    out["total"]        = total;
+    out["reused"]       = prefill.reused.load();
+    out["tokens_per_s"] = tps;
+    out["eta_ms"]       = active && tps > 0 ? (total - processed) / tps * 1000.0 : (active ? -1.0 : 0.0);
+    return out;
+}
 
-    // ensure embeddings mode is off for generation
-    llama_set_embeddings(context, false);
+static json ttft_json(const generation_session * session) {
+    auto ms = [](long long us) { return us >= 0 ? us / 1000.0 : -1.0; };
+    json out;
+    if (!session) {
+        return out;
+    }
+    const long long ttft_us = session->last_ttft_us.load();
+    out["template_ms"] = ms(session->template_us);
+    out["tokenize_ms"] = ms(session->tokenize_us);
+    out["prefill_ms"]  = ms(session->prefill_us);
+    out["sample_ms"]   = ms(session->sample_us);
+    out["reused"]      = session->prefill.reused.load();
+    // template formatting happens in a separate call before completion_init
+    out["ttft_ms"]     = ttft_us >= 0 ? ms(ttft_us) + std::max(0.0, ms(session->template_us)) : -1.0;
+    return out;
+}
 
-    const auto tokens_list = common_tokenize(context, text, 1);
+static json throttle_json(generation_session * session) {
+    json out;
+    {
+        std::lock_guard<std::mutex> lock(g_thermal_mutex);
+        out["enabled"] = g_throttle_enabled;
+        out["temp_c"]  = std::isnan(g_thermal_temp_c) ? -1.0 : (double) g_thermal_temp_c;
+    }
+    if (!session) {
+        return out;
+    }
+    std::lock_guard<std::mutex> lock(session->throttle_mutex);
+    const auto limits = session->throttle.limits();
+    out["level"]        = session->throttle.level();
+    out["n_threads"]    = limits.n_threads;
+    out["ubatch"]       = limits.ubatch;
+    out["pace_ms"]      = limits.min_token_ms;
+    out["token_ms"]     = session->throttle.fast_ms();
+    out["baseline_ms"]  = session->throttle.baseline_ms();
+    out["changes"]      = session->throttle_changes;
+    return out;
+}
 
-    auto n_ctx = llama_n_ctx(context);
-    auto n_kv_req = tokens_list.size() + (n_len - tokens_list.size());
+// Polled while completion_init runs on `context`, from any thread.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1prefill_1progress(JNIEnv *env, jobject, jlong context) {
+    json out;
+    with_session(reinterpret_cast<llama_context *>(context), [&](generation_session * session) { out = prefill_progress_json(session); });
+    return env->NewStringUTF(out.dump().c_str());
+}
 
-    LOGi("n_len = %d, n_ctx = %d, n_kv_req = %zu", n_len, n_ctx, n_kv_req);
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1ttft_1stats(JNIEnv *env, jobject, jlong context) {
+    json out;
+    with_session(reinterpret_cast<llama_context *>(context), [&](generation_session * session) { out = ttft_json(session); });
+    return env->NewStringUTF(out.dump().c_str());
+}
 
-    if (n_kv_req > n_ctx) {
-        LOGe("error: n_kv_req > n_ctx, the required KV cache size is not big enough");
-        env->ReleaseStringUTFChars(jtext, text);
-        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
-                      "n_kv_req > n_ctx: reduce prompt length or increase context");
-        return -1;
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1throttle(JNIEnv *env, jobject, jboolean enabled, jstring jsysfs_root) {
+    {
+        std::lock_guard<std::mutex> lock(g_thermal_mutex);
+        g_throttle_enabled = enabled == JNI_TRUE;
+        if (jsysfs_root) {
+            g_thermal_root = jstring_to_string(env, jsysfs_root);
+            g_thermal_read_us = 0;
+        }
+    }
+    if (enabled == JNI_TRUE) {
+        return;
+    }
+    // back to full speed everywhere
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto & it : g_sessions) {
+        generation_session * session = it.second.get();
+        std::lock_guard<std::mutex> throttle_lock(session->throttle_mutex);
+        if (session->throttle.level() > 0) {
+            session->throttle.reset(session->n_threads, DEFAULT_PREFILL_UBATCH);
+            apply_throttle_limits(session, NAN);
+        }
     }
+}
 
-    // Suppress per-token logging to avoid UI jank and high latency
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1throttle_1stats(JNIEnv *env, jobject, jlong context) {
+    json out;
+    with_session(reinterpret_cast<llama_context *>(context), [&](generation_session * session) { out = throttle_json(session); });
+    return env->NewStringUTF(out.dump().c_str());
+}
 
-    common_batch_clear(*batch);
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_backend_1free(JNIEnv *, jobject) {
+    // Only free backend when there are no active contexts
+    if (g_active_contexts.load(std::memory_order_relaxed) == 0) {
+        model_cache().trim();
+        llama_backend_free();
+    } else {
+        LOGi("backend_free requested but %d contexts still active; skipping", g_active_contexts.load());
+    }
+}
 
-    // Reset KV and evaluate initial prompt in micro-batches with correct absolute positions
-    llama_memory_clear(llama_get_memory(context), true);
-    int ubatch = std::max(16, std::min(g_dynamic_ubatch, std::max(1, (int) llama_n_ubatch(context))));
-    int processed = 0;
-    int n_cur = 0;
-    while (processed < (int) tokens_list.size()) {
-        const int chunk = std::min(ubatch, (int) tokens_list.size() - processed);
-        common_batch_clear(*batch);
-        for (int i = 0; i < chunk; ++i) {
-            const bool is_last = (processed + i == (int) tokens_list.size() - 1);
-            common_batch_add(*batch, tokens_list[processed + i], n_cur + i, { 0 }, is_last);
-        }
-        batch->logits[batch->n_tokens - 1] = true;
-        if (llama_decode(context, *batch) != 0) {
-            LOGe("llama_decode() failed during prompt ubatch at processed=%d chunk=%d", processed, chunk);
-            // Back off ubatch and retry once for transient pressure
-            if (ubatch > 16) {
-                ubatch = std::max(16, ubatch / 2);
-                continue;
-            }
-            break;
-        }
-        processed += chunk;
-        n_cur += chunk;
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_log_1to_1android(JNIEnv *, jobject) {
+    llama_log_set(log_callback, NULL);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1verbose_1tokens(JNIEnv *, jobject, jboolean enable) {
+    g_verbose_tokens = enable == JNI_TRUE;
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto & it : g_sessions) {
+        it.second->verbose_tokens = g_verbose_tokens;
     }
+}
 
-    env->ReleaseStringUTFChars(jtext, text);
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_export_1diag(JNIEnv * env, jobject) {
+    int ubatch = DEFAULT_PREFILL_UBATCH;
+    with_last_session([&](generation_session * session) { if (session) ubatch = session->dynamic_ubatch; });
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "backend(OpenCL=%s,Vulkan=%s), contexts=%d, offload=%d/%d, kvMiB=%.2f, ubatch=%d",
+             ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
+             ggml_backend_reg_by_name("Vulkan") ? "yes" : "no",
+             g_active_contexts.load(),
+             g_offloaded_layers.load(), g_total_layers.load(),
+             g_kv_size_bytes > 0 ? (double) g_kv_size_bytes / (1024.0*1024.0) : 0.0,
+             ubatch);
+    return env->NewStringUTF(buf);
+}
 
-    // Return the absolute number of tokens consumed so far to seed generation positions
-    return n_cur;
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1backend_1search_1dir(JNIEnv * env, jobject, jstring jdir) {
+    const char * cdir = env->GetStringUTFChars(jdir, 0);
+    if (cdir && cdir[0] != '\0') {
+        LOGi("Manually setting backend search dir: %s", cdir);
+        ggml_backend_load_all_from_path(cdir);
+        LOGi("Backend registry (post manual set): OpenCL=%s, Vulkan=%s",
+             ggml_backend_reg_by_name("OpenCL") ? "yes" : "no",
+             ggml_backend_reg_by_name("Vulkan") ? "yes" : "no");
+    }
+    env->ReleaseStringUTFChars(jdir, cdir);
 }
 
 extern "C"
 JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_completion_1loop(
-        JNIEnv * env,
+Java_android_llama_cpp_LLamaAndroid_bench_1model(
+        JNIEnv *env,
         jobject,
         jlong context_pointer,
+        jlong model_pointer,
         jlong batch_pointer,
-        jlong sampler_pointer,
-        jint n_len,
-        jobject intvar_ncur
-) {
-    const auto context = reinterpret_cast<llama_context *>(context_pointer);
-    const auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
-    const auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
-    const auto model = llama_get_model(context);
+        jint pp,
+        jint tg,
+        jint pl,
+        jint nr
+        ) {
+    auto pp_avg = 0.0;
+    auto tg_avg = 0.0;
+    auto pp_std = 0.0;
+    auto tg_std = 0.0;
 
-    if (!la_int_var) la_int_var = env->GetObjectClass(intvar_ncur);
-    if (!la_int_var_value) la_int_var_value = env->GetMethodID(la_int_var, "getValue", "()I");
-    if (!la_int_var_inc) la_int_var_inc = env->GetMethodID(la_int_var, "inc", "()V");
+    const auto context = reinterpret_cast<llama_context *>(context_pointer);
+    const auto model = reinterpret_cast<llama_model *>(model_pointer);
+    const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
 
-    // sample the most likely token
-    const auto t_sample_start = ggml_time_us();
-    const auto new_token_id = llama_sampler_sample(sampler, context, -1);
+    const int n_ctx = llama_n_ctx(context);
 
-    const auto eot = llama_vocab_eot(llama_model_get_vocab(model));
-    // reduce noisy logs for latency
+    LOGi("n_ctx = %d", n_ctx);
 
-    const auto n_cur = env->CallIntMethod(intvar_ncur, la_int_var_value);
-    if (llama_vocab_is_eog(llama_model_get_vocab(model), new_token_id) || n_cur == n_len || new_token_id == eot) {
-        return nullptr;
-    }
+    int i, j;
+    int nri;
+    for (nri = 0; nri < nr; nri++) {
+        LOGi("Benchmark prompt processing (pp)");
 
-    // Periodic memory cleanup during long generations to prevent memory pressure
-    static int token_count = 0;
-    token_count++;
-    // Memory cleanup will be handled by the Kotlin layer
+        common_batch_clear(*batch);
 
-    auto new_token_chars = common_token_to_piece(context, new_token_id);
-    if (g_verbose_tokens) {
-        cached_token_chars += new_token_chars;
-    } else {
-        // Fast path: bypass accumulation when verbose logging is disabled
-        cached_token_chars = new_token_chars;
-    }
+        const int n_tokens = pp;
+        for (i = 0; i < n_tokens; i++) {
+            common_batch_add(*batch, 0, i, { 0 }, false);
+        }
 
-    // Enhanced thinking token processing
-    std::string filtered_chars = cached_token_chars;
-    jstring new_token = nullptr;
-    
-    // Check for repetitive patterns that indicate stuck generation
-    if (filtered_chars.length() > 100) {
-        std::string last_100 = filtered_chars.substr(filtered_chars.length() - 100);
-        if (last_100.find("Wait, can I help you out? No, that's the opposite") != std::string::npos ||
-            last_100.find("I apologize, but I cannot") != std::string::npos ||
-            last_100.find("I'm sorry, but I") != std::string::npos) {
-            // Model is stuck in a loop, stop generation
-            return nullptr;
+        batch->logits[batch->n_tokens - 1] = true;
+        llama_memory_clear(llama_get_memory(context), true);
+
+        const auto t_pp_start = ggml_time_us();
+        if (llama_decode(context, *batch) != 0) {
+            LOGi("llama_decode() failed during prompt processing");
         }
-    }
-    
-    // Enhanced thinking token detection and preservation
-    bool containsThinkingTokens = false;
-    if (filtered_chars.find("<|im_start|>") != std::string::npos ||
-        filtered_chars.find("<|user|>") != std::string::npos ||
-        filtered_chars.find("<|assistant|>") != std::string::npos ||
-        filtered_chars.find("<think>") != std::string::npos ||
-        filtered_chars.find("</think>") != std::string::npos ||
-        filtered_chars.find("Let me think") != std::string::npos ||
-        filtered_chars.find("Let me analyze") != std::string::npos ||
-        filtered_chars.find("I need to") != std::string::npos ||
-        filtered_chars.find("First,") != std::string::npos ||
-        filtered_chars.find("Step") != std::string::npos ||
-        filtered_chars.find("thinking") != std::string::npos ||
-        filtered_chars.find("reasoning") != std::string::npos) {
-        containsThinkingTokens = true;
-        LOGi("Thinking tokens detected: %s", filtered_chars.c_str());
-    }
-    
-    // Strip think tags for non-reasoning models to avoid UI spam
-    // strip only when default enabled (non-reasoning models)
-    if (g_strip_think_default) {
-        // remove <think>...</think>
-        std::string::size_type start = 0;
-        while ((start = filtered_chars.find("<think>", start)) != std::string::npos) {
-            auto end = filtered_chars.find("</think>", start);
-            if (end == std::string::npos) { break; }
-            filtered_chars.erase(start, (end + 8) - start);
+        const auto t_pp_end = ggml_time_us();
+
+        // bench text generation
+
+        LOGi("Benchmark text generation (tg)");
+
+        llama_memory_clear(llama_get_memory(context), true);
+        const auto t_tg_start = ggml_time_us();
+        for (i = 0; i < tg; i++) {
+
+            common_batch_clear(*batch);
+            for (j = 0; j < pl; j++) {
+                common_batch_add(*batch, 0, i, { j }, true);
+            }
+
+            LOGi("llama_decode() text generation: %d", i);
+            if (llama_decode(context, *batch) != 0) {
+                LOGi("llama_decode() failed during text generation");
+            }
         }
-        // clean stray tags
-        while ((start = filtered_chars.find("<think>")) != std::string::npos) filtered_chars.erase(start, 7);
-        while ((start = filtered_chars.find("</think>")) != std::string::npos) filtered_chars.erase(start, 8);
+
+        const auto t_tg_end = ggml_time_us();
+
+        llama_memory_clear(llama_get_memory(context), true);
+
+        const auto t_pp = double(t_pp_end - t_pp_start) / 1000000.0;
+        const auto t_tg = double(t_tg_end - t_tg_start) / 1000000.0;
+
+        const auto speed_pp = double(pp) / t_pp;
+        const auto speed_tg = double(pl * tg) / t_tg;
+
+        pp_avg += speed_pp;
+        tg_avg += speed_tg;
+
+        pp_std += speed_pp * speed_pp;
+        tg_std += speed_tg * speed_tg;
+
+        LOGi("pp %f t/s, tg %f t/s", speed_pp, speed_tg);
     }
 
-    if (is_valid_utf8(filtered_chars.c_str())) {
-        new_token = env->NewStringUTF(filtered_chars.c_str());
-        if (g_verbose_tokens) {
-            LOGi("cached: %s, new_token_chars: `%s`, id: %d, thinking: %s",
-                 filtered_chars.c_str(), new_token_chars.c_str(), new_token_id,
-                 containsThinkingTokens ? "true" : "false");
-        }
-        cached_token_chars.clear();
+    pp_avg /= double(nr);
+    tg_avg /= double(nr);
+
+    if (nr > 1) {
+        pp_std = sqrt(pp_std / double(nr - 1) - pp_avg * pp_avg * double(nr) / double(nr - 1));
+        tg_std = sqrt(tg_std / double(nr - 1) - tg_avg * tg_avg * double(nr) / double(nr - 1));
     } else {
-        new_token = env->NewStringUTF("");
+        pp_std = 0;
+        tg_std = 0;
     }
 
-    common_batch_clear(*batch);
-    common_batch_add(*batch, new_token_id, n_cur, { 0 }, true);
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
 
-    env->CallVoidMethod(intvar_ncur, la_int_var_inc);
+    const auto model_size     = double(llama_model_size(model)) / 1024.0 / 1024.0 / 1024.0;
+    const auto model_n_params = double(llama_model_n_params(model)) / 1e9;
 
-    const auto t_decode_start = ggml_time_us();
-    if (llama_decode(context, *batch) != 0) {
-        LOGe("llama_decode() returned null");
-    }
-    const auto t_decode_end = ggml_time_us();
-    const double decode_ms = double(t_decode_end - t_decode_start) / 1000.0;
-    if (decode_ms > 5000.0) { // 5s watchdog
-        LOGe("decode watchdog: %.2f ms > 5000 ms; clearing KV and aborting token", decode_ms);
-        llama_memory_clear(llama_get_memory(context), true);
-        // adaptively reduce ubatch to ease pressure next iterations
-        if (g_dynamic_ubatch > 16) g_dynamic_ubatch = g_dynamic_ubatch / 2;
-        return nullptr;
-    }
+    // Determine backend based on build flags so benchmarks report the
+    // actual runtime used. This mirrors the backends supported by
+    // ggml/llama.cpp.
+#if defined(GGML_USE_CUDA)
+    const auto backend    = "CUDA";
+#elif defined(GGML_USE_VULKAN)
+    const auto backend    = "Vulkan";
+#elif defined(GGML_USE_METAL) || defined(GGML_USE_MPS)
+    const auto backend    = "Metal";
+#elif defined(GGML_USE_CLBLAST) || defined(GGML_USE_OPENCL)
+    const auto backend    = "OpenCL";
+#else
+    const auto backend    = "CPU";
+#endif
 
-    return new_token;
+    std::stringstream result;
+    result << std::setprecision(2);
+    result << "| model | size | params | backend | test | t/s |\n";
+    result << "| --- | --- | --- | --- | --- | --- |\n";
+    result << "| " << model_desc << " | " << model_size << "GiB | " << model_n_params << "B | " << backend << " | pp " << pp << " | " << pp_avg << " ± " << pp_std << " |\n";
+    result << "| " << model_desc << " | " << model_size << "GiB | " << model_n_params << "B | " << backend << " | tg " << tg << " | " << tg_avg << " ± " << tg_std << " |\n";
+
+    return env->NewStringUTF(result.str().c_str());
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1batch(JNIEnv *, jobject, jint n_tokens, jint embd, jint n_seq_max) {
+    // Use upstream allocator to ensure compatible free
+    llama_batch * batch = new llama_batch;
+    *batch = llama_batch_init(n_tokens, embd, n_seq_max);
+    return reinterpret_cast<jlong>(batch);
 }
 
 extern "C"
 JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_kv_1cache_1clear(JNIEnv *, jobject, jlong context) {
-    llama_memory_clear(llama_get_memory(reinterpret_cast<llama_context *>(context)), true);
+Java_android_llama_cpp_LLamaAndroid_free_1batch(JNIEnv *, jobject, jlong batch_pointer) {
+    if (batch_pointer == 0) return;
+    llama_batch * batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    // Clear dynamic content, then free using upstream helper and delete wrapper
+    common_batch_clear(*batch);
+    llama_batch_free(*batch);
+    delete batch;
 }
 
-// Format given chat. If tmpl is empty, we take the template from model metadata
-inline std::string format_chat(const llama_model *model, const std::string &tmpl, const std::vector<json> &messages) {
-    std::vector<common_chat_msg> chat;
+// Same defaults and rounding as new_sampler, so both produce the same tokens.
+static fused_sampler_params sampler_params_from_ui(jfloat top_p, jint top_k, jfloat temp) {
+    fused_sampler_params params;
+    params.top_k          = top_k == 0 ? 40 : top_k;
+    params.top_p          = top_p == 0.0f ? 0.9f : roundf(top_p * 10) / 10;
+    params.temp           = temp == 0.0f ? 0.4f : roundf(temp * 10) / 10;
+    params.repeat_last_n  = 0;
+    params.seed           = 1234;
+    return params;
+}
 
-    for (size_t i = 0; i < messages.size(); ++i) {
-        const auto &curr_msg = messages[i];
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *, jobject, jfloat top_p, jint top_k, jfloat temp) {
+    LOGi("my params temp=%.1f, top_p=%.1f, top_k=%d", temp, top_p, top_k);
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = true;
+    llama_sampler *smpl = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
 
-        std::string role = json_value(curr_msg, "role", std::string(""));
-        std::string content;
+    // Top K handling
+    if (top_k == 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40)); // Default value
+    } else {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k));
+    }
 
-        if (curr_msg.contains("content")) {
-            if (curr_msg["content"].is_string()) {
-                content = curr_msg["content"].get<std::string>();
-            } else if (curr_msg["content"].is_array()) {
-                for (const auto &part : curr_msg["content"]) {
-                    if (part.contains("text")) {
-                        content += "\n" + part["text"].get<std::string>();
-                    }
-                }
-            } else {
-                throw std::runtime_error("Invalid 'content' type.");
+    // Top P handling
+    if (top_p == 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1)); // Default value
+    } else {
+        float adjusted_top_p = roundf(top_p * 10) / 10;
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(adjusted_top_p, 1));
+    }
+
+    // Temperature handling
+    if (temp == 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.4f)); // Default value
+    } else {
+        float adjusted_temp = roundf(temp * 10) / 10;
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(adjusted_temp));
+    }
+
+    // Always add dist sampler
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(1234));
+
+    return reinterpret_cast<jlong>(smpl);
+}
+
+// The fused sampler is exposed as a regular llama_sampler so it can be freed, reset
+// and applied like the chain; completion_loop detects it and skips building the
+// full-vocabulary candidate array.
+struct fused_sampler_state {
+    fused_sampler      sampler;
+    std::vector<float> scratch;   // logits by token id for the generic apply path
+};
+
+static llama_sampler * new_fused_sampler(const fused_sampler_params & params);
+
+static const llama_sampler_i fused_sampler_iface = {
+    /* .name   = */ [](const llama_sampler *) { return "fused"; },
+    /* .accept = */ [](llama_sampler * smpl, llama_token token) {
+        static_cast<fused_sampler_state *>(smpl->ctx)->sampler.accept(token);
+    },
+    /* .apply  = */ [](llama_sampler * smpl, llama_token_data_array * cur_p) {
+        auto * state = static_cast<fused_sampler_state *>(smpl->ctx);
+        int32_t n_vocab = 0;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            n_vocab = std::max(n_vocab, cur_p->data[i].id + 1);
+        }
+        state->scratch.assign(n_vocab, -INFINITY);
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            state->scratch[cur_p->data[i].id] = cur_p->data[i].logit;
+        }
+        const llama_token token = state->sampler.pick(state->scratch.data(), n_vocab);
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            if (cur_p->data[i].id == token) {
+                cur_p->selected = (int64_t) i;
+                break;
             }
-        } else {
-            throw std::runtime_error("Missing 'content'.");
         }
+    },
+    /* .reset  = */ [](llama_sampler * smpl) {
+        static_cast<fused_sampler_state *>(smpl->ctx)->sampler.reset();
+    },
+    /* .clone  = */ [](const llama_sampler * smpl) {
+        return new_fused_sampler(static_cast<const fused_sampler_state *>(smpl->ctx)->sampler.params());
+    },
+    /* .free   = */ [](llama_sampler * smpl) {
+        delete static_cast<fused_sampler_state *>(smpl->ctx);
+    },
+};
 
-        common_chat_msg msg;
-        msg.role = role;
-        msg.content = content;
-        chat.push_back(msg);
+static llama_sampler * new_fused_sampler(const fused_sampler_params & params) {
+    return llama_sampler_init(&fused_sampler_iface, new fused_sampler_state{ fused_sampler(params), {} });
+}
+
+// Tool-call grammars. The chat templates ask for <tool_call>{"name": ..., "arguments": ...}</tool_call>;
+// set_tool_grammar attaches a lazy grammar that stays dormant until the model emits <tool_call>
+// and from then on only allows a well-formed call, so the app never has to regenerate because
+// of malformed JSON. Compiled grammars are cached per vocabulary by a hash of their source.
+static compiled_grammar_cache<llama_sampler, llama_vocab> & tool_grammar_cache() {
+    static auto * cache = new compiled_grammar_cache<llama_sampler, llama_vocab>(
+            [](const llama_sampler * smpl) { return llama_sampler_clone(smpl); },
+            [](llama_sampler * smpl) { llama_sampler_free(smpl); },
+            8);
+    return *cache;
+}
+
+static void clear_tool_grammar(generation_session * session) {
+    if (session->tool_grammar) {
+        llama_sampler_free(session->tool_grammar);
     }
+    session->tool_grammar = nullptr;
+    session->tool_grammar_vocab = nullptr;
+}
 
-    // Create chat templates inputs
-    common_chat_templates_inputs inputs;
-    inputs.messages = chat;
-    inputs.add_generation_prompt = true;
-    inputs.use_jinja = true;
+static void forget_model_grammars(const llama_model * model) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        for (auto & it : g_sessions) {
+            if (it.second->tool_grammar_vocab == vocab) {
+                clear_tool_grammar(it.second.get());
+            }
+        }
+    }
+    tool_grammar_cache().forget_owner(vocab);
+}
 
-    // Get chat templates from model
-    auto tmpls = common_chat_templates_init(model, tmpl);
-    if (!tmpls) {
-        throw std::runtime_error("Failed to initialize chat templates");
+// OpenAI-style tool list -> schema of one call: {"name": <one of the tools>, "arguments": <its parameters>}.
+static json tool_call_schema(const json & tools) {
+    if (!tools.is_array() || tools.empty()) {
+        throw std::invalid_argument("tools must be a non-empty array");
+    }
+    json alternatives = json::array();
+    for (const auto & tool : tools) {
+        const json & fn = tool.contains("function") ? tool.at("function") : tool;
+        const std::string name = json_value(fn, "name", std::string());
+        if (name.empty()) {
+            throw std::invalid_argument("tool without a name");
+        }
+        json parameters = json_value(fn, "parameters", json{ {"type", "object"} });
+        alternatives.push_back({
+            {"type", "object"},
+            {"properties", {
+                {"name", {{"const", name}}},
+                {"arguments", parameters},
+            }},
+            {"required", json::array({"name", "arguments"})},
+        });
     }
+    return alternatives.size() == 1 ? alternatives[0] : json{ {"anyOf", alternatives} };
+}
 
-    // Apply templates
-    auto params = common_chat_templates_apply(tmpls.get(), inputs);
-    LOGi("formatted_chat: '%s'\n", params.prompt.c_str());
+// GBNF for one or more <tool_call> blocks. `kind` is "tools" (OpenAI tool list), "json_schema"
+// (schema of the call object) or "gbnf" (a complete grammar whose root starts at "<tool_call>").
+static std::string tool_call_grammar(const std::string & kind, const std::string & source) {
+    if (kind == "gbnf") {
+        return source;
+    }
+    if (kind != "tools" && kind != "json_schema") {
+        throw std::invalid_argument("unknown grammar kind: " + kind);
+    }
+    json schema = json::parse(source);
+    if (kind == "tools") {
+        schema = tool_call_schema(schema);
+    }
+    return build_grammar([&](const common_grammar_builder & builder) {
+        builder.resolve_refs(schema);
+        const std::string call  = builder.add_schema("tool-call-object", schema);
+        const std::string ws    = builder.add_rule("tool-call-ws", "[ \\t\\n]*");
+        const std::string block = builder.add_rule("tool-call", "\"<tool_call>\" " + ws + " " + call + " " + ws + " \"</tool_call>\"");
+        builder.add_rule("root", block + " (" + ws + " " + block + ")*");
+    });
+}
 
-    return params.prompt;
+static llama_sampler * new_tool_grammar_sampler(const llama_vocab * vocab, const std::string & grammar) {
+    // group 1 marks where the constrained text starts, as in llama.cpp's own tool-call triggers
+    const char * patterns[] = { "[\\s\\S]*?(<tool_call>[\\s\\S]*)" };
+    return llama_sampler_init_grammar_lazy_patterns(vocab, grammar.c_str(), "root", patterns, 1, nullptr, 0);
 }
 
+// Sampling with a grammar, as common_sampler does: sample unconstrained first and only
+// run the grammar over the whole vocabulary when the pick is rejected. While the grammar
+// waits for its trigger it accepts everything, so plain text costs one extra check; with
+// the fused sampler the first pick also runs on the raw logits, without a candidate array.
+static llama_token sample_with_grammar(generation_session * session, llama_sampler * sampler) {
+    llama_context * context = session->context;
+    llama_sampler * grammar = session->tool_grammar;
+    std::vector<llama_token_data> & candidates = session->grammar_candidates;
+    float * logits = llama_get_logits_ith(context, -1);
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(context)));
+    auto fill = [&]() {
+        candidates.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            candidates[id] = { id, logits[id], 0.0f };
+        }
+        return llama_token_data_array{ candidates.data(), candidates.size(), -1, false };
+    };
+
+    llama_token_data_array cur_p;
+    llama_token id;
+    if (sampler->iface == &fused_sampler_iface) {
+        // pick() leaves the token unrecorded until the grammar has had its say
+        id = static_cast<fused_sampler_state *>(sampler->ctx)->sampler.pick(logits, n_vocab);
+    } else {
+        cur_p = fill();
+        llama_sampler_apply(sampler, &cur_p);
+        id = cur_p.data[cur_p.selected].id;
+    }
 
-extern "C" JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_oaicompat_1completion_1param_1parse(
-        JNIEnv *env, jobject, jobjectArray allMessages, jlong model, jstring chatFormat) {
-    try {
-        // Convert the messages to JSON
+    llama_token_data single = { id, 1.0f, 0.0f };
+    llama_token_data_array single_p = { &single, 1, -1, false };
+    llama_sampler_apply(grammar, &single_p);
+    if (single.logit == -INFINITY) {
+        cur_p = fill();
+        llama_sampler_apply(grammar, &cur_p);
+        llama_sampler_apply(sampler, &cur_p);
+        id = cur_p.data[cur_p.selected].id;
+    }
+    llama_sampler_accept(grammar, id);
+    llama_sampler_accept(sampler, id);
+    return id;
+}
+
+// Samples the next token at logits row `idx` (default: the last one), taking the fused
+// fast path when possible.
+static llama_token sample_next_token(llama_sampler * sampler, llama_context * context, int32_t idx = -1) {
+    if (sampler->iface == &fused_sampler_iface) {
+        auto * state = static_cast<fused_sampler_state *>(sampler->ctx);
+        const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(context)));
+        return state->sampler.sample(llama_get_logits_ith(context, idx), n_vocab);
+    }
+    return llama_sampler_sample(sampler, context, idx);
+}
+
+static llama_token sample_next_token(generation_session * session, llama_sampler * sampler) {
+    if (session->tool_grammar) {
+        return sample_with_grammar(session, sampler);
+    }
+    return sample_next_token(sampler, session->context);
+}
+
+// Computes the log-probability of `token`, just sampled from logits row `idx`, and the best
+// alternatives while the row is still there; completion_loop_impl moves the record into the
+// ring when it emits the token. The fused sampler's top-k buffer already holds the
+// alternatives; other samplers (and grammar-constrained picks) select them from the row.
+static void record_logprobs(generation_session * session, llama_sampler * sampler, int32_t idx, llama_token token) {
+    logprob_ring & ring = session->logprobs;
+    if (!ring.attached()) {
+        return;
+    }
+    const float * logits = llama_get_logits_ith(session->context, idx);
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(session->context)));
+    const float lse = logsumexp(logits, n_vocab);
+    const size_t k = ring.top_k();
+    std::vector<logprob_entry> & alts = session->logprob_alts;
+    alts.clear();
+    if (sampler->iface == &fused_sampler_iface && !session->tool_grammar) {
+        fused_sampler & fused = static_cast<fused_sampler_state *>(sampler->ctx)->sampler;
+        if (fused.keep_top() < k) {
+            fused.set_keep_top(k);   // from the next pick on
+        } else if (fused.top_ids().size() >= k) {
+            for (size_t i = 0; i < k; ++i) {
+                alts.push_back({ fused.top_ids()[i], logits[fused.top_ids()[i]] });
+            }
+        }
+    }
+    if (alts.empty()) {
+        select_top_logits(logits, n_vocab, k, alts);
+    }
+    for (auto & a : alts) {
+        a.logprob -= lse;
+    }
+    session->logprobs_pending.push(token, logits[token] - lse, alts.data(), alts.size());
+}
+
+// Constrains tool-call segments of the context's following completions until clear_tool_grammar.
+// Returns true when the compiled grammar came from the cache.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1tool_1grammar(JNIEnv *env, jobject, jlong context_pointer, jstring jkind, jstring jsource) {
+    auto * context = reinterpret_cast<llama_context *>(context_pointer);
+    generation_session * session = find_session(context);
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "no context");
+        return JNI_FALSE;
+    }
+    const auto * model = llama_get_model(context);
+    const std::string kind   = jstring_to_string(env, jkind);
+    const std::string source = jstring_to_string(env, jsource);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const auto t_start = ggml_time_us();
+    std::string error;
+    bool hit = false;
+    llama_sampler * grammar = tool_grammar_cache().acquire(vocab, grammar_source_hash(kind, source), [&]() -> llama_sampler * {
+        try {
+            return new_tool_grammar_sampler(vocab, tool_call_grammar(kind, source));
+        } catch (const std::exception & e) {
+            error = e.what();
+            return nullptr;
+        }
+    }, &hit);
+    if (!grammar) {
+        const std::string msg = "invalid tool grammar" + (error.empty() ? std::string() : ": " + error);
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), msg.c_str());
+        return JNI_FALSE;
+    }
+    clear_tool_grammar(session);
+    session->tool_grammar = grammar;
+    session->tool_grammar_vocab = vocab;
+    LOGi("tool grammar (%s) %s in %.2f ms", kind.c_str(), hit ? "reused" : "compiled", (ggml_time_us() - t_start) / 1000.0);
+    return hit ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_clear_1tool_1grammar(JNIEnv *, jobject, jlong context) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context));
+    if (session) {
+        clear_tool_grammar(session);
+    }
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1tool_1grammar_1stats(JNIEnv *env, jobject) {
+    auto & cache = tool_grammar_cache();
+    json out;
+    out["cached"] = cache.size();
+    out["hits"]   = cache.hits();
+    out["misses"] = cache.misses();
+    with_last_session([&](generation_session * session) { out["active"] = session && session->tool_grammar; });
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1fused_1sampler(JNIEnv *, jobject, jfloat top_p, jint top_k, jfloat temp) {
+    return reinterpret_cast<jlong>(new_fused_sampler(sampler_params_from_ui(top_p, top_k, temp)));
+}
+
+// Samples `n_iter` tokens from the context's current logits with both the stock chain and
+// the fused sampler (same parameters and seed) and reports the per-token time of each
+// and how many picks matched. Needs logits from a previous decode.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1sampler(
+        JNIEnv *env, jobject, jlong context_pointer, jfloat top_p, jint top_k, jfloat min_p, jfloat temp,
+        jfloat repeat_penalty, jint repeat_last_n, jint n_iter) {
+    auto * context = reinterpret_cast<llama_context *>(context_pointer);
+    if (context == nullptr || n_iter <= 0) {
+        return env->NewStringUTF("{}");
+    }
+    fused_sampler_params params;
+    params.top_k          = top_k;
+    params.top_p          = top_p;
+    params.min_p          = min_p;
+    params.temp           = temp;
+    params.repeat_penalty = repeat_penalty;
+    params.repeat_last_n  = std::max(0, (int) repeat_last_n);
+
+    llama_sampler * chain = new_sampler_chain(params);
+    llama_sampler * fused = new_fused_sampler(params);
+    std::vector<llama_token> chain_tokens(n_iter);
+    std::vector<llama_token> fused_tokens(n_iter);
+
+    const auto t_chain = ggml_time_us();
+    for (int i = 0; i < n_iter; ++i) {
+        chain_tokens[i] = llama_sampler_sample(chain, context, -1);
+    }
+    const auto t_fused = ggml_time_us();
+    for (int i = 0; i < n_iter; ++i) {
+        fused_tokens[i] = sample_next_token(fused, context);
+    }
+    const auto t_end = ggml_time_us();
+    llama_sampler_free(chain);
+    llama_sampler_free(fused);
+
+    int identical = 0;
+    for (int i = 0; i < n_iter; ++i) {
+        identical += chain_tokens[i] == fused_tokens[i];
+    }
+    json out;
+    out["n_vocab"]        = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(context)));
+    out["iterations"]     = n_iter;
+    out["chain_us"]       = (double) (t_fused - t_chain) / n_iter;
+    out["fused_us"]       = (double) (t_end - t_fused) / n_iter;
+    out["identical"]      = identical;
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1sampler(JNIEnv *, jobject, jlong sampler_pointer) {
+    llama_sampler_free(reinterpret_cast<llama_sampler *>(sampler_pointer));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_backend_1init(JNIEnv *, jobject) {
+    llama_backend_init();
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1backend(JNIEnv *env, jobject, jstring jbackend) {
+    const char *backend = env->GetStringUTFChars(jbackend, 0);
+    bool success = true;
+    {
+        std::lock_guard<std::mutex> lock(g_backend_mutex);
+
+        if (g_active_contexts.load(std::memory_order_relaxed) != 0) {
+            LOGi("set_backend: contexts active (%d); refusing backend switch", g_active_contexts.load());
+            success = false;
+        } else {
+            if (strcmp(backend, "opencl") == 0) {
+                g_backend_selection = "opencl";
+                LOGi("Set backend to OpenCL (requires env config at startup)");
+            } else if (strcmp(backend, "vulkan") == 0) {
+                g_backend_selection = "vulkan";
+                // Proactively load system Vulkan and the ggml Vulkan backend if present
+                void *vk1 = dlopen("/system/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
+                void *vk2 = vk1 ? vk1 : dlopen("/vendor/lib64/libvulkan.so", RTLD_NOW | RTLD_GLOBAL);
+                if (!vk2) {
+                    LOGi("Vulkan loader not preloaded: %s", dlerror());
+                } else {
+                    LOGi("Vulkan loader preloaded");
+                }
+                // Try loading backend plugins again to ensure Vulkan is registered
+                ggml_backend_load_all();
+                // Try typical backend sonames and the Android packaged path
+                ggml_backend_load("libggml-vulkan.so");
+                ggml_backend_load("libggml-vulkan-android.so");
+                LOGi("Set backend to Vulkan (requested)");
+            } else {
+                g_backend_selection = "cpu";
+                LOGi("Set backend to CPU");
+            }
+
+            // resident models were placed for the previous backend
+            model_cache().trim();
+            llama_backend_free();
+            llama_backend_init();
+
+            if (g_backend_selection == "opencl" && !llama_supports_gpu_offload()) {
+                LOGe("OpenCL init failed, falling back to CPU");
+                g_backend_selection = "cpu";
+                llama_backend_free();
+                llama_backend_init();
+                success = false;
+            } else if (g_backend_selection == "vulkan") {
+                if (ggml_backend_reg_by_name("Vulkan") == nullptr) {
+                    LOGe("Vulkan backend not registered after init");
+                    g_backend_selection = "cpu";
+                    llama_backend_free();
+                    llama_backend_init();
+                    success = false;
+                }
+            }
+        }
+    }
+
+    env->ReleaseStringUTFChars(jbackend, backend);
+    return success ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_system_1info(JNIEnv *env, jobject) {
+    return env->NewStringUTF(llama_print_system_info());
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1n_1ctx(JNIEnv *, jobject, jlong context_pointer) {
+    const auto context = reinterpret_cast<llama_context *>(context_pointer);
+    if (!context) return 0;
+    return (jint) llama_n_ctx(context);
+}
+
+// KV snapshots of prompt prefixes shared between completions (system prompt, template
+// preamble, tool definitions, earlier turns). Every session keeps its own snapshots,
+// which go away with its context.
+static const size_t PREFIX_CACHE_MIN_TOKENS = 32;   // shorter prefixes are cheaper to decode
+
+// Restores the longest cached prefix of `tokens` (leaving at least one token to decode)
+// into sequence 0 and returns its length; 0 when nothing usable is cached.
+static int restore_prompt_prefix(generation_session * session, const std::vector<llama_token> & tokens) {
+    size_t len = 0;
+    const auto * snapshot = session->prefix.find(tokens.data(), tokens.size(), tokens.size() - 1, &len);
+    if (!snapshot) {
+        return 0;
+    }
+    if (llama_state_seq_set_data(session->context, snapshot->data(), snapshot->size(), 0) == 0) {
+        LOGe("prefix cache: restoring %zu tokens failed", len);
+        llama_memory_clear(llama_get_memory(session->context), true);
+        return 0;
+    }
+    return (int) len;
+}
+
+static void save_prompt_prefix(generation_session * session, const std::vector<llama_token> & tokens, size_t n) {
+    llama_context * context = session->context;
+    std::vector<uint8_t> snapshot(llama_state_seq_get_size(context, 0));
+    snapshot.resize(llama_state_seq_get_data(context, snapshot.data(), snapshot.size(), 0));
+    const size_t bytes = snapshot.size();
+    if (session->prefix.store(tokens.data(), n, std::move(snapshot))) {
+        LOGi("prefix cache: saved %zu tokens (%.1f MiB)", n, bytes / 1024.0 / 1024.0);
+    }
+}
+
+// `budget_bytes` applies to each session; negative keeps the current budget.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1prefix_1cache(JNIEnv *, jobject, jboolean enabled, jlong budget_bytes) {
+    g_prefix_cache_enabled = enabled == JNI_TRUE;
+    if (budget_bytes >= 0) {
+        g_prefix_cache_budget = (size_t) budget_bytes;
+    }
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto & it : g_sessions) {
+        generation_session * session = it.second.get();
+        std::lock_guard<std::mutex> prefix_lock(session->prefix_mutex);
+        session->prefix.set_max_bytes(g_prefix_cache_budget.load());
+        if (!g_prefix_cache_enabled) {
+            session->prefix.clear();
+        }
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_clear_1prefix_1cache(JNIEnv *, jobject) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    for (auto & it : g_sessions) {
+        std::lock_guard<std::mutex> prefix_lock(it.second->prefix_mutex);
+        it.second->prefix.clear();
+    }
+}
+
+static json prefix_cache_json(generation_session * session) {
+    json out;
+    out["enabled"]      = g_prefix_cache_enabled.load();
+    out["budget_bytes"] = g_prefix_cache_budget.load();
+    if (!session) {
+        return out;
+    }
+    std::lock_guard<std::mutex> lock(session->prefix_mutex);
+    out["snapshots"]    = session->prefix.snapshots();
+    out["bytes"]        = session->prefix.bytes();
+    out["path_tokens"]  = session->prefix.tokens();
+    out["hits"]         = session->prefix.hits();
+    out["misses"]       = session->prefix.misses();
+    out["last_reused"]  = session->prefix_reused;
+    return out;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1prefix_1cache_1stats(JNIEnv *env, jobject) {
+    json out;
+    with_last_session([&](generation_session * session) { out = prefix_cache_json(session); });
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+// Prompt-lookup speculative decoding (off by default). Drafts come from the prompt and
+// the reply so far (ngram_draft.h) and are verified in the decode of the sampled token.
+static std::mutex         g_lookup_mutex;
+static bool               g_lookup_enabled = false;
+static ngram_draft_params g_lookup_params;
+static const int          MAX_LOOKUP_DRAFT = 32;
+
+static void reset_speculation(generation_session * session, const std::vector<llama_token> & prompt) {
+    {
+        std::lock_guard<std::mutex> lock(g_lookup_mutex);
+        session->lookup_enabled = g_lookup_enabled;
+        session->lookup = g_lookup_params;
+    }
+    session->history = prompt;
+    session->verified.clear();
+    session->next_token = LLAMA_TOKEN_NULL;
+    session->logprobs_pending.clear();
+    session->spec_drafted = 0;
+    session->spec_accepted = 0;
+    session->spec_verifies = 0;
+    session->first_token_us = -1;
+    session->last_token_us = -1;
+}
+
+// Draft for the tokens after the one about to be decoded at position `n_cur`.
+static std::vector<llama_token> lookup_draft(generation_session * session, int n_cur, int n_len) {
+    // grammar state cannot be rolled back over rejected drafts; a throttled device has no
+    // compute to spare for verification
+    if (!session->lookup_enabled || session->tool_grammar) {
+        return {};
+    }
+    {
+        std::lock_guard<std::mutex> lock(session->throttle_mutex);
+        if (session->throttle.level() >= 2) {
+            return {};
+        }
+    }
+    const int room = std::min(n_len, (int) llama_n_ctx(session->context)) - n_cur - 2;
+    if (room <= 0) {
+        return {};
+    }
+    ngram_draft_params params = session->lookup;
+    params.max_draft = std::min(params.max_draft, room);
+    return ngram_draft(session->history.data(), session->history.size(), params);
+}
+
+// Row 0 of the last decode holds the logits after the sampled token, row i those after
+// draft[i-1]. Rows are sampled in order as if decoded one by one, keeping drafts while
+// they equal the sampled token, so the reply is drawn from the same distribution as
+// without speculation. The first mismatch becomes the next token; the KV entries of the
+// rejected drafts are removed.
+static void verify_draft(generation_session * session, llama_sampler * sampler,
+                         const std::vector<llama_token> & draft, int n_cur) {
+    llama_context * context = session->context;
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(context));
+    size_t accepted = 0;
+    while (true) {
+        const llama_token id = sample_next_token(sampler, context, (int32_t) accepted);
+        record_logprobs(session, sampler, (int32_t) accepted, id);
+        if (accepted < draft.size() && id == draft[accepted]) {
+            session->verified.push_back(id);
+            accepted++;
+            if (llama_vocab_is_eog(vocab, id)) {
+                break;
+            }
+            continue;
+        }
+        session->next_token = id;
+        break;
+    }
+    llama_memory_seq_rm(llama_get_memory(context), 0, n_cur + 1 + (llama_pos) accepted, -1);
+    session->spec_drafted  += (int) draft.size();
+    session->spec_accepted += (int) accepted;
+    session->spec_verifies += 1;
+}
+
+static json speculation_json(const generation_session * session) {
+    json out;
+    {
+        std::lock_guard<std::mutex> lock(g_lookup_mutex);
+        out["enabled"] = g_lookup_enabled;
+    }
+    if (!session) {
+        return out;
+    }
+    const int drafted  = session->spec_drafted.load();
+    const int accepted = session->spec_accepted.load();
+    const int verifies = session->spec_verifies.load();
+    const long long first_us = session->first_token_us.load();
+    const long long last_us  = session->last_token_us.load();
+    const int generated = session->n_generated;
+    out["drafted"]            = drafted;
+    out["accepted"]           = accepted;
+    out["acceptance"]         = drafted > 0 ? (double) accepted / drafted : 0.0;
+    out["verify_decodes"]     = verifies;
+    out["tokens_per_verify"]  = verifies > 0 ? 1.0 + (double) accepted / verifies : 0.0;
+    out["generated"]          = generated;
+    // first to last emitted token: the decode rate the user sees
+    out["tokens_per_s"]       = generated > 1 && last_us > first_us ? (generated - 1) / ((last_us - first_us) / 1e6) : 0.0;
+    return out;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1prompt_1lookup(
+        JNIEnv *env, jobject, jboolean enabled, jint ngram_min, jint ngram_max, jint max_draft) {
+    if (ngram_min < 1 || ngram_max < ngram_min || max_draft < 1 || max_draft > MAX_LOOKUP_DRAFT) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "need 1 <= ngramMin <= ngramMax and 1 <= maxDraft <= 32");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_lookup_mutex);
+    g_lookup_enabled = enabled == JNI_TRUE;
+    g_lookup_params.ngram_min = ngram_min;
+    g_lookup_params.ngram_max = ngram_max;
+    g_lookup_params.max_draft = max_draft;
+}
+
+// Speculation statistics of the last reply on `context`.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1spec_1stats(JNIEnv *env, jobject, jlong context) {
+    json out;
+    with_session(reinterpret_cast<llama_context *>(context), [&](generation_session * session) { out = speculation_json(session); });
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+// Tokenizes and prefills the prompt on the session's context. With `history`, the prompt
+// is those (already tokenized) tokens followed by `text`, and only `text` is tokenized.
+// Returns the number of tokens in the KV cache, -1 after throwing (also for a prompt with
+// no tokens), COMPLETION_CANCELLED (-2) when cancelled.
+static int completion_init_impl(JNIEnv *env, generation_session * session, llama_batch * batch,
+                                const char * text, int n_len, const std::vector<llama_token> * history = nullptr) {
+    llama_context * context = session->context;
+    prefill_progress & prefill = session->prefill;
+    g_last_session = context;
+
+    session->cached_token_chars.clear();
+    session->n_generated = 0;
+    session->prompt_start_us = ggml_time_us();
+    session->ttft_pending = true;
+    session->template_us = t_template_us;
+    t_template_us = -1;
+    if (session->tool_grammar) {
+        // back to waiting for <tool_call>
+        llama_sampler_reset(session->tool_grammar);
+    }
+    detach_released_loras(session);
+
+    // ensure embeddings mode is off for generation
+    llama_set_embeddings(context, false);
+
+    std::vector<llama_token> tokens_list;
+    if (history) {
+        tokens_list = *history;
+    }
+    // BOS only at the start of the prompt: a history already begins with it
+    const auto text_tokens = common_tokenize(context, text, tokens_list.empty());
+    tokens_list.insert(tokens_list.end(), text_tokens.begin(), text_tokens.end());
+    session->tokenize_us = ggml_time_us() - session->prompt_start_us;
+    if (tokens_list.empty()) {
+        // nothing to decode, so no logits to sample from (empty text on a model without BOS)
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "empty prompt");
+        return -1;
+    }
+    reset_speculation(session, tokens_list);
+
+    auto n_ctx = llama_n_ctx(context);
+    auto n_kv_req = tokens_list.size() + (n_len - tokens_list.size());
+
+    LOGi("n_len = %d, n_ctx = %d, n_kv_req = %zu", n_len, n_ctx, n_kv_req);
+
+    if (n_kv_req > n_ctx) {
+        LOGe("error: n_kv_req > n_ctx, the required KV cache size is not big enough");
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"),
+                      "n_kv_req > n_ctx: reduce prompt length or increase context");
+        return -1;
+    }
+
+    // Suppress per-token logging to avoid UI jank and high latency
+
+    common_batch_clear(*batch);
+
+    // Reset KV and evaluate initial prompt in micro-batches with correct absolute positions
+    llama_memory_clear(llama_get_memory(context), true);
+    int ubatch = std::max(16, std::min(session->dynamic_ubatch, std::max(1, (int) llama_n_ubatch(context))));
+    int n_cur = 0;
+    size_t save_at = 0;
+    std::unique_lock<std::mutex> prefix_lock(session->prefix_mutex);
+    if (g_prefix_cache_enabled && !tokens_list.empty()) {
+        // Start from the longest cached prefix. Where this prompt leaves the paths of earlier
+        // prompts is a prefix they share, so snapshot there for the next one.
+        n_cur = restore_prompt_prefix(session, tokens_list);
+        save_at = std::min(session->prefix.match_path(tokens_list.data(), tokens_list.size()), tokens_list.size() - 1);
+        if (save_at < (size_t) n_cur + PREFIX_CACHE_MIN_TOKENS) {
+            save_at = 0;
+        }
+        session->prefix.insert_path(tokens_list.data(), tokens_list.size());
+        if (n_cur > 0) {
+            LOGi("prefix cache: reused %d of %zu prompt tokens", n_cur, tokens_list.size());
+        }
+    }
+    session->prefix_reused = n_cur;
+    int processed = n_cur;
+    bool cancelled = false;
+    prefill.total = (int) tokens_list.size();
+    prefill.reused = n_cur;
+    prefill.processed = n_cur;
+    prefill.t_decode_start_us = ggml_time_us();
+    prefill.active = true;
+    while (processed < (int) tokens_list.size()) {
+        if (cancel_requested(session)) {
+            cancelled = true;
+            break;
+        }
+        int chunk = std::min(ubatch, (int) tokens_list.size() - processed);
+        if (save_at > (size_t) processed) {
+            chunk = std::min(chunk, (int) save_at - processed);
+        }
+        common_batch_clear(*batch);
+        for (int i = 0; i < chunk; ++i) {
+            const bool is_last = (processed + i == (int) tokens_list.size() - 1);
+            common_batch_add(*batch, tokens_list[processed + i], n_cur + i, { 0 }, is_last);
+        }
+        batch->logits[batch->n_tokens - 1] = true;
+        if (llama_decode(context, *batch) != 0) {
+            if (cancel_requested(session)) {
+                cancelled = true;
+                break;
+            }
+            LOGe("llama_decode() failed during prompt ubatch at processed=%d chunk=%d", processed, chunk);
+            // Back off ubatch and retry once for transient pressure
+            if (ubatch > 16) {
+                ubatch = std::max(16, ubatch / 2);
+                continue;
+            }
+            break;
+        }
+        processed += chunk;
+        n_cur += chunk;
+        prefill.processed = processed;
+        if (save_at > 0 && (size_t) processed == save_at) {
+            save_prompt_prefix(session, tokens_list, save_at);
+        }
+    }
+    prefix_lock.unlock();
+    prefill.active = false;
+    session->prefill_us = ggml_time_us() - session->prompt_start_us - session->tokenize_us;
+
+    if (cancelled) {
+        // the aborted ubatch may be partially in the KV cache
+        llama_memory_clear(llama_get_memory(context), true);
+        finish_cancel(session);
+        return -2;
+    }
+
+    // Return the absolute number of tokens consumed so far to seed generation positions
+    return n_cur;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1init(
+        JNIEnv *env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jstring jtext,
+        jint n_len
+    ) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context_pointer));
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown context");
+        return -1;
+    }
+    const auto text = env->GetStringUTFChars(jtext, 0);
+    const int n_cur = completion_init_impl(env, session, reinterpret_cast<llama_batch *>(batch_pointer), text, n_len);
+    env->ReleaseStringUTFChars(jtext, text);
+    return n_cur;
+}
+
+// Copies a prompt token array, rejecting ids the model's vocab does not have.
+// False after throwing.
+static bool read_prompt_tokens(JNIEnv *env, llama_context * context, jintArray jtokens, std::vector<llama_token> & out) {
+    const jsize n = jtokens ? env->GetArrayLength(jtokens) : 0;
+    out.resize(n);
+    if (n > 0) {
+        env->GetIntArrayRegion(jtokens, 0, n, reinterpret_cast<jint *>(out.data()));
+    }
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(context)));
+    for (llama_token id : out) {
+        if (id < 0 || id >= n_vocab) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "prompt token id outside the vocab");
+            return false;
+        }
+    }
+    return true;
+}
+
+// completion_init for a pre-tokenized history (tokens of earlier turns, see tokenize_prompt)
+// followed by the new text, so only the new turn is tokenized.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1init_1tokens(
+        JNIEnv *env, jobject, jlong context_pointer, jlong batch_pointer, jintArray jhistory, jstring jtext, jint n_len) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context_pointer));
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown context");
+        return -1;
+    }
+    std::vector<llama_token> history;
+    if (!read_prompt_tokens(env, session->context, jhistory, history)) {
+        return -1;
+    }
+    const std::string text = jtext ? jstring_to_string(env, jtext) : std::string();
+    return completion_init_impl(env, session, reinterpret_cast<llama_batch *>(batch_pointer), text.c_str(), n_len, &history);
+}
+
+// Token ids of a piece of rendered prompt, exactly as completion_init tokenizes it (BOS
+// only when `add_bos`, special-token text kept as text), for the app to store next to the
+// message and pass back to completion_init_tokens.
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_tokenize_1prompt(JNIEnv *env, jobject, jlong jmodel, jstring jtext, jboolean add_bos) {
+    const auto * model = reinterpret_cast<const llama_model *>(jmodel);
+    if (model == nullptr || jtext == nullptr) {
+        return env->NewIntArray(0);
+    }
+    const auto tokens = common_tokenize(llama_model_get_vocab(model), jstring_to_string(env, jtext), add_bos, false);
+    jintArray result = env->NewIntArray((jsize) tokens.size());
+    env->SetIntArrayRegion(result, 0, (jsize) tokens.size(), reinterpret_cast<const jint *>(tokens.data()));
+    return result;
+}
+
+// Samples and decodes one token on the session's context. Returns the token text, or
+// null at the end of the reply or when cancelled.
+static jstring completion_loop_impl(JNIEnv * env, generation_session * session, llama_batch * batch,
+                                    llama_sampler * sampler, int n_len, jobject intvar_ncur) {
+    llama_context * context = session->context;
+    const auto model = llama_get_model(context);
+
+    if (!session->int_var_value) {
+        jclass int_var = env->GetObjectClass(intvar_ncur);
+        session->int_var_value = env->GetMethodID(int_var, "getValue", "()I");
+        session->int_var_inc   = env->GetMethodID(int_var, "inc", "()V");
+        env->DeleteLocalRef(int_var);
+    }
+
+    if (cancel_requested(session)) {
+        finish_cancel(session);
+        return nullptr;
+    }
+
+    // sample the most likely token, unless verifying a draft already produced it
+    const auto t_sample_start = ggml_time_us();
+    bool in_kv = false;
+    llama_token new_token_id;
+    if (!session->verified.empty()) {
+        new_token_id = session->verified.front();
+        session->verified.pop_front();
+        in_kv = true;
+    } else if (session->next_token != LLAMA_TOKEN_NULL) {
+        new_token_id = session->next_token;
+        session->next_token = LLAMA_TOKEN_NULL;
+    } else {
+        new_token_id = sample_next_token(session, sampler);
+        record_logprobs(session, sampler, -1, new_token_id);
+    }
+
+    const auto eot = llama_vocab_eot(llama_model_get_vocab(model));
+    // reduce noisy logs for latency
+
+    if (session->ttft_pending) {
+        session->ttft_pending = false;
+        const long long ttft_us = ggml_time_us() - session->prompt_start_us;
+        session->last_ttft_us = ttft_us;
+        session->sample_us = ttft_us - session->tokenize_us - session->prefill_us;
+        g_last_ttft_us = ttft_us;
+        long long unset = -1;
+        if (g_first_ttft_us.compare_exchange_strong(unset, ttft_us)) {
+            g_first_ttft_preloaded = g_model_preloaded.load();
+        }
+    }
+
+    const auto n_cur = env->CallIntMethod(intvar_ncur, session->int_var_value);
+    if (llama_vocab_is_eog(llama_model_get_vocab(model), new_token_id) || n_cur == n_len || new_token_id == eot) {
+        return nullptr;
+    }
+
+    // Periodic memory cleanup during long generations to prevent memory pressure
+    session->n_generated++;
+    const long long t_token = ggml_time_us();
+    long long unset_first = -1;
+    session->first_token_us.compare_exchange_strong(unset_first, t_token);
+    session->last_token_us = t_token;
+    // Memory cleanup will be handled by the Kotlin layer
+
+    auto new_token_chars = common_token_to_piece(context, new_token_id);
+    if (session->verbose_tokens) {
+        session->cached_token_chars += new_token_chars;
+    } else {
+        // Fast path: bypass accumulation when verbose logging is disabled
+        session->cached_token_chars = new_token_chars;
+    }
+
+    // Enhanced thinking token processing
+    std::string filtered_chars = session->cached_token_chars;
+    jstring new_token = nullptr;
+    
+    // Check for repetitive patterns that indicate stuck generation
+    if (filtered_chars.length() > 100) {
+        std::string last_100 = filtered_chars.substr(filtered_chars.length() - 100);
+        if (last_100.find("Wait, can I help you out? No, that's the opposite") != std::string::npos ||
+            last_100.find("I apologize, but I cannot") != std::string::npos ||
+            last_100.find("I'm sorry, but I") != std::string::npos) {
+            // Model is stuck in a loop, stop generation
+            return nullptr;
+        }
+    }
+    
+    // Enhanced thinking token detection and preservation
+    const bool containsThinkingTokens = has_thinking_markers(filtered_chars);
+    if (containsThinkingTokens) {
+        LOGi("Thinking tokens detected: %s", filtered_chars.c_str());
+    }
+    
+    // Strip think tags for non-reasoning models to avoid UI spam
+    // strip only when default enabled (non-reasoning models)
+    if (session->strip_think) {
+        strip_think_tags(filtered_chars);
+    }
+
+    if (is_valid_utf8(filtered_chars.c_str())) {
+        new_token = env->NewStringUTF(filtered_chars.c_str());
+        if (session->verbose_tokens) {
+            LOGi("cached: %s, new_token_chars: `%s`, id: %d, thinking: %s",
+                 filtered_chars.c_str(), new_token_chars.c_str(), new_token_id,
+                 containsThinkingTokens ? "true" : "false");
+        }
+        session->cached_token_chars.clear();
+    } else {
+        new_token = env->NewStringUTF("");
+    }
+
+    session->history.push_back(new_token_id);
+    session->logprobs_pending.emit(new_token_id, session->logprobs);
+    env->CallVoidMethod(intvar_ncur, session->int_var_inc);
+    if (in_kv) {
+        return new_token;
+    }
+
+    // decode the token, together with a draft of the tokens that may follow it
+    const auto draft = lookup_draft(session, n_cur, n_len);
+    common_batch_clear(*batch);
+    common_batch_add(*batch, new_token_id, n_cur, { 0 }, true);
+    for (size_t i = 0; i < draft.size(); ++i) {
+        common_batch_add(*batch, draft[i], n_cur + 1 + (int) i, { 0 }, true);
+    }
+
+    const auto t_decode_start = ggml_time_us();
+    if (llama_decode(context, *batch) != 0) {
+        if (cancel_requested(session)) {
+            finish_cancel(session);
+            return nullptr;
+        }
+        LOGe("llama_decode() returned null");
+    } else if (!draft.empty()) {
+        verify_draft(session, sampler, draft, n_cur);
+    }
+    const auto t_decode_end = ggml_time_us();
+    const double decode_ms = double(t_decode_end - t_decode_start) / 1000.0;
+    if (decode_ms > 5000.0) { // 5s watchdog
+        LOGe("decode watchdog: %.2f ms > 5000 ms; throttling down", decode_ms);
+        throttle_on_stall(session);
+    } else if (draft.empty()) {
+        // verification batches cost more than one token and stay out of the latency trend
+        const double pace_ms = throttle_on_token(session, decode_ms);
+        if (pace_ms > decode_ms) {
+            // pacing below the device's peak rate keeps it out of thermal throttling
+            usleep((useconds_t) ((pace_ms - decode_ms) * 1000.0));
+        }
+    }
+
+    return new_token;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_completion_1loop(
+        JNIEnv * env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jlong sampler_pointer,
+        jint n_len,
+        jobject intvar_ncur
+) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context_pointer));
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown context");
+        return nullptr;
+    }
+    return completion_loop_impl(env, session, reinterpret_cast<llama_batch *>(batch_pointer),
+                                reinterpret_cast<llama_sampler *>(sampler_pointer), n_len, intvar_ncur);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_kv_1cache_1clear(JNIEnv *, jobject, jlong context) {
+    llama_memory_clear(llama_get_memory(reinterpret_cast<llama_context *>(context)), true);
+}
+
+// End of a reply (finished, failed or cancelled); see end_generation.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_end_1generation(JNIEnv *, jobject, jlong context) {
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    auto it = g_sessions.find(reinterpret_cast<llama_context *>(context));
+    if (it != g_sessions.end()) {
+        end_generation(it->second.get());
+    }
+}
+
+// LoRA hot-swapping: adapters are loaded once per base model (lora_cache.h) and attached to
+// contexts per request. Another adapter set changes what the context computes, so a switch
+// clears its KV cache and prefix snapshots; applying the set that is already attached is free.
+static std::mutex g_lora_stats_mutex;
+static int        g_lora_switches        = 0;
+static double     g_lora_last_switch_ms  = -1.0;
+static double     g_lora_total_switch_ms = 0.0;
+
+// KV state computed with other weights is useless; the caller holds g_sessions_mutex.
+static void invalidate_session_kv(generation_session * session) {
+    llama_memory_clear(llama_get_memory(session->context), true);
+    std::lock_guard<std::mutex> prefix_lock(session->prefix_mutex);
+    session->prefix.clear();
+}
+
+// Never destroyed, like the model cache: adapters die with their base model. Attached
+// adapters are pinned, so none is freed while a context may still use it.
+static lora_cache<llama_model, llama_adapter_lora> & lora_adapters() {
+    static auto * cache = new lora_cache<llama_model, llama_adapter_lora>([](llama_adapter_lora * adapter) {
+        llama_adapter_lora_free(adapter);
+    });
+    return *cache;
+}
+
+// Detaches the adapters released since the last completion. Runs at completion_init on the
+// session's own thread, so it never changes a context in the middle of a decode.
+static void detach_released_loras(generation_session * session) {
+    lora_set<llama_adapter_lora> dropped;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        auto & set = session->loras;
+        for (auto it = set.begin(); it != set.end();) {
+            if (!lora_adapters().released(it->first)) {
+                ++it;
+                continue;
+            }
+            llama_rm_adapter_lora(session->context, it->first);
+            dropped.push_back(*it);
+            it = set.erase(it);
+        }
+        if (!dropped.empty()) {
+            invalidate_session_kv(session);
+        }
+    }
+    lora_adapters().unpin(dropped);
+}
+
+// Context budgeter state: content token counts per vocab, template overheads per model
+// and chat format.
+static token_count_cache<llama_vocab> & message_token_counts() {
+    static auto * cache = new token_count_cache<llama_vocab>(4096);
+    return *cache;
+}
+static std::mutex g_budget_overheads_mutex;
+static std::map<std::pair<const llama_model *, std::string>, budget_overhead> g_budget_overheads;
+
+static void forget_model(const llama_model * model) {
+    forget_model_grammars(model);
+    lora_adapters().forget_owner(model);
+    message_token_counts().forget_owner(llama_model_get_vocab(model));
+    std::lock_guard<std::mutex> lock(g_budget_overheads_mutex);
+    for (auto it = g_budget_overheads.begin(); it != g_budget_overheads.end();) {
+        it = it->first.first == model ? g_budget_overheads.erase(it) : std::next(it);
+    }
+}
+
+// Weight bytes of a LoRA GGUF: what the adapter adds to the resident footprint.
+static size_t lora_file_bytes(const std::string & path) {
+    gguf_init_params params = { /*no_alloc*/ true, /*ctx*/ nullptr };
+    gguf_context * gctx = gguf_init_from_file(path.c_str(), params);
+    if (!gctx) return 0;
+    size_t bytes = 0;
+    for (int64_t i = 0; i < gguf_get_n_tensors(gctx); ++i) {
+        bytes += gguf_get_tensor_size(gctx, i);
+    }
+    gguf_free(gctx);
+    return bytes;
+}
+
+// Makes `want` the adapter set of the session's context. False (and the context left
+// without adapters) when an adapter does not belong to its model or cannot be attached.
+// The new adapters are pinned before they are attached and the old ones unpinned after
+// they are detached, so a concurrent lora_release cannot free one in between.
+static bool apply_loras(generation_session * session, const lora_set<llama_adapter_lora> & want, bool * changed) {
+    *changed = false;
+    const llama_model * model = llama_get_model(session->context);
+    if (!lora_adapters().pin(model, want)) {
+        return false;
+    }
+    lora_set<llama_adapter_lora> unpinned = want;   // pins to drop once the lock is released
+    bool ok = true;
+    double ms = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        if (!lora_set_equal(session->loras, want)) {
+            const long long t0 = ggml_time_us();
+            llama_clear_adapter_lora(session->context);
+            unpinned = std::move(session->loras);
+            session->loras.clear();
+            invalidate_session_kv(session);
+            *changed = true;
+            for (const auto & b : want) {
+                if (llama_set_adapter_lora(session->context, b.first, b.second) != 0) {
+                    llama_clear_adapter_lora(session->context);
+                    unpinned.insert(unpinned.end(), want.begin(), want.end());
+                    session->loras.clear();
+                    ok = false;
+                    break;
+                }
+            }
+            if (ok) {
+                session->loras = want;
+            }
+            ms = (ggml_time_us() - t0) / 1000.0;
+        }
+    }
+    lora_adapters().unpin(unpinned);
+    if (!ok || !*changed) {
+        return ok;
+    }
+    std::lock_guard<std::mutex> stats_lock(g_lora_stats_mutex);
+    g_lora_switches++;
+    g_lora_last_switch_ms = ms;
+    g_lora_total_switch_ms += ms;
+    return true;
+}
+
+// The caller holds g_sessions_mutex; `entries` is a snapshot of the adapter cache.
+template <typename Entries>
+static json lora_attached_json_locked(const generation_session * session, const Entries & entries) {
+    json attached = json::array();
+    if (!session) return attached;
+    for (const auto & b : session->loras) {
+        auto e = std::find_if(entries.begin(), entries.end(), [&](const auto & x) { return x.adapter == b.first; });
+        attached.push_back({
+            {"path", e == entries.end() ? std::string() : e->path},
+            {"scale", b.second},
+        });
+    }
+    return attached;
+}
+
+static json lora_attached_json(const generation_session * session) {
+    const auto entries = lora_adapters().snapshot();
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    return lora_attached_json_locked(session, entries);
+}
+
+static bool lora_set_from_arrays(JNIEnv * env, jlongArray jadapters, jfloatArray jscales, lora_set<llama_adapter_lora> & out) {
+    const jsize n = jadapters ? env->GetArrayLength(jadapters) : 0;
+    if ((jscales ? env->GetArrayLength(jscales) : 0) != n) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "need one scale per adapter");
+        return false;
+    }
+    std::vector<jlong>  adapters(n);
+    std::vector<jfloat> scales(n);
+    if (n > 0) {
+        env->GetLongArrayRegion(jadapters, 0, n, adapters.data());
+        env->GetFloatArrayRegion(jscales, 0, n, scales.data());
+    }
+    out.clear();
+    for (jsize i = 0; i < n; ++i) {
+        out.emplace_back(reinterpret_cast<llama_adapter_lora *>(adapters[i]), scales[i]);
+    }
+    return true;
+}
+
+static jboolean lora_apply_impl(JNIEnv * env, generation_session * session, jlongArray jadapters, jfloatArray jscales) {
+    lora_set<llama_adapter_lora> want;
+    if (!lora_set_from_arrays(env, jadapters, jscales, want)) return JNI_FALSE;
+    bool changed = false;
+    if (!apply_loras(session, want, &changed)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "adapter not loaded for this model");
+        return JNI_FALSE;
+    }
+    return changed ? JNI_TRUE : JNI_FALSE;
+}
+
+// Loads a LoRA GGUF for `model`, or takes another reference to the one already loaded.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_lora_1load(JNIEnv *env, jobject, jlong jmodel, jstring jpath) {
+    auto * model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model || !jpath) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "lora_load needs a model and a path");
+        return 0;
+    }
+    const std::string path = jstring_to_string(env, jpath);
+    llama_adapter_lora * adapter = lora_adapters().acquire(model, path, [&](size_t & bytes) {
+        bytes = lora_file_bytes(path);
+        return llama_adapter_lora_init(model, path.c_str());
+    });
+    if (!adapter) {
+        LOGe("lora_load: cannot load %s", path.c_str());
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "llama_adapter_lora_init() failed");
+        return 0;
+    }
+    return reinterpret_cast<jlong>(adapter);
+}
+
+// Drops one reference; the last one detaches the adapter from every context and frees it.
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_lora_1release(JNIEnv *, jobject, jlong jadapter) {
+    auto * adapter = reinterpret_cast<llama_adapter_lora *>(jadapter);
+    if (adapter) lora_adapters().release(adapter);
+}
+
+// Sets the adapters of the main chat context. Returns true when the set changed (and the
+// KV cache was cleared).
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_lora_1apply(JNIEnv *env, jobject, jlong context, jlongArray jadapters, jfloatArray jscales) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context));
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown context");
+        return JNI_FALSE;
+    }
+    return lora_apply_impl(env, session, jadapters, jscales);
+}
+
+// Loaded adapters with their footprint and load time, switch latency, and the adapters of
+// the context that ran the last completion.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1lora_1stats(JNIEnv *env, jobject) {
+    json adapters = json::array();
+    size_t total = 0;
+    for (const auto & e : lora_adapters().snapshot()) {
+        adapters.push_back({
+            {"path", e.path},
+            {"bytes", e.bytes},
+            {"load_ms", e.load_ms},
+            {"refs", e.refs},
+        });
+        total += e.bytes;
+    }
+    json out;
+    out["adapters"]    = std::move(adapters);
+    out["total_bytes"] = total;
+    {
+        std::lock_guard<std::mutex> lock(g_lora_stats_mutex);
+        out["switches"]       = g_lora_switches;
+        out["last_switch_ms"] = g_lora_last_switch_ms;
+        out["avg_switch_ms"]  = g_lora_switches > 0 ? g_lora_total_switch_ms / g_lora_switches : -1.0;
+    }
+    const auto entries = lora_adapters().snapshot();
+    with_last_session([&](generation_session * session) {
+        out["attached"] = lora_attached_json_locked(session, entries);
+    });
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+// Self-contained generation sessions: a context with its own batch and sampler on a shared
+// model. Several can prefill and decode at the same time (one thread each), e.g. a chat and
+// a background summarizer. The handle is the generation_session pointer, only ever
+// compared against the registry, so a stale handle is rejected instead of dereferenced.
+// The caller holds g_sessions_mutex.
+static generation_session * find_session_handle_locked(jlong handle) {
+    for (auto & it : g_sessions) {
+        if (reinterpret_cast<jlong>(it.second.get()) == handle) {
+            return it.second.get();
+        }
+    }
+    return nullptr;
+}
+
+// Session calls other than session_cancel run on the session's own thread, which is also
+// the one that runs session_free, so the session stays valid after the lookup.
+static generation_session * session_from_handle(JNIEnv *env, jlong handle) {
+    generation_session * session = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        session = find_session_handle_locked(handle);
+    }
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "session is closed");
+    }
+    return session;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1create(
+        JNIEnv *env, jobject, jlong jmodel, jint n_threads, jfloat top_p, jint top_k, jfloat temp, jboolean fused) {
+    llama_context * context = create_context(env, reinterpret_cast<llama_model *>(jmodel), n_threads);
+    if (!context) {
+        return 0;
+    }
+    generation_session * session = find_session(context);
+    session->batch = new llama_batch;
+    *session->batch = llama_batch_init(1024, 0, 1);
+    const auto params = sampler_params_from_ui(top_p, top_k, temp);
+    session->sampler = fused == JNI_TRUE ? new_fused_sampler(params) : new_sampler_chain(params);
+    return reinterpret_cast<jlong>(session);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1free(JNIEnv *, jobject, jlong handle) {
+    generation_session * session = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_sessions_mutex);
+        session = find_session_handle_locked(handle);
+    }
+    if (!session) return;
+    llama_sampler * sampler = session->sampler;
+    llama_batch   * batch   = session->batch;
+    destroy_context(session->context);   // deletes the session
+    llama_sampler_free(sampler);
+    if (batch) {
+        llama_batch_free(*batch);
+        delete batch;
+    }
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1completion_1init(JNIEnv *env, jobject, jlong handle, jstring jtext, jint n_len) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return -1;
+    const auto text = env->GetStringUTFChars(jtext, 0);
+    const int n_cur = completion_init_impl(env, session, session->batch, text, n_len);
+    env->ReleaseStringUTFChars(jtext, text);
+    if (n_cur >= 0) {
+        llama_sampler_reset(session->sampler);
+    }
+    return n_cur;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1completion_1init_1tokens(
+        JNIEnv *env, jobject, jlong handle, jintArray jhistory, jstring jtext, jint n_len) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return -1;
+    std::vector<llama_token> history;
+    if (!read_prompt_tokens(env, session->context, jhistory, history)) {
+        return -1;
+    }
+    const std::string text = jtext ? jstring_to_string(env, jtext) : std::string();
+    const int n_cur = completion_init_impl(env, session, session->batch, text.c_str(), n_len, &history);
+    if (n_cur >= 0) {
+        llama_sampler_reset(session->sampler);
+    }
+    return n_cur;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1completion_1loop(JNIEnv *env, jobject, jlong handle, jint n_len, jobject intvar_ncur) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return nullptr;
+    return completion_loop_impl(env, session, session->batch, session->sampler, n_len, intvar_ncur);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1cancel(JNIEnv *env, jobject, jlong handle) {
+    // from any thread, so under the registry lock like cancel_generation: session_free
+    // cannot delete the session in between
+    std::lock_guard<std::mutex> lock(g_sessions_mutex);
+    generation_session * session = find_session_handle_locked(handle);
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "session is closed");
+        return;
+    }
+    request_cancel(session);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1kv_1clear(JNIEnv *env, jobject, jlong handle) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return;
+    std::lock_guard<std::mutex> lock(session->prefix_mutex);
+    llama_memory_clear(llama_get_memory(session->context), true);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1end_1generation(JNIEnv *env, jobject, jlong handle) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return;
+    end_generation(session);
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1stats(JNIEnv *env, jobject, jlong handle) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return nullptr;
+    json out;
+    out["generated"]    = session->n_generated;
+    out["prefill"]      = prefill_progress_json(session);
+    out["ttft"]         = ttft_json(session);
+    out["prefix_cache"] = prefix_cache_json(session);
+    out["throttle"]     = throttle_json(session);
+    out["speculation"]  = speculation_json(session);
+    out["tool_grammar"] = session->tool_grammar != nullptr;
+    out["lora"]         = lora_attached_json(session);
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1lora_1apply(JNIEnv *env, jobject, jlong handle, jlongArray jadapters, jfloatArray jscales) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return JNI_FALSE;
+    return lora_apply_impl(env, session, jadapters, jscales);
+}
+
+// Log-probabilities of every emitted token of the following replies, written into the
+// direct ByteBuffer `buffer` (layout in token_logprobs.h) with `top_k` alternatives each.
+// A null buffer or top_k < 0 turns them off. The app must keep the buffer alive while
+// attached. Returns the ring capacity in records (0 when off).
+static jint set_logprobs_impl(JNIEnv * env, generation_session * session, jobject buffer, jint top_k) {
+    session->logprobs_pending.clear();
+    if (!buffer || top_k < 0) {
+        session->logprobs.detach();
+        return 0;
+    }
+    void * mem = env->GetDirectBufferAddress(buffer);
+    const jlong bytes = env->GetDirectBufferCapacity(buffer);
+    if (!mem || bytes <= 0 || !session->logprobs.attach(mem, (size_t) bytes, (uint32_t) top_k)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "need an 8-byte aligned direct ByteBuffer large enough for one record");
+        return 0;
+    }
+    session->logprob_alts.reserve(top_k);
+    return (jint) ((bytes - logprob_ring::HEADER) / logprob_ring::record_bytes((uint32_t) top_k));
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1logprobs(JNIEnv *env, jobject, jlong context, jobject buffer, jint top_k) {
+    generation_session * session = find_session(reinterpret_cast<llama_context *>(context));
+    if (!session) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown context");
+        return 0;
+    }
+    return set_logprobs_impl(env, session, buffer, top_k);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1set_1logprobs(JNIEnv *env, jobject, jlong handle, jobject buffer, jint top_k) {
+    generation_session * session = session_from_handle(env, handle);
+    if (!session) return 0;
+    return set_logprobs_impl(env, session, buffer, top_k);
+}
+
+// Format given chat. If tmpl is empty, we take the template from model metadata
+inline std::string format_chat(const llama_model *model, const std::string &tmpl, const std::vector<json> &messages) {
+    std::vector<common_chat_msg> chat;
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const auto &curr_msg = messages[i];
+
+        std::string role = json_value(curr_msg, "role", std::string(""));
+        std::string content;
+
+        if (curr_msg.contains("content")) {
+            if (curr_msg["content"].is_string()) {
+                content = curr_msg["content"].get<std::string>();
+            } else if (curr_msg["content"].is_array()) {
+                for (const auto &part : curr_msg["content"]) {
+                    if (part.contains("text")) {
+                        content += "\n" + part["text"].get<std::string>();
+                    }
+                }
+            } else {
+                throw std::runtime_error("Invalid 'content' type.");
+            }
+        } else {
+            throw std::runtime_error("Missing 'content'.");
+        }
+
+        common_chat_msg msg;
+        msg.role = role;
+        msg.content = content;
+        chat.push_back(msg);
+    }
+
+    // Create chat templates inputs
+    common_chat_templates_inputs inputs;
+    inputs.messages = chat;
+    inputs.add_generation_prompt = true;
+    inputs.use_jinja = true;
+
+    // Get chat templates from model
+    auto tmpls = common_chat_templates_init(model, tmpl);
+    if (!tmpls) {
+        throw std::runtime_error("Failed to initialize chat templates");
+    }
+
+    // Apply templates
+    auto params = common_chat_templates_apply(tmpls.get(), inputs);
+    LOGi("formatted_chat: '%s'\n", params.prompt.c_str());
+
+    return params.prompt;
+}
+
+
+// Jinja template for a chat format name from the UI; unknown formats get Qwen3's.
+static std::string chat_template_for_format(const std::string & chatFormatStr_cpp) {
+    std::string template_content = "";
+
+    if (chatFormatStr_cpp == "QWEN3") {
+        // Use Qwen3 template with thinking support
+        template_content = R"(
+{%- if tools %}
+ {{- '<|im_start|>system\n' }}
+ {%- if messages[0].role == 'system' %}
+ {{- messages[0].content + '\n\n' }}
+ {%- endif %}
+ {{- "# Tools\n\nYou may call one or more functions to assist with the user query.\n\nYou are provided with function signatures within <tools></tools> XML tags:\n<tools>" }}
+ {%- for tool in tools %}
+ {{- "\n" }}
+ {{- tool | tojson }}
+ {%- endfor %}
+ {{- "\n</tools>\n\nFor each function call, return a json object with function name and arguments within <tool_call></tool_call> XML tags:\n<tool_call>\n{\"name\": <function-name>, \"arguments\": <args-json-object>}\n</tool_call><|im_end|>\n" }}
+{%- else %}
+{%- if messages[0].role == 'system' %}
+ {{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
+ {%- endif %}
+{%- endif %}
+{%- set ns = namespace(multi_step_tool=true, last_query_index=messages|length - 1) %}
+{%- for message in messages[::-1] %}
+ {%- set index = (messages|length - 1) - loop.index0 %}
+ {%- set tool_start = "<tool_response>" %}
+ {%- set tool_start_length = tool_start|length %}
+ {%- set start_of_message = message.content[:tool_start_length] %}
+ {%- set tool_end = "</tool_response>" %}
+ {%- set tool_end_length = tool_end|length %}
+ {%- set start_pos = (message.content|length) - tool_end_length %}
+ {%- if start_pos < 0 %}
+ {%- set start_pos = 0 %}
+ {%- endif %}
+ {%- set end_of_message = message.content[start_pos:] %}
+ {%- if ns.multi_step_tool and message.role == "user" and not(start_of_message == tool_start and end_of_message == tool_end) %}
+ {%- set ns.multi_step_tool = false %}
+ {%- set ns.last_query_index = index %}
+ {%- endif %}
+{%- endfor %}
+{%- for message in messages %}
+ {%- if (message.role == "user") or (message.role == "system" and not loop.first) %}
+ {{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
+ {%- elif message.role == "assistant" %}
+ {%- set content = message.content %}
+ {%- set reasoning_content = '' %}
+ {%- if message.reasoning_content is defined and message.reasoning_content is not none %}
+ {%- set reasoning_content = message.reasoning_content %}
+ {%- else %}
+ {%- if '</think>' in message.content %}
+ {%- set content = (message.content.split('</think>')|last).lstrip('\n') %}
+{%- set reasoning_content = (message.content.split('</think>')|first).rstrip('\n') %}
+{%- set reasoning_content = (reasoning_content.split('<think>')|last).lstrip('\n') %}
+ {%- endif %}
+ {%- endif %}
+ {%- if loop.index0 > ns.last_query_index %}
+ {%- if loop.last or (not loop.last and reasoning_content) %}
+ {{- '<|im_start|>' + message.role + '\n<think>\n' + reasoning_content.strip('\n') + '\n</think>\n\n' + content.lstrip('\n') }}
+ {%- else %}
+ {{- '<|im_start|>' + message.role + '\n' + content }}
+ {%- endif %}
+ {%- else %}
+ {{- '<|im_start|>' + message.role + '\n' + content }}
+ {%- endif %}
+ {%- if message.tool_calls %}
+ {%- for tool_call in message.tool_calls %}
+ {%- if (loop.first and content) or (not loop.first) %}
+ {{- '\n' }}
+ {%- endif %}
+ {%- if tool_call.function %}
+ {%- set tool_call = tool_call.function %}
+ {%- endif %}
+ {{- '<tool_call>\n{"name": "' }}
+ {{- tool_call.name }}
+ {{- '", "arguments": ' }}
+ {%- if tool_call.arguments is string %}
+ {{- tool_call.arguments }}
+ {%- else %}
+ {{- tool_call.arguments | tojson }}
+ {%- endif %}
+ {{- '}\n</tool_call>' }}
+ {%- endfor %}
+ {%- endif %}
+ {{- '<|im_end|>\n' }}
+ {%- elif message.role == "tool" %}
+ {%- if loop.first or (messages[loop.index0 - 1].role != "tool") %}
+ {{- '<|im_start|>user' }}
+ {%- endif %}
+ {{- '\n<tool_response>\n' }}
+ {{- message.content }}
+ {{- '\n</tool_response>' }}
+ {%- if loop.last or (messages[loop.index0 + 1].role != "tool") %}
+ {{- '<|im_end|>\n' }}
+ {%- endif %}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+ {{- '<|im_start|>assistant\n' }}
+ {{- '<think>\n' }}
+ {{- 'Let me think through this step by step:\n' }}
+ {{- '1. First, I need to understand the question\n' }}
+ {{- '2. Then I will work through the solution\n' }}
+ {{- '3. Finally, I will provide the answer\n' }}
+ {{- '</think>\n' }}
+ {{- '\n' }}
+ {%- endif %}
+)";
+        LOGi("Using Qwen3 template with thinking support");
+    } else if (chatFormatStr_cpp == "CHATML") {
+        // Use ChatML template
+        template_content = R"(
+{%- if messages[0].role == 'system' %}
+{{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role != 'system' %}
+{{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+{{- '<|im_start|>assistant\n<think>\n' }}
+{%- endif %}
+)";
+        LOGi("Using ChatML template");
+    } else if (chatFormatStr_cpp == "ALPACA") {
+        // Use Alpaca template
+        template_content = R"(
+{%- if messages[0].role == 'system' %}
+{{- '### Instruction:\n' + messages[0].content + '\n\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' %}
+{{- '### Input:\n' + message.content + '\n\n' }}
+{%- elif message.role == 'assistant' %}
+{{- '### Response:\n' + message.content + '\n\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+{{- '### Response:\n' }}
+{%- endif %}
+)";
+        LOGi("Using Alpaca template");
+    } else if (chatFormatStr_cpp == "VICUNA") {
+        // Use Vicuna template
+        template_content = R"(
+{%- if messages[0].role == 'system' %}
+{{- messages[0].content + '\n\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' %}
+{{- 'USER: ' + message.content + '\n' }}
+{%- elif message.role == 'assistant' %}
+{{- 'ASSISTANT: ' + message.content + '\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+{{- 'ASSISTANT: ' }}
+{%- endif %}
+)";
+        LOGi("Using Vicuna template");
+    } else if (chatFormatStr_cpp == "LLAMA2") {
+        // Use Llama2 template
+        template_content = R"(
+{%- if messages[0].role == 'system' %}
+{{- '[INST] <<SYS>>\n' + messages[0].content + '\n<</SYS>>\n\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' %}
+{{- message.content + ' [/INST]' }}
+{%- elif message.role == 'assistant' %}
+{{- ' ' + message.content + ' [INST] ' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+{{- ' ' }}
+{%- endif %}
+)";
+        LOGi("Using Llama2 template");
+    } else if (chatFormatStr_cpp == "ZEPHYR") {
+        // Use Zephyr template
+        template_content = R"(
+{%- if messages[0].role == 'system' %}
+{{- '<|system|>\n' + messages[0].content + '\n<|end|>\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' %}
+{{- '<|user|>\n' + message.content + '\n<|end|>\n' }}
+{%- elif message.role == 'assistant' %}
+{{- '<|assistant|>\n' + message.content + '\n<|end|>\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+{{- '<|assistant|>\n' }}
+{%- endif %}
+)";
+        LOGi("Using Zephyr template");
+    } else {
+        // Default to Qwen3 template for unknown formats
+        template_content = R"(
+{%- if tools %}
+ {{- '<|im_start|>system\n' }}
+ {%- if messages[0].role == 'system' %}
+ {{- messages[0].content + '\n\n' }}
+ {%- endif %}
+ {{- "# Tools\n\nYou may call one or more functions to assist with the user query.\n\nYou are provided with function signatures within <tools></tools> XML tags:\n<tools>" }}
+ {%- for tool in tools %}
+ {{- "\n" }}
+ {{- tool | tojson }}
+ {%- endfor %}
+ {{- "\n</tools>\n\nFor each function call, return a json object with function name and arguments within <tool_call></tool_call> XML tags:\n<tool_call>\n{\"name\": <function-name>, \"arguments\": <args-json-object>}\n</tool_call><|im_end|>\n" }}
+{%- else %}
+{%- if messages[0].role == 'system' %}
+ {{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
+ {%- endif %}
+{%- endif %}
+{%- set ns = namespace(multi_step_tool=true, last_query_index=messages|length - 1) %}
+{%- for message in messages[::-1] %}
+ {%- set index = (messages|length - 1) - loop.index0 %}
+ {%- set tool_start = "<tool_response>" %}
+ {%- set tool_start_length = tool_start|length %}
+ {%- set start_of_message = message.content[:tool_start_length] %}
+ {%- set tool_end = "</tool_response>" %}
+ {%- set tool_end_length = tool_end|length %}
+ {%- set start_pos = (message.content|length) - tool_end_length %}
+ {%- if start_pos < 0 %}
+ {%- set start_pos = 0 %}
+ {%- endif %}
+ {%- set end_of_message = message.content[start_pos:] %}
+ {%- if ns.multi_step_tool and message.role == "user" and not(start_of_message == tool_start and end_of_message == tool_end) %}
+ {%- set ns.multi_step_tool = false %}
+ {%- set ns.last_query_index = index %}
+ {%- endif %}
+{%- endfor %}
+{%- for message in messages %}
+ {%- if (message.role == "user") or (message.role == "system" and not loop.first) %}
+ {{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
+ {%- elif message.role == "assistant" %}
+ {%- set content = message.content %}
+ {%- set reasoning_content = '' %}
+ {%- if message.reasoning_content is defined and message.reasoning_content is not none %}
+ {%- set reasoning_content = message.reasoning_content %}
+ {%- else %}
+ {%- if '</think>' in message.content %}
+ {%- set content = (message.content.split('</think>')|last).lstrip('\n') %}
+{%- set reasoning_content = (message.content.split('</think>')|first).rstrip('\n') %}
+{%- set reasoning_content = (reasoning_content.split('<think>')|last).lstrip('\n') %}
+ {%- endif %}
+ {%- endif %}
+ {%- if loop.index0 > ns.last_query_index %}
+ {%- if loop.last or (not loop.last and reasoning_content) %}
+ {{- '<|im_start|>' + message.role + '\n<think>\n' + reasoning_content.strip('\n') + '\n</think>\n\n' + content.lstrip('\n') }}
+ {%- else %}
+ {{- '<|im_start|>' + message.role + '\n' + content }}
+ {%- endif %}
+ {%- else %}
+ {{- '<|im_start|>' + message.role + '\n' + content }}
+ {%- endif %}
+ {%- if message.tool_calls %}
+ {%- for tool_call in message.tool_calls %}
+ {%- if (loop.first and content) or (not loop.first) %}
+ {{- '\n' }}
+ {%- endif %}
+ {%- if tool_call.function %}
+ {%- set tool_call = tool_call.function %}
+ {%- endif %}
+ {{- '<tool_call>\n{"name": "' }}
+ {{- tool_call.name }}
+ {{- '", "arguments": ' }}
+ {%- if tool_call.arguments is string %}
+ {{- tool_call.arguments }}
+ {%- else %}
+ {{- tool_call.arguments | tojson }}
+ {%- endif %}
+ {{- '}\n</tool_call>' }}
+ {%- endfor %}
+ {%- endif %}
+ {{- '<|im_end|>\n' }}
+ {%- elif message.role == "tool" %}
+ {%- if loop.first or (messages[loop.index0 - 1].role != "tool") %}
+ {{- '<|im_start|>user' }}
+ {%- endif %}
+ {{- '\n<tool_response>\n' }}
+ {{- message.content }}
+ {{- '\n</tool_response>' }}
+ {%- if loop.last or (messages[loop.index0 + 1].role != "tool") %}
+ {{- '<|im_end|>\n' }}
+ {%- endif %}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}
+ {{- '<|im_start|>assistant\n' }}
+ {%- if enable_thinking is defined and enable_thinking is false %}
+ {{- '<think>\n\n</think>\n\n' }}
+ {%- endif %}
+{%- endif %}
+)";
+        LOGi("Using default Qwen3 template for format: %s", chatFormatStr_cpp.c_str());
+    }
+    return template_content;
+}
+
+// Template overhead of `format` on `model`, from four probe renders the first time.
+// Counted the way completion_init tokenizes the prompt (with BOS, no special parsing).
+static budget_overhead template_budget_overhead(const llama_model * model, const std::string & format) {
+    const auto key = std::make_pair(model, format);
+    {
+        std::lock_guard<std::mutex> lock(g_budget_overheads_mutex);
+        auto it = g_budget_overheads.find(key);
+        if (it != g_budget_overheads.end()) {
+            return it->second;
+        }
+    }
+    const std::string tmpl = chat_template_for_format(format);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    auto render_tokens = [&](std::initializer_list<const char *> roles) {
+        std::vector<json> messages;
+        for (const char * role : roles) {
+            messages.push_back({ { "role", role }, { "content", "" } });
+        }
+        return (int32_t) common_tokenize(vocab, format_chat(model, tmpl, messages), true, false).size();
+    };
+    const budget_overhead overhead = measure_budget_overhead(
+            render_tokens({ "user" }), render_tokens({ "user", "assistant" }),
+            render_tokens({ "user", "assistant", "user" }), render_tokens({ "system", "user" }));
+    std::lock_guard<std::mutex> lock(g_budget_overheads_mutex);
+    g_budget_overheads[key] = overhead;
+    return overhead;
+}
+
+// Which of `allMessages` to send so that the prompt plus `n_reserve` generated tokens fits
+// in `n_ctx`, without rendering or tokenizing the prompt: every system message and the
+// latest turns are kept. Only messages not seen before are tokenized. Returns JSON
+// {"kept": [indices], "dropped": n, "tokens": estimated prompt tokens, "fits": bool}.
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_budget_1context(
+        JNIEnv *env, jobject, jobjectArray allMessages, jlong jmodel, jstring chatFormat, jint n_ctx, jint n_reserve) {
+    const auto * model = reinterpret_cast<const llama_model *>(jmodel);
+    if (model == nullptr || allMessages == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "budgeting needs a model and messages");
+        return nullptr;
+    }
+    const auto t_start = ggml_time_us();
+    try {
+        const std::vector<json> messages = json::parse(mapListToJSONString(env, allMessages));
+        const budget_overhead overhead = template_budget_overhead(model, jstring_to_string(env, chatFormat));
+
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+        auto & counts = message_token_counts();
+        std::vector<budget_message> budget(messages.size());
+        std::vector<std::string> missing;
+        std::vector<size_t> missing_idx;
+        for (size_t i = 0; i < messages.size(); ++i) {
+            const std::string content = json_value(messages[i], "content", std::string(""));
+            budget[i].role = budget_role_of(json_value(messages[i], "role", std::string("")));
+            if (!counts.lookup(vocab, content, budget[i].tokens)) {
+                missing.push_back(content);
+                missing_idx.push_back(i);
+            }
+        }
+        const token_batch batch = batch_tokenize(missing, false, std::min(4, cpu_performance_core_count()),
+                                                 [vocab](const std::string & text, int32_t * tokens, int32_t n_max) {
+            return llama_tokenize(vocab, text.c_str(), (int32_t) text.size(), tokens, n_max,
+                                  /*add_special*/ false, /*parse_special*/ false);
+        });
+        for (size_t j = 0; j < missing.size(); ++j) {
+            budget[missing_idx[j]].tokens = batch.counts[j];
+            counts.store(vocab, missing[j], batch.counts[j]);
+        }
+
+        const budget_window window = fit_context_window(budget, overhead, n_ctx, n_reserve);
+        LOGi("context budget: kept %zu of %zu messages, ~%d tokens (%zu tokenized) in %.2f ms",
+             window.kept.size(), messages.size(), window.tokens, missing.size(), (ggml_time_us() - t_start) / 1000.0);
+        json result = {
+            { "kept",    window.kept },
+            { "dropped", messages.size() - window.kept.size() },
+            { "tokens",  window.tokens },
+            { "fits",    window.fits },
+        };
+        return env->NewStringUTF(result.dump().c_str());
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return nullptr;
+    }
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_oaicompat_1completion_1param_1parse(
+        JNIEnv *env, jobject, jobjectArray allMessages, jlong model, jstring chatFormat) {
+    const auto t_start = ggml_time_us();
+    try {
+        // Convert the messages to JSON
         std::string parsedData = mapListToJSONString(env, allMessages);
         // Parse and format
         std::vector<json> jsonMessages = json::parse(parsedData);
@@ -1000,607 +3535,1943 @@ Java_android_llama_cpp_LLamaAndroid_oaicompat_1completion_1param_1parse(
             std::string content = json_value(msg, "content", std::string(""));
             LOGi("Message %zu: role='%s', content='%s'", i, role.c_str(), content.substr(0, 100).c_str());
         }
-        
-        // Extract the chat format string
-        const char* chatFormatStr = env->GetStringUTFChars(chatFormat, nullptr);
-        std::string chatFormatStr_cpp = std::string(chatFormatStr);
-        env->ReleaseStringUTFChars(chatFormat, chatFormatStr);
-        
-        LOGi("Received chat format: '%s'", chatFormatStr_cpp.c_str());
-        
-        // Try to detect Qwen3 model and use appropriate template
-        auto model_ptr = reinterpret_cast<const llama_model *>(model);
-        std::string template_content = "";
-        
-        // Use the chat format from the UI to select the appropriate template
-        if (chatFormatStr_cpp == "QWEN3") {
-            // Use Qwen3 template with thinking support
-            template_content = R"(
-{%- if tools %}
- {{- '<|im_start|>system\n' }}
- {%- if messages[0].role == 'system' %}
- {{- messages[0].content + '\n\n' }}
- {%- endif %}
- {{- "# Tools\n\nYou may call one or more functions to assist with the user query.\n\nYou are provided with function signatures within <tools></tools> XML tags:\n<tools>" }}
- {%- for tool in tools %}
- {{- "\n" }}
- {{- tool | tojson }}
- {%- endfor %}
- {{- "\n</tools>\n\nFor each function call, return a json object with function name and arguments within <tool_call></tool_call> XML tags:\n<tool_call>\n{\"name\": <function-name>, \"arguments\": <args-json-object>}\n</tool_call><|im_end|>\n" }}
-{%- else %}
-{%- if messages[0].role == 'system' %}
- {{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
- {%- endif %}
-{%- endif %}
-{%- set ns = namespace(multi_step_tool=true, last_query_index=messages|length - 1) %}
-{%- for message in messages[::-1] %}
- {%- set index = (messages|length - 1) - loop.index0 %}
- {%- set tool_start = "<tool_response>" %}
- {%- set tool_start_length = tool_start|length %}
- {%- set start_of_message = message.content[:tool_start_length] %}
- {%- set tool_end = "</tool_response>" %}
- {%- set tool_end_length = tool_end|length %}
- {%- set start_pos = (message.content|length) - tool_end_length %}
- {%- if start_pos < 0 %}
- {%- set start_pos = 0 %}
- {%- endif %}
- {%- set end_of_message = message.content[start_pos:] %}
- {%- if ns.multi_step_tool and message.role == "user" and not(start_of_message == tool_start and end_of_message == tool_end) %}
- {%- set ns.multi_step_tool = false %}
- {%- set ns.last_query_index = index %}
- {%- endif %}
-{%- endfor %}
-{%- for message in messages %}
- {%- if (message.role == "user") or (message.role == "system" and not loop.first) %}
- {{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
- {%- elif message.role == "assistant" %}
- {%- set content = message.content %}
- {%- set reasoning_content = '' %}
- {%- if message.reasoning_content is defined and message.reasoning_content is not none %}
- {%- set reasoning_content = message.reasoning_content %}
- {%- else %}
- {%- if '</think>' in message.content %}
- {%- set content = (message.content.split('</think>')|last).lstrip('\n') %}
-{%- set reasoning_content = (message.content.split('</think>')|first).rstrip('\n') %}
-{%- set reasoning_content = (reasoning_content.split('<think>')|last).lstrip('\n') %}
- {%- endif %}
- {%- endif %}
- {%- if loop.index0 > ns.last_query_index %}
- {%- if loop.last or (not loop.last and reasoning_content) %}
- {{- '<|im_start|>' + message.role + '\n<think>\n' + reasoning_content.strip('\n') + '\n</think>\n\n' + content.lstrip('\n') }}
- {%- else %}
- {{- '<|im_start|>' + message.role + '\n' + content }}
- {%- endif %}
- {%- else %}
- {{- '<|im_start|>' + message.role + '\n' + content }}
- {%- endif %}
- {%- if message.tool_calls %}
- {%- for tool_call in message.tool_calls %}
- {%- if (loop.first and content) or (not loop.first) %}
- {{- '\n' }}
- {%- endif %}
- {%- if tool_call.function %}
- {%- set tool_call = tool_call.function %}
- {%- endif %}
- {{- '<tool_call>\n{"name": "' }}
- {{- tool_call.name }}
- {{- '", "arguments": ' }}
- {%- if tool_call.arguments is string %}
- {{- tool_call.arguments }}
- {%- else %}
- {{- tool_call.arguments | tojson }}
- {%- endif %}
- {{- '}\n</tool_call>' }}
- {%- endfor %}
- {%- endif %}
- {{- '<|im_end|>\n' }}
- {%- elif message.role == "tool" %}
- {%- if loop.first or (messages[loop.index0 - 1].role != "tool") %}
- {{- '<|im_start|>user' }}
- {%- endif %}
- {{- '\n<tool_response>\n' }}
- {{- message.content }}
- {{- '\n</tool_response>' }}
- {%- if loop.last or (messages[loop.index0 + 1].role != "tool") %}
- {{- '<|im_end|>\n' }}
- {%- endif %}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
- {{- '<|im_start|>assistant\n' }}
- {{- '<think>\n' }}
- {{- 'Let me think through this step by step:\n' }}
- {{- '1. First, I need to understand the question\n' }}
- {{- '2. Then I will work through the solution\n' }}
- {{- '3. Finally, I will provide the answer\n' }}
- {{- '</think>\n' }}
- {{- '\n' }}
- {%- endif %}
-)";
-            LOGi("Using Qwen3 template with thinking support");
-        } else if (chatFormatStr_cpp == "CHATML") {
-            // Use ChatML template
-            template_content = R"(
-{%- if messages[0].role == 'system' %}
-{{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
-{%- endif %}
-{%- for message in messages %}
-{%- if message.role != 'system' %}
-{{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>\n' }}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
-{{- '<|im_start|>assistant\n<think>\n' }}
-{%- endif %}
-)";
-            LOGi("Using ChatML template");
-        } else if (chatFormatStr_cpp == "ALPACA") {
-            // Use Alpaca template
-            template_content = R"(
-{%- if messages[0].role == 'system' %}
-{{- '### Instruction:\n' + messages[0].content + '\n\n' }}
-{%- endif %}
-{%- for message in messages %}
-{%- if message.role == 'user' %}
-{{- '### Input:\n' + message.content + '\n\n' }}
-{%- elif message.role == 'assistant' %}
-{{- '### Response:\n' + message.content + '\n\n' }}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
-{{- '### Response:\n' }}
-{%- endif %}
-)";
-            LOGi("Using Alpaca template");
-        } else if (chatFormatStr_cpp == "VICUNA") {
-            // Use Vicuna template
-            template_content = R"(
-{%- if messages[0].role == 'system' %}
-{{- messages[0].content + '\n\n' }}
-{%- endif %}
-{%- for message in messages %}
-{%- if message.role == 'user' %}
-{{- 'USER: ' + message.content + '\n' }}
-{%- elif message.role == 'assistant' %}
-{{- 'ASSISTANT: ' + message.content + '\n' }}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
-{{- 'ASSISTANT: ' }}
-{%- endif %}
-)";
-            LOGi("Using Vicuna template");
-        } else if (chatFormatStr_cpp == "LLAMA2") {
-            // Use Llama2 template
-            template_content = R"(
-{%- if messages[0].role == 'system' %}
-{{- '[INST] <<SYS>>\n' + messages[0].content + '\n<</SYS>>\n\n' }}
-{%- endif %}
-{%- for message in messages %}
-{%- if message.role == 'user' %}
-{{- message.content + ' [/INST]' }}
-{%- elif message.role == 'assistant' %}
-{{- ' ' + message.content + ' [INST] ' }}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
-{{- ' ' }}
-{%- endif %}
-)";
-            LOGi("Using Llama2 template");
-        } else if (chatFormatStr_cpp == "ZEPHYR") {
-            // Use Zephyr template
-            template_content = R"(
-{%- if messages[0].role == 'system' %}
-{{- '<|system|>\n' + messages[0].content + '\n<|end|>\n' }}
-{%- endif %}
-{%- for message in messages %}
-{%- if message.role == 'user' %}
-{{- '<|user|>\n' + message.content + '\n<|end|>\n' }}
-{%- elif message.role == 'assistant' %}
-{{- '<|assistant|>\n' + message.content + '\n<|end|>\n' }}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
-{{- '<|assistant|>\n' }}
-{%- endif %}
-)";
-            LOGi("Using Zephyr template");
+        
+        // Extract the chat format string
+        const char* chatFormatStr = env->GetStringUTFChars(chatFormat, nullptr);
+        std::string chatFormatStr_cpp = std::string(chatFormatStr);
+        env->ReleaseStringUTFChars(chatFormat, chatFormatStr);
+        
+        LOGi("Received chat format: '%s'", chatFormatStr_cpp.c_str());
+        
+        // Try to detect Qwen3 model and use appropriate template
+        auto model_ptr = reinterpret_cast<const llama_model *>(model);
+        const std::string template_content = chat_template_for_format(chatFormatStr_cpp);
+        
+        const auto formattedPrompts = format_chat(model_ptr, template_content, jsonMessages);
+        
+        LOGi("Template content length: %zu", template_content.length());
+        LOGi("Formatted prompt length: %zu", formattedPrompts.length());
+        LOGi("Formatted prompt preview: %s", formattedPrompts.substr(0, 200).c_str());
+
+        t_template_us = ggml_time_us() - t_start;
+        return env->NewStringUTF(formattedPrompts.c_str());
+    } catch (const std::exception &e) {
+        LOGe("Error processing data: %s", e.what());
+        return env->NewStringUTF("");
+    }
+}
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1eot_1str(JNIEnv *env, jobject , jlong jmodel) {
+    auto model = reinterpret_cast<llama_model *>(jmodel);
+    const auto eot = llama_vocab_eot(llama_model_get_vocab(model));
+
+    if (eot == -1){
+        std::string piece = "<|im_end|>";
+        return env->NewStringUTF(piece.c_str());
+    }
+
+    std::string piece;
+    piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
+    const int n_chars = llama_token_to_piece(llama_model_get_vocab(model), eot, &piece[0], piece.size(), 0, true);
+    if (n_chars < 0) {
+        piece.resize(-n_chars);
+        int check = llama_token_to_piece(llama_model_get_vocab(model), eot, &piece[0], piece.size(), 0, true);
+        GGML_ASSERT(check == -n_chars);
+    }
+    else {
+        piece.resize(n_chars);
+    }
+
+     return env->NewStringUTF(piece.c_str());
+
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_count_1tokens(JNIEnv *env, jobject, jlong jmodel, jstring jtext) {
+    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
+    if (model == nullptr) {
+        return 0;
+    }
+    const char *c_text = env->GetStringUTFChars(jtext, nullptr);
+    std::string text(c_text);
+    env->ReleaseStringUTFChars(jtext, c_text);
+
+    std::vector<llama_token> tokens(text.size() + 2);
+    const struct llama_vocab * vocab = llama_model_get_vocab(model);
+    int32_t n_tokens = llama_tokenize(vocab,
+                                      text.c_str(),
+                                      static_cast<int32_t>(text.size()),
+                                      tokens.data(),
+                                      static_cast<int32_t>(tokens.size()),
+                                      /*add_special*/ false,
+                                      /*parse_special*/ true);
+
+    if (n_tokens < 0) n_tokens = 0;
+    return n_tokens;
+}
+
+// Tokenizes every string of `jtexts` the way count_tokens does, on up to four performance
+// cores for large batches; the vocab is only read. False (with an exception) on bad arguments.
+static bool tokenize_strings(JNIEnv *env, jlong jmodel, jobjectArray jtexts, bool with_ids, token_batch & out) {
+    const auto * model = reinterpret_cast<const llama_model *>(jmodel);
+    if (model == nullptr || jtexts == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "tokenizing needs a model and texts");
+        return false;
+    }
+    const jsize n_texts = env->GetArrayLength(jtexts);
+    std::vector<std::string> texts;
+    texts.reserve(n_texts);
+    for (jsize i = 0; i < n_texts; ++i) {
+        LocalRef<jstring> jtext(env, (jstring) env->GetObjectArrayElement(jtexts, i));
+        texts.push_back(jtext.get() ? jstring_to_string(env, jtext.get()) : std::string());
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    out = batch_tokenize(texts, with_ids, std::min(4, cpu_performance_core_count()),
+                         [vocab](const std::string & text, int32_t * tokens, int32_t n_max) {
+        return llama_tokenize(vocab, text.c_str(), (int32_t) text.size(), tokens, n_max,
+                              /*add_special*/ false, /*parse_special*/ true);
+    });
+    return true;
+}
+
+// Token count of each string, in order.
+extern "C" JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_count_1tokens_1batch(JNIEnv *env, jobject, jlong jmodel, jobjectArray jtexts) {
+    token_batch batch;
+    if (!tokenize_strings(env, jmodel, jtexts, false, batch)) {
+        return nullptr;
+    }
+    jintArray result = env->NewIntArray((jsize) batch.counts.size());
+    env->SetIntArrayRegion(result, 0, (jsize) batch.counts.size(), reinterpret_cast<const jint *>(batch.counts.data()));
+    return result;
+}
+
+// Token ids of all strings, flattened; string i owns ids[offsets[i] .. offsets[i + 1]) of
+// `joffsets`, which must hold one more entry than there are strings.
+extern "C" JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_tokenize_1batch(
+        JNIEnv *env, jobject, jlong jmodel, jobjectArray jtexts, jintArray joffsets) {
+    if (jtexts == nullptr || joffsets == nullptr || env->GetArrayLength(joffsets) != env->GetArrayLength(jtexts) + 1) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "offsets must have one entry more than texts");
+        return nullptr;
+    }
+    token_batch batch;
+    if (!tokenize_strings(env, jmodel, jtexts, true, batch)) {
+        return nullptr;
+    }
+    env->SetIntArrayRegion(joffsets, 0, (jsize) batch.offsets.size(), reinterpret_cast<const jint *>(batch.offsets.data()));
+    jintArray result = env->NewIntArray((jsize) batch.ids.size());
+    env->SetIntArrayRegion(result, 0, (jsize) batch.ids.size(), reinterpret_cast<const jint *>(batch.ids.data()));
+    return result;
+}
+
+// Vocab-only models: the tokenizer and GGUF metadata without any tensor data.
+// The handle is a regular llama_model, so count_tokens and get_eot_str accept it too.
+static model_residency_cache<llama_model> & vocab_cache() {
+    static auto * cache = new model_residency_cache<llama_model>(
+            [](llama_model * model) { forget_model(model); llama_model_free(model); },
+            // token texts, scores, attributes and lookup maps; roughly 64 bytes per token
+            [](const llama_model * model) { return (size_t) llama_vocab_n_tokens(llama_model_get_vocab(model)) * 64; },
+            (size_t) 32 << 20);
+    return *cache;
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_acquire_1vocab(JNIEnv *env, jobject, jstring jpath) {
+    const std::string path = jstring_to_string(env, jpath);
+    model_file_key key;
+    if (!model_file_key_from_path(path, "vocab_only", key)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "model file not found");
+        return 0;
+    }
+    ensure_backends_initialized();
+
+    const auto t_start = ggml_time_us();
+    bool hit = false;
+    llama_model * model = vocab_cache().acquire(key, [&]() {
+        llama_model_params params = llama_model_default_params();
+        params.vocab_only   = true;
+        params.n_gpu_layers = 0;
+        return llama_model_load_from_file(path.c_str(), params);
+    }, &hit);
+    if (!model) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "acquire_vocab() failed");
+        return 0;
+    }
+    LOGi("vocab for %s %s in %.2f ms", path.c_str(), hit ? "reused" : "loaded", (ggml_time_us() - t_start) / 1000.0);
+    return reinterpret_cast<jlong>(model);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_release_1vocab(JNIEnv *, jobject, jlong jvocab) {
+    vocab_cache().release(reinterpret_cast<llama_model *>(jvocab));
+}
+
+extern "C" JNIEXPORT jintArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_vocab_1tokenize(
+        JNIEnv *env, jobject, jlong jvocab, jstring jtext, jboolean add_special, jboolean parse_special) {
+    const auto * model = reinterpret_cast<const llama_model *>(jvocab);
+    if (model == nullptr) {
+        return env->NewIntArray(0);
+    }
+    const auto tokens = common_tokenize(llama_model_get_vocab(model), jstring_to_string(env, jtext),
+                                        add_special, parse_special);
+    jintArray result = env->NewIntArray((jsize) tokens.size());
+    env->SetIntArrayRegion(result, 0, (jsize) tokens.size(), reinterpret_cast<const jint *>(tokens.data()));
+    return result;
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_vocab_1detokenize(
+        JNIEnv *env, jobject, jlong jvocab, jintArray jtokens, jboolean special) {
+    const auto * model = reinterpret_cast<const llama_model *>(jvocab);
+    if (model == nullptr) {
+        return env->NewStringUTF("");
+    }
+    const auto * vocab = llama_model_get_vocab(model);
+    const jsize n = env->GetArrayLength(jtokens);
+    std::vector<llama_token> tokens(n);
+    env->GetIntArrayRegion(jtokens, 0, n, reinterpret_cast<jint *>(tokens.data()));
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    for (llama_token t : tokens) {
+        if (t < 0 || t >= n_vocab) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "token id out of range");
+            return nullptr;
+        }
+    }
+    const std::string text = common_detokenize(vocab, tokens, special);
+    return env->NewStringUTF(text.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_vocab_1special_1tokens(JNIEnv *env, jobject, jlong jvocab) {
+    const auto * model = reinterpret_cast<const llama_model *>(jvocab);
+    if (model == nullptr) {
+        return env->NewStringUTF("{}");
+    }
+    const auto * vocab = llama_model_get_vocab(model);
+    auto token_json = [&](llama_token t) {
+        json j;
+        j["id"] = t;
+        j["text"] = t == LLAMA_TOKEN_NULL ? "" : common_token_to_piece(vocab, t, true);
+        return j;
+    };
+
+    json out;
+    out["n_tokens"] = llama_vocab_n_tokens(vocab);
+    out["add_bos"]  = llama_vocab_get_add_bos(vocab);
+    out["add_eos"]  = llama_vocab_get_add_eos(vocab);
+    out["bos"] = token_json(llama_vocab_bos(vocab));
+    out["eos"] = token_json(llama_vocab_eos(vocab));
+    out["eot"] = token_json(llama_vocab_eot(vocab));
+    out["sep"] = token_json(llama_vocab_sep(vocab));
+    out["nl"]  = token_json(llama_vocab_nl(vocab));
+    out["pad"] = token_json(llama_vocab_pad(vocab));
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+// Embedded chat template (`name` selects a named variant, empty for the default).
+// Works with both vocab-only and fully loaded models.
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_model_1chat_1template(JNIEnv *env, jobject, jlong jmodel, jstring jname) {
+    const auto * model = reinterpret_cast<const llama_model *>(jmodel);
+    if (model == nullptr) {
+        return env->NewStringUTF("");
+    }
+    const std::string name = jname ? jstring_to_string(env, jname) : "";
+    const char * tmpl = llama_model_chat_template(model, name.empty() ? nullptr : name.c_str());
+    return env->NewStringUTF(tmpl ? tmpl : "");
+}
+
+// Renders a JSON array of {role, content} messages with the model's embedded template
+// through llama.cpp's built-in template matcher (no Jinja engine involved).
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_vocab_1apply_1chat_1template(
+        JNIEnv *env, jobject, jlong jmodel, jstring jmessages, jboolean add_assistant) {
+    const auto * model = reinterpret_cast<const llama_model *>(jmodel);
+    const char * tmpl = model ? llama_model_chat_template(model, nullptr) : nullptr;
+    if (tmpl == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "model has no chat template");
+        return nullptr;
+    }
+
+    json messages;
+    try {
+        messages = json::parse(jstring_to_string(env, jmessages));
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return nullptr;
+    }
+    std::vector<std::string> roles, contents;
+    for (const auto & m : messages) {
+        roles.push_back(json_value(m, "role", std::string("user")));
+        contents.push_back(json_value(m, "content", std::string()));
+    }
+    std::vector<llama_chat_message> chat;
+    size_t total = 0;
+    for (size_t i = 0; i < roles.size(); ++i) {
+        chat.push_back({ roles[i].c_str(), contents[i].c_str() });
+        total += roles[i].size() + contents[i].size();
+    }
+
+    std::vector<char> buf(total * 2 + 256);
+    int32_t n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, buf.data(), (int32_t) buf.size());
+    if (n > (int32_t) buf.size()) {
+        buf.resize(n);
+        n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, buf.data(), (int32_t) buf.size());
+    }
+    if (n < 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "chat template not supported");
+        return nullptr;
+    }
+    return env->NewStringUTF(std::string(buf.data(), n).c_str());
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_getMemoryUsageNative(JNIEnv *, jobject, jlong jctx) {
+    auto * ctx = reinterpret_cast<llama_context *>(jctx);
+    if (ctx == nullptr) {
+        return 0;
+    }
+
+    // llama_get_state_size() returns the amount of memory (in bytes) currently used by the context
+    const size_t used = llama_state_get_size(ctx);
+    return static_cast<jlong>(used);
+}
+
+struct quant_option {
+    std::string name;
+    llama_ftype ftype;
+    std::string desc;
+};
+
+static const std::vector<quant_option> QUANT_OPTIONS = {
+    { "Q4_0",     LLAMA_FTYPE_MOSTLY_Q4_0,     " 4.34G, +0.4685 ppl @ Llama-3-8B",  },
+    { "Q4_1",     LLAMA_FTYPE_MOSTLY_Q4_1,     " 4.78G, +0.4511 ppl @ Llama-3-8B",  },
+    { "Q5_0",     LLAMA_FTYPE_MOSTLY_Q5_0,     " 5.21G, +0.1316 ppl @ Llama-3-8B",  },
+    { "Q5_1",     LLAMA_FTYPE_MOSTLY_Q5_1,     " 5.65G, +0.1062 ppl @ Llama-3-8B",  },
+    { "IQ2_XXS",  LLAMA_FTYPE_MOSTLY_IQ2_XXS,  " 2.06 bpw quantization",            },
+    { "IQ2_XS",   LLAMA_FTYPE_MOSTLY_IQ2_XS,   " 2.31 bpw quantization",            },
+    { "IQ2_S",    LLAMA_FTYPE_MOSTLY_IQ2_S,    " 2.5  bpw quantization",            },
+    { "IQ2_M",    LLAMA_FTYPE_MOSTLY_IQ2_M,    " 2.7  bpw quantization",            },
+    { "IQ1_S",    LLAMA_FTYPE_MOSTLY_IQ1_S,    " 1.56 bpw quantization",            },
+    { "IQ1_M",    LLAMA_FTYPE_MOSTLY_IQ1_M,    " 1.75 bpw quantization",            },
+    { "TQ1_0",    LLAMA_FTYPE_MOSTLY_TQ1_0,    " 1.69 bpw ternarization",           },
+    { "TQ2_0",    LLAMA_FTYPE_MOSTLY_TQ2_0,    " 2.06 bpw ternarization",           },
+    { "Q2_K",     LLAMA_FTYPE_MOSTLY_Q2_K,     " 2.96G, +3.5199 ppl @ Llama-3-8B",  },
+    { "Q2_K_S",   LLAMA_FTYPE_MOSTLY_Q2_K_S,   " 2.96G, +3.1836 ppl @ Llama-3-8B",  },
+    { "IQ3_XXS",  LLAMA_FTYPE_MOSTLY_IQ3_XXS,  " 3.06 bpw quantization",            },
+    { "IQ3_S",    LLAMA_FTYPE_MOSTLY_IQ3_S,    " 3.44 bpw quantization",            },
+    { "IQ3_M",    LLAMA_FTYPE_MOSTLY_IQ3_M,    " 3.66 bpw quantization mix",        },
+    { "Q3_K",     LLAMA_FTYPE_MOSTLY_Q3_K_M,   "alias for Q3_K_M"                   },
+    { "IQ3_XS",   LLAMA_FTYPE_MOSTLY_IQ3_XS,   " 3.3 bpw quantization",             },
+    { "Q3_K_S",   LLAMA_FTYPE_MOSTLY_Q3_K_S,   " 3.41G, +1.6321 ppl @ Llama-3-8B",  },
+    { "Q3_K_M",   LLAMA_FTYPE_MOSTLY_Q3_K_M,   " 3.74G, +0.6569 ppl @ Llama-3-8B",  },
+    { "Q3_K_L",   LLAMA_FTYPE_MOSTLY_Q3_K_L,   " 4.03G, +0.5562 ppl @ Llama-3-8B",  },
+    { "IQ4_NL",   LLAMA_FTYPE_MOSTLY_IQ4_NL,   " 4.50 bpw non-linear quantization", },
+    { "IQ4_XS",   LLAMA_FTYPE_MOSTLY_IQ4_XS,   " 4.25 bpw non-linear quantization", },
+    { "Q4_K",     LLAMA_FTYPE_MOSTLY_Q4_K_M,   "alias for Q4_K_M",                  },
+    { "Q4_K_S",   LLAMA_FTYPE_MOSTLY_Q4_K_S,   " 4.37G, +0.2689 ppl @ Llama-3-8B",  },
+    { "Q4_K_M",   LLAMA_FTYPE_MOSTLY_Q4_K_M,   " 4.58G, +0.1754 ppl @ Llama-3-8B",  },
+    { "Q5_K",     LLAMA_FTYPE_MOSTLY_Q5_K_M,   "alias for Q5_K_M",                  },
+    { "Q5_K_S",   LLAMA_FTYPE_MOSTLY_Q5_K_S,   " 5.21G, +0.1049 ppl @ Llama-3-8B",  },
+    { "Q5_K_M",   LLAMA_FTYPE_MOSTLY_Q5_K_M,   " 5.33G, +0.0569 ppl @ Llama-3-8B",  },
+    { "Q6_K",     LLAMA_FTYPE_MOSTLY_Q6_K,     " 6.14G, +0.0217 ppl @ Llama-3-8B",  },
+    { "Q8_0",     LLAMA_FTYPE_MOSTLY_Q8_0,     " 7.96G, +0.0026 ppl @ Llama-3-8B",  },
+    { "F16",      LLAMA_FTYPE_MOSTLY_F16,      "14.00G, +0.0020 ppl @ Mistral-7B",  },
+    { "BF16",     LLAMA_FTYPE_MOSTLY_BF16,     "14.00G, -0.0050 ppl @ Mistral-7B",  },
+    { "F32",      LLAMA_FTYPE_ALL_F32,         "26.00G              @ 7B",          },
+    // Note: Ensure COPY comes after F32 to avoid ftype 0 from matching.
+    { "COPY",     LLAMA_FTYPE_ALL_F32,         "only copy tensors, no quantizing",  },
+};
+
+static bool try_parse_ftype(const std::string & ftype_str_in, llama_ftype & ftype, std::string & ftype_str_out) {
+    std::string ftype_str;
+
+    for (auto ch : ftype_str_in) {
+        ftype_str.push_back(std::toupper(ch));
+    }
+    for (const auto & it : QUANT_OPTIONS) {
+        if (it.name == ftype_str) {
+            ftype = it.ftype;
+            ftype_str_out = it.name;
+            return true;
+        }
+    }
+    try {
+        int ftype_int = std::stoi(ftype_str);
+        for (const auto & it : QUANT_OPTIONS) {
+            if (it.ftype == ftype_int) {
+                ftype = it.ftype;
+                ftype_str_out = it.name;
+                return true;
+            }
+        }
+    }
+    catch (...) {
+        // stoi failed
+    }
+    return false;
+}
+
+// Quantize tool name of a GGUF general.file_type value, e.g. "Q4_K_M".
+static std::string ftype_name(uint32_t ftype) {
+    ftype &= ~(uint32_t) LLAMA_FTYPE_GUESSED;
+    for (const auto & it : QUANT_OPTIONS) {
+        if ((uint32_t) it.ftype == ftype && it.desc.rfind("alias", 0) != 0) {
+            return it.name;
+        }
+    }
+    return "";
+}
+
+static std::string gguf_get_string(const gguf_context * gctx, const std::string & key) {
+    const int64_t id = gguf_find_key(gctx, key.c_str());
+    if (id < 0 || gguf_get_kv_type(gctx, id) != GGUF_TYPE_STRING) {
+        return "";
+    }
+    return gguf_get_val_str(gctx, id);
+}
+
+static int64_t gguf_get_integer(const gguf_context * gctx, const std::string & key, int64_t default_value) {
+    const int64_t id = gguf_find_key(gctx, key.c_str());
+    if (id < 0) {
+        return default_value;
+    }
+    switch (gguf_get_kv_type(gctx, id)) {
+        case GGUF_TYPE_UINT8:  return gguf_get_val_u8(gctx, id);
+        case GGUF_TYPE_INT8:   return gguf_get_val_i8(gctx, id);
+        case GGUF_TYPE_UINT16: return gguf_get_val_u16(gctx, id);
+        case GGUF_TYPE_INT16:  return gguf_get_val_i16(gctx, id);
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(gctx, id);
+        case GGUF_TYPE_INT32:  return gguf_get_val_i32(gctx, id);
+        case GGUF_TYPE_UINT64: return (int64_t) gguf_get_val_u64(gctx, id);
+        case GGUF_TYPE_INT64:  return gguf_get_val_i64(gctx, id);
+        default:               return default_value;
+    }
+}
+
+// Reads the GGUF header of `path` without loading tensor data. Tensor shapes
+// are only materialized as metadata (no_alloc) to sum the parameter count.
+// GGUF strings and file names are not guaranteed UTF-8, so invalid bytes are
+// dumped as U+FFFD instead of throwing.
+static std::string read_model_metadata(const std::string & path) {
+    json out;
+    out["path"] = path;
+    out["file_size"] = page_cache_file_size(path.c_str());
+
+    ggml_context * meta = nullptr;
+    gguf_init_params params = { /*no_alloc*/ true, /*ctx*/ &meta };
+    gguf_context * gctx = gguf_init_from_file(path.c_str(), params);
+    if (!gctx) {
+        out["error"] = "not a readable GGUF file";
+        return out.dump(-1, ' ', false, json::error_handler_t::replace);
+    }
+
+    const std::string arch = gguf_get_string(gctx, "general.architecture");
+    int64_t n_params = 0;
+    if (meta) {
+        for (ggml_tensor * t = ggml_get_first_tensor(meta); t; t = ggml_get_next_tensor(meta, t)) {
+            n_params += ggml_nelements(t);
+        }
+        ggml_free(meta);
+    }
+
+    const int64_t file_type = gguf_get_integer(gctx, "general.file_type", -1);
+    const int64_t tokens_id = gguf_find_key(gctx, "tokenizer.ggml.tokens");
+
+    out["architecture"]     = arch;
+    out["name"]             = gguf_get_string(gctx, "general.name");
+    out["parameter_count"]  = n_params;
+    out["context_length"]   = gguf_get_integer(gctx, arch + ".context_length", 0);
+    out["embedding_length"] = gguf_get_integer(gctx, arch + ".embedding_length", 0);
+    out["block_count"]      = gguf_get_integer(gctx, arch + ".block_count", 0);
+    out["vocab_size"]       = tokens_id >= 0 ? (int64_t) gguf_get_arr_n(gctx, tokens_id) : 0;
+    out["file_type"]        = file_type;
+    out["quantization"]     = file_type >= 0 ? ftype_name((uint32_t) file_type) : "";
+    out["n_tensors"]        = gguf_get_n_tensors(gctx);
+    out["chat_template"]    = gguf_get_string(gctx, "tokenizer.chat_template");
+    gguf_free(gctx);
+    return out.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+static model_scan_cache & model_metadata_cache() {
+    static auto * cache = new model_scan_cache();
+    return *cache;
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_scan_1model_1metadata(JNIEnv *env, jobject, jstring jpath) {
+    const std::string path = jstring_to_string(env, jpath);
+    std::string payload = model_metadata_cache().get(path, read_model_metadata);
+    if (payload.empty()) {
+        payload = json{{"path", path}, {"error", "file not found"}}.dump(-1, ' ', false, json::error_handler_t::replace);
+    }
+    return env->NewStringUTF(payload.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_scan_1model_1dir(JNIEnv *env, jobject, jstring jdir, jint n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+    const std::string dir = jstring_to_string(env, jdir);
+    const auto files = model_scan_list_dir(dir, ".gguf");
+    if (n_threads <= 0) {
+        n_threads = (jint) std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    json models = json::array();
+    for (const auto & payload : model_scan_files(model_metadata_cache(), files, read_model_metadata, n_threads)) {
+        if (!payload.empty()) {
+            models.push_back(json::parse(payload));
+        }
+    }
+    LOGi("scanned %zu models in %s in %.2f ms", files.size(), dir.c_str(), (ggml_time_us() - t_start_us) / 1000.0);
+    return env->NewStringUTF(models.dump(-1, ' ', false, json::error_handler_t::replace).c_str());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_quantizeNative(
+        JNIEnv *env,
+        jobject,
+        jstring jinputPath,
+        jstring joutputPath,
+        jstring jquantizeType
+) {
+    const std::string inputPath = jstring_to_string(env, jinputPath);
+    const std::string outputPath = jstring_to_string(env, joutputPath);
+    const std::string quantizeType = jstring_to_string(env, jquantizeType);
+
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    std::string ftype_str;
+    if (!try_parse_ftype(quantizeType, params.ftype, ftype_str)) {
+        return -1;
+    }
+    params.nthread = cpu_performance_core_count();
+
+    return llama_model_quantize(inputPath.c_str(), outputPath.c_str(), &params);
+}
+
+// Must match tensor_quantization in llama-quant.cpp, which receives it through
+// llama_model_quantize_params::tensor_types.
+struct tensor_quantization {
+    std::string name;
+    ggml_type   quant = GGML_TYPE_COUNT;
+};
+
+// Case-insensitive lookup of a ggml type name such as "q8_0" or "Q6_K".
+static bool try_parse_ggml_type(const std::string & name, ggml_type & type) {
+    auto lower = [](std::string str) {
+        for (auto & ch : str) ch = (char) std::tolower((unsigned char) ch);
+        return str;
+    };
+    const std::string wanted = lower(name);
+    for (int i = 0; i < GGML_TYPE_COUNT; ++i) {
+        const char * type_name = ggml_type_name((ggml_type) i);
+        if (type_name && lower(type_name) == wanted) {
+            type = (ggml_type) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// GGUF imatrix files store per-matrix summed squared activations (<name>.in_sum2)
+// and call counts (<name>.counts); llama-quantize expects their ratio.
+static bool load_gguf_imatrix(const std::string & path, std::unordered_map<std::string, std::vector<float>> & out,
+                              std::string & error) {
+    ggml_context * data_ctx = nullptr;
+    gguf_init_params params = { /*no_alloc*/ false, /*ctx*/ &data_ctx };
+    gguf_context * gctx = gguf_init_from_file(path.c_str(), params);
+    if (!gctx) {
+        error = "cannot read imatrix " + path;
+        return false;
+    }
+    const std::string sums_suffix = ".in_sum2";
+    for (int64_t i = 0; i < gguf_get_n_tensors(gctx); ++i) {
+        const std::string name = gguf_get_tensor_name(gctx, i);
+        if (name.size() <= sums_suffix.size() ||
+            name.compare(name.size() - sums_suffix.size(), sums_suffix.size(), sums_suffix) != 0) {
+            continue;
+        }
+        const std::string base = name.substr(0, name.size() - sums_suffix.size());
+        const ggml_tensor * sums = ggml_get_tensor(data_ctx, name.c_str());
+        const ggml_tensor * counts = ggml_get_tensor(data_ctx, (base + ".counts").c_str());
+        if (!sums || !counts || sums->type != GGML_TYPE_F32 || counts->type != GGML_TYPE_F32) {
+            continue;
+        }
+        const int64_t ne0 = sums->ne[0];
+        const int64_t ne1 = sums->ne[1];
+        const auto * s = (const float *) sums->data;
+        const auto * c = (const float *) counts->data;
+        auto & values = out[base];
+        values.resize(ne0 * ne1);
+        for (int64_t j = 0; j < ne1; ++j) {
+            for (int64_t k = 0; k < ne0; ++k) {
+                // a matrix that saw no calibration input gets neutral weights
+                values[j*ne0 + k] = c[j] > 0.0f ? s[j*ne0 + k] / c[j] : 1.0f;
+            }
+        }
+    }
+    gguf_free(gctx);
+    ggml_free(data_ctx);
+    if (out.empty()) {
+        error = "no imatrix entries in " + path;
+        return false;
+    }
+    return true;
+}
+
+static bool load_imatrix(const std::string & path, std::unordered_map<std::string, std::vector<float>> & out,
+                         std::string & error) {
+    char magic[4] = {0};
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) {
+        error = "cannot open imatrix " + path;
+        return false;
+    }
+    const bool is_gguf = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, "GGUF", 4) == 0;
+    fclose(f);
+    return is_gguf ? load_gguf_imatrix(path, out, error) : load_legacy_imatrix(path, out, &error);
+}
+
+enum quantize_state { QUANTIZE_RUNNING, QUANTIZE_DONE, QUANTIZE_FAILED, QUANTIZE_CANCELLED };
+
+struct quantize_cancelled : std::runtime_error {
+    quantize_cancelled() : std::runtime_error("quantization cancelled") {}
+};
+
+// A quantization running on its own native thread. Progress is scraped from the
+// per-tensor log lines of llama_model_quantize, which has no progress callback.
+struct quantize_job {
+    std::string input;
+    std::string output;
+    std::string imatrix_path;
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    std::unordered_map<std::string, std::vector<float>> imatrix;
+    std::vector<tensor_quantization> tensor_types;
+
+    std::atomic<int>  state{QUANTIZE_RUNNING};
+    std::atomic<int>  tensors_done{0};
+    std::atomic<int>  tensors_total{0};
+    std::atomic<bool> cancel{false};
+    const std::atomic<bool> * parent_cancel = nullptr;   // set when run as part of a quant sweep
+    std::atomic<long long> t_end_us{0};
+    long long         t_start_us = 0;
+    int               result = -1;
+
+    std::mutex        mutex;     // guards the strings below
+    std::string       tensor;
+    std::string       error;
+
+    std::thread       worker;
+};
+
+static void quantize_job_on_log(quantize_job * job, const char * text) {
+    quantize_log_line line;
+    if (!parse_quantize_log_line(text, line)) {
+        return;
+    }
+    job->tensors_total.store(line.total, std::memory_order_relaxed);
+    job->tensors_done.store(line.index - 1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->tensor = line.tensor;
+    }
+    // only thrown between tensors, when no quantization worker threads are running
+    if (job->parent_cancel && job->parent_cancel->load(std::memory_order_relaxed)) {
+        job->cancel = true;
+    }
+    if (job->cancel.load(std::memory_order_relaxed)) {
+        throw quantize_cancelled();
+    }
+}
+
+static void run_quantize_job(quantize_job * job) {
+    std::string error;
+    if (!job->imatrix_path.empty() && !load_imatrix(job->imatrix_path, job->imatrix, error)) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->error = error;
+        job->t_end_us = ggml_time_us();
+        job->state = QUANTIZE_FAILED;
+        return;
+    }
+    if (!job->imatrix.empty()) {
+        job->params.imatrix = &job->imatrix;
+    }
+    if (!job->tensor_types.empty()) {
+        job->params.tensor_types = &job->tensor_types;
+    }
+
+    LOGi("quantize %s -> %s with %d threads", job->input.c_str(), job->output.c_str(), job->params.nthread);
+    t_quantize_job = job;
+    job->result = (int) llama_model_quantize(job->input.c_str(), job->output.c_str(), &job->params);
+    t_quantize_job = nullptr;
+
+    job->t_end_us = ggml_time_us();
+    if (job->cancel.load()) {
+        unlink(job->output.c_str());
+        job->state = QUANTIZE_CANCELLED;
+    } else if (job->result == 0) {
+        job->tensors_done.store(job->tensors_total.load());
+        job->state = QUANTIZE_DONE;
+    } else {
+        unlink(job->output.c_str());
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->error = "llama_model_quantize() returned " + std::to_string(job->result);
+        job->state = QUANTIZE_FAILED;
+    }
+    LOGi("quantize finished in %.1f s, state %d", (job->t_end_us - job->t_start_us) / 1e6, job->state.load());
+}
+
+// Options (all optional): n_threads (0 = performance cores), imatrix (path),
+// keep_output_high_precision, output_tensor_type, token_embedding_type,
+// tensor_types (["pattern=type", ...]), allow_requantize, pure.
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_quantize_1start(
+        JNIEnv *env, jobject, jstring jinput, jstring joutput, jstring jtype, jstring joptions) {
+    auto job = std::make_unique<quantize_job>();
+    job->input  = jstring_to_string(env, jinput);
+    job->output = jstring_to_string(env, joutput);
+
+    auto fail = [&](const std::string & msg) -> jlong {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), msg.c_str());
+        return 0;
+    };
+
+    std::string ftype_str;
+    if (!try_parse_ftype(jstring_to_string(env, jtype), job->params.ftype, ftype_str)) {
+        return fail("unknown quantization type");
+    }
+
+    json options;
+    try {
+        const std::string options_str = joptions ? jstring_to_string(env, joptions) : "";
+        options = options_str.empty() ? json::object() : json::parse(options_str);
+    } catch (const std::exception & e) {
+        return fail(e.what());
+    }
+
+    const int n_threads = json_value(options, "n_threads", 0);
+    job->params.nthread          = n_threads > 0 ? n_threads : cpu_performance_core_count();
+    job->params.allow_requantize = json_value(options, "allow_requantize", false);
+    job->params.pure             = json_value(options, "pure", false);
+    job->imatrix_path            = json_value(options, "imatrix", std::string());
+
+    // output.weight and token_embd.weight dominate quality loss at low bit widths
+    const bool high_precision_target = job->params.ftype == LLAMA_FTYPE_MOSTLY_Q8_0 ||
+                                       job->params.ftype == LLAMA_FTYPE_MOSTLY_F16 ||
+                                       job->params.ftype == LLAMA_FTYPE_MOSTLY_BF16 ||
+                                       job->params.ftype == LLAMA_FTYPE_ALL_F32;
+    if (json_value(options, "keep_output_high_precision", false) && !high_precision_target) {
+        job->params.output_tensor_type    = GGML_TYPE_Q8_0;
+        job->params.token_embedding_type  = GGML_TYPE_Q8_0;
+    }
+    const std::string output_type = json_value(options, "output_tensor_type", std::string());
+    if (!output_type.empty() && !try_parse_ggml_type(output_type, job->params.output_tensor_type)) {
+        return fail("unknown output_tensor_type " + output_type);
+    }
+    const std::string embd_type = json_value(options, "token_embedding_type", std::string());
+    if (!embd_type.empty() && !try_parse_ggml_type(embd_type, job->params.token_embedding_type)) {
+        return fail("unknown token_embedding_type " + embd_type);
+    }
+    for (const auto & spec : json_value(options, "tensor_types", json::array())) {
+        std::string pattern, type_name;
+        tensor_quantization tq;
+        if (!spec.is_string() || !parse_tensor_type_override(spec.get<std::string>(), pattern, type_name) ||
+            !try_parse_ggml_type(type_name, tq.quant)) {
+            return fail("bad tensor type override " + spec.dump());
+        }
+        tq.name = pattern;
+        job->tensor_types.push_back(tq);
+    }
+
+    ensure_backends_initialized();
+    job->t_start_us = ggml_time_us();
+    quantize_job * raw = job.release();
+    raw->worker = std::thread(run_quantize_job, raw);
+    return reinterpret_cast<jlong>(raw);
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_quantize_1poll(JNIEnv *env, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quantize_job *>(jjob);
+    if (job == nullptr) {
+        return env->NewStringUTF("{}");
+    }
+    static const char * state_names[] = { "running", "done", "failed", "cancelled" };
+    const int state = job->state.load();
+    const int done  = job->tensors_done.load(std::memory_order_relaxed);
+    const int total = job->tensors_total.load(std::memory_order_relaxed);
+    const long long t_end = job->t_end_us.load();
+
+    json out;
+    out["state"]         = state_names[state];
+    out["tensors_done"]  = done;
+    out["tensors_total"] = total;
+    out["progress"]      = total > 0 ? (double) done / total : 0.0;
+    out["elapsed_ms"]    = ((t_end > 0 ? t_end : ggml_time_us()) - job->t_start_us) / 1000;
+    out["n_threads"]     = job->params.nthread;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        out["tensor"] = job->tensor;
+        if (!job->error.empty()) out["error"] = job->error;
+    }
+    if (state != QUANTIZE_RUNNING) {
+        out["result"] = job->result;
+    }
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_quantize_1cancel(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quantize_job *>(jjob);
+    if (job) {
+        job->cancel = true;
+    }
+}
+
+// Cancels the job if it is still running, waits for the worker and frees the job.
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_quantize_1free(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quantize_job *>(jjob);
+    if (job == nullptr) {
+        return;
+    }
+    job->cancel = true;
+    if (job->worker.joinable()) {
+        job->worker.join();
+    }
+    delete job;
+}
+
+// Quant sweep: quantizes one source model into several types in a scratch directory
+// and measures each result on this device (size, load time, pp/tg speed, perplexity).
+struct quant_sweep_job {
+    std::string source;
+    std::string scratch_dir;
+    std::string sample;
+    std::vector<std::string> types;
+    int  n_threads  = 0;
+    int  n_pp       = 128;
+    int  n_tg       = 32;
+    bool keep_files = false;
+
+    std::atomic<int>  state{QUANTIZE_RUNNING};
+    std::atomic<bool> cancel{false};
+    std::atomic<long long> t_end_us{0};
+    long long         t_start_us = 0;
+
+    std::mutex        mutex;     // guards everything below
+    int               index = 0;
+    std::string       phase;
+    quantize_job *    active_quant = nullptr;
+    std::vector<quant_sweep_entry> results;
+
+    std::thread       worker;
+};
+
+static void set_sweep_phase(quant_sweep_job * job, int index, const char * phase) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->index = index;
+    job->phase = phase;
+}
+
+// Loads a quantized model and fills the timing and perplexity fields of `entry`.
+// Perplexity is computed like llama-perplexity: 256-token windows starting with
+// BOS, scoring only the second half of each window so every token has context.
+static bool evaluate_quantized_model(const std::string & path, quant_sweep_job * job, quant_sweep_entry & entry) {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = resolve_gpu_layers(g_user_gpu_layers);
+    const auto t_load = ggml_time_us();
+    llama_model * model = llama_model_load_from_file(path.c_str(), mparams);
+    entry.load_ms = (ggml_time_us() - t_load) / 1000.0;
+    if (!model) {
+        entry.error = "load failed";
+        return false;
+    }
+
+    const int n_window = 256;
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 512;
+    cparams.n_batch         = 512;
+    cparams.n_threads       = job->n_threads;
+    cparams.n_threads_batch = job->n_threads;
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    if (!ctx) {
+        llama_model_free(model);
+        entry.error = "context creation failed";
+        return false;
+    }
+    g_active_contexts.fetch_add(1, std::memory_order_relaxed);
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const auto tokens = common_tokenize(ctx, job->sample, true, false);
+    llama_batch batch = llama_batch_init(cparams.n_batch, 0, 1);
+    auto * mem = llama_get_memory(ctx);
+    bool ok = (int) tokens.size() > n_window / 2;
+    if (!ok) {
+        entry.error = "sample text too short";
+    }
+
+    // prompt processing: one batch of sample tokens
+    if (ok) {
+        const int n_pp = std::min<int>({ job->n_pp, (int) tokens.size(), (int) cparams.n_batch });
+        common_batch_clear(batch);
+        for (int i = 0; i < n_pp; ++i) {
+            common_batch_add(batch, tokens[i], i, { 0 }, i == n_pp - 1);
+        }
+        llama_memory_clear(mem, true);
+        const auto t_pp = ggml_time_us();
+        ok = llama_decode(ctx, batch) == 0;
+        entry.pp_tps = n_pp / ((ggml_time_us() - t_pp) / 1e6);
+    }
+
+    // text generation: single-token decodes
+    if (ok) {
+        llama_memory_clear(mem, true);
+        const auto t_tg = ggml_time_us();
+        int n_tg = 0;   // decoded; fewer than job->n_tg when cancelled
+        for (int i = 0; i < job->n_tg && ok && !job->cancel.load(); ++i) {
+            common_batch_clear(batch);
+            common_batch_add(batch, tokens[i % tokens.size()], i, { 0 }, true);
+            ok = llama_decode(ctx, batch) == 0;
+            if (ok) n_tg++;
+        }
+        entry.tg_tps = n_tg > 0 ? n_tg / ((ggml_time_us() - t_tg) / 1e6) : 0.0;
+    }
+
+    // perplexity over the sample
+    double nll = 0.0;
+    int n_scored = 0;
+    const int n_windows = std::max<int>(1, (int) tokens.size() / n_window);
+    const int window = std::min<int>(n_window, (int) tokens.size());
+    for (int w = 0; ok && w < n_windows && !job->cancel.load(); ++w) {
+        const int start = w * window;
+        common_batch_clear(batch);
+        for (int i = 0; i < window; ++i) {
+            llama_token t = tokens[start + i];
+            if (i == 0 && llama_vocab_get_add_bos(vocab)) {
+                t = llama_vocab_bos(vocab);
+            }
+            common_batch_add(batch, t, i, { 0 }, i >= window / 2 - 1);
+        }
+        llama_memory_clear(mem, true);
+        ok = llama_decode(ctx, batch) == 0;
+        for (int i = window / 2 - 1; ok && i < window - 1; ++i) {
+            nll += token_nll(llama_get_logits_ith(ctx, i), n_vocab, tokens[start + i + 1]);
+            n_scored++;
+        }
+    }
+    if (ok && n_scored > 0) {
+        entry.perplexity = std::exp(nll / n_scored);
+    } else if (entry.error.empty()) {
+        entry.error = job->cancel.load() ? "cancelled" : "llama_decode() failed";
+        ok = false;
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    g_active_contexts.fetch_sub(1, std::memory_order_relaxed);
+    llama_model_free(model);
+    return ok;
+}
+
+static void run_quant_sweep(quant_sweep_job * job) {
+    mkdir(job->scratch_dir.c_str(), 0755);
+    std::string base = job->source.substr(job->source.find_last_of('/') + 1);
+    base = base.substr(0, base.rfind(".gguf"));
+
+    for (size_t i = 0; i < job->types.size() && !job->cancel.load(); ++i) {
+        quant_sweep_entry entry;
+        entry.type = job->types[i];
+        const std::string out_path = job->scratch_dir + "/" + base + "-" + entry.type + ".gguf";
+
+        auto quant = std::make_unique<quantize_job>();
+        quant->input = job->source;
+        quant->output = out_path;
+        quant->params.nthread = job->n_threads;
+        quant->parent_cancel = &job->cancel;
+        quant->t_start_us = ggml_time_us();
+        std::string ftype_str;
+        try_parse_ftype(entry.type, quant->params.ftype, ftype_str);   // validated in quant_sweep_start
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->index = (int) i;
+            job->phase = "quantize";
+            job->active_quant = quant.get();
+        }
+        run_quantize_job(quant.get());
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->active_quant = nullptr;
+        }
+        if (quant->state == QUANTIZE_CANCELLED) {
+            break;
+        }
+
+        if (quant->state == QUANTIZE_DONE) {
+            entry.file_bytes = page_cache_file_size(out_path.c_str());
+            set_sweep_phase(job, (int) i, "evaluate");
+            entry.ok = evaluate_quantized_model(out_path, job, entry);
+            if (!job->keep_files) {
+                unlink(out_path.c_str());
+            }
         } else {
-            // Default to Qwen3 template for unknown formats
-            template_content = R"(
-{%- if tools %}
- {{- '<|im_start|>system\n' }}
- {%- if messages[0].role == 'system' %}
- {{- messages[0].content + '\n\n' }}
- {%- endif %}
- {{- "# Tools\n\nYou may call one or more functions to assist with the user query.\n\nYou are provided with function signatures within <tools></tools> XML tags:\n<tools>" }}
- {%- for tool in tools %}
- {{- "\n" }}
- {{- tool | tojson }}
- {%- endfor %}
- {{- "\n</tools>\n\nFor each function call, return a json object with function name and arguments within <tool_call></tool_call> XML tags:\n<tool_call>\n{\"name\": <function-name>, \"arguments\": <args-json-object>}\n</tool_call><|im_end|>\n" }}
-{%- else %}
-{%- if messages[0].role == 'system' %}
- {{- '<|im_start|>system\n' + messages[0].content + '<|im_end|>\n' }}
- {%- endif %}
-{%- endif %}
-{%- set ns = namespace(multi_step_tool=true, last_query_index=messages|length - 1) %}
-{%- for message in messages[::-1] %}
- {%- set index = (messages|length - 1) - loop.index0 %}
- {%- set tool_start = "<tool_response>" %}
- {%- set tool_start_length = tool_start|length %}
- {%- set start_of_message = message.content[:tool_start_length] %}
- {%- set tool_end = "</tool_response>" %}
- {%- set tool_end_length = tool_end|length %}
- {%- set start_pos = (message.content|length) - tool_end_length %}
- {%- if start_pos < 0 %}
- {%- set start_pos = 0 %}
- {%- endif %}
- {%- set end_of_message = message.content[start_pos:] %}
- {%- if ns.multi_step_tool and message.role == "user" and not(start_of_message == tool_start and end_of_message == tool_end) %}
- {%- set ns.multi_step_tool = false %}
- {%- set ns.last_query_index = index %}
- {%- endif %}
-{%- endfor %}
-{%- for message in messages %}
- {%- if (message.role == "user") or (message.role == "system" and not loop.first) %}
- {{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
- {%- elif message.role == "assistant" %}
- {%- set content = message.content %}
- {%- set reasoning_content = '' %}
- {%- if message.reasoning_content is defined and message.reasoning_content is not none %}
- {%- set reasoning_content = message.reasoning_content %}
- {%- else %}
- {%- if '</think>' in message.content %}
- {%- set content = (message.content.split('</think>')|last).lstrip('\n') %}
-{%- set reasoning_content = (message.content.split('</think>')|first).rstrip('\n') %}
-{%- set reasoning_content = (reasoning_content.split('<think>')|last).lstrip('\n') %}
- {%- endif %}
- {%- endif %}
- {%- if loop.index0 > ns.last_query_index %}
- {%- if loop.last or (not loop.last and reasoning_content) %}
- {{- '<|im_start|>' + message.role + '\n<think>\n' + reasoning_content.strip('\n') + '\n</think>\n\n' + content.lstrip('\n') }}
- {%- else %}
- {{- '<|im_start|>' + message.role + '\n' + content }}
- {%- endif %}
- {%- else %}
- {{- '<|im_start|>' + message.role + '\n' + content }}
- {%- endif %}
- {%- if message.tool_calls %}
- {%- for tool_call in message.tool_calls %}
- {%- if (loop.first and content) or (not loop.first) %}
- {{- '\n' }}
- {%- endif %}
- {%- if tool_call.function %}
- {%- set tool_call = tool_call.function %}
- {%- endif %}
- {{- '<tool_call>\n{"name": "' }}
- {{- tool_call.name }}
- {{- '", "arguments": ' }}
- {%- if tool_call.arguments is string %}
- {{- tool_call.arguments }}
- {%- else %}
- {{- tool_call.arguments | tojson }}
- {%- endif %}
- {{- '}\n</tool_call>' }}
- {%- endfor %}
- {%- endif %}
- {{- '<|im_end|>\n' }}
- {%- elif message.role == "tool" %}
- {%- if loop.first or (messages[loop.index0 - 1].role != "tool") %}
- {{- '<|im_start|>user' }}
- {%- endif %}
- {{- '\n<tool_response>\n' }}
- {{- message.content }}
- {{- '\n</tool_response>' }}
- {%- if loop.last or (messages[loop.index0 + 1].role != "tool") %}
- {{- '<|im_end|>\n' }}
- {%- endif %}
-{%- endif %}
-{%- endfor %}
-{%- if add_generation_prompt %}
- {{- '<|im_start|>assistant\n' }}
- {%- if enable_thinking is defined and enable_thinking is false %}
- {{- '<think>\n\n</think>\n\n' }}
- {%- endif %}
-{%- endif %}
-)";
-            LOGi("Using default Qwen3 template for format: %s", chatFormatStr_cpp.c_str());
+            entry.error = quant->error;
         }
-        
-        const auto formattedPrompts = format_chat(model_ptr, template_content, jsonMessages);
-        
-        LOGi("Template content length: %zu", template_content.length());
-        LOGi("Formatted prompt length: %zu", formattedPrompts.length());
-        LOGi("Formatted prompt preview: %s", formattedPrompts.substr(0, 200).c_str());
+        LOGi("quant sweep %s: %.1f MiB, load %.0f ms, pp %.2f t/s, tg %.2f t/s, ppl %.4f %s",
+             entry.type.c_str(), entry.file_bytes / 1024.0 / 1024.0, entry.load_ms, entry.pp_tps, entry.tg_tps,
+             entry.perplexity, entry.error.c_str());
 
-        return env->NewStringUTF(formattedPrompts.c_str());
-    } catch (const std::exception &e) {
-        LOGe("Error processing data: %s", e.what());
-        return env->NewStringUTF("");
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->results.push_back(entry);
+        mark_pareto_front(job->results);
     }
+
+    job->t_end_us = ggml_time_us();
+    job->state = job->cancel.load() ? QUANTIZE_CANCELLED : QUANTIZE_DONE;
+    set_sweep_phase(job, (int) job->types.size(), "");
 }
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1eot_1str(JNIEnv *env, jobject , jlong jmodel) {
-    auto model = reinterpret_cast<llama_model *>(jmodel);
-    const auto eot = llama_vocab_eot(llama_model_get_vocab(model));
 
-    if (eot == -1){
-        std::string piece = "<|im_end|>";
-        return env->NewStringUTF(piece.c_str());
+// Options (all optional): n_threads (0 = performance cores), n_pp, n_tg, keep_files.
+// An empty `types` array sweeps Q4_0, Q4_K_M, Q5_K_M, Q6_K and Q8_0; a null or
+// empty sample uses the bundled QUANT_SWEEP_SAMPLE text.
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_quant_1sweep_1start(
+        JNIEnv *env, jobject, jstring jsource, jstring jscratch_dir, jobjectArray jtypes, jstring jsample, jstring joptions) {
+    auto job = std::make_unique<quant_sweep_job>();
+    job->source      = jstring_to_string(env, jsource);
+    job->scratch_dir = jstring_to_string(env, jscratch_dir);
+    job->sample      = jsample ? jstring_to_string(env, jsample) : "";
+    if (job->sample.empty()) {
+        job->sample = QUANT_SWEEP_SAMPLE;
+    }
+
+    const jsize n_types = jtypes ? env->GetArrayLength(jtypes) : 0;
+    for (jsize i = 0; i < n_types; ++i) {
+        LocalRef<jstring> jtype(env, (jstring) env->GetObjectArrayElement(jtypes, i));
+        llama_ftype ftype;
+        std::string name;
+        if (!jtype.get() || !try_parse_ftype(jstring_to_string(env, jtype.get()), ftype, name) || name == "COPY") {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "unknown quantization type");
+            return 0;
+        }
+        job->types.push_back(name);
+    }
+    if (job->types.empty()) {
+        job->types = { "Q4_0", "Q4_K_M", "Q5_K_M", "Q6_K", "Q8_0" };
+    }
+
+    json options;
+    try {
+        const std::string options_str = joptions ? jstring_to_string(env, joptions) : "";
+        options = options_str.empty() ? json::object() : json::parse(options_str);
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return 0;
+    }
+    const int n_threads = json_value(options, "n_threads", 0);
+    job->n_threads  = n_threads > 0 ? n_threads : cpu_performance_core_count();
+    job->n_pp       = std::max(1, json_value(options, "n_pp", job->n_pp));
+    job->n_tg       = std::max(1, json_value(options, "n_tg", job->n_tg));
+    job->keep_files = json_value(options, "keep_files", false);
+
+    ensure_backends_initialized();
+    job->t_start_us = ggml_time_us();
+    quant_sweep_job * raw = job.release();
+    raw->worker = std::thread(run_quant_sweep, raw);
+    return reinterpret_cast<jlong>(raw);
+}
+
+static json quant_sweep_entry_json(const quant_sweep_entry & e) {
+    json j;
+    j["type"]       = e.type;
+    j["ok"]         = e.ok;
+    j["file_bytes"] = e.file_bytes;
+    j["load_ms"]    = e.load_ms;
+    j["pp_tps"]     = e.pp_tps;
+    j["tg_tps"]     = e.tg_tps;
+    j["perplexity"] = e.perplexity;
+    j["pareto"]     = e.pareto;
+    if (!e.error.empty()) j["error"] = e.error;
+    return j;
+}
+
+// Progress and results so far; `table` is the markdown Pareto table.
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_quant_1sweep_1poll(JNIEnv *env, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quant_sweep_job *>(jjob);
+    if (job == nullptr) {
+        return env->NewStringUTF("{}");
+    }
+    static const char * state_names[] = { "running", "done", "failed", "cancelled" };
+    const long long t_end = job->t_end_us.load();
+
+    json out;
+    out["state"]      = state_names[job->state.load()];
+    out["elapsed_ms"] = ((t_end > 0 ? t_end : ggml_time_us()) - job->t_start_us) / 1000;
+    out["n_types"]    = job->types.size();
+    std::lock_guard<std::mutex> lock(job->mutex);
+    out["index"] = job->index;
+    out["type"]  = job->index < (int) job->types.size() ? job->types[job->index] : "";
+    out["phase"] = job->phase;
+    if (job->active_quant) {
+        const int total = job->active_quant->tensors_total.load(std::memory_order_relaxed);
+        const int done  = job->active_quant->tensors_done.load(std::memory_order_relaxed);
+        out["quantize_progress"] = total > 0 ? (double) done / total : 0.0;
+    }
+    json results = json::array();
+    for (const auto & e : job->results) {
+        results.push_back(quant_sweep_entry_json(e));
+    }
+    out["results"] = results;
+    out["table"]   = quant_sweep_table(job->results);
+    return env->NewStringUTF(out.dump().c_str());
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_quant_1sweep_1cancel(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quant_sweep_job *>(jjob);
+    if (job) {
+        job->cancel = true;
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_quant_1sweep_1free(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<quant_sweep_job *>(jjob);
+    if (job == nullptr) {
+        return;
+    }
+    job->cancel = true;
+    if (job->worker.joinable()) {
+        job->worker.join();
+    }
+    delete job;
+}
+
+// Pooling, normalization and truncation of the contexts made by new_embeddings_ctx.
+static std::mutex g_embedding_opts_mutex;
+static std::unordered_map<const llama_context *, embedding_options> g_embedding_opts;
+
+// {"pooling": "model"|"none"|"mean"|"cls"|"last", "normalize": bool, "dim": int}; missing
+// keys keep their defaults. Throws std::invalid_argument on bad values.
+static embedding_options parse_embedding_options(const std::string & text) {
+    embedding_options opts;
+    if (text.empty()) {
+        return opts;
+    }
+    const json body = json::parse(text);
+    const std::string pooling = json_value(body, "pooling", std::string("model"));
+    if (!parse_embedding_pooling(pooling, opts.pooling)) {
+        throw std::invalid_argument("unknown pooling " + pooling);
+    }
+    opts.normalize = json_value(body, "normalize", opts.normalize);
+    opts.dim = json_value(body, "dim", opts.dim);
+    if (opts.dim < 0) {
+        throw std::invalid_argument("dim must be >= 0");
+    }
+    return opts;
+}
+
+// Encoder-style context of the embeddings, rerank and index paths: `n_seq_max` sequences
+// in a unified KV cache of `n_ctx` tokens. A pooled sequence must sit in one ubatch, so the
+// batch covers the whole context. With `require_rank`, a model whose pooling is not RANK is
+// rejected: null with `error` set.
+static llama_context * new_encoder_ctx(const llama_model * model, int n_ctx, int n_seq_max, int n_threads,
+                                       enum llama_pooling_type pooling, bool require_rank = false,
+                                       const char ** error = nullptr) {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.embeddings = true;
+    ctx_params.n_threads = n_threads;
+    ctx_params.n_threads_batch = ctx_params.n_threads;
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_batch = ctx_params.n_ctx;
+    ctx_params.n_ubatch = ctx_params.n_ctx;
+    ctx_params.n_seq_max = n_seq_max;
+    ctx_params.kv_unified = true;
+    ctx_params.pooling_type = pooling;
+    llama_context * ctx = llama_init_from_model(const_cast<llama_model *>(model), ctx_params);
+    if (ctx && require_rank && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_RANK) {
+        llama_free(ctx);
+        if (error) *error = "model is not a reranker (pooling type is not RANK)";
+        return nullptr;
+    }
+    return ctx;
+}
+
+// Embeddings context for one text of up to 512 tokens.
+static llama_context * new_embeddings_ctx(const llama_model * model, const embedding_options & opts) {
+    llama_context *ctx = new_encoder_ctx(model, 512, 1, std::max(1, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2),
+                                         (enum llama_pooling_type) opts.pooling);
+    if (ctx) {
+        std::lock_guard<std::mutex> lock(g_embedding_opts_mutex);
+        g_embedding_opts[ctx] = opts;
+    }
+    return ctx;
+}
+
+static void free_embeddings_ctx(llama_context * ctx) {
+    {
+        std::lock_guard<std::mutex> lock(g_embedding_opts_mutex);
+        g_embedding_opts.erase(ctx);
+    }
+    llama_free(ctx);
+}
+
+// Embeds `text` on a context from new_embeddings_ctx into `out`: the pooled vector of
+// sequence 0, or the last token's row without pooling, then truncated and normalized as
+// the context was configured. Text beyond the context is cut off.
+static bool embed_text_with_ctx(llama_context * ctx, const std::string & text, std::vector<float> & out) {
+    const llama_model *model = llama_get_model(ctx);
+    if (model == nullptr) return false;
+    embedding_options opts;
+    {
+        std::lock_guard<std::mutex> lock(g_embedding_opts_mutex);
+        auto it = g_embedding_opts.find(ctx);
+        if (it != g_embedding_opts.end()) opts = it->second;
+    }
+
+    std::vector<llama_token> tokens(text.size());
+    int n_tokens = llama_tokenize(llama_model_get_vocab(model), text.c_str(), (int) text.length(), tokens.data(), (int) tokens.size(), false, false);
+    if (n_tokens <= 0) {
+        return false;
+    }
+    n_tokens = std::min(n_tokens, (int) llama_n_ubatch(ctx));
+
+    // the context is reused across texts: each one starts at position 0
+    llama_memory_clear(llama_get_memory(ctx), true);
+    llama_batch batch2 = llama_batch_init(n_tokens, /*embd*/ 0, /*n_seq_max*/ 1);
+    for (int i = 0; i < n_tokens; ++i) {
+        common_batch_add(batch2, tokens[i], i, { 0 }, i == n_tokens - 1);
+    }
+    const int rc = llama_decode(ctx, batch2);
+    llama_batch_free(batch2);
+    if (rc != 0) {
+        return false;
+    }
+
+    const int n_embd = llama_model_n_embd(model);
+    const float *embeddings = llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE
+        ? llama_get_embeddings_ith(ctx, -1)
+        : llama_get_embeddings_seq(ctx, 0);
+    if (embeddings == nullptr) {
+        return false;
+    }
+    out.assign(embeddings, embeddings + n_embd);
+    finish_embedding(out, opts);
+    return true;
+}
+
+static jfloatArray to_jfloat_array(JNIEnv * env, const std::vector<float> & v) {
+    jfloatArray result = env->NewFloatArray((jsize) v.size());
+    env->SetFloatArrayRegion(result, 0, (jsize) v.size(), v.data());
+    return result;
+}
+
+// One-off embedding on a temporary context; see new_embeddings_context for the options.
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1embeddings(JNIEnv *env, jobject, jlong jmodel, jstring jtext, jstring joptions) {
+    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
+    if (model == nullptr) {
+        return nullptr;
+    }
+    embedding_options opts;
+    try {
+        opts = parse_embedding_options(joptions ? jstring_to_string(env, joptions) : "");
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return nullptr;
+    }
+    llama_context *ctx = new_embeddings_ctx(model, opts);
+    if (ctx == nullptr) {
+        return nullptr;
+    }
+    std::vector<float> embedding;
+    const bool ok = embed_text_with_ctx(ctx, jstring_to_string(env, jtext), embedding);
+    free_embeddings_ctx(ctx);
+    return ok ? to_jfloat_array(env, embedding) : nullptr;
+}
+
+// Reusable embeddings context. `options` selects the pooling (the model's own by default),
+// native L2 normalization and Matryoshka truncation to `dim` components.
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1embeddings_1context(JNIEnv *env, jobject, jlong jmodel, jstring joptions) {
+    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
+    if (model == nullptr) return 0;
+    embedding_options opts;
+    try {
+        opts = parse_embedding_options(joptions ? jstring_to_string(env, joptions) : "");
+    } catch (const std::exception & e) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        return 0;
+    }
+    return reinterpret_cast<jlong>(new_embeddings_ctx(model, opts));
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_free_1embeddings_1context(JNIEnv *, jobject, jlong jctx) {
+    auto * ctx = reinterpret_cast<llama_context *>(jctx);
+    if (ctx) free_embeddings_ctx(ctx);
+}
+
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1embeddings_1with_1ctx(JNIEnv *env, jobject, jlong jctx, jstring jtext) {
+    llama_context *ctx = reinterpret_cast<llama_context *>(jctx);
+    if (ctx == nullptr) return nullptr;
+
+    std::vector<float> embedding;
+    if (!embed_text_with_ctx(ctx, jstring_to_string(env, jtext), embedding)) {
+        return nullptr;
+    }
+    return to_jfloat_array(env, embedding);
+}
+
+// Cross-encoder reranking for reranker GGUFs (pooling type RANK). Every query+passage pair
+// is its own sequence; pairs are packed into shared batches so N passages cost a few
+// decodes instead of N. Encoders attend over the whole sequence, so the context runs with
+// n_ubatch == n_batch == n_ctx and a pair never spans two ubatches.
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_new_1rerank_1context(JNIEnv *env, jobject, jlong jmodel, jint n_ctx, jint n_seq_max) {
+    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
+    if (model == nullptr) return 0;
+    const char * error = nullptr;
+    llama_context *ctx = new_encoder_ctx(model, std::max(64, (int) n_ctx), std::max(1, (int) n_seq_max),
+                                         std::max(1, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2),
+                                         LLAMA_POOLING_TYPE_UNSPECIFIED, true, &error);
+    if (error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), error);
+    }
+    return reinterpret_cast<jlong>(ctx);
+}
+
+struct rerank_run {
+    size_t    pairs   = 0;
+    size_t    tokens  = 0;
+    int       decodes = 0;
+    long long us      = 0;
+};
+
+static std::mutex g_rerank_mutex;
+static rerank_run g_last_rerank;
+
+// Scores of `docs` against `query` in input order, packing at most `max_seqs` pairs per
+// decode. Pairs are laid out like llama.cpp's server: [BOS] query [EOS] [SEP] doc [EOS],
+// with the query tokenized once. Passages are truncated to fit n_batch.
+static bool rerank_pairs(llama_context * ctx, const std::string & query, const std::vector<std::string> & docs,
+                         size_t max_seqs, std::vector<float> & scores, rerank_run & run) {
+    const auto t_start = ggml_time_us();
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+    const size_t n_batch = llama_n_batch(ctx);
+    max_seqs = std::max<size_t>(1, std::min<size_t>(max_seqs, llama_n_seq_max(ctx)));
+
+    const bool add_bos = llama_vocab_get_add_bos(vocab);
+    const bool add_eos = llama_vocab_get_add_eos(vocab);
+    const bool add_sep = llama_vocab_get_add_sep(vocab);
+    // a long query is cut to half the batch, leaving room for passage tokens; the cut comes
+    // before the special tokens are added so the pair keeps its separators
+    auto query_tokens = common_tokenize(vocab, query, false, false);
+    const size_t n_special = (add_bos ? 1 : 0) + (add_eos ? 1 : 0) + (add_sep ? 1 : 0);
+    query_tokens.resize(std::min(query_tokens.size(), n_batch / 2 > n_special ? n_batch / 2 - n_special : 0));
+
+    std::vector<llama_token> head;
+    if (add_bos) head.push_back(llama_vocab_bos(vocab));
+    head.insert(head.end(), query_tokens.begin(), query_tokens.end());
+    if (add_eos) head.push_back(llama_vocab_eos(vocab));
+    if (add_sep) head.push_back(llama_vocab_sep(vocab));
+
+    std::vector<std::vector<llama_token>> pairs(docs.size());
+    std::vector<size_t> lengths(docs.size());
+    for (size_t i = 0; i < docs.size(); ++i) {
+        auto doc = common_tokenize(vocab, docs[i], false, false);
+        doc.resize(std::min(doc.size(), n_batch - head.size() - (add_eos ? 1 : 0)));
+        pairs[i] = head;
+        pairs[i].insert(pairs[i].end(), doc.begin(), doc.end());
+        if (add_eos) pairs[i].push_back(llama_vocab_eos(vocab));
+        lengths[i] = pairs[i].size();
+    }
+
+    scores.assign(docs.size(), 0.0f);
+    run = rerank_run();
+    run.pairs = docs.size();
+    llama_batch batch = llama_batch_init((int32_t) n_batch, 0, (int32_t) max_seqs);
+    bool ok = true;
+    for (const auto & group : pack_sequences(lengths, n_batch, max_seqs)) {
+        if (llama_get_memory(ctx)) {
+            llama_memory_clear(llama_get_memory(ctx), true);
+        }
+        common_batch_clear(batch);
+        for (size_t s = 0; s < group.size(); ++s) {
+            const auto & tokens = pairs[group[s]];
+            for (size_t k = 0; k < tokens.size(); ++k) {
+                common_batch_add(batch, tokens[k], (llama_pos) k, { (llama_seq_id) s }, true);
+            }
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            LOGe("rerank: decode of %zu pairs failed", group.size());
+            ok = false;
+            break;
+        }
+        run.decodes++;
+        run.tokens += batch.n_tokens;
+        for (size_t s = 0; s < group.size(); ++s) {
+            const float * score = llama_get_embeddings_seq(ctx, (llama_seq_id) s);
+            scores[group[s]] = score ? score[0] : 0.0f;
+        }
     }
+    llama_batch_free(batch);
+    run.us = ggml_time_us() - t_start;
+    return ok;
+}
 
-    std::string piece;
-    piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
-    const int n_chars = llama_token_to_piece(llama_model_get_vocab(model), eot, &piece[0], piece.size(), 0, true);
-    if (n_chars < 0) {
-        piece.resize(-n_chars);
-        int check = llama_token_to_piece(llama_model_get_vocab(model), eot, &piece[0], piece.size(), 0, true);
-        GGML_ASSERT(check == -n_chars);
+static bool rerank_args(JNIEnv *env, jlong jctx, jstring jquery, jobjectArray jdocs,
+                        llama_context *& ctx, std::string & query, std::vector<std::string> & docs) {
+    ctx = reinterpret_cast<llama_context *>(jctx);
+    if (ctx == nullptr || jquery == nullptr || jdocs == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "rerank needs a context, a query and passages");
+        return false;
     }
-    else {
-        piece.resize(n_chars);
+    query = jstring_to_string(env, jquery);
+    const jsize n_docs = env->GetArrayLength(jdocs);
+    docs.reserve(n_docs);
+    for (jsize i = 0; i < n_docs; ++i) {
+        LocalRef<jstring> jdoc(env, (jstring) env->GetObjectArrayElement(jdocs, i));
+        docs.push_back(jdoc.get() ? jstring_to_string(env, jdoc.get()) : std::string());
     }
-
-     return env->NewStringUTF(piece.c_str());
-
+    return true;
 }
 
-extern "C" JNIEXPORT jint JNICALL
-Java_android_llama_cpp_LLamaAndroid_count_1tokens(JNIEnv *env, jobject, jlong jmodel, jstring jtext) {
-    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
-    if (model == nullptr) {
-        return 0;
+// One relevance score per passage (higher is more relevant), in input order.
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_rerank(JNIEnv *env, jobject, jlong jctx, jstring jquery, jobjectArray jdocs) {
+    llama_context * ctx;
+    std::string query;
+    std::vector<std::string> docs;
+    if (!rerank_args(env, jctx, jquery, jdocs, ctx, query, docs)) {
+        return nullptr;
     }
-    const char *c_text = env->GetStringUTFChars(jtext, nullptr);
-    std::string text(c_text);
-    env->ReleaseStringUTFChars(jtext, c_text);
+    std::vector<float> scores;
+    rerank_run run;
+    const bool ok = rerank_pairs(ctx, query, docs, llama_n_seq_max(ctx), scores, run);
+    {
+        std::lock_guard<std::mutex> lock(g_rerank_mutex);
+        g_last_rerank = run;
+    }
+    if (!ok) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "rerank decode failed");
+        return nullptr;
+    }
+    jfloatArray result = env->NewFloatArray((jsize) scores.size());
+    env->SetFloatArrayRegion(result, 0, (jsize) scores.size(), scores.data());
+    return result;
+}
 
-    std::vector<llama_token> tokens(text.size() + 2);
-    const struct llama_vocab * vocab = llama_model_get_vocab(model);
-    int32_t n_tokens = llama_tokenize(vocab,
-                                      text.c_str(),
-                                      static_cast<int32_t>(text.size()),
-                                      tokens.data(),
-                                      static_cast<int32_t>(tokens.size()),
-                                      /*add_special*/ false,
-                                      /*parse_special*/ true);
+static json rerank_run_json(const rerank_run & run) {
+    const double s = run.us / 1e6;
+    json out;
+    out["pairs"]        = run.pairs;
+    out["tokens"]       = run.tokens;
+    out["decodes"]      = run.decodes;
+    out["ms"]           = run.us / 1000.0;
+    out["pairs_per_s"]  = s > 0 ? run.pairs / s : 0.0;
+    out["tokens_per_s"] = s > 0 ? run.tokens / s : 0.0;
+    return out;
+}
 
-    if (n_tokens < 0) n_tokens = 0;
-    return n_tokens;
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_get_1rerank_1stats(JNIEnv *env, jobject) {
+    std::lock_guard<std::mutex> lock(g_rerank_mutex);
+    return env->NewStringUTF(rerank_run_json(g_last_rerank).dump().c_str());
 }
 
-extern "C" JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_getMemoryUsageNative(JNIEnv *, jobject, jlong jctx) {
-    auto * ctx = reinterpret_cast<llama_context *>(jctx);
-    if (ctx == nullptr) {
-        return 0;
+// Reranks the passages `n_iter` times packed into shared batches and one pair per decode,
+// and reports the best run of each, the speedup and the largest score difference.
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1rerank(JNIEnv *env, jobject, jlong jctx, jstring jquery, jobjectArray jdocs, jint n_iter) {
+    llama_context * ctx;
+    std::string query;
+    std::vector<std::string> docs;
+    if (!rerank_args(env, jctx, jquery, jdocs, ctx, query, docs)) {
+        return nullptr;
     }
-
-    // llama_get_state_size() returns the amount of memory (in bytes) currently used by the context
-    const size_t used = llama_state_get_size(ctx);
-    return static_cast<jlong>(used);
+    rerank_run best_batched, best_sequential;
+    std::vector<float> batched, sequential;
+    for (int it = 0; it < std::max(1, (int) n_iter); ++it) {
+        rerank_run run;
+        if (!rerank_pairs(ctx, query, docs, llama_n_seq_max(ctx), batched, run)) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "rerank decode failed");
+            return nullptr;
+        }
+        if (it == 0 || run.us < best_batched.us) best_batched = run;
+        if (!rerank_pairs(ctx, query, docs, 1, sequential, run)) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "rerank decode failed");
+            return nullptr;
+        }
+        if (it == 0 || run.us < best_sequential.us) best_sequential = run;
+    }
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < batched.size(); ++i) {
+        max_diff = std::max(max_diff, std::fabs(batched[i] - sequential[i]));
+    }
+    json out;
+    out["batched"]        = rerank_run_json(best_batched);
+    out["sequential"]     = rerank_run_json(best_sequential);
+    out["speedup"]        = best_batched.us > 0 ? (double) best_sequential.us / best_batched.us : 0.0;
+    out["max_score_diff"] = max_diff;
+    return env->NewStringUTF(out.dump().c_str());
 }
 
-struct quant_option {
-    std::string name;
-    llama_ftype ftype;
-    std::string desc;
+// Native document indexing: the document is split by exact token counts into overlapping
+// chunks and embedded in batches, one sequence per chunk. Worker threads tokenize segments
+// of the text while the embedding thread decodes earlier chunks; a bounded queue between
+// them keeps memory flat. Results are drained incrementally by index_poll.
+struct index_chunk {
+    int                      index = 0;
+    std::vector<llama_token> tokens;
+    std::string              text;
+    std::vector<float>       embedding;
 };
 
-static const std::vector<quant_option> QUANT_OPTIONS = {
-    { "Q4_0",     LLAMA_FTYPE_MOSTLY_Q4_0,     " 4.34G, +0.4685 ppl @ Llama-3-8B",  },
-    { "Q4_1",     LLAMA_FTYPE_MOSTLY_Q4_1,     " 4.78G, +0.4511 ppl @ Llama-3-8B",  },
-    { "Q5_0",     LLAMA_FTYPE_MOSTLY_Q5_0,     " 5.21G, +0.1316 ppl @ Llama-3-8B",  },
-    { "Q5_1",     LLAMA_FTYPE_MOSTLY_Q5_1,     " 5.65G, +0.1062 ppl @ Llama-3-8B",  },
-    { "IQ2_XXS",  LLAMA_FTYPE_MOSTLY_IQ2_XXS,  " 2.06 bpw quantization",            },
-    { "IQ2_XS",   LLAMA_FTYPE_MOSTLY_IQ2_XS,   " 2.31 bpw quantization",            },
-    { "IQ2_S",    LLAMA_FTYPE_MOSTLY_IQ2_S,    " 2.5  bpw quantization",            },
-    { "IQ2_M",    LLAMA_FTYPE_MOSTLY_IQ2_M,    " 2.7  bpw quantization",            },
-    { "IQ1_S",    LLAMA_FTYPE_MOSTLY_IQ1_S,    " 1.56 bpw quantization",            },
-    { "IQ1_M",    LLAMA_FTYPE_MOSTLY_IQ1_M,    " 1.75 bpw quantization",            },
-    { "TQ1_0",    LLAMA_FTYPE_MOSTLY_TQ1_0,    " 1.69 bpw ternarization",           },
-    { "TQ2_0",    LLAMA_FTYPE_MOSTLY_TQ2_0,    " 2.06 bpw ternarization",           },
-    { "Q2_K",     LLAMA_FTYPE_MOSTLY_Q2_K,     " 2.96G, +3.5199 ppl @ Llama-3-8B",  },
-    { "Q2_K_S",   LLAMA_FTYPE_MOSTLY_Q2_K_S,   " 2.96G, +3.1836 ppl @ Llama-3-8B",  },
-    { "IQ3_XXS",  LLAMA_FTYPE_MOSTLY_IQ3_XXS,  " 3.06 bpw quantization",            },
-    { "IQ3_S",    LLAMA_FTYPE_MOSTLY_IQ3_S,    " 3.44 bpw quantization",            },
-    { "IQ3_M",    LLAMA_FTYPE_MOSTLY_IQ3_M,    " 3.66 bpw quantization mix",        },
-    { "Q3_K",     LLAMA_FTYPE_MOSTLY_Q3_K_M,   "alias for Q3_K_M"                   },
-    { "IQ3_XS",   LLAMA_FTYPE_MOSTLY_IQ3_XS,   " 3.3 bpw quantization",             },
-    { "Q3_K_S",   LLAMA_FTYPE_MOSTLY_Q3_K_S,   " 3.41G, +1.6321 ppl @ Llama-3-8B",  },
-    { "Q3_K_M",   LLAMA_FTYPE_MOSTLY_Q3_K_M,   " 3.74G, +0.6569 ppl @ Llama-3-8B",  },
-    { "Q3_K_L",   LLAMA_FTYPE_MOSTLY_Q3_K_L,   " 4.03G, +0.5562 ppl @ Llama-3-8B",  },
-    { "IQ4_NL",   LLAMA_FTYPE_MOSTLY_IQ4_NL,   " 4.50 bpw non-linear quantization", },
-    { "IQ4_XS",   LLAMA_FTYPE_MOSTLY_IQ4_XS,   " 4.25 bpw non-linear quantization", },
-    { "Q4_K",     LLAMA_FTYPE_MOSTLY_Q4_K_M,   "alias for Q4_K_M",                  },
-    { "Q4_K_S",   LLAMA_FTYPE_MOSTLY_Q4_K_S,   " 4.37G, +0.2689 ppl @ Llama-3-8B",  },
-    { "Q4_K_M",   LLAMA_FTYPE_MOSTLY_Q4_K_M,   " 4.58G, +0.1754 ppl @ Llama-3-8B",  },
-    { "Q5_K",     LLAMA_FTYPE_MOSTLY_Q5_K_M,   "alias for Q5_K_M",                  },
-    { "Q5_K_S",   LLAMA_FTYPE_MOSTLY_Q5_K_S,   " 5.21G, +0.1049 ppl @ Llama-3-8B",  },
-    { "Q5_K_M",   LLAMA_FTYPE_MOSTLY_Q5_K_M,   " 5.33G, +0.0569 ppl @ Llama-3-8B",  },
-    { "Q6_K",     LLAMA_FTYPE_MOSTLY_Q6_K,     " 6.14G, +0.0217 ppl @ Llama-3-8B",  },
-    { "Q8_0",     LLAMA_FTYPE_MOSTLY_Q8_0,     " 7.96G, +0.0026 ppl @ Llama-3-8B",  },
-    { "F16",      LLAMA_FTYPE_MOSTLY_F16,      "14.00G, +0.0020 ppl @ Mistral-7B",  },
-    { "BF16",     LLAMA_FTYPE_MOSTLY_BF16,     "14.00G, -0.0050 ppl @ Mistral-7B",  },
-    { "F32",      LLAMA_FTYPE_ALL_F32,         "26.00G              @ 7B",          },
-    // Note: Ensure COPY comes after F32 to avoid ftype 0 from matching.
-    { "COPY",     LLAMA_FTYPE_ALL_F32,         "only copy tensors, no quantizing",  },
+struct index_job {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    std::string   text;
+    int           chunk_tokens  = 256;
+    int           overlap       = 32;
+    int           n_threads     = 2;     // tokenizer threads
+    int           n_seq_max     = 8;     // chunks per embedding decode
+    int           segment_bytes = 8192;
+    embedding_options embd_opts;         // pooling, normalize and dim of every chunk
+    double        pages         = 0.0;
+
+    std::atomic<int>  state{QUANTIZE_RUNNING};
+    std::atomic<bool> cancel{false};
+    std::atomic<int>  chunks_done{0};
+    std::atomic<int>  chunks_total{-1};  // known once tokenization finished
+    std::atomic<long long> tokens{0};
+    std::atomic<int>  decodes{0};
+    std::atomic<long long> tokenize_us{0};
+    std::atomic<long long> t_end_us{0};
+    long long         t_start_us = 0;
+
+    std::mutex                 mutex;   // guards results and error
+    std::vector<index_chunk>   results;
+    std::string                error;
+
+    // tokenized segments handed from the tokenizer threads to the chunker
+    std::mutex              seg_mutex;
+    std::condition_variable seg_cv;
+
+    std::thread worker;
 };
 
-static bool try_parse_ftype(const std::string & ftype_str_in, llama_ftype & ftype, std::string & ftype_str_out) {
-    std::string ftype_str;
+static bool index_abort_callback(void * data) {
+    return static_cast<index_job *>(data)->cancel.load(std::memory_order_relaxed);
+}
 
-    for (auto ch : ftype_str_in) {
-        ftype_str.push_back(std::toupper(ch));
+// Sets the cancel flag under seg_mutex so a chunker waiting for a segment cannot miss it.
+static void index_request_cancel(index_job * job) {
+    std::lock_guard<std::mutex> lock(job->seg_mutex);
+    job->cancel = true;
+    job->seg_cv.notify_all();
+}
+
+// Embedding context with one sequence per chunk. Models without their own pooling
+// (chat models) get mean pooling so every sequence has an embedding.
+static llama_context * new_index_context(index_job * job) {
+    const int n_ctx = job->chunk_tokens * job->n_seq_max;
+    const int n_threads = std::max(1, cpu_performance_core_count());
+    llama_context * ctx = new_encoder_ctx(job->model, n_ctx, job->n_seq_max, n_threads,
+                                          (enum llama_pooling_type) job->embd_opts.pooling);
+    if (ctx && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+        llama_free(ctx);
+        ctx = new_encoder_ctx(job->model, n_ctx, job->n_seq_max, n_threads, LLAMA_POOLING_TYPE_MEAN);
     }
-    for (const auto & it : QUANT_OPTIONS) {
-        if (it.name == ftype_str) {
-            ftype = it.ftype;
-            ftype_str_out = it.name;
-            return true;
-        }
+    if (ctx) {
+        llama_set_abort_callback(ctx, index_abort_callback, job);
     }
-    try {
-        int ftype_int = std::stoi(ftype_str);
-        for (const auto & it : QUANT_OPTIONS) {
-            if (it.ftype == ftype_int) {
-                ftype = it.ftype;
-                ftype_str_out = it.name;
-                return true;
+    return ctx;
+}
+
+static void index_fail(index_job * job, const std::string & error) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->error.empty()) job->error = error;
+}
+
+// Embedding thread: decodes up to n_seq_max queued chunks at a time.
+static void run_index_embedder(index_job * job, bounded_queue<index_chunk> & queue) {
+    const int n_embd = llama_model_n_embd(job->model);
+    const size_t n_batch = llama_n_batch(job->ctx);
+    llama_batch batch = llama_batch_init((int32_t) n_batch, 0, job->n_seq_max);
+    std::vector<index_chunk> group;
+    index_chunk first;
+    while (queue.pop(first)) {
+        group.clear();
+        group.push_back(std::move(first));
+        queue.try_pop_many(group, (size_t) job->n_seq_max - 1);
+
+        if (llama_get_memory(job->ctx)) {
+            llama_memory_clear(llama_get_memory(job->ctx), true);
+        }
+        common_batch_clear(batch);
+        for (size_t s = 0; s < group.size(); ++s) {
+            const auto & tokens = group[s].tokens;
+            for (size_t k = 0; k < tokens.size(); ++k) {
+                common_batch_add(batch, tokens[k], (llama_pos) k, { (llama_seq_id) s }, true);
             }
         }
+        if (llama_decode(job->ctx, batch) != 0) {
+            if (!job->cancel.load()) index_fail(job, "embedding decode failed");
+            index_request_cancel(job);
+            break;
+        }
+        job->decodes++;
+        job->tokens += batch.n_tokens;
+        for (size_t s = 0; s < group.size(); ++s) {
+            const float * embd = llama_get_embeddings_seq(job->ctx, (llama_seq_id) s);
+            if (embd) {
+                group[s].embedding.assign(embd, embd + n_embd);
+                finish_embedding(group[s].embedding, job->embd_opts);
+            }
+            group[s].tokens = std::vector<llama_token>();
+        }
+        job->chunks_done += (int) group.size();
+        std::lock_guard<std::mutex> lock(job->mutex);
+        for (auto & chunk : group) job->results.push_back(std::move(chunk));
     }
-    catch (...) {
-        // stoi failed
-    }
-    return false;
+    llama_batch_free(batch);
+    queue.close();   // unblocks the chunker after a failure
 }
 
-extern "C" JNIEXPORT jint JNICALL
-Java_android_llama_cpp_LLamaAndroid_quantizeNative(
-        JNIEnv *env,
-        jobject,
-        jstring jinputPath,
-        jstring joutputPath,
-        jstring jquantizeType
-) {
-    const char *inputPath = env->GetStringUTFChars(jinputPath, 0);
-    const char *outputPath = env->GetStringUTFChars(joutputPath, 0);
-    const char *quantizeType = env->GetStringUTFChars(jquantizeType, 0);
+static void run_index_job(index_job * job) {
+    const llama_vocab * vocab = llama_model_get_vocab(job->model);
+    job->ctx = new_index_context(job);
+    if (!job->ctx) {
+        index_fail(job, "cannot create the embedding context");
+        job->t_end_us = ggml_time_us();
+        job->state = QUANTIZE_FAILED;
+        return;
+    }
 
-    llama_model_quantize_params params = llama_model_quantize_default_params();
-    std::string ftype_str;
-    if (!try_parse_ftype(quantizeType, params.ftype, ftype_str)) {
-        return -1;
+    // tokenizers claim segments in order; the chunker consumes them in order
+    const auto segments = split_segments(job->text, (size_t) job->segment_bytes);
+    std::vector<std::vector<llama_token>> seg_tokens(segments.size());
+    std::vector<char> seg_ready(segments.size(), 0);
+    std::atomic<size_t> next_segment{0};
+    std::vector<std::thread> tokenizers;
+    for (int t = 0; t < job->n_threads; ++t) {
+        tokenizers.emplace_back([&]() {
+            for (size_t i; (i = next_segment.fetch_add(1)) < segments.size() && !job->cancel.load();) {
+                auto tokens = common_tokenize(vocab, job->text.substr(segments[i].first, segments[i].second), false, false);
+                std::lock_guard<std::mutex> lock(job->seg_mutex);
+                seg_tokens[i] = std::move(tokens);
+                seg_ready[i] = 1;
+                job->seg_cv.notify_all();
+            }
+        });
     }
 
-    int result = llama_model_quantize(inputPath, outputPath, &params);
+    bounded_queue<index_chunk> queue((size_t) job->n_seq_max * 2);
+    std::thread embedder(run_index_embedder, job, std::ref(queue));
+
+    token_chunker<llama_token> chunker((size_t) job->chunk_tokens, (size_t) job->overlap);
+    std::vector<std::vector<llama_token>> chunks;
+    int n_chunks = 0;
+    auto emit = [&]() {
+        for (auto & tokens : chunks) {
+            index_chunk chunk;
+            chunk.index  = n_chunks++;
+            chunk.text   = common_detokenize(vocab, tokens, false);
+            chunk.tokens = std::move(tokens);
+            if (!queue.push(std::move(chunk))) break;
+        }
+        chunks.clear();
+    };
+    for (size_t i = 0; i < segments.size() && !job->cancel.load(); ++i) {
+        std::vector<llama_token> tokens;
+        {
+            std::unique_lock<std::mutex> lock(job->seg_mutex);
+            job->seg_cv.wait(lock, [&] { return seg_ready[i] || job->cancel.load(); });
+            tokens = std::move(seg_tokens[i]);
+        }
+        chunker.push(tokens.data(), tokens.size(), chunks);
+        emit();
+    }
+    if (!job->cancel.load()) {
+        chunker.finish(chunks);
+        emit();
+        job->chunks_total = n_chunks;
+    }
+    for (auto & t : tokenizers) t.join();
+    job->tokenize_us = ggml_time_us() - job->t_start_us;
+    queue.close();
+    embedder.join();
+
+    llama_free(job->ctx);
+    job->ctx = nullptr;
+    job->t_end_us = ggml_time_us();
+    bool failed;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        failed = !job->error.empty();
+    }
+    job->state = failed ? QUANTIZE_FAILED : (job->cancel.load() ? QUANTIZE_CANCELLED : QUANTIZE_DONE);
+    LOGi("indexed %d chunks (%.0f pages) in %.2f s", job->chunks_done.load(), job->pages,
+         (job->t_end_us - job->t_start_us) / 1e6);
+}
 
-    env->ReleaseStringUTFChars(jinputPath, inputPath);
-    env->ReleaseStringUTFChars(joutputPath, outputPath);
-    env->ReleaseStringUTFChars(jquantizeType, quantizeType);
+// Options (all optional): chunk_tokens (256), overlap (32), n_threads (tokenizer threads,
+// 0 = performance cores - 1), n_seq_max (8 chunks per decode), segment_bytes (8192), and
+// pooling / normalize / dim as for new_embeddings_context.
+// The model must stay loaded until index_free.
+extern "C" JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_index_1start(JNIEnv *env, jobject, jlong jmodel, jstring jtext, jstring joptions) {
+    auto fail = [&](const std::string & msg) -> jlong {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), msg.c_str());
+        return 0;
+    };
+    auto * model = reinterpret_cast<llama_model *>(jmodel);
+    if (!model || !jtext) {
+        return fail("index_start needs a model and a text");
+    }
+    json options;
+    try {
+        const std::string options_str = joptions ? jstring_to_string(env, joptions) : "";
+        options = options_str.empty() ? json::object() : json::parse(options_str);
+    } catch (const std::exception & e) {
+        return fail(e.what());
+    }
 
-    return result;
+    auto job = std::make_unique<index_job>();
+    job->model         = model;
+    job->text          = jstring_to_string(env, jtext);
+    job->chunk_tokens  = json_value(options, "chunk_tokens", job->chunk_tokens);
+    job->overlap       = json_value(options, "overlap", job->overlap);
+    job->n_seq_max     = std::max(1, json_value(options, "n_seq_max", job->n_seq_max));
+    job->segment_bytes = std::max(256, json_value(options, "segment_bytes", job->segment_bytes));
+    const int n_threads = json_value(options, "n_threads", 0);
+    job->n_threads     = n_threads > 0 ? n_threads : std::max(1, cpu_performance_core_count() - 1);
+    if (job->chunk_tokens < 8 || job->overlap < 0 || job->overlap >= job->chunk_tokens) {
+        return fail("need chunk_tokens >= 8 and 0 <= overlap < chunk_tokens");
+    }
+    try {
+        job->embd_opts = parse_embedding_options(options.dump());
+    } catch (const std::exception & e) {
+        return fail(e.what());
+    }
+    if (job->embd_opts.pooling == EMBD_POOL_NONE) {
+        return fail("chunks need a pooled embedding: use model, mean, cls or last");
+    }
+    job->pages = count_pages(job->text);
+
+    ensure_backends_initialized();
+    job->t_start_us = ggml_time_us();
+    index_job * raw = job.release();
+    raw->worker = std::thread(run_index_job, raw);
+    return reinterpret_cast<jlong>(raw);
 }
 
-extern "C" JNIEXPORT jfloatArray JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1embeddings(JNIEnv *env, jobject, jlong jmodel, jstring jtext) {
-    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
-    if (model == nullptr) {
-        return nullptr;
+// Progress plus the chunks embedded since the previous poll.
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_index_1poll(JNIEnv *env, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<index_job *>(jjob);
+    if (job == nullptr) {
+        return env->NewStringUTF("{}");
     }
-    const char *c_text = env->GetStringUTFChars(jtext, nullptr);
-    std::string text(c_text);
-    env->ReleaseStringUTFChars(jtext, c_text);
-
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.embeddings = true;
-    ctx_params.n_ctx = 512;
-    ctx_params.kv_unified = true;
-    ctx_params.n_batch = 256;
-    ctx_params.n_ubatch = 64;
-    llama_context *ctx = llama_init_from_model(const_cast<llama_model *>(model), ctx_params);
-    if (ctx == nullptr) {
-        return nullptr;
+    static const char * state_names[] = { "running", "done", "failed", "cancelled" };
+    const int state = job->state.load();
+    const int done  = job->chunks_done.load();
+    const int total = job->chunks_total.load();
+    const long long t_end = job->t_end_us.load();
+    const double elapsed_s = ((t_end > 0 ? t_end : ggml_time_us()) - job->t_start_us) / 1e6;
+    const double progress = state == QUANTIZE_DONE ? 1.0 : (total > 0 ? (double) done / total : 0.0);
+
+    std::vector<index_chunk> ready;
+    json out;
+    out["state"]        = state_names[state];
+    out["chunks_done"]  = done;
+    out["chunks_total"] = total;
+    out["tokens"]       = job->tokens.load();
+    out["decodes"]      = job->decodes.load();
+    out["pages"]        = job->pages;
+    out["pages_per_s"]  = elapsed_s > 0 ? job->pages * progress / elapsed_s : 0.0;
+    out["elapsed_ms"]   = elapsed_s * 1000.0;
+    out["tokenize_ms"]  = job->tokenize_us.load() / 1000.0;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        ready.swap(job->results);
+        if (!job->error.empty()) out["error"] = job->error;
+    }
+    json chunks = json::array();
+    for (const auto & chunk : ready) {
+        chunks.push_back({
+            {"index", chunk.index},
+            {"text", chunk.text},
+            {"embedding", chunk.embedding},
+        });
     }
+    out["chunks"] = std::move(chunks);
+    return env->NewStringUTF(out.dump().c_str());
+}
 
-    std::vector<llama_token> tokens(text.size());
-    int n_tokens = llama_tokenize(llama_model_get_vocab(model), text.c_str(), text.length(), tokens.data(), tokens.size(), false, false);
-    if (n_tokens < 0) {
-        return nullptr;
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_index_1cancel(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<index_job *>(jjob);
+    if (job) {
+        index_request_cancel(job);
     }
+}
 
-    if (n_tokens > 0) {
-        // stream tokens in micro-batches to reduce spikes
-        int processed = 0;
-        while (processed < n_tokens) {
-            const int chunk = std::min(64, n_tokens - processed);
-            llama_batch batch2 = llama_batch_init(chunk, /*embd*/ 0, /*n_seq_max*/ 1);
-            for (int i = 0; i < chunk; ++i) {
-                common_batch_add(batch2, tokens[processed + i], processed + i, { 0 }, processed + i == n_tokens - 1);
-            }
-            batch2.logits[batch2.n_tokens - 1] = true;
-            llama_decode(ctx, batch2);
-            llama_batch_free(batch2);
-            processed += chunk;
-        }
-        const int n_embd = llama_model_n_embd(model);
-        const float *embeddings = llama_get_embeddings(ctx);
-        if (embeddings != nullptr) {
-            jfloatArray result = env->NewFloatArray(n_embd);
-            env->SetFloatArrayRegion(result, 0, n_embd, embeddings);
-            llama_free(ctx);
-            return result;
-        }
+// Cancels the job if it is still running, waits for its threads and frees the job.
+extern "C" JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_index_1free(JNIEnv *, jobject, jlong jjob) {
+    auto * job = reinterpret_cast<index_job *>(jjob);
+    if (job == nullptr) {
+        return;
+    }
+    index_request_cancel(job);
+    if (job->worker.joinable()) {
+        job->worker.join();
     }
+    delete job;
+}
 
-    llama_free(ctx);
-    return nullptr;
+// On-disk embedding store (embedding_store.h). Searches hold the lock shared and read the
+// mapped file in place; appends, deletes and compaction hold it exclusively because a
+// grown store is remapped.
+struct store_handle {
+    std::shared_mutex                mutex;
+    std::unique_ptr<embedding_store> store;
+};
+
+static store_handle * store_from_handle(JNIEnv * env, jlong jstore) {
+    auto * handle = reinterpret_cast<store_handle *>(jstore);
+    if (handle == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "store is closed");
+    }
+    return handle;
 }
 
 extern "C" JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1embeddings_1context(JNIEnv *, jobject, jlong jmodel) {
-    const llama_model *model = reinterpret_cast<llama_model *>(jmodel);
-    if (model == nullptr) return 0;
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.embeddings = true;
-    ctx_params.n_threads = std::max(1, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2);
-    ctx_params.n_threads_batch = ctx_params.n_threads;
-    ctx_params.n_ctx = 512;
-    ctx_params.kv_unified = true;
-    llama_context *ctx = llama_init_from_model(const_cast<llama_model *>(model), ctx_params);
-    return reinterpret_cast<jlong>(ctx);
+Java_android_llama_cpp_LLamaAndroid_store_1open(JNIEnv *env, jobject, jstring jpath, jstring jmodel_id, jint dim, jboolean half) {
+    std::string error;
+    auto store = embedding_store::open(jstring_to_string(env, jpath), jstring_to_string(env, jmodel_id),
+                                       (uint32_t) std::max(0, (int) dim), half ? EMBEDDING_F16 : EMBEDDING_F32, &error);
+    if (!store) {
+        LOGe("store_open: %s", error.c_str());
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.c_str());
+        return 0;
+    }
+    LOGi("store_open: %llu vectors of dim %u", (unsigned long long) store->live(), store->dim());
+    auto * handle = new store_handle();
+    handle->store = std::move(store);
+    return reinterpret_cast<jlong>(handle);
 }
 
 extern "C" JNIEXPORT void JNICALL
-Java_android_llama_cpp_LLamaAndroid_free_1embeddings_1context(JNIEnv *, jobject, jlong jctx) {
-    auto * ctx = reinterpret_cast<llama_context *>(jctx);
-    if (ctx) llama_free(ctx);
+Java_android_llama_cpp_LLamaAndroid_store_1close(JNIEnv *, jobject, jlong jstore) {
+    delete reinterpret_cast<store_handle *>(jstore);
 }
 
-extern "C" JNIEXPORT jfloatArray JNICALL
-Java_android_llama_cpp_LLamaAndroid_get_1embeddings_1with_1ctx(JNIEnv *env, jobject, jlong jctx, jstring jtext) {
-    llama_context *ctx = reinterpret_cast<llama_context *>(jctx);
-    if (ctx == nullptr) return nullptr;
-    const llama_model *model = llama_get_model(ctx);
-    if (model == nullptr) return nullptr;
+// Appends vectors.length / dim vectors under `ids`, replacing ids that are present, and
+// compacts once a quarter of the file is tombstones.
+extern "C" JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1append(JNIEnv *env, jobject, jlong jstore, jlongArray jids, jfloatArray jvectors) {
+    store_handle * handle = store_from_handle(env, jstore);
+    if (handle == nullptr) return JNI_FALSE;
+    const jsize n = env->GetArrayLength(jids);
+    std::unique_lock<std::shared_mutex> lock(handle->mutex);
+    if ((size_t) env->GetArrayLength(jvectors) != (size_t) n * handle->store->dim()) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "need ids.size * dim floats");
+        return JNI_FALSE;
+    }
+    std::vector<int64_t> ids(n);
+    env->GetLongArrayRegion(jids, 0, n, reinterpret_cast<jlong *>(ids.data()));
+    jfloat * vectors = env->GetFloatArrayElements(jvectors, nullptr);
+    const bool ok = handle->store->append(ids.data(), vectors, (size_t) n) && handle->store->maybe_compact();
+    env->ReleaseFloatArrayElements(jvectors, vectors, JNI_ABORT);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
 
-    const char *c_text = env->GetStringUTFChars(jtext, nullptr);
-    std::string text(c_text);
-    env->ReleaseStringUTFChars(jtext, c_text);
+// Embeds `text` on an embeddings context and appends it without the vector crossing JNI.
+extern "C" JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1append_1text(JNIEnv *env, jobject, jlong jstore, jlong jctx, jlong id, jstring jtext) {
+    store_handle * handle = store_from_handle(env, jstore);
+    auto * ctx = reinterpret_cast<llama_context *>(jctx);
+    if (handle == nullptr || ctx == nullptr) return JNI_FALSE;
+    std::vector<float> embedding;
+    if (!embed_text_with_ctx(ctx, jstring_to_string(env, jtext), embedding)) {
+        return JNI_FALSE;
+    }
+    std::unique_lock<std::shared_mutex> lock(handle->mutex);
+    if (embedding.size() != handle->store->dim()) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "embedding size does not match the store");
+        return JNI_FALSE;
+    }
+    const int64_t sid = id;
+    return handle->store->append(&sid, embedding.data(), 1) && handle->store->maybe_compact() ? JNI_TRUE : JNI_FALSE;
+}
 
-    std::vector<llama_token> tokens(text.size());
-    int n_tokens = llama_tokenize(llama_model_get_vocab(model), text.c_str(), (int) text.length(), tokens.data(), (int) tokens.size(), false, false);
-    if (n_tokens < 0) {
+extern "C" JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1remove(JNIEnv *env, jobject, jlong jstore, jlong id) {
+    store_handle * handle = store_from_handle(env, jstore);
+    if (handle == nullptr) return JNI_FALSE;
+    std::unique_lock<std::shared_mutex> lock(handle->mutex);
+    return handle->store->remove(id) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Top-k cosine search. Returns the scores, best first, and writes the matching ids to
+// the front of `out_ids`, which must hold at least k entries.
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1search(JNIEnv *env, jobject, jlong jstore, jfloatArray jquery, jint k, jlongArray jout_ids) {
+    store_handle * handle = store_from_handle(env, jstore);
+    if (handle == nullptr) return nullptr;
+    std::shared_lock<std::shared_mutex> lock(handle->mutex);
+    if ((size_t) env->GetArrayLength(jquery) != handle->store->dim() || k < 0 || env->GetArrayLength(jout_ids) < k) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "query must have dim floats and out_ids k entries");
         return nullptr;
     }
-
-    if (n_tokens > 0) {
-        int processed = 0;
-        while (processed < n_tokens) {
-            const int chunk = std::min(64, n_tokens - processed);
-            llama_batch batch2 = llama_batch_init(chunk, /*embd*/ 0, /*n_seq_max*/ 1);
-            for (int i = 0; i < chunk; ++i) {
-                common_batch_add(batch2, tokens[processed + i], processed + i, { 0 }, processed + i == n_tokens - 1);
-            }
-            batch2.logits[batch2.n_tokens - 1] = true;
-            llama_decode(ctx, batch2);
-            llama_batch_free(batch2);
-            processed += chunk;
-        }
-        const int n_embd = llama_model_n_embd(model);
-        const float *embeddings = llama_get_embeddings(ctx);
-        if (embeddings != nullptr) {
-            jfloatArray result = env->NewFloatArray(n_embd);
-            env->SetFloatArrayRegion(result, 0, n_embd, embeddings);
-            return result;
-        }
+    std::vector<float> query(handle->store->dim());
+    env->GetFloatArrayRegion(jquery, 0, (jsize) query.size(), query.data());
+    const auto hits = handle->store->search(query.data(), (size_t) k);
+    lock.unlock();
+
+    std::vector<jlong>  ids(hits.size());
+    std::vector<jfloat> scores(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) {
+        ids[i]    = hits[i].id;
+        scores[i] = hits[i].score;
     }
+    env->SetLongArrayRegion(jout_ids, 0, (jsize) ids.size(), ids.data());
+    jfloatArray result = env->NewFloatArray((jsize) scores.size());
+    env->SetFloatArrayRegion(result, 0, (jsize) scores.size(), scores.data());
+    return result;
+}
 
-    return nullptr;
+extern "C" JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1compact(JNIEnv *env, jobject, jlong jstore) {
+    store_handle * handle = store_from_handle(env, jstore);
+    if (handle == nullptr) return JNI_FALSE;
+    std::unique_lock<std::shared_mutex> lock(handle->mutex);
+    return handle->store->compact() ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_store_1stats(JNIEnv *env, jobject, jlong jstore) {
+    store_handle * handle = store_from_handle(env, jstore);
+    if (handle == nullptr) return nullptr;
+    std::shared_lock<std::shared_mutex> lock(handle->mutex);
+    const embedding_store & store = *handle->store;
+    json out;
+    out["model_id"]   = store.model_id();
+    out["dim"]        = store.dim();
+    out["live"]       = store.live();
+    out["deleted"]    = store.deleted();
+    out["capacity"]   = store.capacity();
+    out["file_bytes"] = store.file_bytes();
+    return env->NewStringUTF(out.dump().c_str());
 }
 
 // Hardware detection functions for Android GPU acceleration
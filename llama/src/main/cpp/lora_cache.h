@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// LoRA adapters loaded once per base model and shared by every context on it.
+//
+// acquire() loads an adapter on first use and bumps its refcount; release() drops a
+// reference. Contexts pin the adapters attached to them (pin/unpin), so an adapter is freed
+// once it has neither references nor pins: a released adapter stays valid until every
+// context has detached it, which each does on its own thread (released() tells it to).
+// forget_owner() frees every adapter of a base model that is about to be freed, whatever
+// its refcount: adapters cannot outlive the model whose tensors they patch.
+template <typename Owner, typename Adapter>
+class lora_cache {
+public:
+    // Loads the adapter and sets `bytes` to its weight size; nullptr on failure.
+    using loader_fn  = std::function<Adapter *(size_t & bytes)>;
+    using deleter_fn = std::function<void(Adapter *)>;
+
+    struct entry {
+        const Owner * owner   = nullptr;
+        std::string   path;
+        Adapter *     adapter = nullptr;
+        size_t        bytes   = 0;
+        double        load_ms = 0.0;
+        int           refs    = 0;
+        int           pins    = 0;   // contexts it is attached to
+    };
+
+    explicit lora_cache(deleter_fn deleter) : deleter_(std::move(deleter)) {}
+
+    Adapter * acquire(const Owner * owner, const std::string & path, const loader_fn & load) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto & e : entries_) {
+            if (e.owner == owner && e.path == path) {
+                e.refs++;
+                return e.adapter;
+            }
+        }
+        const auto t0 = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        Adapter * adapter = load(bytes);
+        if (!adapter) {
+            return nullptr;
+        }
+        entry e;
+        e.owner   = owner;
+        e.path    = path;
+        e.adapter = adapter;
+        e.bytes   = bytes;
+        e.load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        e.refs    = 1;
+        entries_.push_back(std::move(e));
+        return adapter;
+    }
+
+    // Returns true when this was the last reference and the adapter was freed; a pinned
+    // adapter is freed by the last unpin instead.
+    bool release(Adapter * adapter) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = find(adapter);
+        if (it == entries_.end() || it->refs == 0) {
+            return false;
+        }
+        it->refs--;
+        return free_if_unused(it);
+    }
+
+    // Pins every adapter of `adapters` (pairs with the adapter first) for attaching to a
+    // context. False, pinning none, unless all are loaded for `owner` and not released.
+    template <typename Set>
+    bool pin(const Owner * owner, const Set & adapters) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto & b : adapters) {
+            auto it = find(b.first);
+            if (it == entries_.end() || it->owner != owner || it->refs == 0) {
+                return false;
+            }
+        }
+        for (const auto & b : adapters) {
+            find(b.first)->pins++;
+        }
+        return true;
+    }
+
+    // Drops the pins of `adapters` once they are detached; frees the released ones.
+    template <typename Set>
+    void unpin(const Set & adapters) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto & b : adapters) {
+            auto it = find(b.first);
+            if (it != entries_.end() && it->pins > 0) {
+                it->pins--;
+                free_if_unused(it);
+            }
+        }
+    }
+
+    // True when every reference to `adapter` was released and contexts should detach it.
+    bool released(const Adapter * adapter) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(entries_.begin(), entries_.end(), [&](const entry & e) { return e.adapter == adapter; });
+        return it == entries_.end() || it->refs == 0;
+    }
+
+    void forget_owner(const Owner * owner) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->owner == owner) {
+                deleter_(it->adapter);
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // True when `adapter` is loaded for `owner` and not released.
+    bool owns(const Owner * owner, const Adapter * adapter) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::any_of(entries_.begin(), entries_.end(),
+                           [&](const entry & e) { return e.adapter == adapter && e.owner == owner && e.refs > 0; });
+    }
+
+    std::vector<entry> snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_;
+    }
+
+private:
+    typename std::vector<entry>::iterator find(const Adapter * adapter) {
+        return std::find_if(entries_.begin(), entries_.end(), [&](const entry & e) { return e.adapter == adapter; });
+    }
+
+    bool free_if_unused(typename std::vector<entry>::iterator it) {
+        if (it->refs > 0 || it->pins > 0) {
+            return false;
+        }
+        deleter_(it->adapter);
+        entries_.erase(it);
+        return true;
+    }
+
+    deleter_fn         deleter_;
+    mutable std::mutex mutex_;
+    std::vector<entry> entries_;
+};
+
+// Adapters attached to a context and their scales.
+template <typename Adapter>
+using lora_set = std::vector<std::pair<Adapter *, float>>;
+
+// Same adapters with the same scales, in any order.
+template <typename Adapter>
+bool lora_set_equal(lora_set<Adapter> a, lora_set<Adapter> b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    return a == b;
+}
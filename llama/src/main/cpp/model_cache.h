@@ -0,0 +1,270 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+// Identity of a model file on disk plus the load parameters that shape the
+// resident model. A changed size or mtime means the file was replaced.
+struct model_file_key {
+    std::string path;
+    long long   size  = 0;
+    long long   mtime = 0;
+    std::string params;
+
+    bool operator==(const model_file_key & other) const {
+        return path == other.path && size == other.size && mtime == other.mtime && params == other.params;
+    }
+};
+
+// Fills `out` from stat(2). Returns false if the file does not exist.
+inline bool model_file_key_from_path(const std::string & path, const std::string & params, model_file_key & out) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    out.path   = path;
+    out.size   = (long long) st.st_size;
+    out.mtime  = (long long) st.st_mtime;
+    out.params = params;
+    return true;
+}
+
+// Refcounted registry of loaded models keyed by model_file_key.
+//
+// acquire() returns a shared handle and bumps its refcount; release() drops it.
+// Unreferenced models stay resident until the total size exceeds the budget,
+// at which point the least recently used unreferenced ones are freed.
+// Concurrent acquires of the same key wait for a single load.
+template <typename T>
+class model_residency_cache {
+public:
+    using loader_fn  = std::function<T *()>;
+    using deleter_fn = std::function<void(T *)>;
+    using size_fn    = std::function<size_t(const T *)>;
+
+    struct stats {
+        size_t entries        = 0;
+        size_t referenced     = 0;
+        size_t resident_bytes = 0;
+        size_t budget_bytes   = 0;
+        size_t hits           = 0;
+        size_t misses         = 0;
+        size_t evictions      = 0;
+    };
+
+    model_residency_cache(deleter_fn deleter, size_fn size_of, size_t budget_bytes)
+        : deleter_(std::move(deleter)), size_of_(std::move(size_of)), budget_(budget_bytes) {}
+
+    ~model_residency_cache() {
+        for (auto & e : entries_) {
+            if (e.handle) {
+                deleter_(e.handle);
+            }
+        }
+    }
+
+    model_residency_cache(const model_residency_cache &) = delete;
+    model_residency_cache & operator=(const model_residency_cache &) = delete;
+
+    // Returns the resident model for `key`, loading it with `load` on a miss.
+    // `hit` (optional) reports whether the model was already resident.
+    // Returns nullptr if the load failed.
+    T * acquire(const model_file_key & key, const loader_fn & load, bool * hit = nullptr) {
+        std::vector<T *> victims;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            auto it = find_key(key);
+            if (it == entries_.end()) {
+                break;
+            }
+            if (it->loading) {
+                cv_.wait(lock);
+                continue;   // the entry may have been erased by a failed load
+            }
+            it->refs++;
+            it->last_used = ++tick_;
+            hits_++;
+            if (hit) *hit = true;
+            return it->handle;
+        }
+
+        // Unreferenced entries for an older version of the same file are dead weight
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->key.path == key.path && it->refs == 0 && !it->loading) {
+                victims.push_back(it->handle);
+                resident_ -= it->bytes;
+                evictions_++;
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        entries_.push_back(entry{});
+        auto placeholder = std::prev(entries_.end());
+        placeholder->key = key;
+        placeholder->loading = true;
+        misses_++;
+        if (hit) *hit = false;
+
+        lock.unlock();
+        free_all(victims);
+        victims.clear();
+        T * handle = load();
+        lock.lock();
+
+        placeholder->loading = false;
+        if (!handle) {
+            entries_.erase(placeholder);
+            cv_.notify_all();
+            return nullptr;
+        }
+        placeholder->handle = handle;
+        placeholder->bytes = size_of_(handle);
+        placeholder->refs = 1;
+        placeholder->last_used = ++tick_;
+        resident_ += placeholder->bytes;
+        collect_victims(victims);
+        cv_.notify_all();
+
+        lock.unlock();
+        free_all(victims);
+        return handle;
+    }
+
+    // Drops one reference. Returns false if `handle` is not owned by the cache.
+    bool release(T * handle) {
+        std::vector<T *> victims;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = find_handle(handle);
+            if (it == entries_.end()) {
+                return false;
+            }
+            if (it->refs > 0) {
+                it->refs--;
+            }
+            it->last_used = ++tick_;
+            collect_victims(victims);
+        }
+        free_all(victims);
+        return true;
+    }
+
+    bool contains(const T * handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return find_handle(handle) != entries_.end();
+    }
+
+    void set_budget(size_t budget_bytes) {
+        std::vector<T *> victims;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            budget_ = budget_bytes;
+            collect_victims(victims);
+        }
+        free_all(victims);
+    }
+
+    // Frees every unreferenced model regardless of the budget.
+    void trim() {
+        std::vector<T *> victims;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                if (it->refs == 0 && !it->loading) {
+                    victims.push_back(it->handle);
+                    resident_ -= it->bytes;
+                    evictions_++;
+                    it = entries_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        free_all(victims);
+    }
+
+    stats get_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats s;
+        for (const auto & e : entries_) {
+            if (e.loading) continue;
+            s.entries++;
+            if (e.refs > 0) s.referenced++;
+        }
+        s.resident_bytes = resident_;
+        s.budget_bytes   = budget_;
+        s.hits           = hits_;
+        s.misses         = misses_;
+        s.evictions      = evictions_;
+        return s;
+    }
+
+private:
+    struct entry {
+        model_file_key key;
+        T *    handle    = nullptr;
+        size_t bytes     = 0;
+        int    refs      = 0;
+        bool   loading   = false;
+        unsigned long long last_used = 0;
+    };
+    using iterator = typename std::list<entry>::iterator;
+
+    iterator find_key(const model_file_key & key) {
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->key == key) return it;
+        }
+        return entries_.end();
+    }
+
+    iterator find_handle(const T * handle) {
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (handle && it->handle == handle) return it;
+        }
+        return entries_.end();
+    }
+
+    // Must hold mutex_. Moves LRU unreferenced entries into `victims` until under budget.
+    void collect_victims(std::vector<T *> & victims) {
+        while (resident_ > budget_) {
+            auto lru = entries_.end();
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                if (it->refs == 0 && !it->loading && (lru == entries_.end() || it->last_used < lru->last_used)) {
+                    lru = it;
+                }
+            }
+            if (lru == entries_.end()) {
+                break;   // everything left is in use
+            }
+            victims.push_back(lru->handle);
+            resident_ -= lru->bytes;
+            evictions_++;
+            entries_.erase(lru);
+        }
+    }
+
+    void free_all(const std::vector<T *> & victims) {
+        for (T * handle : victims) {
+            deleter_(handle);
+        }
+    }
+
+    deleter_fn deleter_;
+    size_fn    size_of_;
+    size_t     budget_;
+    size_t     resident_  = 0;
+    size_t     hits_      = 0;
+    size_t     misses_    = 0;
+    size_t     evictions_ = 0;
+    unsigned long long tick_ = 0;
+    std::list<entry> entries_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
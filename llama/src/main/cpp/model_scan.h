@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "model_cache.h"
+
+// Memoizes per-file metadata (any serialized payload, e.g. a JSON object) by
+// path, size and mtime, so re-listing unchanged models skips the file read.
+class model_scan_cache {
+public:
+    // Produces the payload for a file. Called without the cache lock held.
+    using reader_fn = std::function<std::string(const std::string & path)>;
+
+    // Returns the payload for `path`, reading it only if the file changed since
+    // the last call. `hit` (optional) reports whether the cached value was used.
+    // Returns an empty string if the file does not exist.
+    std::string get(const std::string & path, const reader_fn & read, bool * hit = nullptr) {
+        if (hit) *hit = false;
+        model_file_key key;
+        if (!model_file_key_from_path(path, "", key)) {
+            forget(path);
+            return "";
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(path);
+            if (it != entries_.end() && it->second.first == key) {
+                if (hit) *hit = true;
+                return it->second.second;
+            }
+        }
+        std::string payload = read(path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[path] = { key, payload };
+        return payload;
+    }
+
+    void forget(const std::string & path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.erase(path);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+private:
+    std::unordered_map<std::string, std::pair<model_file_key, std::string>> entries_;
+    std::mutex mutex_;
+};
+
+// Regular files in `dir` whose name ends with `suffix`, sorted by name.
+inline std::vector<std::string> model_scan_list_dir(const std::string & dir, const std::string & suffix) {
+    std::vector<std::string> files;
+    DIR * d = opendir(dir.c_str());
+    if (!d) {
+        return files;
+    }
+    while (dirent * ent = readdir(d)) {
+        const std::string name = ent->d_name;
+        if (name.size() < suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            continue;
+        }
+        std::string path = dir;
+        if (path.empty() || path.back() != '/') path.push_back('/');
+        path += name;
+        struct stat st{};
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            files.push_back(std::move(path));
+        }
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Fetches the payload of every file through `cache` using up to `n_threads`
+// workers. Results are in the same order as `files`.
+inline std::vector<std::string> model_scan_files(model_scan_cache & cache, const std::vector<std::string> & files,
+                                                 const model_scan_cache::reader_fn & read, int n_threads) {
+    std::vector<std::string> results(files.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+            results[i] = cache.get(files[i], read);
+        }
+    };
+
+    const size_t n_workers = std::min<size_t>(files.size(), (size_t) std::max(1, n_threads));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_workers; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & t : threads) {
+        t.join();
+    }
+    return results;
+}
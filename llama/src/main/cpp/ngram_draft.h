@@ -0,0 +1,44 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Prompt-lookup drafting: answers grounded in a document often copy spans of it, so the
+// tokens that followed an earlier occurrence of the last few tokens are a good guess for
+// what comes next. No draft model is needed; the target model verifies the guess in one
+// batched decode.
+
+struct ngram_draft_params {
+    int ngram_min = 2;   // shortest suffix that may be looked up
+    int ngram_max = 4;   // longer suffixes are tried first: fewer, better matches
+    int max_draft = 8;   // tokens proposed per verification
+};
+
+// Draft continuation of tokens[0..n): finds the most recent earlier occurrence of the
+// longest suffix of length ngram_max..ngram_min and returns up to max_draft tokens that
+// followed it. Empty when no suffix occurs earlier.
+template <typename T>
+std::vector<T> ngram_draft(const T * tokens, size_t n, const ngram_draft_params & params = {}) {
+    std::vector<T> draft;
+    if (params.max_draft <= 0) {
+        return draft;
+    }
+    const int lo = std::max(1, params.ngram_min);
+    for (int len = params.ngram_max; len >= lo; --len) {
+        if (n < (size_t) len + 1) {
+            continue;
+        }
+        const T * suffix = tokens + n - len;
+        // i + len <= n - 1: the match must be followed by at least one token
+        for (size_t i = n - len; i-- > 0;) {
+            if (tokens[i] != suffix[0] || !std::equal(suffix, suffix + len, tokens + i)) {
+                continue;
+            }
+            const size_t from = i + len;
+            const size_t to   = std::min(n, from + (size_t) params.max_draft);
+            draft.assign(tokens + from, tokens + to);
+            return draft;
+        }
+    }
+    return draft;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Helpers for inspecting and warming the kernel page cache of model files.
+// These only touch the file through our own short-lived mappings, so the pages
+// they bring in are shared with the mapping llama.cpp creates when loading.
+
+// Returns the size of the file at `path`, or -1 if it cannot be stat'ed.
+inline long long page_cache_file_size(const char * path) {
+    struct stat st{};
+    if (!path || stat(path, &st) != 0) {
+        return -1;
+    }
+    return (long long) st.st_size;
+}
+
+// Fraction (0..1) of the pages in [offset, offset + length) that are currently
+// resident, estimated from at most `max_samples` evenly spaced pages.
+// Returns -1 on error.
+inline double page_cache_residency(const char * path, size_t offset, size_t length, size_t max_samples = 4096) {
+    const long long file_size = page_cache_file_size(path);
+    if (file_size <= 0 || offset >= (size_t) file_size) {
+        return -1.0;
+    }
+    if (length == 0 || offset + length > (size_t) file_size) {
+        length = (size_t) file_size - offset;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1.0;
+    }
+    void * addr = mmap(nullptr, (size_t) file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1.0;
+    }
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t first_page = offset / page;
+    const size_t last_page = (offset + length - 1) / page;
+    const size_t n_pages = last_page - first_page + 1;
+    const size_t n_samples = std::max<size_t>(1, std::min(n_pages, max_samples));
+    const size_t stride = n_pages / n_samples;
+
+    size_t resident = 0;
+    size_t checked = 0;
+    unsigned char vec = 0;
+    for (size_t i = 0; i < n_samples; ++i) {
+        auto * p = (unsigned char *) addr + (first_page + i * stride) * page;
+        if (mincore(p, page, &vec) == 0) {
+            resident += (vec & 1);
+            checked++;
+        }
+    }
+    munmap(addr, (size_t) file_size);
+    return checked > 0 ? (double) resident / (double) checked : -1.0;
+}
+
+// Asks the kernel to start reading [offset, offset + length) into the page
+// cache without waiting for it. posix_fadvise covers the fd based readers;
+// madvise(MADV_WILLNEED) on a throwaway mapping covers mmap based loaders.
+inline bool page_cache_prefetch(const char * path, size_t offset, size_t length, bool use_madvise = true) {
+    const long long file_size = page_cache_file_size(path);
+    if (file_size <= 0 || offset >= (size_t) file_size) {
+        return false;
+    }
+    if (length == 0 || offset + length > (size_t) file_size) {
+        length = (size_t) file_size - offset;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED) == 0;
+
+    if (use_madvise) {
+        void * addr = mmap(nullptr, (size_t) file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            const size_t aligned = offset - (offset % page);
+            ok = madvise((char *) addr + aligned, length + (offset - aligned), MADV_WILLNEED) == 0 && ok;
+            munmap(addr, (size_t) file_size);
+        } else {
+            ok = false;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Reads [offset, offset + length) front to back so the whole range is in the
+// page cache before the loader maps it; sequential reads are much faster than
+// the random page faults of a cold mmap. Stops early when `cancel` becomes true.
+// Returns the number of bytes read, or -1 on error.
+inline long long page_cache_warm(const char * path, size_t offset, size_t length = 0,
+                                 const std::atomic<bool> * cancel = nullptr, size_t chunk = (size_t) 1 << 20) {
+    const long long file_size = page_cache_file_size(path);
+    if (file_size <= 0 || offset >= (size_t) file_size) {
+        return -1;
+    }
+    if (length == 0 || offset + length > (size_t) file_size) {
+        length = (size_t) file_size - offset;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED);
+
+    std::vector<char> buf(chunk);
+    long long total = 0;
+    while ((size_t) total < length) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            break;
+        }
+        const size_t want = std::min(chunk, length - (size_t) total);
+        const ssize_t got = pread(fd, buf.data(), want, (off_t) (offset + total));
+        if (got <= 0) {
+            break;
+        }
+        total += got;
+    }
+    close(fd);
+    return total;
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Radix tree over the token ids of recent prompts. Any node can carry a snapshot
+// (serialized KV state of the sequence holding exactly the tokens on the path to
+// that node). The tree remembers token paths on their own too, so a new prompt
+// can tell how much it shares with earlier ones and snapshot at that branch point.
+// Snapshots are kept under a byte budget and the paths under a token budget, both
+// evicted least recently used first.
+class prefix_cache {
+public:
+    using token = int32_t;
+
+    explicit prefix_cache(size_t max_bytes = (size_t) 128 << 20, size_t max_tokens = 1 << 16)
+        : max_bytes_(max_bytes), max_tokens_(max_tokens), root_(new node) {}
+
+    // Length of the longest prefix of `tokens` that is a known path.
+    size_t match_path(const token * tokens, size_t n) const {
+        const node * cur = root_.get();
+        size_t i = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) break;
+            const node * child = it->second.get();
+            size_t j = 0;
+            while (j < child->edge.size() && i < n && child->edge[j] == tokens[i]) {
+                ++i;
+                ++j;
+            }
+            if (j < child->edge.size()) break;
+            cur = child;
+        }
+        return i;
+    }
+
+    // Longest snapshot whose prefix is at most `max_len` tokens of `tokens`.
+    // Returns nullptr when none; `len` receives the snapshot's prefix length.
+    const std::vector<uint8_t> * find(const token * tokens, size_t n, size_t max_len, size_t * len) {
+        node * cur = root_.get();
+        node * best = nullptr;
+        size_t best_len = 0;
+        size_t i = 0;
+        n = std::min(n, max_len);
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) break;
+            node * child = it->second.get();
+            if (i + child->edge.size() > n || !std::equal(child->edge.begin(), child->edge.end(), tokens + i)) break;
+            i += child->edge.size();
+            cur = child;
+            if (!cur->snapshot.empty()) {
+                best = cur;
+                best_len = i;
+            }
+        }
+        *len = best_len;
+        if (!best) {
+            misses_++;
+            return nullptr;
+        }
+        hits_++;
+        touch(tokens, best_len);
+        return &best->snapshot;
+    }
+
+    // Records `tokens` as a path, evicting old paths past the token budget.
+    void insert_path(const token * tokens, size_t n) {
+        node_at(tokens, n);
+        touch(tokens, n);
+        while (n_tokens_ > max_tokens_ && evict_leaf()) {}
+    }
+
+    // Stores the snapshot for the prefix tokens[0..n). Returns false when it alone
+    // exceeds the byte budget.
+    bool store(const token * tokens, size_t n, std::vector<uint8_t> snapshot) {
+        if (n == 0 || snapshot.empty() || snapshot.size() > max_bytes_) {
+            return false;
+        }
+        node * target = node_at(tokens, n);
+        if (target->snapshot.empty()) n_snapshots_++;
+        n_bytes_ -= target->snapshot.size();
+        n_bytes_ += snapshot.size();
+        target->snapshot = std::move(snapshot);
+        touch(tokens, n);
+        while (n_bytes_ > max_bytes_) {
+            node * lru = lru_snapshot(root_.get(), target);
+            if (!lru) break;
+            drop_snapshot(lru);
+        }
+        while (n_tokens_ > max_tokens_ && evict_leaf()) {}
+        return true;
+    }
+
+    void set_max_bytes(size_t bytes) {
+        max_bytes_ = bytes;
+        while (n_bytes_ > max_bytes_) {
+            node * lru = lru_snapshot(root_.get(), nullptr);
+            if (!lru) break;
+            drop_snapshot(lru);
+        }
+    }
+
+    void clear() {
+        root_.reset(new node);
+        n_bytes_ = 0;
+        n_tokens_ = 0;
+        n_snapshots_ = 0;
+    }
+
+    size_t   bytes()     const { return n_bytes_; }
+    size_t   max_bytes() const { return max_bytes_; }
+    size_t   tokens()    const { return n_tokens_; }
+    size_t   snapshots() const { return n_snapshots_; }
+    uint64_t hits()      const { return hits_; }
+    uint64_t misses()    const { return misses_; }
+
+private:
+    struct node {
+        std::vector<token>                     edge;       // tokens from the parent to this node
+        std::map<token, std::unique_ptr<node>> children;   // by first token of the child's edge
+        std::vector<uint8_t>                   snapshot;
+        uint64_t                               last_use = 0;
+        node *                                 parent = nullptr;
+    };
+
+    // Node ending exactly at tokens[0..n), creating and splitting edges as needed.
+    node * node_at(const token * tokens, size_t n) {
+        node * cur = root_.get();
+        size_t i = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                std::unique_ptr<node> leaf(new node);
+                leaf->edge.assign(tokens + i, tokens + n);
+                leaf->parent = cur;
+                n_tokens_ += leaf->edge.size();
+                node * raw = leaf.get();
+                cur->children[tokens[i]] = std::move(leaf);
+                return raw;
+            }
+            node * child = it->second.get();
+            size_t j = 0;
+            while (j < child->edge.size() && i + j < n && child->edge[j] == tokens[i + j]) {
+                ++j;
+            }
+            if (j < child->edge.size()) {
+                // split the edge at j: cur -> mid (edge[0..j)) -> child (edge[j..))
+                std::unique_ptr<node> mid(new node);
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + j);
+                mid->parent = cur;
+                mid->last_use = child->last_use;
+                std::unique_ptr<node> owned = std::move(it->second);
+                owned->edge.erase(owned->edge.begin(), owned->edge.begin() + j);
+                owned->parent = mid.get();
+                mid->children[owned->edge[0]] = std::move(owned);
+                node * raw = mid.get();
+                it->second = std::move(mid);
+                child = raw;
+            }
+            i += j;
+            cur = child;
+        }
+        return cur;
+    }
+
+    void touch(const token * tokens, size_t n) {
+        const uint64_t now = ++clock_;
+        node * cur = root_.get();
+        size_t i = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) break;
+            cur = it->second.get();
+            cur->last_use = now;
+            i += cur->edge.size();
+        }
+    }
+
+    node * lru_snapshot(node * n, const node * keep) {
+        node * best = (!n->snapshot.empty() && n != keep) ? n : nullptr;
+        for (auto & c : n->children) {
+            node * cand = lru_snapshot(c.second.get(), keep);
+            if (cand && (!best || cand->last_use < best->last_use)) best = cand;
+        }
+        return best;
+    }
+
+    void drop_snapshot(node * n) {
+        n_bytes_ -= n->snapshot.size();
+        n_snapshots_ -= 1;
+        std::vector<uint8_t>().swap(n->snapshot);
+    }
+
+    node * lru_leaf(node * n) {
+        if (n->children.empty()) return n == root_.get() ? nullptr : n;
+        node * best = nullptr;
+        for (auto & c : n->children) {
+            node * cand = lru_leaf(c.second.get());
+            if (cand && (!best || cand->last_use < best->last_use)) best = cand;
+        }
+        return best;
+    }
+
+    // Removes the least recently used leaf and merges its parent into the
+    // remaining child when that leaves a plain pass-through node.
+    bool evict_leaf() {
+        node * leaf = lru_leaf(root_.get());
+        if (!leaf) return false;
+        if (!leaf->snapshot.empty()) drop_snapshot(leaf);
+        n_tokens_ -= leaf->edge.size();
+        node * parent = leaf->parent;
+        parent->children.erase(leaf->edge[0]);
+        if (parent != root_.get() && parent->children.size() == 1 && parent->snapshot.empty()) {
+            std::unique_ptr<node> only = std::move(parent->children.begin()->second);
+            parent->children.clear();
+            parent->edge.insert(parent->edge.end(), only->edge.begin(), only->edge.end());
+            parent->snapshot = std::move(only->snapshot);
+            parent->last_use = only->last_use;
+            for (auto & c : only->children) c.second->parent = parent;
+            parent->children = std::move(only->children);
+        }
+        return true;
+    }
+
+    size_t                max_bytes_;
+    size_t                max_tokens_;
+    std::unique_ptr<node> root_;
+    size_t                n_bytes_     = 0;
+    size_t                n_tokens_    = 0;
+    size_t                n_snapshots_ = 0;
+    uint64_t              clock_       = 0;
+    uint64_t              hits_        = 0;
+    uint64_t              misses_      = 0;
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Default evaluation text for the perplexity column: plain English prose of a few
+// hundred tokens, so every device scores the same input. Long enough for two or
+// three 256-token windows with common tokenizers.
+static const char * const QUANT_SWEEP_SAMPLE = R"(The lighthouse stood on a narrow spit of rock at the mouth of the harbor, and for more than a century its keepers had written down the weather every evening before lighting the lamp. The logbooks were kept in a cupboard beside the stairs, bound in green cloth that had faded to the color of moss. Anyone who read them from the beginning would notice how the handwriting changed over the years, from careful copperplate to hurried pencil, and how the entries grew shorter as the work became routine.
+
+In the early volumes the keepers described everything: the direction of the wind, the height of the swell, the number of fishing boats that went out before dawn and the number that came back. They noted when the swallows arrived in spring and when the first frost silvered the railings. One keeper recorded the price of coal each month, another copied out recipes for fish stew, and a third, who seems to have been lonely, wrote short letters to his sister that he never sent.
+
+Later the harbor changed. A railway reached the town, the fishing fleet shrank, and a cannery opened on the far shore. Steamships replaced the old sailing barges, and the keepers began to list their names instead of describing their rigging. When electricity finally came to the lighthouse, the entry for that night says only that the new lamp was brighter than expected and that the keeper's wife complained it kept her awake.
+
+Scientists who study climate have since borrowed the logbooks. Because the measurements were taken at the same place and the same hour for so long, they form an unusually steady record. Small errors in a single reading matter less than the patience of the whole series. A thermometer that was half a degree wrong in one decade can be corrected by comparing it with the decade before and the decade after, the way a navigator checks a doubtful position against several landmarks at once.
+
+There is a lesson in that for anyone who measures things. A single number, however precise, rarely tells the whole story. What matters is whether it was gathered the same way each time, whether the conditions were written down, and whether someone thought to keep the notes where others could find them. The keepers did not know that their weather reports would be useful a hundred years later. They simply did the same small task every evening, and the value of the work accumulated quietly, like sand against a wall.
+
+Today the lamp turns by itself, watched over by a sensor and a radio link, and nobody lives in the keeper's cottage. Visitors climb the stairs in summer to look at the view. Most of them walk past the cupboard without opening it, but now and then someone lifts out one of the green volumes, turns a few pages, and reads aloud about a storm that blew in from the west on a winter night long ago.)";
+
+// Measurements of one quantization type in a quant sweep.
+struct quant_sweep_entry {
+    std::string type;
+    bool        ok         = false;
+    std::string error;
+    long long   file_bytes = 0;
+    double      load_ms    = 0.0;
+    double      pp_tps     = 0.0;   // prompt processing tokens/s
+    double      tg_tps     = 0.0;   // generation tokens/s
+    double      perplexity = 0.0;
+    bool        pareto     = false; // not dominated on size, tg speed and perplexity
+};
+
+// Negative log-likelihood of `target` under the softmax of `logits`.
+inline double token_nll(const float * logits, int n_vocab, int target) {
+    float max_logit = logits[0];
+    for (int i = 1; i < n_vocab; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += std::exp((double) (logits[i] - max_logit));
+    }
+    return std::log(sum) - (double) (logits[target] - max_logit);
+}
+
+// Flags the entries no other entry beats on all of file size, generation
+// speed and perplexity (and strictly on at least one).
+inline void mark_pareto_front(std::vector<quant_sweep_entry> & entries) {
+    auto dominates = [](const quant_sweep_entry & a, const quant_sweep_entry & b) {
+        const bool no_worse = a.file_bytes <= b.file_bytes && a.tg_tps >= b.tg_tps && a.perplexity <= b.perplexity;
+        const bool better   = a.file_bytes <  b.file_bytes || a.tg_tps >  b.tg_tps || a.perplexity <  b.perplexity;
+        return no_worse && better;
+    };
+    for (auto & e : entries) {
+        e.pareto = e.ok;
+        for (const auto & other : entries) {
+            if (e.pareto && &other != &e && other.ok && dominates(other, e)) {
+                e.pareto = false;
+            }
+        }
+    }
+}
+
+// Markdown table sorted by file size, in the style of bench_model's output.
+// Pareto-optimal rows are starred; dppl is relative to the lowest perplexity.
+inline std::string quant_sweep_table(std::vector<quant_sweep_entry> entries) {
+    std::sort(entries.begin(), entries.end(), [](const quant_sweep_entry & a, const quant_sweep_entry & b) {
+        return a.ok != b.ok ? a.ok : a.file_bytes < b.file_bytes;
+    });
+    double best_ppl = 0.0;
+    for (const auto & e : entries) {
+        if (e.ok && (best_ppl == 0.0 || e.perplexity < best_ppl)) best_ppl = e.perplexity;
+    }
+
+    std::string out = "| type | size MiB | load ms | pp t/s | tg t/s | ppl | dppl | pareto |\n";
+    out += "| --- | --- | --- | --- | --- | --- | --- | --- |\n";
+    char row[256];
+    for (const auto & e : entries) {
+        if (!e.ok) {
+            out += "| " + e.type + " | failed: " + e.error + " | | | | | | |\n";
+            continue;
+        }
+        snprintf(row, sizeof(row), "| %s | %.1f | %.0f | %.2f | %.2f | %.4f | %+.4f | %s |\n",
+                 e.type.c_str(), e.file_bytes / 1024.0 / 1024.0, e.load_ms, e.pp_tps, e.tg_tps,
+                 e.perplexity, e.perplexity - best_ppl, e.pareto ? "*" : "");
+        out += row;
+    }
+    return out;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Helpers for running llama_model_quantize as a background job. They do not
+// depend on llama.cpp so they can be unit tested on the host.
+
+// Per-tensor progress line printed by llama_model_quantize before each tensor,
+// e.g. "[  12/ 291]                  blk.1.attn_k.weight - [ 4096,  1024], type =    f16, ".
+struct quantize_log_line {
+    int         index = 0;   // 1-based
+    int         total = 0;
+    std::string tensor;
+};
+
+inline bool parse_quantize_log_line(const char * text, quantize_log_line & out) {
+    if (text == nullptr || text[0] != '[') {
+        return false;
+    }
+    char name[256] = {0};
+    int index = 0, total = 0;
+    if (sscanf(text, "[%d/%d] %255s", &index, &total, name) != 3 || index <= 0 || total <= 0 || index > total) {
+        return false;
+    }
+    out.index  = index;
+    out.total  = total;
+    out.tensor = name;
+    return true;
+}
+
+// Splits a "pattern=type" tensor type override as accepted by llama-quantize --tensor-type.
+inline bool parse_tensor_type_override(const std::string & spec, std::string & pattern, std::string & type) {
+    const size_t eq = spec.find('=');
+    if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size()) {
+        return false;
+    }
+    pattern = spec.substr(0, eq);
+    type    = spec.substr(eq + 1);
+    return true;
+}
+
+// Loads an importance matrix in the legacy binary format written by llama-imatrix
+// (imatrix.dat): per entry the name, the number of calls and the summed squared
+// activations, which are averaged over the calls here as llama-quantize does.
+inline bool load_legacy_imatrix(const std::string & path,
+                                std::unordered_map<std::string, std::vector<float>> & out,
+                                std::string * error = nullptr) {
+    auto fail = [&](const std::string & msg) {
+        if (error) *error = msg;
+        out.clear();
+        return false;
+    };
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return fail("cannot open " + path);
+    }
+    int32_t n_entries = 0;
+    if (!in.read((char *) &n_entries, sizeof(n_entries)) || n_entries <= 0) {
+        return fail("no entries in " + path);
+    }
+    for (int32_t i = 0; i < n_entries; ++i) {
+        int32_t len = 0;
+        if (!in.read((char *) &len, sizeof(len)) || len <= 0 || len > 4096) {
+            return fail("bad name length in entry " + std::to_string(i));
+        }
+        std::string name(len, '\0');
+        int32_t ncall = 0, nval = 0;
+        if (!in.read(&name[0], len) || !in.read((char *) &ncall, sizeof(ncall)) ||
+            !in.read((char *) &nval, sizeof(nval)) || nval <= 0) {
+            return fail("truncated entry " + std::to_string(i));
+        }
+        auto & values = out[name];
+        values.resize(nval);
+        if (!in.read((char *) values.data(), (std::streamsize) nval * sizeof(float))) {
+            return fail("truncated data for " + name);
+        }
+        if (ncall > 0) {
+            for (auto & v : values) {
+                v /= (float) ncall;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "fused_sampler.h"
+#include "llama.h"
+
+// The llama.cpp sampler chain the fused sampler replaces: penalties -> top_k -> top_p ->
+// min_p -> temp -> dist, with stages at their neutral setting left out. Used for sessions
+// without the fused sampler, by bench_sampler, and by the parity test against llama.cpp.
+inline llama_sampler * new_sampler_chain(const fused_sampler_params & params) {
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = true;
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    if (params.repeat_last_n > 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_penalties(params.repeat_last_n, params.repeat_penalty, 0.0f, 0.0f));
+    }
+    if (params.top_k > 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
+    }
+    if (params.top_p < 1.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, 1));
+    }
+    if (params.min_p > 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_min_p(params.min_p, 1));
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temp));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
+    return smpl;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+// Packing of independent sequences (e.g. query+passage pairs for a reranker) into shared
+// decode batches. Each batch holds at most `max_tokens` tokens and `max_seqs` sequences;
+// fewer batches mean fewer graph launches for the same tokens.
+
+// Indices of the sequences in each batch. First-fit decreasing: the longest sequences are
+// placed first, each into the first batch with room left. A sequence longer than
+// `max_tokens` gets a batch of its own; callers truncate beforehand.
+inline std::vector<std::vector<size_t>> pack_sequences(const std::vector<size_t> & lengths,
+                                                       size_t max_tokens, size_t max_seqs) {
+    std::vector<size_t> order(lengths.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lengths[a] > lengths[b]; });
+
+    std::vector<std::vector<size_t>> batches;
+    std::vector<size_t> used;
+    max_seqs = std::max<size_t>(1, max_seqs);
+    for (size_t idx : order) {
+        size_t b = 0;
+        while (b < batches.size() && (batches[b].size() >= max_seqs || used[b] + lengths[idx] > max_tokens)) {
+            ++b;
+        }
+        if (b == batches.size()) {
+            batches.emplace_back();
+            used.push_back(0);
+        }
+        batches[b].push_back(idx);
+        used[b] += lengths[idx];
+    }
+    return batches;
+}
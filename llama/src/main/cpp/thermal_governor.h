@@ -0,0 +1,151 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+
+// Decode throttling driven by thermal sysfs and the per-token latency trend.
+// `sysfs_root` is normally /sys and only overridden by tests.
+
+// Temperature of the hottest thermal zone in degrees Celsius, or NAN when no zone is readable.
+inline float thermal_max_temp_c(const std::string & sysfs_root = "/sys") {
+    float hottest = NAN;
+    struct stat st{};
+    const std::string base = sysfs_root + "/class/thermal/thermal_zone";
+    for (int zone = 0; stat((base + std::to_string(zone)).c_str(), &st) == 0; ++zone) {
+        std::ifstream f(base + std::to_string(zone) + "/temp");
+        long raw = 0;
+        if (!(f >> raw)) {
+            continue;
+        }
+        // millidegrees on almost every device, whole degrees on a few
+        const float c = std::labs(raw) >= 1000 ? raw / 1000.0f : (float) raw;
+        if (c <= 0.0f || c > 150.0f) {
+            continue;   // disconnected sensors report 0, negative or bogus values
+        }
+        if (std::isnan(hottest) || c > hottest) {
+            hottest = c;
+        }
+    }
+    return hottest;
+}
+
+struct throttle_config {
+    float  hot_c          = 70.0f;   // step down at or above this temperature
+    float  cool_c         = 60.0f;   // only recover below this temperature
+    double slow_ratio     = 1.5;     // smoothed latency over its expected value that counts as degrading
+    double recover_ratio  = 1.15;
+    int    warmup_tokens  = 8;       // tokens used to establish the baseline
+    int    settle_tokens  = 16;      // tokens to wait after a change before stepping down again
+};
+
+// What the decode loop should run with at the current level.
+struct throttle_limits {
+    int    n_threads;
+    int    ubatch;
+    double min_token_ms;   // pacing: 0 = as fast as possible
+};
+
+// Four levels: 0 full speed, 1 smaller prefill ubatch, 2 one thread fewer and paced to
+// ~80% of the baseline token rate, 3 half the threads, a quarter of the ubatch and ~60%.
+// KV state is never touched; the caller applies limits() after every change.
+class throttle_governor {
+public:
+    static constexpr int MAX_LEVEL = 3;
+
+    explicit throttle_governor(int max_threads = 1, int max_ubatch = 64, throttle_config cfg = {})
+        : cfg_(cfg) {
+        reset(max_threads, max_ubatch);
+    }
+
+    void reset(int max_threads, int max_ubatch) {
+        max_threads_ = std::max(1, max_threads);
+        max_ubatch_  = std::max(16, max_ubatch);
+        level_ = 0;
+        n_tokens_ = 0;
+        since_change_ = 0;
+        fast_ms_ = 0.0;
+        baseline_ms_ = 0.0;
+    }
+
+    // Feeds the decode time of one token and the current temperature (NAN if unknown).
+    // Returns true when the level changed.
+    bool on_token(double decode_ms, float temp_c) {
+        n_tokens_++;
+        since_change_++;
+        fast_ms_ = n_tokens_ == 1 ? decode_ms : fast_ms_ + 0.3 * (decode_ms - fast_ms_);
+        if (n_tokens_ <= cfg_.warmup_tokens) {
+            baseline_ms_ = baseline_ms_ == 0.0 ? fast_ms_ : std::min(baseline_ms_, fast_ms_);
+            return false;
+        }
+
+        const bool   hot   = !std::isnan(temp_c) && temp_c >= cfg_.hot_c;
+        const bool   cool  = std::isnan(temp_c) || temp_c < cfg_.cool_c;
+        const double ratio = fast_ms_ / expected_ms();
+
+        if (level_ < MAX_LEVEL && since_change_ >= cfg_.settle_tokens && (hot || ratio > cfg_.slow_ratio)) {
+            return set_level(level_ + 1);
+        }
+        if (level_ > 0 && since_change_ >= 2 * cfg_.settle_tokens && cool && ratio < cfg_.recover_ratio) {
+            return set_level(level_ - 1);
+        }
+        if (level_ == 0 && !hot) {
+            // latency grows slowly with the context; follow it without chasing spikes
+            baseline_ms_ = fast_ms_ < baseline_ms_ ? fast_ms_ : baseline_ms_ + 0.01 * (fast_ms_ - baseline_ms_);
+        }
+        return false;
+    }
+
+    // A decode far beyond any normal latency (the watchdog): throttle fully at once.
+    bool on_stall() {
+        return set_level(MAX_LEVEL);
+    }
+
+    throttle_limits limits() const {
+        throttle_limits l = { max_threads_, max_ubatch_, 0.0 };
+        if (level_ >= 1) {
+            l.ubatch = std::max(16, max_ubatch_ / 2);
+        }
+        if (level_ >= 2) {
+            l.n_threads = std::max(1, max_threads_ - 1);
+            l.min_token_ms = baseline_ms_ * 1.25;
+        }
+        if (level_ >= 3) {
+            l.n_threads = std::max(1, max_threads_ / 2);
+            l.ubatch = std::max(16, max_ubatch_ / 4);
+            l.min_token_ms = baseline_ms_ * 1.6;
+        }
+        return l;
+    }
+
+    int    level()       const { return level_; }
+    double fast_ms()     const { return fast_ms_; }
+    double baseline_ms() const { return baseline_ms_; }
+
+private:
+    // Latency the current level should have if nothing else degraded: fewer threads are slower.
+    double expected_ms() const {
+        const double base = baseline_ms_ > 0.0 ? baseline_ms_ : fast_ms_;
+        return std::max(1e-3, base * max_threads_ / limits().n_threads);
+    }
+
+    bool set_level(int level) {
+        level = std::max(0, std::min(MAX_LEVEL, level));
+        if (level == level_) {
+            return false;
+        }
+        level_ = level;
+        since_change_ = 0;
+        return true;
+    }
+
+    throttle_config cfg_;
+    int    max_threads_  = 1;
+    int    max_ubatch_   = 64;
+    int    level_        = 0;
+    int    n_tokens_     = 0;
+    int    since_change_ = 0;
+    double fast_ms_      = 0.0;   // EWMA of the decode latency
+    double baseline_ms_  = 0.0;   // unthrottled latency at the current context length
+};
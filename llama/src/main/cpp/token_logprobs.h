@@ -0,0 +1,184 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "fused_sampler.h"
+
+// Per-token log-probabilities for the app: the chosen token and its top-k alternatives,
+// written into a ring inside a caller-provided (direct ByteBuffer) block of memory, so the
+// decode loop allocates nothing and the JVM creates no objects per token.
+//
+// Ring layout, native byte order:
+//   header   magic u32, version u32, capacity u32, top_k u32, record_bytes u32, pad u32,
+//            written u64 (records pushed so far; record i lives in slot i % capacity)
+//   records  token i32, logprob f32, n_alt i32, then top_k x (id i32, logprob f32)
+//
+// `written` is published with a release store after the record is complete. Readers load
+// `written` first and then read only records below it; a record is overwritten once
+// `capacity` newer ones were pushed. One record per emitted token, in emission order.
+
+struct logprob_entry {
+    int32_t id;
+    float   logprob;
+};
+
+// log(sum(exp(x))) over x[0..n), stable against large logits.
+inline float logsumexp(const float * x, size_t n) {
+    if (n == 0) {
+        return -INFINITY;
+    }
+    const float max_x = fused_block_max(x, n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += expf(x[i] - max_x);
+    }
+    return max_x + logf(sum);
+}
+
+// The `k` largest logits, best first, into `out` (reused: no allocation once it has
+// grown to k). Entries hold raw logits; subtract logsumexp() for log-probabilities.
+inline void select_top_logits(const float * logits, int32_t n_vocab, size_t k, std::vector<logprob_entry> & out) {
+    auto better = [](const logprob_entry & a, const logprob_entry & b) {
+        return a.logprob > b.logprob || (a.logprob == b.logprob && a.id < b.id);
+    };
+    out.clear();
+    k = std::min(k, (size_t) std::max(0, n_vocab));
+    if (k == 0) {
+        return;
+    }
+    int32_t i = 0;
+    for (; i < n_vocab && out.size() < k; ++i) {
+        out.push_back({ i, logits[i] });
+    }
+    std::make_heap(out.begin(), out.end(), better);   // front: worst of the current top-k
+    for (; i < n_vocab; ++i) {
+        if (logits[i] > out.front().logprob) {
+            std::pop_heap(out.begin(), out.end(), better);
+            out.back() = { i, logits[i] };
+            std::push_heap(out.begin(), out.end(), better);
+        }
+    }
+    std::sort(out.begin(), out.end(), better);
+}
+
+class logprob_ring {
+public:
+    static constexpr uint32_t MAGIC   = 0x4c505247;   // "LPRG"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t   HEADER  = 32;
+
+    static size_t record_bytes(uint32_t top_k) { return 12 + (size_t) top_k * 8; }
+
+    // Bytes a ring of `capacity` records with `top_k` alternatives needs.
+    static size_t bytes_for(uint32_t capacity, uint32_t top_k) { return HEADER + (size_t) capacity * record_bytes(top_k); }
+
+    // Lays the ring out over `mem` (8-byte aligned); as many records as fit. False when
+    // not even one does.
+    bool attach(void * mem, size_t bytes, uint32_t top_k) {
+        detach();
+        if (!mem || reinterpret_cast<uintptr_t>(mem) % alignof(uint64_t) != 0 || bytes < bytes_for(1, top_k)) {
+            return false;
+        }
+        base_     = static_cast<uint8_t *>(mem);
+        top_k_    = top_k;
+        capacity_ = (uint32_t) ((bytes - HEADER) / record_bytes(top_k));
+        const uint32_t header[6] = { MAGIC, VERSION, capacity_, top_k_, (uint32_t) record_bytes(top_k_), 0 };
+        std::memcpy(base_, header, sizeof(header));
+        written_ = 0;
+        publish();
+        return true;
+    }
+
+    void detach() {
+        base_ = nullptr;
+        capacity_ = 0;
+        top_k_ = 0;
+        written_ = 0;
+    }
+
+    bool     attached() const { return base_ != nullptr; }
+    uint32_t top_k()    const { return top_k_; }
+    uint64_t written()  const { return written_; }
+
+    // Writes one record; alternatives beyond top_k are dropped.
+    void push(int32_t token, float logprob, const logprob_entry * alts, size_t n_alt) {
+        if (!base_) {
+            return;
+        }
+        n_alt = std::min(n_alt, (size_t) top_k_);
+        uint8_t * rec = base_ + HEADER + (written_ % capacity_) * record_bytes(top_k_);
+        const int32_t n = (int32_t) n_alt;
+        std::memcpy(rec, &token, 4);
+        std::memcpy(rec + 4, &logprob, 4);
+        std::memcpy(rec + 8, &n, 4);
+        std::memcpy(rec + 12, alts, n_alt * sizeof(logprob_entry));
+        written_++;
+        publish();
+    }
+
+private:
+    // release: a reader that sees the new count also sees the record bytes written before
+    void publish() {
+        __atomic_store_n(reinterpret_cast<uint64_t *>(base_ + 24), written_, __ATOMIC_RELEASE);
+    }
+
+    uint8_t * base_     = nullptr;
+    uint32_t  capacity_ = 0;
+    uint32_t  top_k_    = 0;
+    uint64_t  written_  = 0;
+};
+
+// Records computed before their token is emitted: speculative decoding samples accepted
+// drafts and the token after them ahead of time. Kept in sampling order and moved into the
+// ring as the tokens are emitted, so tokens that never are (end of reply, length limit)
+// leave no record. Storage is reused once the queue drains.
+class logprob_pending {
+public:
+    void push(int32_t token, float logprob, const logprob_entry * alts, size_t n_alt) {
+        if (head_ == records_.size()) {
+            clear();
+        }
+        records_.push_back({ token, logprob, alts_.size(), n_alt });
+        alts_.insert(alts_.end(), alts, alts + n_alt);
+    }
+
+    // Moves the oldest record into `ring` if it is for `token`. A record for another token
+    // means the queue is out of step with the stream; it is dropped with the rest.
+    bool emit(int32_t token, logprob_ring & ring) {
+        if (head_ == records_.size()) {
+            return false;
+        }
+        const record & r = records_[head_];
+        if (r.token != token) {
+            clear();
+            return false;
+        }
+        ring.push(r.token, r.logprob, alts_.data() + r.alt_offset, r.n_alt);
+        head_++;
+        return true;
+    }
+
+    void clear() {
+        records_.clear();
+        alts_.clear();
+        head_ = 0;
+    }
+
+    size_t size() const { return records_.size() - head_; }
+
+private:
+    struct record {
+        int32_t token;
+        float   logprob;
+        size_t  alt_offset;
+        size_t  n_alt;
+    };
+    std::vector<record>        records_;
+    std::vector<logprob_entry> alts_;
+    size_t                     head_ = 0;
+};
+
+static_assert(sizeof(logprob_entry) == 8, "ring records store (id, logprob) pairs");
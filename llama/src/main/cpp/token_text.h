@@ -0,0 +1,72 @@
+#pragma once
+#include <string>
+
+// Text handling of every streamed token, between detokenization and NewStringUTF.
+
+// True when `string` holds only complete UTF-8 sequences; a token piece that ends in
+// the middle of a character is held back until the next piece completes it.
+inline bool is_valid_utf8(const char * string) {
+    if (!string) {
+        return true;
+    }
+
+    const unsigned char * bytes = (const unsigned char *)string;
+    int num;
+
+    while (*bytes != 0x00) {
+        if ((*bytes & 0x80) == 0x00) {
+            // U+0000 to U+007F
+            num = 1;
+        } else if ((*bytes & 0xE0) == 0xC0) {
+            // U+0080 to U+07FF
+            num = 2;
+        } else if ((*bytes & 0xF0) == 0xE0) {
+            // U+0800 to U+FFFF
+            num = 3;
+        } else if ((*bytes & 0xF8) == 0xF0) {
+            // U+10000 to U+10FFFF
+            num = 4;
+        } else {
+            return false;
+        }
+
+        bytes += 1;
+        for (int i = 1; i < num; ++i) {
+            if ((*bytes & 0xC0) != 0x80) {
+                return false;
+            }
+            bytes += 1;
+        }
+    }
+
+    return true;
+}
+
+// Chat markers and reasoning phrases; only used to annotate verbose token logs.
+inline bool has_thinking_markers(const std::string & text) {
+    return text.find("<|im_start|>") != std::string::npos ||
+           text.find("<|user|>") != std::string::npos ||
+           text.find("<|assistant|>") != std::string::npos ||
+           text.find("<think>") != std::string::npos ||
+           text.find("</think>") != std::string::npos ||
+           text.find("Let me think") != std::string::npos ||
+           text.find("Let me analyze") != std::string::npos ||
+           text.find("I need to") != std::string::npos ||
+           text.find("First,") != std::string::npos ||
+           text.find("Step") != std::string::npos ||
+           text.find("thinking") != std::string::npos ||
+           text.find("reasoning") != std::string::npos;
+}
+
+// Removes <think>...</think> blocks and stray tags, for non-reasoning models.
+inline void strip_think_tags(std::string & text) {
+    std::string::size_type start = 0;
+    while ((start = text.find("<think>", start)) != std::string::npos) {
+        auto end = text.find("</think>", start);
+        if (end == std::string::npos) { break; }
+        text.erase(start, (end + 8) - start);
+    }
+    // clean stray tags
+    while ((start = text.find("<think>")) != std::string::npos) text.erase(start, 7);
+    while ((start = text.find("</think>")) != std::string::npos) text.erase(start, 8);
+}
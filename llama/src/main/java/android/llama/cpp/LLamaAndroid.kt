@@ -10,11 +10,24 @@ import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.flow
 import kotlinx.coroutines.flow.flowOn
 import kotlinx.coroutines.withContext
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 import java.util.concurrent.Executors
+import java.util.concurrent.TimeUnit
+import java.util.concurrent.locks.ReentrantReadWriteLock
+import kotlin.concurrent.read
 import kotlin.concurrent.thread
+import kotlin.concurrent.write
 import kotlinx.coroutines.flow.*
 import kotlinx.coroutines.withTimeout
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.launch
+import org.json.JSONArray
+import org.json.JSONObject
 import kotlin.time.Duration.Companion.minutes
 import kotlin.time.Duration.Companion.seconds
 
@@ -31,6 +44,10 @@ class LLamaAndroid {
     @Volatile private var batchHandleCache: Long = 0L
     @Volatile private var samplerHandleCache: Long = 0L
 
+    // Samples with the single-pass native sampler instead of the llama.cpp chain.
+    // Same tokens for the same settings; takes effect on the next load().
+    @Volatile var useFusedSampler: Boolean = false
+
     private val _isSending = mutableStateOf(false)
     private val isSending: Boolean by _isSending
 
@@ -85,8 +102,14 @@ class LLamaAndroid {
 
         stopGeneration = true
         _isMarked.value = false
+        // Also interrupts a prefill or decode that is running right now
+        val context = contextHandleCache
+        if (nativeLibraryLoaded && context != 0L) cancel_generation(context)
     }
 
+    /** JSON with the number of native cancels and the last cancel-to-idle latency. */
+    fun getCancelStats(): String = get_cancel_stats()
+
     private val executor = Executors.newSingleThreadExecutor {
         thread(start = false, name = "Llm-RunLoop") {
             Log.d(tag, "Dedicated thread for native code: ${Thread.currentThread().name}")
@@ -136,15 +159,69 @@ class LLamaAndroid {
 
     private external fun log_to_android()
     private external fun load_model(filename: String): Long
+    private external fun load_model_ex(
+        filename: String,
+        useMmap: Boolean,
+        useMlock: Boolean,
+        prefetch: Boolean,
+        listener: LoadProgressListener?
+    ): Long
+    private external fun acquire_model(
+        filename: String,
+        useMmap: Boolean,
+        useMlock: Boolean,
+        prefetch: Boolean,
+        chatModel: Boolean,
+        listener: LoadProgressListener?
+    ): Long
+    private external fun release_model(model: Long)
+    private external fun set_model_cache_budget(bytes: Long)
+    private external fun trim_model_cache()
+    private external fun get_model_cache_stats(): String
+    private external fun scan_model_metadata(path: String): String
+    private external fun scan_model_dir(dir: String, nThreads: Int): String
+    private external fun acquire_vocab(path: String): Long
+    private external fun release_vocab(vocab: Long)
+    private external fun vocab_tokenize(vocab: Long, text: String, addSpecial: Boolean, parseSpecial: Boolean): IntArray
+    private external fun vocab_detokenize(vocab: Long, tokens: IntArray, special: Boolean): String
+    private external fun vocab_special_tokens(vocab: Long): String
+    private external fun model_chat_template(model: Long, name: String?): String
+    private external fun vocab_apply_chat_template(model: Long, messagesJson: String, addAssistant: Boolean): String
+    private external fun preload_model(filename: String, useMmap: Boolean, useMlock: Boolean, nThreads: Int, nGpuLayers: Int): Boolean
+    private external fun await_preload(timeoutMs: Long): Int
+    private external fun discard_preload()
+    private external fun get_preload_stats(): String
+    private external fun cancel_load()
+    private external fun begin_load()
+    private external fun get_load_stats(): String
     private external fun free_model(model: Long)
     private external fun new_context(model: Long, userThreads: Int): Long
     private external fun free_context(context: Long)
+    private external fun cancel_generation(context: Long)
+    private external fun get_cancel_stats(): String
+    private external fun get_prefill_progress(context: Long): String
+    private external fun get_ttft_stats(context: Long): String
+    private external fun set_throttle(enabled: Boolean, sysfsRoot: String?)
+    private external fun get_throttle_stats(context: Long): String
+    private external fun set_prompt_lookup(enabled: Boolean, ngramMin: Int, ngramMax: Int, maxDraft: Int)
+    private external fun get_spec_stats(context: Long): String
     private external fun backend_init(numa: Boolean)
     private external fun backend_free()
     private external fun set_backend(backend: String): Boolean
     private external fun new_batch(nTokens: Int, embd: Int, nSeqMax: Int): Long
     private external fun free_batch(batch: Long)
     private external fun new_sampler(top_p: Float, top_k: Int, temp: Float): Long
+    private external fun new_fused_sampler(top_p: Float, top_k: Int, temp: Float): Long
+    private external fun bench_sampler(
+        context: Long,
+        top_p: Float,
+        top_k: Int,
+        min_p: Float,
+        temp: Float,
+        repeatPenalty: Float,
+        repeatLastN: Int,
+        nIter: Int
+    ): String
     private external fun free_sampler(sampler: Long)
     private external fun bench_model(
         context: Long,
@@ -186,11 +263,77 @@ class LLamaAndroid {
     ): String?
 
     private external fun kv_cache_clear(context: Long)
+    private external fun end_generation(context: Long)
+    private external fun set_tool_grammar(context: Long, kind: String, source: String): Boolean
+    private external fun clear_tool_grammar(context: Long)
+    private external fun get_tool_grammar_stats(): String
+    private external fun set_prefix_cache(enabled: Boolean, budgetBytes: Long)
+    private external fun clear_prefix_cache()
+    private external fun get_prefix_cache_stats(): String
+    private external fun session_create(model: Long, nThreads: Int, top_p: Float, top_k: Int, temp: Float, fused: Boolean): Long
+    private external fun session_free(session: Long)
+    private external fun session_completion_init(session: Long, text: String, nLen: Int): Int
+    private external fun session_completion_init_tokens(session: Long, history: IntArray, text: String, nLen: Int): Int
+    private external fun completion_init_tokens(context: Long, batch: Long, history: IntArray, text: String, nLen: Int): Int
+    private external fun tokenize_prompt(model: Long, text: String, addBos: Boolean): IntArray
+    private external fun session_completion_loop(session: Long, nLen: Int, ncur: IntVar): String?
+    private external fun session_cancel(session: Long)
+    private external fun session_kv_clear(session: Long)
+    private external fun session_end_generation(session: Long)
+    private external fun session_stats(session: Long): String
+    private external fun session_lora_apply(session: Long, adapters: LongArray, scales: FloatArray): Boolean
+    private external fun lora_load(model: Long, path: String): Long
+    private external fun lora_release(adapter: Long)
+    private external fun lora_apply(context: Long, adapters: LongArray, scales: FloatArray): Boolean
+    private external fun get_lora_stats(): String
+    private external fun set_logprobs(context: Long, buffer: ByteBuffer?, topK: Int): Int
+    private external fun session_set_logprobs(session: Long, buffer: ByteBuffer?, topK: Int): Int
 
     private external fun get_eot_str(model: Long): String
     private external fun count_tokens(model: Long, text: String): Int
-    private external fun get_embeddings(model: Long, text: String): FloatArray
+    private external fun budget_context(
+        allmessages: Array<Map<String, String>>,
+        model: Long,
+        chatFormat: String,
+        nCtx: Int,
+        nReserve: Int
+    ): String
+    private external fun count_tokens_batch(model: Long, texts: Array<String>): IntArray
+    private external fun tokenize_batch(model: Long, texts: Array<String>, offsets: IntArray): IntArray
+    private external fun get_embeddings(model: Long, text: String, optionsJson: String): FloatArray
+    private external fun new_rerank_context(model: Long, nCtx: Int, nSeqMax: Int): Long
+    private external fun free_embeddings_context(context: Long)
+    private external fun rerank(context: Long, query: String, passages: Array<String>): FloatArray
+    private external fun get_rerank_stats(): String
+    private external fun bench_rerank(context: Long, query: String, passages: Array<String>, nIter: Int): String
     private external fun quantizeNative(inputPath: String, outputPath: String, quantizeType: String): Int
+    private external fun quantize_start(inputPath: String, outputPath: String, quantizeType: String, optionsJson: String): Long
+    private external fun quantize_poll(job: Long): String
+    private external fun quantize_cancel(job: Long)
+    private external fun quantize_free(job: Long)
+    private external fun quant_sweep_start(
+        sourcePath: String,
+        scratchDir: String,
+        types: Array<String>,
+        sample: String?,
+        optionsJson: String
+    ): Long
+    private external fun quant_sweep_poll(job: Long): String
+    private external fun quant_sweep_cancel(job: Long)
+    private external fun quant_sweep_free(job: Long)
+    private external fun index_start(model: Long, text: String, optionsJson: String): Long
+    private external fun index_poll(job: Long): String
+    private external fun index_cancel(job: Long)
+    private external fun index_free(job: Long)
+    private external fun new_embeddings_context(model: Long, optionsJson: String): Long
+    private external fun store_open(path: String, modelId: String, dim: Int, half: Boolean): Long
+    private external fun store_close(store: Long)
+    private external fun store_append(store: Long, ids: LongArray, vectors: FloatArray): Boolean
+    private external fun store_append_text(store: Long, context: Long, id: Long, text: String): Boolean
+    private external fun store_remove(store: Long, id: Long): Boolean
+    private external fun store_search(store: Long, query: FloatArray, k: Int, outIds: LongArray): FloatArray
+    private external fun store_compact(store: Long): Boolean
+    private external fun store_stats(store: Long): String
 
     private external fun getMemoryUsageNative(context: Long): Long
     private external fun set_verbose_tokens(enable: Boolean)
@@ -211,15 +354,57 @@ class LLamaAndroid {
         }
     }
 
+    /**
+     * Times the llama.cpp sampler chain against the fused sampler on the logits of the
+     * last decode. Returns JSON with chain_us/fused_us per token and how many of the
+     * [nIter] picks were identical.
+     */
+    suspend fun benchSampler(
+        topP: Float = 0.9f,
+        topK: Int = 40,
+        minP: Float = 0.0f,
+        temp: Float = 0.8f,
+        repeatPenalty: Float = 1.0f,
+        repeatLastN: Int = 0,
+        nIter: Int = 200
+    ): String {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> bench_sampler(state.context, topP, topK, minP, temp, repeatPenalty, repeatLastN, nIter)
+                else -> throw IllegalStateException("No model loaded")
+            }
+        }
+    }
+
     suspend fun getOffloadCounts(): IntArray {
         return withContext(runLoop) { get_offload_counts() }
     }
 
-    suspend fun load(pathToModel: String, userThreads: Int, topK: Int, topP: Float, temp: Float, gpuLayers: Int = -1){
+    /**
+     * Loads a model and creates its context, batch and sampler.
+     *
+     * [useMmap]/[useMlock] map to llama.cpp's model params; [prefetch] asks the kernel to
+     * start reading the tensor data before the loader touches it. [onProgress] is invoked
+     * on the run loop thread with values in 0..1 while tensors are loaded.
+     */
+    suspend fun load(
+        pathToModel: String,
+        userThreads: Int,
+        topK: Int,
+        topP: Float,
+        temp: Float,
+        gpuLayers: Int = -1,
+        useMmap: Boolean = true,
+        useMlock: Boolean = false,
+        prefetch: Boolean = false,
+        onProgress: LoadProgressListener? = null
+    ){
         if (!nativeLibraryLoaded) {
             // Best-effort synchronous load to avoid UnsatisfiedLinkError on first JNI call
             ensureLibraryLoaded()
         }
+        // from here on a cancelLoad() applies to this load, even before it reaches native code
+        begin_load()
         withContext(runLoop) {
             when (threadLocalState.get()) {
                 is State.Idle -> {
@@ -230,7 +415,11 @@ class LLamaAndroid {
                     var batch = 0L
                     var sampler = 0L
                     try {
-                        model = load_model(pathToModel)
+                        // Let a background preload finish first: same model => instant hand-over,
+                        // different model => avoid two concurrent loads competing for memory
+                        await_preload(-1)
+                        // Served from the native residency cache when the same file was used recently
+                        model = acquire_model(pathToModel, useMmap, useMlock, prefetch, true, onProgress)
                         if (model == 0L) throw IllegalStateException("load_model() failed")
 
                         // Configure native stream filtering (default on). UI can still collapse/hide thinking tokens.
@@ -242,7 +431,11 @@ class LLamaAndroid {
                         batch = new_batch(1024, 0, 1)
                         if (batch == 0L) throw IllegalStateException("new_batch() failed")
 
-                        sampler = new_sampler(top_k = topK, top_p = topP, temp = temp)
+                        sampler = if (useFusedSampler) {
+                            new_fused_sampler(top_k = topK, top_p = topP, temp = temp)
+                        } else {
+                            new_sampler(top_k = topK, top_p = topP, temp = temp)
+                        }
                         if (sampler == 0L) throw IllegalStateException("new_sampler() failed")
 
                         val modelEotStr = get_eot_str(model)
@@ -260,7 +453,7 @@ class LLamaAndroid {
                         if (sampler != 0L) free_sampler(sampler)
                         if (batch != 0L) free_batch(batch)
                         if (context != 0L) free_context(context)
-                        if (model != 0L) free_model(model)
+                        if (model != 0L) release_model(model)
                         threadLocalState.set(State.Idle)
                         throw e
                     }
@@ -272,6 +465,136 @@ class LLamaAndroid {
         }
     }
 
+    /**
+     * Starts loading [pathToModel] on a native background thread: the weights are read into
+     * the page cache, the model is loaded into the residency cache and a one-token decode
+     * warms the backend. A later [load] of the same file picks it up without reloading.
+     * Returns false if another preload is still running.
+     */
+    fun preload(
+        pathToModel: String,
+        userThreads: Int = 0,
+        gpuLayers: Int = -1,
+        useMmap: Boolean = true,
+        useMlock: Boolean = false
+    ): Boolean {
+        if (!ensureLibraryLoaded()) return false
+        // must match the offload setting of the eventual load() so the cache key lines up
+        return preload_model(pathToModel, useMmap, useMlock, userThreads, gpuLayers)
+    }
+
+    /**
+     * Waits up to [timeoutMs] (negative = forever) for a running [preload].
+     * Returns true once the model is resident and warmed up.
+     */
+    suspend fun awaitPreload(timeoutMs: Long = -1): Boolean {
+        if (!nativeLibraryLoaded) return false
+        return withContext(Dispatchers.IO) { await_preload(timeoutMs) == 1 }
+    }
+
+    /**
+     * Drops the reference a finished [preload] holds when its model will not be used, and
+     * aborts a preload that is still running.
+     */
+    fun discardPreload() {
+        if (!nativeLibraryLoaded) return
+        discard_preload()
+    }
+
+    /**
+     * JSON with the preload phases (page warm, load, warm-up decode) and the time to first
+     * token of the first reply in this process, flagged with whether it used a preload.
+     */
+    suspend fun getPreloadStats(): String {
+        return withContext(runLoop) { get_preload_stats() }
+    }
+
+    /**
+     * Aborts an in-flight [load], including one still waiting for a [preload]. Safe to call
+     * from any thread; the pending load fails with a CancellationException. A [preload] is
+     * not affected; [discardPreload] aborts it.
+     */
+    fun cancelLoad() {
+        if (!nativeLibraryLoaded) return
+        cancel_load()
+    }
+
+    /**
+     * JSON timing breakdown of the last load: cold/warm, backend init, prefetch,
+     * metadata and tensor phases in milliseconds.
+     */
+    suspend fun getLoadStats(): String {
+        return withContext(runLoop) { get_load_stats() }
+    }
+
+    /**
+     * Sets the memory budget for models kept resident after [unload].
+     * Least recently used models beyond the budget are freed.
+     */
+    suspend fun setModelCacheBudget(bytes: Long) {
+        withContext(runLoop) { set_model_cache_budget(bytes) }
+    }
+
+    /** Frees every resident model that is not currently loaded. */
+    suspend fun trimModelCache() {
+        withContext(runLoop) { trim_model_cache() }
+    }
+
+    /** JSON with resident bytes, budget, hits, misses and evictions of the model cache. */
+    suspend fun getModelCacheStats(): String {
+        return withContext(runLoop) { get_model_cache_stats() }
+    }
+
+    /**
+     * JSON metadata read from the GGUF header only (architecture, name, parameter count,
+     * context length, quantization, chat template, ...) without loading tensors.
+     * Results are cached by path, size and mtime. Failures carry an "error" field.
+     */
+    suspend fun scanModelMetadata(path: String): String {
+        if (!ensureLibraryLoaded()) return "{}"
+        return withContext(Dispatchers.IO) { scan_model_metadata(path) }
+    }
+
+    /** JSON array of [scanModelMetadata] results for every .gguf file in [dir], read in parallel. */
+    suspend fun scanModelDirectory(dir: String, nThreads: Int = 0): String {
+        if (!ensureLibraryLoaded()) return "[]"
+        return withContext(Dispatchers.IO) { scan_model_dir(dir, nThreads) }
+    }
+
+    /**
+     * Opens the tokenizer of a GGUF file without its weights (vocab_only). The handle costs a
+     * few MB, is shared between callers and must be returned with [releaseVocab].
+     * Tokenizer calls on it are thread-safe and do not go through the inference thread.
+     */
+    suspend fun acquireVocab(pathToModel: String): Long {
+        if (!ensureLibraryLoaded()) throw IllegalStateException("native library not loaded")
+        return withContext(Dispatchers.IO) { acquire_vocab(pathToModel) }
+    }
+
+    fun releaseVocab(vocab: Long) {
+        if (!nativeLibraryLoaded || vocab == 0L) return
+        release_vocab(vocab)
+    }
+
+    fun tokenize(vocab: Long, text: String, addSpecial: Boolean = false, parseSpecial: Boolean = true): IntArray =
+        vocab_tokenize(vocab, text, addSpecial, parseSpecial)
+
+    fun detokenize(vocab: Long, tokens: IntArray, special: Boolean = true): String =
+        vocab_detokenize(vocab, tokens, special)
+
+    /** JSON with the BOS/EOS/EOT/SEP/NL/PAD ids and texts, vocab size and add_bos/add_eos flags. */
+    fun getSpecialTokens(vocab: Long): String = vocab_special_tokens(vocab)
+
+    /** Chat template embedded in a vocab or full model handle; empty if it has none. */
+    fun getChatTemplate(model: Long, name: String? = null): String = model_chat_template(model, name)
+
+    /**
+     * Formats a JSON array of {role, content} messages with the embedded template,
+     * e.g. to count prompt tokens while the weights are still loading.
+     */
+    fun applyChatTemplate(model: Long, messagesJson: String, addAssistant: Boolean = true): String =
+        vocab_apply_chat_template(model, messagesJson, addAssistant)
+
     fun setBackendSearchDir(dir: String) {
         if (!nativeLibraryLoaded) {
             ensureLibraryLoaded()
@@ -312,12 +635,65 @@ class LLamaAndroid {
         return res
     }
 
-    suspend fun getEmbeddings(text: String): FloatArray {
+    /**
+     * Token counts of [texts] (e.g. one per chat message) in a single native call; large
+     * lists are tokenized on several cores.
+     */
+    suspend fun countTokens(texts: List<String>): IntArray = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> count_tokens_batch(state.model, texts.toTypedArray())
+            else -> IntArray(texts.size)
+        }
+    }
+
+    /**
+     * Picks the [messages] that fit in [nCtx] tokens with [nReserve] left for the reply:
+     * every system message and as many of the latest turns as fit. Estimated from cached
+     * per-message token counts and the template's per-message overhead, with no render.
+     */
+    suspend fun fitContextWindow(
+        messages: List<Map<String, String>>,
+        chatFormat: String,
+        nCtx: Int,
+        nReserve: Int = nlen
+    ): ContextWindow = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> {
+                val json = JSONObject(budget_context(messages.toTypedArray(), state.model, chatFormat, nCtx, nReserve))
+                val kept = json.getJSONArray("kept")
+                ContextWindow(
+                    kept = List(kept.length()) { kept.getInt(it) },
+                    dropped = json.getInt("dropped"),
+                    tokens = json.getInt("tokens"),
+                    fits = json.getBoolean("fits")
+                )
+            }
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    /** Token ids of [texts]; see [TokenizedBatch]. */
+    suspend fun tokenize(texts: List<String>): TokenizedBatch = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> {
+                val offsets = IntArray(texts.size + 1)
+                val ids = tokenize_batch(state.model, texts.toTypedArray(), offsets)
+                TokenizedBatch(ids, offsets)
+            }
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    /**
+     * Embeds [text] with the loaded model. [options] picks the pooling and can normalize and
+     * truncate the vector natively, so callers need no post-processing.
+     */
+    suspend fun getEmbeddings(text: String, options: EmbeddingOptions = EmbeddingOptions()): FloatArray {
         var res = floatArrayOf()
         withContext(runLoop) {
             when (val state = threadLocalState.get()) {
                 is State.Loaded -> {
-                    res = get_embeddings(state.model, text)
+                    res = get_embeddings(state.model, text, options.toJson())
                 }
                 else -> {}
             }
@@ -325,14 +701,148 @@ class LLamaAndroid {
         return res
     }
 
-    suspend fun quantize(inputPath: String, outputPath: String, quantizeType: String): Int {
-        var res = -1
-        withContext(runLoop) {
-            res = quantizeNative(inputPath, outputPath, quantizeType)
+    /**
+     * Quantizes [inputPath] into [outputPath] on a native worker thread, off the inference
+     * thread. Returns 0 on success, -1 for an unknown type or option and the llama.cpp error
+     * code otherwise. Cancelling the calling coroutine stops the job after the current tensor
+     * and deletes the partial output.
+     */
+    suspend fun quantize(
+        inputPath: String,
+        outputPath: String,
+        quantizeType: String,
+        options: QuantizeOptions = QuantizeOptions(),
+        onProgress: ((QuantizeProgress) -> Unit)? = null
+    ): Int = withContext(Dispatchers.IO) {
+        if (!ensureLibraryLoaded()) return@withContext -1
+        val job = try {
+            quantize_start(inputPath, outputPath, quantizeType, options.toJson())
+        } catch (e: IllegalArgumentException) {
+            Log.e(tag, "Quantization rejected: ${e.message}")
+            return@withContext -1
+        }
+        try {
+            var result: Int? = null
+            while (result == null) {
+                val status = JSONObject(quantize_poll(job))
+                onProgress?.invoke(
+                    QuantizeProgress(
+                        tensorsDone = status.optInt("tensors_done"),
+                        tensorsTotal = status.optInt("tensors_total"),
+                        tensor = status.optString("tensor"),
+                        elapsedMs = status.optLong("elapsed_ms"),
+                        nThreads = status.optInt("n_threads")
+                    )
+                )
+                when (status.optString("state")) {
+                    "running" -> delay(250)
+                    "done" -> result = 0
+                    "cancelled" -> throw CancellationException("Quantization cancelled")
+                    else -> {
+                        Log.e(tag, "Quantization failed: ${status.optString("error")}")
+                        result = status.optInt("result", 1).takeIf { it != 0 } ?: 1
+                    }
+                }
+            }
+            checkNotNull(result)
+        } finally {
+            // stops a job that is still running (coroutine cancelled) and joins the worker
+            withContext(NonCancellable) { quantize_free(job) }
         }
-        return res
     }
     
+    private val activeIndexJobs = mutableSetOf<Long>()
+
+    /**
+     * Splits [text] into chunks of exactly [IndexOptions.chunkTokens] tokens (overlapping by
+     * [IndexOptions.overlap]) and embeds them with the loaded model in batches on native
+     * threads. Chunks are emitted as soon as they are embedded; [onProgress] receives
+     * throughput (pages/s) after every poll. Cancelling the flow stops the job.
+     */
+    fun indexDocument(
+        text: String,
+        options: IndexOptions = IndexOptions(),
+        onProgress: ((IndexProgress) -> Unit)? = null
+    ): Flow<IndexedChunk> = flow {
+        val model = modelHandleCache
+        check(model != 0L) { "No model loaded" }
+        val job = index_start(model, text, options.toJson())
+        synchronized(activeIndexJobs) { activeIndexJobs.add(job) }
+        try {
+            while (true) {
+                // unload() frees jobs it finds here, so poll only while this one is still listed
+                val status = synchronized(activeIndexJobs) {
+                    if (job in activeIndexJobs) JSONObject(index_poll(job)) else null
+                } ?: throw CancellationException("Model unloaded during indexing")
+                val chunks = status.optJSONArray("chunks") ?: JSONArray()
+                for (i in 0 until chunks.length()) {
+                    val chunk = chunks.getJSONObject(i)
+                    val values = chunk.getJSONArray("embedding")
+                    emit(IndexedChunk(
+                        index = chunk.getInt("index"),
+                        text = chunk.getString("text"),
+                        embedding = FloatArray(values.length()) { values.getDouble(it).toFloat() }
+                    ))
+                }
+                onProgress?.invoke(IndexProgress(
+                    chunksDone = status.optInt("chunks_done"),
+                    chunksTotal = status.optInt("chunks_total", -1),
+                    pages = status.optDouble("pages", 0.0),
+                    pagesPerSecond = status.optDouble("pages_per_s", 0.0),
+                    elapsedMs = status.optDouble("elapsed_ms", 0.0).toLong()
+                ))
+                when (status.optString("state")) {
+                    "running" -> delay(INDEX_POLL_MS)
+                    "done" -> break
+                    "cancelled" -> throw CancellationException("Indexing cancelled")
+                    else -> throw IllegalStateException("Indexing failed: ${status.optString("error")}")
+                }
+            }
+        } finally {
+            val owned = synchronized(activeIndexJobs) { activeIndexJobs.remove(job) }
+            if (owned) withContext(NonCancellable) { index_free(job) }
+        }
+    }.flowOn(Dispatchers.IO)
+
+    /**
+     * Quantizes [sourcePath] into each of [types] (empty = Q4_0, Q4_K_M, Q5_K_M, Q6_K, Q8_0)
+     * under [scratchDir] and measures file size, load time, pp/tg throughput and perplexity
+     * on [sampleText] (null = bundled sample) on this device. [onProgress] receives the
+     * poll JSON. Returns the final JSON with per-type results and a markdown Pareto table.
+     * Needs memory for one extra model at a time; best run with no chat model loaded.
+     */
+    suspend fun quantSweep(
+        sourcePath: String,
+        scratchDir: String,
+        types: List<String> = emptyList(),
+        sampleText: String? = null,
+        nThreads: Int = 0,
+        keepFiles: Boolean = false,
+        onProgress: ((String) -> Unit)? = null
+    ): String = withContext(Dispatchers.IO) {
+        if (!ensureLibraryLoaded()) throw IllegalStateException("native library not loaded")
+        val options = JSONObject().apply {
+            put("n_threads", nThreads)
+            put("keep_files", keepFiles)
+        }.toString()
+        val job = quant_sweep_start(sourcePath, scratchDir, types.toTypedArray(), sampleText, options)
+        try {
+            var status = quant_sweep_poll(job)
+            while (JSONObject(status).optString("state") == "running") {
+                onProgress?.invoke(status)
+                delay(500)
+                status = quant_sweep_poll(job)
+            }
+            onProgress?.invoke(status)
+            if (JSONObject(status).optString("state") == "cancelled") {
+                throw CancellationException("Quant sweep cancelled")
+            }
+            status
+        } finally {
+            withContext(NonCancellable) { quant_sweep_free(job) }
+        }
+    }
+
     suspend fun setBackend(backend: String): Boolean {
         var success = false
         withContext(runLoop) {
@@ -381,7 +891,159 @@ class LLamaAndroid {
         }
     }
 
-    suspend fun send(message: String): Flow<String> = flow {
+    /**
+     * Reuse of KV snapshots for prompt prefixes shared between completions (on by default,
+     * 64 MiB). A negative [budgetBytes] keeps the current budget.
+     */
+    suspend fun setPrefixCache(enabled: Boolean, budgetBytes: Long = -1L) {
+        withContext(runLoop) { set_prefix_cache(enabled, budgetBytes) }
+    }
+
+    suspend fun clearPrefixCache() {
+        withContext(runLoop) { clear_prefix_cache() }
+    }
+
+    /** JSON with snapshot count, bytes, hits/misses and the tokens reused by the last prompt. */
+    fun getPrefixCacheStats(): String = get_prefix_cache_stats()
+
+    /** JSON with the compiled tool-grammar cache size, hits and misses. */
+    fun getToolGrammarStats(): String = get_tool_grammar_stats()
+
+    /**
+     * Progress of the chat context's prompt prefill that is running now (or finished last);
+     * any thread. [Session]s report theirs in [Session.stats].
+     */
+    fun getPrefillProgress(): PrefillProgress {
+        val json = JSONObject(get_prefill_progress(contextHandleCache))
+        return PrefillProgress(
+            processed = json.optInt("processed"),
+            total = json.optInt("total"),
+            reused = json.optInt("reused"),
+            tokensPerSecond = json.optDouble("tokens_per_s", 0.0),
+            etaMs = json.optDouble("eta_ms", -1.0).toLong(),
+            active = json.optBoolean("active")
+        )
+    }
+
+    /**
+     * Enables the native thermal/latency governor (on by default). It steps threads, prefill
+     * ubatch and token pacing down under heat or slowing decode, without touching the KV cache.
+     * [sysfsRoot] replaces /sys for reading thermal zones; null keeps the current root.
+     */
+    suspend fun setThrottle(enabled: Boolean, sysfsRoot: String? = null) {
+        withContext(runLoop) { set_throttle(enabled, sysfsRoot) }
+    }
+
+    /** JSON with the chat context's throttle level, current limits, temperature and latency baseline. */
+    fun getThrottleStats(): String = get_throttle_stats(contextHandleCache)
+
+    /** JSON with the chat's last TTFT split into template, tokenize, prefill and first-sample time. */
+    fun getTtftStats(): String = get_ttft_stats(contextHandleCache)
+
+    /**
+     * Draft-free speculative decoding (off by default): the tokens that followed an earlier
+     * occurrence of the last [ngramMin]..[ngramMax] tokens in the prompt or reply are proposed
+     * and verified in one decode, up to [maxDraft] (1..32) at a time. Speeds up replies that
+     * quote the prompt, such as RAG answers and summaries. Applies from the next reply.
+     */
+    suspend fun setPromptLookup(enabled: Boolean, ngramMin: Int = 2, ngramMax: Int = 4, maxDraft: Int = 8) {
+        withContext(runLoop) { set_prompt_lookup(enabled, ngramMin, ngramMax, maxDraft) }
+    }
+
+    /** JSON with drafted/accepted tokens, acceptance rate and effective tok/s of the chat's last reply. */
+    fun getSpecStats(): String = get_spec_stats(contextHandleCache)
+
+    private val loadedLoras = mutableListOf<LoraAdapter>()
+
+    /**
+     * Loads a LoRA adapter for the loaded model; loading the same file again shares the
+     * resident weights. Adapters are released by [releaseLora] or [unload].
+     */
+    suspend fun loadLora(path: String): LoraAdapter = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> LoraAdapter(lora_load(state.model, path), path).also { loadedLoras.add(it) }
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    /**
+     * Drops [adapter]. After the last reference each context detaches it when it starts its
+     * next completion, and the adapter is freed once no context has it attached.
+     */
+    suspend fun releaseLora(adapter: LoraAdapter) {
+        withContext(runLoop) {
+            if (loadedLoras.remove(adapter)) lora_release(adapter.handle)
+        }
+    }
+
+    /**
+     * Attaches exactly [adapters] (adapter to scale) to the chat context, e.g. before each
+     * [send] of a specialized chat; an empty map detaches all. Re-applying the current set is
+     * free. A different set clears the KV and prefix caches and returns true.
+     */
+    suspend fun setLoras(adapters: Map<LoraAdapter, Float>): Boolean = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> lora_apply(state.context, adapters.keys.map { it.handle }.toLongArray(), adapters.values.toFloatArray())
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    /** JSON with loaded adapters (bytes, load_ms, refs), switch latency and the attached set. */
+    fun getLoraStats(): String = get_lora_stats()
+
+    private var logprobs: LogprobRing? = null
+
+    /**
+     * Records the log-probability and the [topK] best alternatives of every token [send]
+     * produces from now on, into a ring of [capacity] tokens that is read without copies.
+     */
+    suspend fun enableLogprobs(topK: Int = 5, capacity: Int = 256): LogprobRing = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> {
+                val ring = LogprobRing.allocate(topK, capacity)
+                set_logprobs(state.context, ring.buffer, topK)
+                logprobs = ring
+                ring
+            }
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    suspend fun disableLogprobs() {
+        withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> set_logprobs(state.context, null, 0)
+                else -> {}
+            }
+            logprobs = null
+        }
+    }
+
+    /**
+     * Token ids of a piece of rendered prompt, exactly as [send] would tokenize it; only the
+     * start of the prompt gets [addBos]. Store them with the message and pass the history's
+     * tokens to [send] so earlier turns are not tokenized again.
+     */
+    suspend fun tokenizePrompt(text: String, addBos: Boolean = false): IntArray = withContext(runLoop) {
+        when (val state = threadLocalState.get()) {
+            is State.Loaded -> tokenize_prompt(state.model, text, addBos)
+            else -> throw IllegalStateException("No model loaded")
+        }
+    }
+
+    /**
+     * Generates a reply to [message]. With [toolGrammar], anything the model writes after
+     * `<tool_call>` is constrained to a well-formed call; plain text is unaffected.
+     * [onPrefillProgress] is called from a background thread while the prompt is decoded.
+     * With [history] (from [tokenizePrompt]), the prompt is those tokens followed by
+     * [message], and only [message] is tokenized.
+     */
+    suspend fun send(
+        message: String,
+        toolGrammar: ToolGrammar? = null,
+        onPrefillProgress: ((PrefillProgress) -> Unit)? = null,
+        history: IntArray? = null
+    ): Flow<String> = flow {
         stopGeneration = false
         _isSending.value = true
 
@@ -397,7 +1059,35 @@ class LLamaAndroid {
                 try {
                     // Memory pressure check before generation
                     checkMemoryPressure()
-                    val initVal = completion_init(state.context, state.batch, message, nlen)
+                    if (toolGrammar != null) {
+                        set_tool_grammar(state.context, toolGrammar.kind, toolGrammar.source)
+                    }
+                    val initPrompt = {
+                        if (history == null) completion_init(state.context, state.batch, message, nlen)
+                        else completion_init_tokens(state.context, state.batch, history, message, nlen)
+                    }
+                    val initVal = if (onPrefillProgress == null) {
+                        initPrompt()
+                    } else {
+                        coroutineScope {
+                            // completion_init blocks the run loop; poll its progress from elsewhere
+                            val poller = launch(Dispatchers.Default) {
+                                while (true) {
+                                    delay(PREFILL_POLL_MS)
+                                    onPrefillProgress(getPrefillProgress())
+                                }
+                            }
+                            try {
+                                initPrompt()
+                            } finally {
+                                poller.cancel()
+                            }
+                        }
+                    }
+                    if (initVal == COMPLETION_CANCELLED) {
+                        _isSending.value = false
+                        return@flow
+                    }
                     if (initVal < 0) {
                         emit("Error: prompt exceeds context window. Reduce prompt length or increase context.")
                         _isSending.value = false
@@ -448,7 +1138,10 @@ class LLamaAndroid {
                     _isSending.value = false
                     _isCompleteEOT.value = false
                 } finally {
+                    if (toolGrammar != null) clear_tool_grammar(state.context)
                     kv_cache_clear(state.context)
+                    // a Stop that came after the reply ended must not cancel the next one
+                    end_generation(state.context)
                     _isSending.value = false
                 }
             }
@@ -507,6 +1200,251 @@ class LLamaAndroid {
 
 
 
+    /**
+     * Loads a reranker GGUF (pooling type RANK, e.g. bge-reranker) next to the chat model.
+     * [nCtx] bounds one query+passage pair and one packed batch; up to [nSeqMax] pairs
+     * share a decode.
+     */
+    suspend fun openReranker(pathToModel: String, nCtx: Int = 2048, nSeqMax: Int = 16): Reranker {
+        if (!nativeLibraryLoaded) ensureLibraryLoaded()
+        return withContext(runLoop) {
+            val model = acquire_model(pathToModel, true, false, false, false, null)
+            if (model == 0L) throw IllegalStateException("load_model() failed")
+            val context = try {
+                new_rerank_context(model, nCtx, nSeqMax)
+            } catch (e: Exception) {
+                release_model(model)
+                throw e
+            }
+            if (context == 0L) {
+                release_model(model)
+                throw IllegalStateException("new_rerank_context() failed")
+            }
+            Reranker(model, context)
+        }
+    }
+
+    /** Cross-encoder scoring of passages against a query; calls run on the reranker's own thread. */
+    inner class Reranker internal constructor(private val model: Long, private var context: Long) : AutoCloseable {
+        private val executor = Executors.newSingleThreadExecutor { thread(start = false, name = "Llm-Rerank") { it.run() } }
+        private val dispatcher = executor.asCoroutineDispatcher()
+
+        /** One score per passage, in input order; higher is more relevant. */
+        suspend fun rerank(query: String, passages: List<String>): FloatArray = withContext(dispatcher) {
+            check(context != 0L) { "Reranker is closed" }
+            if (passages.isEmpty()) floatArrayOf() else this@LLamaAndroid.rerank(context, query, passages.toTypedArray())
+        }
+
+        /** JSON with pairs, decodes, tokens and pairs/s of the last [rerank] of any reranker. */
+        fun lastStats(): String = get_rerank_stats()
+
+        /** JSON comparing packed batches with one pair per decode over [iterations] runs. */
+        suspend fun bench(query: String, passages: List<String>, iterations: Int = 3): String = withContext(dispatcher) {
+            check(context != 0L) { "Reranker is closed" }
+            bench_rerank(context, query, passages.toTypedArray(), iterations)
+        }
+
+        override fun close() {
+            val ctx = context
+            if (ctx == 0L) return
+            context = 0L
+            executor.execute {
+                free_embeddings_context(ctx)
+                release_model(model)
+            }
+            executor.shutdown()
+            executor.awaitTermination(SESSION_CLOSE_TIMEOUT_S, TimeUnit.SECONDS)
+        }
+    }
+
+    // Embeddings contexts of the loaded model for EmbeddingStore.addText, one per options; run loop only
+    private val storeEmbeddingsContexts = mutableMapOf<EmbeddingOptions, Long>()
+
+    /**
+     * Opens the vector file at [path], creating it when missing. The file is memory-mapped
+     * and searched in place, so nothing is deserialized at startup. [modelId] and [dim] must
+     * match an existing file; [halfPrecision] stores f16 vectors at half the size.
+     * [embedding] is how [EmbeddingStore.addText] embeds; its dim must produce [dim] floats.
+     */
+    fun openEmbeddingStore(
+        path: String,
+        modelId: String,
+        dim: Int,
+        halfPrecision: Boolean = false,
+        embedding: EmbeddingOptions = EmbeddingOptions(normalize = true)
+    ): EmbeddingStore {
+        if (!nativeLibraryLoaded) ensureLibraryLoaded()
+        return EmbeddingStore(store_open(path, modelId, dim, halfPrecision), embedding)
+    }
+
+    /**
+     * Append-only, crash-safe vector file with top-k cosine search. Adding an id that is
+     * present replaces it; deleted records are dropped by compaction, which also runs on its
+     * own once a quarter of the file is deleted records.
+     */
+    inner class EmbeddingStore internal constructor(
+        private var handle: Long,
+        private val embedding: EmbeddingOptions
+    ) : AutoCloseable {
+        // calls hold the read lock so close() cannot free the store under them
+        private val lock = ReentrantReadWriteLock()
+
+        private inline fun <T> withStore(block: (Long) -> T): T = lock.read {
+            check(handle != 0L) { "EmbeddingStore is closed" }
+            block(handle)
+        }
+
+        /** Appends [vectors], dim floats per id, in one synced commit. */
+        fun add(ids: LongArray, vectors: FloatArray): Boolean = withStore { store_append(it, ids, vectors) }
+
+        fun add(id: Long, vector: FloatArray): Boolean = add(longArrayOf(id), vector)
+
+        /** Embeds [text] with the loaded model and appends it; the vector stays native. */
+        suspend fun addText(id: Long, text: String): Boolean = withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val context = storeEmbeddingsContexts.getOrPut(embedding) {
+                        new_embeddings_context(state.model, embedding.toJson()).also {
+                            if (it == 0L) throw IllegalStateException("new_embeddings_context() failed")
+                        }
+                    }
+                    withStore { store_append_text(it, context, id, text) }
+                }
+                else -> throw IllegalStateException("No model loaded")
+            }
+        }
+
+        fun remove(id: Long): Boolean = withStore { store_remove(it, id) }
+
+        /** Ids and cosine scores of the [k] closest vectors, best first. */
+        fun search(query: FloatArray, k: Int): List<Pair<Long, Float>> = withStore { store ->
+            if (k <= 0) return@withStore emptyList()
+            val ids = LongArray(k)
+            val scores = store_search(store, query, k, ids)
+            scores.indices.map { ids[it] to scores[it] }
+        }
+
+        /** Rewrites the file without deleted records. */
+        fun compact(): Boolean = withStore { store_compact(it) }
+
+        /** JSON with model_id, dim, live, deleted, capacity and file_bytes. */
+        fun stats(): String = withStore { store_stats(it) }
+
+        override fun close() {
+            lock.write {
+                if (handle == 0L) return
+                store_close(handle)
+                handle = 0L
+            }
+        }
+    }
+
+    private val openSessions = mutableSetOf<Session>()
+
+    /**
+     * Opens a [Session] on the loaded model: its own context, batch and sampler, decoding on
+     * its own thread, so it can run next to [send] (e.g. summarizing in the background).
+     * Sessions are closed by [unload] at the latest.
+     */
+    suspend fun openSession(userThreads: Int, topK: Int, topP: Float, temp: Float): Session {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val handle = session_create(state.model, userThreads, topP, topK, temp, useFusedSampler)
+                    if (handle == 0L) throw IllegalStateException("session_create() failed")
+                    Session(handle).also { synchronized(openSessions) { openSessions.add(it) } }
+                }
+                else -> throw IllegalStateException("No model loaded")
+            }
+        }
+    }
+
+    /**
+     * Generation state of one native context. Calls on a session run on its own thread;
+     * different sessions do not block each other or the run loop.
+     */
+    inner class Session internal constructor(handle: Long) : AutoCloseable {
+        // read by cancel() on any thread; native code rejects a handle that close() freed
+        @Volatile private var handle: Long = handle
+        private val executor = Executors.newSingleThreadExecutor { thread(start = false, name = "Llm-Session") { it.run() } }
+        private val dispatcher = executor.asCoroutineDispatcher()
+
+        /**
+         * Generates a reply to [message], after the pre-tokenized [history] if given; the KV
+         * cache is cleared afterwards.
+         */
+        fun send(message: String, maxTokens: Int = nlen, history: IntArray? = null): Flow<String> = flow {
+            val session = handle
+            if (session == 0L) throw IllegalStateException("Session is closed")
+            try {
+                val initVal = if (history == null) session_completion_init(session, message, maxTokens)
+                    else session_completion_init_tokens(session, history, message, maxTokens)
+                if (initVal == COMPLETION_CANCELLED) return@flow
+                if (initVal < 0) throw IllegalArgumentException("prompt exceeds context window")
+                val ncur = IntVar(initVal)
+                while (ncur.value < context_size) {
+                    val str = session_completion_loop(session, maxTokens, ncur) ?: break
+                    emit(str)
+                }
+            } finally {
+                session_kv_clear(session)
+                session_end_generation(session)
+            }
+        }.flowOn(dispatcher)
+
+        /** Interrupts the running prefill or decode; [send]'s flow then completes. */
+        fun cancel() {
+            val session = handle
+            if (session == 0L) return
+            try {
+                session_cancel(session)
+            } catch (e: IllegalArgumentException) {
+                // closed concurrently: nothing left to cancel
+            }
+        }
+
+        /** JSON with the session's prefill, TTFT, prefix cache and throttle state. */
+        suspend fun stats(): String = withContext(dispatcher) {
+            if (handle == 0L) "{}" else session_stats(handle)
+        }
+
+        /** Like [LLamaAndroid.setLoras], for this session's context only. */
+        suspend fun setLoras(adapters: Map<LoraAdapter, Float>): Boolean = withContext(dispatcher) {
+            check(handle != 0L) { "Session is closed" }
+            session_lora_apply(handle, adapters.keys.map { it.handle }.toLongArray(), adapters.values.toFloatArray())
+        }
+
+        private var logprobs: LogprobRing? = null
+
+        /** Like [LLamaAndroid.enableLogprobs], for this session's replies. */
+        suspend fun enableLogprobs(topK: Int = 5, capacity: Int = 256): LogprobRing = withContext(dispatcher) {
+            check(handle != 0L) { "Session is closed" }
+            val ring = LogprobRing.allocate(topK, capacity)
+            session_set_logprobs(handle, ring.buffer, topK)
+            logprobs = ring
+            ring
+        }
+
+        suspend fun disableLogprobs() {
+            withContext(dispatcher) {
+                if (handle != 0L) session_set_logprobs(handle, null, 0)
+                logprobs = null
+            }
+        }
+
+        override fun close() {
+            val session = handle
+            if (session == 0L) return
+            handle = 0L
+            synchronized(openSessions) { openSessions.remove(this) }
+            session_cancel(session)
+            // frees after any call still running on the session thread, before the model can go
+            executor.execute { session_free(session) }
+            executor.shutdown()
+            executor.awaitTermination(SESSION_CLOSE_TIMEOUT_S, TimeUnit.SECONDS)
+        }
+    }
+
     /**
      * Unloads the model and frees resources.
      *
@@ -516,8 +1454,19 @@ class LLamaAndroid {
         withContext(runLoop) {
             when (val state = threadLocalState.get()) {
                 is State.Loaded -> {
+                    synchronized(openSessions) { openSessions.toList() }.forEach { it.close() }
+                    synchronized(activeIndexJobs) {
+                        activeIndexJobs.forEach { index_free(it) }
+                        activeIndexJobs.clear()
+                    }
+                    storeEmbeddingsContexts.values.forEach { free_embeddings_context(it) }
+                    storeEmbeddingsContexts.clear()
+                    loadedLoras.forEach { lora_release(it.handle) }
+                    loadedLoras.clear()
+                    logprobs = null
                     free_context(state.context)
-                    free_model(state.model)
+                    // Keeps the model resident (within the cache budget) for fast switching back
+                    release_model(state.model)
                     free_sampler(state.sampler)
                     free_batch(state.batch)
 
@@ -564,6 +1513,176 @@ class LLamaAndroid {
     
     fun getSampler(): Long = samplerHandleCache
 
+    fun interface LoadProgressListener {
+        fun onProgress(progress: Float)
+    }
+
+    /** Options for [quantize]. Tensor overrides use llama-quantize syntax, e.g. "attn_v=q6_k". */
+    data class QuantizeOptions(
+        /** 0 uses every performance core. */
+        val nThreads: Int = 0,
+        /** imatrix.dat or GGUF imatrix from llama-imatrix. */
+        val imatrixPath: String? = null,
+        /** Keeps output and token embedding tensors at Q8_0. */
+        val keepOutputHighPrecision: Boolean = false,
+        val outputTensorType: String? = null,
+        val tokenEmbeddingType: String? = null,
+        val tensorTypes: List<String> = emptyList(),
+        val allowRequantize: Boolean = false,
+        val pure: Boolean = false
+    ) {
+        fun toJson(): String = JSONObject().apply {
+            put("n_threads", nThreads)
+            imatrixPath?.let { put("imatrix", it) }
+            put("keep_output_high_precision", keepOutputHighPrecision)
+            outputTensorType?.let { put("output_tensor_type", it) }
+            tokenEmbeddingType?.let { put("token_embedding_type", it) }
+            put("tensor_types", JSONArray(tensorTypes))
+            put("allow_requantize", allowRequantize)
+            put("pure", pure)
+        }.toString()
+    }
+
+    /**
+     * Grammar for `<tool_call>` segments, compiled once per model and source. [kind] is
+     * "tools" (OpenAI tool list), "json_schema" (schema of the call object) or "gbnf"
+     * (complete grammar whose root starts at the `<tool_call>` tag).
+     */
+    data class ToolGrammar(val kind: String, val source: String) {
+        companion object {
+            fun forTools(toolsJson: String) = ToolGrammar("tools", toolsJson)
+            fun jsonSchema(schema: String) = ToolGrammar("json_schema", schema)
+            fun gbnf(grammar: String) = ToolGrammar("gbnf", grammar)
+        }
+    }
+
+    data class PrefillProgress(
+        val processed: Int,
+        val total: Int,
+        /** Tokens restored from the prefix cache instead of decoded. */
+        val reused: Int,
+        val tokensPerSecond: Double,
+        /** -1 until the first micro-batch has been measured. */
+        val etaMs: Long,
+        val active: Boolean
+    ) {
+        val fraction: Float get() = if (total > 0) processed.toFloat() / total else 0f
+    }
+
+    /** Options for [indexDocument]. */
+    data class IndexOptions(
+        val chunkTokens: Int = 256,
+        /** Tokens shared by consecutive chunks; less than [chunkTokens]. */
+        val overlap: Int = 32,
+        /** Tokenizer threads; 0 uses the performance cores but one. */
+        val nThreads: Int = 0,
+        /** Chunks embedded per decode. */
+        val nSeqMax: Int = 8,
+        /** Pooling, normalization and truncation of chunk vectors; [Pooling.NONE] is rejected. */
+        val embedding: EmbeddingOptions = EmbeddingOptions()
+    ) {
+        fun toJson(): String = JSONObject(embedding.toJson()).apply {
+            put("chunk_tokens", chunkTokens)
+            put("overlap", overlap)
+            put("n_threads", nThreads)
+            put("n_seq_max", nSeqMax)
+        }.toString()
+    }
+
+    /** How the context reduces token rows to one vector; [MODEL] keeps the GGUF's choice. */
+    enum class Pooling { MODEL, NONE, MEAN, CLS, LAST }
+
+    /** Post-processing of embeddings, applied natively. */
+    data class EmbeddingOptions(
+        val pooling: Pooling = Pooling.MODEL,
+        /** Return unit-length vectors (L2), so cosine similarity is a dot product. */
+        val normalize: Boolean = false,
+        /** Keep the first [dim] components (Matryoshka models); 0 keeps all. */
+        val dim: Int = 0
+    ) {
+        fun toJson(): String = JSONObject().apply {
+            put("pooling", pooling.name.lowercase())
+            put("normalize", normalize)
+            put("dim", dim)
+        }.toString()
+    }
+
+    class IndexedChunk(val index: Int, val text: String, val embedding: FloatArray)
+
+    /** Result of [fitContextWindow]: indices of the messages to keep, in order. */
+    data class ContextWindow(
+        val kept: List<Int>,
+        val dropped: Int,
+        /** Estimated prompt tokens of the kept messages. */
+        val tokens: Int,
+        /** False when even the system prompt and the newest message exceed the budget. */
+        val fits: Boolean
+    )
+
+    /** Flattened token ids; text `i` owns `ids[offsets[i] until offsets[i + 1]]`. */
+    class TokenizedBatch(val ids: IntArray, val offsets: IntArray) {
+        val size: Int get() = offsets.size - 1
+        fun count(i: Int): Int = offsets[i + 1] - offsets[i]
+        fun tokens(i: Int): IntArray = ids.copyOfRange(offsets[i], offsets[i + 1])
+    }
+
+    /** A LoRA adapter resident next to the base model; see [loadLora]. */
+    class LoraAdapter internal constructor(internal val handle: Long, val path: String)
+
+    /**
+     * Per-token log-probabilities written by the native decode loop; see [enableLogprobs].
+     * Token `seq` (0-based, counted since enabling) stays readable while
+     * `seq >= written - capacity`. Read it from the flow's collector, between tokens.
+     */
+    class LogprobRing private constructor(internal val buffer: ByteBuffer) {
+        val capacity: Int get() = buffer.getInt(8)
+        val topK: Int get() = buffer.getInt(12)
+        private val recordBytes: Int get() = buffer.getInt(16)
+
+        /** Tokens emitted so far. Read it before the records: the ones below it are complete. */
+        val written: Long get() = buffer.getLong(24)
+
+        private fun offset(seq: Long): Int = HEADER_BYTES + (seq % capacity).toInt() * recordBytes
+
+        fun token(seq: Long): Int = buffer.getInt(offset(seq))
+        /** Natural log of the token's probability under the model, over the full vocabulary. */
+        fun logprob(seq: Long): Float = buffer.getFloat(offset(seq) + 4)
+        fun alternatives(seq: Long): Int = buffer.getInt(offset(seq) + 8)
+        /** The [i]th most likely token at that position, best first; may be the chosen one. */
+        fun alternativeToken(seq: Long, i: Int): Int = buffer.getInt(offset(seq) + 12 + 8 * i)
+        fun alternativeLogprob(seq: Long, i: Int): Float = buffer.getFloat(offset(seq) + 16 + 8 * i)
+
+        companion object {
+            private const val HEADER_BYTES = 32
+
+            internal fun allocate(topK: Int, capacity: Int): LogprobRing {
+                require(topK >= 0 && capacity > 0) { "topK must be >= 0 and capacity > 0" }
+                val bytes = HEADER_BYTES + capacity * (12 + 8 * topK)
+                return LogprobRing(ByteBuffer.allocateDirect(bytes).order(ByteOrder.nativeOrder()))
+            }
+        }
+    }
+
+    data class IndexProgress(
+        val chunksDone: Int,
+        /** -1 until the whole document is tokenized. */
+        val chunksTotal: Int,
+        /** Form-feed separated pages, or 3000 characters per page. */
+        val pages: Double,
+        val pagesPerSecond: Double,
+        val elapsedMs: Long
+    )
+
+    data class QuantizeProgress(
+        val tensorsDone: Int,
+        val tensorsTotal: Int,
+        val tensor: String,
+        val elapsedMs: Long,
+        val nThreads: Int
+    ) {
+        val fraction: Float get() = if (tensorsTotal > 0) tensorsDone.toFloat() / tensorsTotal else 0f
+    }
+
     companion object {
         private class IntVar(value: Int) {
             @Volatile
@@ -582,6 +1701,12 @@ class LLamaAndroid {
             data class Loaded(val model: Long, val context: Long, val batch: Long, val sampler: Long , val modelEotStr:String): State
         }
 
+        // completion_init result when cancel_generation interrupted the prefill
+        private const val COMPLETION_CANCELLED = -2
+        private const val PREFILL_POLL_MS = 100L
+        private const val SESSION_CLOSE_TIMEOUT_S = 10L
+        private const val INDEX_POLL_MS = 100L
+
         // Enforce only one instance of Llm.
         private val _instance: LLamaAndroid = LLamaAndroid()
 
@@ -0,0 +1,76 @@
+#include <gtest/gtest.h>
+#include "batch_tokenize.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace {
+
+// one token per whitespace-separated word: the word's length; asks for more room like
+// llama_tokenize when the buffer is too small
+int32_t word_tokenize(const std::string & text, int32_t * out, int32_t n_max) {
+    std::vector<int32_t> tokens;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && text[i] == ' ') ++i;
+        size_t j = i;
+        while (j < text.size() && text[j] != ' ') ++j;
+        if (j > i) tokens.push_back((int32_t) (j - i));
+        i = j;
+    }
+    if ((int32_t) tokens.size() > n_max) return -(int32_t) tokens.size();
+    std::copy(tokens.begin(), tokens.end(), out);
+    return (int32_t) tokens.size();
+}
+
+std::vector<std::string> messages(size_t n) {
+    std::vector<std::string> texts;
+    for (size_t i = 0; i < n; ++i) {
+        std::string t;
+        for (size_t w = 0; w < i % 23; ++w) t += std::string(1 + (i + w) % 9, 'a') + " ";
+        texts.push_back(t);
+    }
+    return texts;
+}
+
+} // namespace
+
+TEST(BatchTokenizeTest, CountsAndFlattensInOrder) {
+    const std::vector<std::string> texts = { "ab c", "", "dddd ee f" };
+    const auto batch = batch_tokenize(texts, true, 4, word_tokenize);
+    EXPECT_EQ(batch.counts, (std::vector<int32_t>{ 2, 0, 3 }));
+    EXPECT_EQ(batch.offsets, (std::vector<int32_t>{ 0, 2, 2, 5 }));
+    EXPECT_EQ(batch.ids, (std::vector<int32_t>{ 2, 1, 4, 2, 1 }));
+
+    const auto counts_only = batch_tokenize(texts, false, 4, word_tokenize);
+    EXPECT_EQ(counts_only.counts, batch.counts);
+    EXPECT_TRUE(counts_only.ids.empty());
+    EXPECT_TRUE(batch_tokenize({}, true, 4, word_tokenize).offsets == std::vector<int32_t>{ 0 });
+}
+
+TEST(BatchTokenizeTest, GrowsScratchWhenTokensOutnumberBytes) {
+    // more tokens than text.size() + 2 of room
+    auto many = [](const std::string &, int32_t * out, int32_t n_max) -> int32_t {
+        if (n_max < 10) return -10;
+        for (int32_t i = 0; i < 10; ++i) out[i] = i;
+        return 10;
+    };
+    const auto batch = batch_tokenize({ "x" }, true, 1, many);
+    EXPECT_EQ(batch.counts[0], 10);
+    EXPECT_EQ(batch.ids.back(), 9);
+}
+
+TEST(BatchTokenizeTest, ParallelMatchesSerial) {
+    const auto texts = messages(2000);   // well above the parallel threshold
+    std::atomic<int> calls{0};
+    auto counted = [&](const std::string & text, int32_t * out, int32_t n_max) {
+        calls++;
+        return word_tokenize(text, out, n_max);
+    };
+    const auto serial = batch_tokenize(texts, true, 1, word_tokenize);
+    const auto parallel = batch_tokenize(texts, true, 4, counted);
+    EXPECT_EQ(calls.load(), 2000);
+    EXPECT_EQ(parallel.counts, serial.counts);
+    EXPECT_EQ(parallel.offsets, serial.offsets);
+    EXPECT_EQ(parallel.ids, serial.ids);
+}
@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+#include "context_budget.h"
+#include <vector>
+
+namespace {
+
+budget_overhead chatml_like() {
+    // <|im_start|>role\n ... <|im_end|>\n around each message, BOS + generation prompt
+    return measure_budget_overhead(/*u*/ 9, /*ua*/ 14, /*uau*/ 19, /*su*/ 14);
+}
+
+} // namespace
+
+TEST(ContextBudgetTest, MeasuresOverheadPerRole) {
+    const auto o = chatml_like();
+    EXPECT_EQ(o.per_role[BUDGET_ROLE_USER], 5);
+    EXPECT_EQ(o.per_role[BUDGET_ROLE_ASSISTANT], 5);
+    EXPECT_EQ(o.per_role[BUDGET_ROLE_SYSTEM], 5);
+    EXPECT_EQ(o.base, 4);
+    EXPECT_EQ(budget_role_of("tool"), BUDGET_ROLE_USER);
+}
+
+TEST(ContextBudgetTest, KeepsSystemPromptAndLatestTurns) {
+    const std::vector<budget_message> chat = {
+        { BUDGET_ROLE_SYSTEM, 20 },
+        { BUDGET_ROLE_USER, 100 },
+        { BUDGET_ROLE_ASSISTANT, 300 },
+        { BUDGET_ROLE_USER, 40 },
+        { BUDGET_ROLE_ASSISTANT, 60 },
+        { BUDGET_ROLE_USER, 10 },
+    };
+    const auto o = chatml_like();
+
+    auto all = fit_context_window(chat, o, 2048, 512);
+    EXPECT_EQ(all.kept, (std::vector<int32_t>{ 0, 1, 2, 3, 4, 5 }));
+    EXPECT_EQ(all.tokens, 4 + 530 + 6 * 5);
+    EXPECT_TRUE(all.fits);
+
+    // room for the system prompt and the last three messages only
+    auto w = fit_context_window(chat, o, 512, 256);
+    EXPECT_EQ(w.kept, (std::vector<int32_t>{ 0, 3, 4, 5 }));
+    EXPECT_EQ(w.tokens, 4 + 25 + 45 + 65 + 15);
+    EXPECT_TRUE(w.fits);
+    EXPECT_LE(w.tokens, 512 - 256);
+}
+
+TEST(ContextBudgetTest, WindowStartsWithAUserTurn) {
+    const std::vector<budget_message> chat = {
+        { BUDGET_ROLE_USER, 500 },
+        { BUDGET_ROLE_ASSISTANT, 10 },
+        { BUDGET_ROLE_USER, 10 },
+    };
+    const auto o = chatml_like();
+    EXPECT_EQ(fit_context_window(chat, o, 100, 0).kept, (std::vector<int32_t>{ 1, 2 }));   // as the app always did
+    EXPECT_EQ(fit_context_window(chat, o, 100, 0, true).kept, (std::vector<int32_t>{ 2 }));
+}
+
+TEST(ContextBudgetTest, PinsEverySystemMessage) {
+    const std::vector<budget_message> chat = {
+        { BUDGET_ROLE_SYSTEM, 20 },
+        { BUDGET_ROLE_USER, 300 },
+        { BUDGET_ROLE_SYSTEM, 30 },   // e.g. injected document context
+        { BUDGET_ROLE_ASSISTANT, 300 },
+        { BUDGET_ROLE_USER, 10 },
+        { BUDGET_ROLE_SYSTEM, 5 },
+    };
+    const auto w = fit_context_window(chat, chatml_like(), 256, 0);
+    EXPECT_EQ(w.kept, (std::vector<int32_t>{ 0, 2, 4, 5 }));
+    EXPECT_EQ(w.tokens, 4 + 25 + 35 + 15 + 10);
+    EXPECT_TRUE(w.fits);
+}
+
+TEST(ContextBudgetTest, NewestMessageIsKeptEvenWhenTooLong) {
+    const std::vector<budget_message> chat = {
+        { BUDGET_ROLE_SYSTEM, 10 },
+        { BUDGET_ROLE_USER, 10 },
+        { BUDGET_ROLE_USER, 1000 },
+    };
+    const auto w = fit_context_window(chat, chatml_like(), 512, 128);
+    EXPECT_EQ(w.kept, (std::vector<int32_t>{ 0, 2 }));
+    EXPECT_FALSE(w.fits);
+}
+
+TEST(ContextBudgetTest, CachesCountsPerOwner) {
+    token_count_cache<int> cache(2);
+    int a, b;
+    int32_t n = 0;
+    cache.store(&a, "hello", 2);
+    EXPECT_TRUE(cache.lookup(&a, "hello", n));
+    EXPECT_EQ(n, 2);
+    EXPECT_FALSE(cache.lookup(&b, "hello", n));
+    EXPECT_FALSE(cache.lookup(&a, "hellO", n));
+
+    cache.store(&b, "hello", 3);
+    cache.store(&a, "world", 1);   // evicts the oldest
+    EXPECT_FALSE(cache.lookup(&a, "hello", n));
+    EXPECT_EQ(cache.size(), 2u);
+    cache.forget_owner(&b);
+    EXPECT_EQ(cache.size(), 1u);
+    EXPECT_TRUE(cache.lookup(&a, "world", n));
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include "cpu_topology.h"
+#include "temp_dir.h"
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+class CpuTopologyTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_FALSE(tmp_.path().empty());
+        root_ = tmp_.path();
+    }
+
+    void set_max_freq(int cpu, long khz) {
+        const std::string dir = tmp_.make_dirs("cpu" + std::to_string(cpu) + "/cpufreq");
+        std::ofstream(dir + "/cpuinfo_max_freq") << khz << "\n";
+    }
+    temp_dir    tmp_{"cpu_topology_test"};
+    std::string root_;
+};
+
+TEST_F(CpuTopologyTest, FallsBackToOnlineCoresWithoutCpufreq) {
+    EXPECT_TRUE(cpu_max_frequencies(root_).empty());
+    EXPECT_EQ(cpu_performance_core_count(root_), (int) sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+TEST_F(CpuTopologyTest, ExcludesSlowestCluster) {
+    set_max_freq(0, 1800000);
+    set_max_freq(1, 2800000);
+    EXPECT_EQ(cpu_max_frequencies(root_).size(), 2u);
+    EXPECT_EQ(cpu_performance_core_count(root_), 1);
+}
+
+TEST_F(CpuTopologyTest, StopsAtFirstMissingCpu) {
+    set_max_freq(0, 1800000);
+    set_max_freq(2, 2800000);
+    EXPECT_EQ(cpu_max_frequencies(root_), (std::vector<long>{ 1800000 }));
+}
+
+TEST_F(CpuTopologyTest, HomogeneousCoresAllCount) {
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) GTEST_SKIP() << "needs at least two online CPUs";
+    set_max_freq(0, 2000000);
+    set_max_freq(1, 2000000);
+    EXPECT_EQ(cpu_performance_core_count(root_), 2);
+}
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include "doc_index.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(DocIndexTest, SegmentsCoverTheTextAndCutBeforeWhitespace) {
+    std::string text;
+    for (int i = 0; i < 40; ++i) {
+        text += "Sentence number " + std::to_string(i) + " of the document.";
+        text += (i % 5 == 4) ? "\n\n" : " ";
+    }
+    const auto segments = split_segments(text, 200);
+    ASSERT_GT(segments.size(), 3u);
+    size_t pos = 0;
+    for (const auto & s : segments) {
+        EXPECT_EQ(s.first, pos);
+        pos += s.second;
+        if (pos < text.size()) {
+            EXPECT_TRUE(text[pos] == ' ' || text[pos] == '\n');
+            EXPECT_NE(text[pos - 1], ' ');
+        }
+    }
+    EXPECT_EQ(pos, text.size());
+    // a paragraph break in reach wins over a closer space
+    EXPECT_EQ(text.substr(segments[0].first + segments[0].second, 2), "\n\n");
+}
+
+TEST(DocIndexTest, SegmentsWithoutWhitespaceKeepUtf8Intact) {
+    std::string text;
+    for (int i = 0; i < 100; ++i) text += "\xE6\x96\x87";   // 3-byte character
+    const auto segments = split_segments(text, 32);
+    for (const auto & s : segments) {
+        EXPECT_EQ(s.second % 3, 0u);
+    }
+}
+
+TEST(DocIndexTest, CountsPagesByFormFeeds) {
+    EXPECT_EQ(count_pages("a\fb\fc"), 3.0);
+    EXPECT_EQ(count_pages("a\fb\f"), 2.0);
+    EXPECT_EQ(count_pages(std::string(6000, 'x')), 2.0);
+    EXPECT_EQ(count_pages(""), 0.0);
+}
+
+TEST(DocIndexTest, ChunksHaveExactSizeAndOverlap) {
+    token_chunker<int> chunker(4, 1);
+    std::vector<std::vector<int>> out;
+    const std::vector<int> a = { 1, 2, 3 };
+    const std::vector<int> b = { 4, 5, 6, 7, 8 };
+    chunker.push(a.data(), a.size(), out);
+    EXPECT_TRUE(out.empty());
+    chunker.push(b.data(), b.size(), out);
+    chunker.finish(out);
+    ASSERT_EQ(out.size(), 3u);
+    EXPECT_EQ(out[0], std::vector<int>({1, 2, 3, 4}));
+    EXPECT_EQ(out[1], std::vector<int>({4, 5, 6, 7}));
+    EXPECT_EQ(out[2], std::vector<int>({7, 8}));
+}
+
+TEST(DocIndexTest, NoTrailingChunkOfOverlapOnly) {
+    token_chunker<int> chunker(3, 1);
+    std::vector<std::vector<int>> out;
+    const std::vector<int> t = { 1, 2, 3, 4, 5 };
+    chunker.push(t.data(), t.size(), out);
+    chunker.finish(out);
+    ASSERT_EQ(out.size(), 2u);
+    EXPECT_EQ(out[1], std::vector<int>({3, 4, 5}));
+
+    token_chunker<int> short_doc(8, 2);
+    std::vector<std::vector<int>> one;
+    short_doc.push(t.data(), 2, one);
+    short_doc.finish(one);
+    ASSERT_EQ(one.size(), 1u);
+    EXPECT_EQ(one[0].size(), 2u);
+}
+
+TEST(DocIndexTest, BoundedQueueBlocksProducerAndDrainsAfterClose) {
+    bounded_queue<int> queue(2);
+    std::thread producer([&] {
+        for (int i = 0; i < 100; ++i) ASSERT_TRUE(queue.push(i));
+        queue.close();
+    });
+    int expected = 0, item = 0;
+    while (queue.pop(item)) {
+        EXPECT_EQ(item, expected++);
+    }
+    producer.join();
+    EXPECT_EQ(expected, 100);
+    EXPECT_FALSE(queue.push(1));
+}
@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include "embedding_pool.h"
+#include <vector>
+
+TEST(EmbeddingPoolTest, ParsesPoolingNames) {
+    int pooling = 99;
+    EXPECT_TRUE(parse_embedding_pooling("model", pooling));
+    EXPECT_EQ(pooling, EMBD_POOL_MODEL);
+    EXPECT_TRUE(parse_embedding_pooling("cls", pooling));
+    EXPECT_EQ(pooling, EMBD_POOL_CLS);
+    EXPECT_TRUE(parse_embedding_pooling("last", pooling));
+    EXPECT_EQ(pooling, EMBD_POOL_LAST);
+    EXPECT_FALSE(parse_embedding_pooling("rank", pooling));
+    EXPECT_EQ(pooling, EMBD_POOL_LAST);
+}
+
+TEST(EmbeddingPoolTest, NormalizesAnyLength) {
+    for (size_t n : { 1u, 3u, 8u, 13u, 384u }) {
+        std::vector<float> v(n);
+        for (size_t i = 0; i < n; ++i) v[i] = (float) (i % 7) - 2.5f;
+        const float norm = l2_normalize(v.data(), n);
+        EXPECT_GT(norm, 0.0f);
+        EXPECT_NEAR(l2_norm(v.data(), n), 1.0f, 1e-5f) << n;
+    }
+    std::vector<float> zero(5, 0.0f);
+    EXPECT_EQ(l2_normalize(zero.data(), zero.size()), 0.0f);
+    EXPECT_EQ(zero[0], 0.0f);
+}
+
+TEST(EmbeddingPoolTest, TruncatesBeforeNormalizing) {
+    std::vector<float> v = { 3.0f, 4.0f, 100.0f, 100.0f };
+    embedding_options opts;
+    opts.dim = 2;
+    opts.normalize = true;
+    finish_embedding(v, opts);
+    ASSERT_EQ(v.size(), 2u);
+    EXPECT_NEAR(v[0], 0.6f, 1e-6f);
+    EXPECT_NEAR(v[1], 0.8f, 1e-6f);
+
+    std::vector<float> w = { 1.0f, 2.0f };
+    opts.dim = 8;   // larger than the model: full vector
+    opts.normalize = false;
+    finish_embedding(w, opts);
+    EXPECT_EQ(w, (std::vector<float>{ 1.0f, 2.0f }));
+}
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+#include "embedding_store.h"
+#include "temp_dir.h"
+#include <cmath>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+class EmbeddingStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_FALSE(dir_.path().empty());
+        path_ = dir_.path() + "/vectors.bin";
+    }
+
+    std::unique_ptr<embedding_store> open(embedding_dtype dtype = EMBEDDING_F32) {
+        std::string error;
+        auto store = embedding_store::open(path_, "test-model", 4, dtype, &error);
+        EXPECT_TRUE(store) << error;
+        return store;
+    }
+
+    temp_dir    dir_{"embedding_store_test"};
+    std::string path_;
+};
+
+namespace {
+
+// Unit vector along `axis` with a small component on the next one.
+std::vector<float> basis(int axis, float tilt = 0.0f) {
+    std::vector<float> v(4, 0.0f);
+    v[axis % 4] = 1.0f;
+    v[(axis + 1) % 4] = tilt;
+    return v;
+}
+
+} // namespace
+
+TEST(EmbeddingHalfTest, RoundTripsRepresentableValues) {
+    for (float f : { 0.0f, 1.0f, -2.5f, 0.000061035156f, 5.9604645e-08f, 65504.0f }) {
+        EXPECT_EQ(embedding_fp16_to_fp32(embedding_fp32_to_fp16(f)), f) << f;
+    }
+    EXPECT_NEAR(embedding_fp16_to_fp32(embedding_fp32_to_fp16(0.1f)), 0.1f, 1e-4f);
+    EXPECT_TRUE(std::isinf(embedding_fp16_to_fp32(embedding_fp32_to_fp16(1e6f))));
+}
+
+TEST_F(EmbeddingStoreTest, SearchesAndSurvivesReopen) {
+    {
+        auto store = open();
+        const int64_t ids[3] = { 10, 11, 12 };
+        std::vector<float> vecs;
+        for (int i = 0; i < 3; ++i) {
+            auto v = basis(i);
+            vecs.insert(vecs.end(), v.begin(), v.end());
+        }
+        ASSERT_TRUE(store->append(ids, vecs.data(), 3));
+    }
+    auto store = open();
+    EXPECT_EQ(store->live(), 3u);
+    const auto q = basis(1, 0.2f);
+    const auto hits = store->search(q.data(), 2);
+    ASSERT_EQ(hits.size(), 2u);
+    EXPECT_EQ(hits[0].id, 11);
+    EXPECT_EQ(hits[1].id, 12);
+    EXPECT_GT(hits[0].score, hits[1].score);
+}
+
+TEST_F(EmbeddingStoreTest, RejectsAnotherModel) {
+    open();
+    std::string error;
+    EXPECT_FALSE(embedding_store::open(path_, "other-model", 4, EMBEDDING_F32, &error));
+    EXPECT_FALSE(embedding_store::open(path_, "test-model", 8, EMBEDDING_F32, &error));
+    EXPECT_FALSE(error.empty());
+}
+
+TEST_F(EmbeddingStoreTest, RemovesReplacesAndCompacts) {
+    auto store = open(EMBEDDING_F16);
+    std::vector<int64_t> ids;
+    std::vector<float> vecs;
+    for (int i = 0; i < 100; ++i) {   // past the initial capacity: grows by compaction
+        ids.push_back(i);
+        auto v = basis(i, 0.01f * i);
+        vecs.insert(vecs.end(), v.begin(), v.end());
+    }
+    ASSERT_TRUE(store->append(ids.data(), vecs.data(), ids.size()));
+    EXPECT_GE(store->capacity(), 100u);
+
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_TRUE(store->remove(i));
+    }
+    EXPECT_FALSE(store->remove(0));
+    const int64_t id = 99;
+    const auto v = basis(0);
+    ASSERT_TRUE(store->append(&id, v.data(), 1));   // replaces the old 99
+    EXPECT_EQ(store->live(), 50u);
+    EXPECT_EQ(store->deleted(), 51u);
+
+    ASSERT_TRUE(store->maybe_compact());
+    EXPECT_TRUE(store->is_open());
+    EXPECT_EQ(store->deleted(), 0u);
+    EXPECT_EQ(store->count(), 50u);
+    const auto hits = store->search(v.data(), 1);
+    ASSERT_EQ(hits.size(), 1u);
+    EXPECT_EQ(hits[0].id, 99);
+    EXPECT_NEAR(hits[0].score, 1.0f, 1e-3f);
+
+    store.reset();
+    store = open(EMBEDDING_F16);
+    EXPECT_EQ(store->live(), 50u);
+    EXPECT_TRUE(store->contains(99));
+    EXPECT_FALSE(store->contains(0));
+}
+
+TEST_F(EmbeddingStoreTest, IgnoresTornWrites) {
+    {
+        auto store = open();
+        const int64_t id = 1;
+        const auto v = basis(0);
+        ASSERT_TRUE(store->append(&id, v.data(), 1));
+    }
+    {
+        // a crashed append: records past `count` and a half-written header slot
+        const int fd = ::open(path_.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        const std::vector<uint8_t> junk(600, 0xAB);
+        ASSERT_EQ(pwrite(fd, junk.data(), junk.size(), embedding_store::DATA_START + 64), (ssize_t) junk.size());
+        ASSERT_EQ(pwrite(fd, junk.data(), 100, 0), 100);
+        ::close(fd);
+    }
+    auto store = open();
+    EXPECT_EQ(store->count(), 1u);
+    EXPECT_TRUE(store->contains(1));
+    const int64_t id = 2;
+    const auto v = basis(2);
+    ASSERT_TRUE(store->append(&id, v.data(), 1));
+    const auto hits = store->search(v.data(), 5);
+    ASSERT_EQ(hits.size(), 2u);
+    EXPECT_EQ(hits[0].id, 2);
+}
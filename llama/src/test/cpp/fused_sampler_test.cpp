@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+#include "fused_sampler.h"
+#include "sampler_reference.h"
+#include <random>
+
+static std::vector<float> random_logits(std::mt19937 & gen, int32_t n_vocab) {
+    std::normal_distribution<float> nd(0.0f, 3.0f);
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) l = nd(gen);
+    return logits;
+}
+
+static void expect_same_tokens(const fused_sampler_params & params, int32_t n_vocab, int n_tokens) {
+    std::mt19937 gen(params.seed * 7 + 1);
+    fused_sampler fused(params);
+    reference_chain ref(params);
+    for (int t = 0; t < n_tokens; ++t) {
+        auto logits = random_logits(gen, n_vocab);
+        const int32_t expected = ref.sample(logits.data(), n_vocab);
+        const auto before = logits;
+        const int32_t actual = fused.sample(logits.data(), n_vocab);
+        ASSERT_EQ(actual, expected) << "token " << t;
+        ASSERT_EQ(logits, before) << "logits must be restored";
+    }
+}
+
+TEST(FusedSamplerTest, MatchesChainTopKTopPTemp) {
+    fused_sampler_params p;
+    p.top_k = 40; p.top_p = 0.9f; p.temp = 0.7f; p.repeat_last_n = 0;
+    expect_same_tokens(p, 32000, 200);
+}
+
+TEST(FusedSamplerTest, MatchesChainWithMinPAndPenalty) {
+    fused_sampler_params p;
+    p.top_k = 64; p.top_p = 0.95f; p.min_p = 0.05f; p.temp = 0.8f;
+    p.repeat_penalty = 1.3f; p.repeat_last_n = 16; p.seed = 42;
+    expect_same_tokens(p, 5000, 300);
+}
+
+TEST(FusedSamplerTest, MatchesChainWithoutTopK) {
+    fused_sampler_params p;
+    p.top_k = 0; p.top_p = 0.8f; p.temp = 1.0f; p.seed = 7;
+    expect_same_tokens(p, 3000, 50);
+}
+
+TEST(FusedSamplerTest, GreedyPicksArgmaxAndKeepsRngInStep) {
+    fused_sampler_params p;
+    p.top_k = 10; p.temp = 0.0f; p.repeat_last_n = 0;
+    expect_same_tokens(p, 1000, 20);
+
+    std::vector<float> logits(100, 0.0f);
+    logits[37] = 5.0f;
+    fused_sampler greedy(p);
+    EXPECT_EQ(greedy.sample(logits.data(), 100), 37);
+}
+
+TEST(FusedSamplerTest, PenaltyDiscouragesRepeats) {
+    fused_sampler_params p;
+    p.top_k = 2; p.temp = 0.0f; p.repeat_penalty = 10.0f; p.repeat_last_n = 4;
+    fused_sampler s(p);
+    std::vector<float> logits = { 1.0f, 2.0f, 1.9f };
+    EXPECT_EQ(s.sample(logits.data(), 3), 1);
+    EXPECT_EQ(s.sample(logits.data(), 3), 2);   // 2.0 / 10 < 1.9
+    s.reset();
+    EXPECT_EQ(s.sample(logits.data(), 3), 1);
+}
+
+TEST(FusedSamplerTest, BlockMaxHandlesTails) {
+    std::vector<float> x = { -3.0f, -1.0f, -2.0f, 4.0f, -5.0f, 6.5f, 0.0f };
+    for (size_t n = 1; n <= x.size(); ++n) {
+        EXPECT_EQ(fused_block_max(x.data(), n), *std::max_element(x.begin(), x.begin() + n));
+    }
+}
+
+// Logits from raw mt19937 output only, so every standard library produces the same ones.
+static std::vector<float> portable_logits(std::mt19937 & gen, int32_t n_vocab) {
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) l = (float) (gen() >> 8) * (12.0f / 16777216.0f) - 6.0f;
+    return logits;
+}
+
+static std::vector<int32_t> sample_sequence(const fused_sampler_params & params, int32_t n_vocab, int n_tokens) {
+    std::mt19937 gen(params.seed + 11);
+    fused_sampler fused(params);
+    std::vector<int32_t> tokens;
+    for (int t = 0; t < n_tokens; ++t) {
+        auto logits = portable_logits(gen, n_vocab);
+        tokens.push_back(fused.sample(logits.data(), n_vocab));
+    }
+    return tokens;
+}
+
+// Pinned sequences, so a change that moves both implementations together is still caught.
+// Recorded from fused_sampler after checking them against reference_chain; parity with
+// llama.cpp's own chain is checked by llama_sampler_parity_test, which links llama.cpp.
+TEST(FusedSamplerTest, GoldenSequences) {
+    fused_sampler_params a;
+    a.top_k = 40; a.top_p = 0.9f; a.temp = 0.7f; a.repeat_last_n = 0; a.seed = 1234;
+    EXPECT_EQ(sample_sequence(a, 32000, 16), (std::vector<int32_t>{
+        22049, 25478, 17568, 20062, 26870, 12323, 6760, 9176, 23653, 30895, 18891, 6689, 2509, 755, 18842, 25919 }));
+
+    fused_sampler_params b;
+    b.top_k = 64; b.top_p = 0.95f; b.min_p = 0.05f; b.temp = 0.8f;
+    b.repeat_penalty = 1.3f; b.repeat_last_n = 16; b.seed = 42;
+    EXPECT_EQ(sample_sequence(b, 32000, 16), (std::vector<int32_t>{
+        6064, 362, 11719, 20092, 7715, 17236, 1042, 12942, 17633, 31566, 9077, 9578, 20508, 1585, 26442, 22283 }));
+}
@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include "grammar_cache.h"
+#include <string>
+
+namespace {
+
+struct fake_grammar {
+    std::string source;
+    int         state = 0;
+};
+
+struct fake_vocab {};
+
+int g_live = 0;
+
+fake_grammar * make_grammar(const std::string & source) {
+    g_live++;
+    return new fake_grammar{ source };
+}
+
+using cache_t = compiled_grammar_cache<fake_grammar, fake_vocab>;
+
+cache_t make_cache(size_t capacity) {
+    return cache_t(
+            [](const fake_grammar * g) { g_live++; return new fake_grammar(*g); },
+            [](fake_grammar * g) { g_live--; delete g; },
+            capacity);
+}
+
+void release(fake_grammar * g) {
+    g_live--;
+    delete g;
+}
+
+} // namespace
+
+TEST(GrammarCacheTest, HashDependsOnKindAndSource) {
+    EXPECT_EQ(grammar_source_hash("gbnf", "root ::= \"a\""), grammar_source_hash("gbnf", "root ::= \"a\""));
+    EXPECT_NE(grammar_source_hash("gbnf", "x"), grammar_source_hash("json_schema", "x"));
+    EXPECT_NE(grammar_source_hash("ab", "c"), grammar_source_hash("a", "bc"));
+}
+
+TEST(GrammarCacheTest, CompilesOncePerKeyAndHandsOutIndependentCopies) {
+    g_live = 0;
+    {
+        cache_t cache = make_cache(4);
+        fake_vocab vocab;
+        int compiles = 0;
+        auto make = [&]() { compiles++; return make_grammar("g"); };
+
+        bool hit = true;
+        fake_grammar * a = cache.acquire(&vocab, 1, make, &hit);
+        EXPECT_FALSE(hit);
+        a->state = 42;
+        fake_grammar * b = cache.acquire(&vocab, 1, make, &hit);
+        EXPECT_TRUE(hit);
+        EXPECT_EQ(compiles, 1);
+        EXPECT_NE(a, b);
+        EXPECT_EQ(b->state, 0);
+        EXPECT_EQ(cache.hits(), 1u);
+        EXPECT_EQ(cache.misses(), 1u);
+        release(a);
+        release(b);
+        EXPECT_EQ(g_live, 1);   // the cached prototype
+    }
+    EXPECT_EQ(g_live, 0);
+}
+
+TEST(GrammarCacheTest, KeysAreScopedToTheOwner) {
+    g_live = 0;
+    cache_t cache = make_cache(4);
+    fake_vocab v1, v2;
+    int compiles = 0;
+    auto make = [&]() { compiles++; return make_grammar("g"); };
+
+    release(cache.acquire(&v1, 7, make));
+    release(cache.acquire(&v2, 7, make));
+    EXPECT_EQ(compiles, 2);
+    EXPECT_EQ(cache.size(), 2u);
+
+    cache.forget_owner(&v1);
+    EXPECT_EQ(cache.size(), 1u);
+    release(cache.acquire(&v1, 7, make));
+    EXPECT_EQ(compiles, 3);
+    cache.clear();
+    EXPECT_EQ(g_live, 0);
+}
+
+TEST(GrammarCacheTest, EvictsLeastRecentlyUsed) {
+    g_live = 0;
+    cache_t cache = make_cache(2);
+    fake_vocab vocab;
+    int compiles = 0;
+    auto make = [&]() { compiles++; return make_grammar("g"); };
+
+    release(cache.acquire(&vocab, 1, make));
+    release(cache.acquire(&vocab, 2, make));
+    release(cache.acquire(&vocab, 1, make));   // 2 is now the oldest
+    release(cache.acquire(&vocab, 3, make));
+    EXPECT_EQ(cache.size(), 2u);
+    EXPECT_EQ(compiles, 3);
+
+    bool hit = false;
+    release(cache.acquire(&vocab, 1, make, &hit));
+    EXPECT_TRUE(hit);
+    release(cache.acquire(&vocab, 2, make, &hit));
+    EXPECT_FALSE(hit);
+    cache.clear();
+    EXPECT_EQ(g_live, 0);
+}
+
+TEST(GrammarCacheTest, FailedCompileIsNotCached) {
+    cache_t cache = make_cache(2);
+    fake_vocab vocab;
+    int compiles = 0;
+    auto fail = [&]() -> fake_grammar * { compiles++; return nullptr; };
+
+    EXPECT_EQ(cache.acquire(&vocab, 1, fail), nullptr);
+    EXPECT_EQ(cache.acquire(&vocab, 1, fail), nullptr);
+    EXPECT_EQ(compiles, 2);
+    EXPECT_EQ(cache.size(), 0u);
+}
@@ -0,0 +1,262 @@
+// Microbenchmarks of the token hot path, on Linux without a phone or a JVM: sampling, and
+// the JNI side, where a FakeJvmEnv stands in for JNIEnv with heap-allocated strings and
+// maps, so the numbers include the marshaling work our code drives but not ART's own costs.
+// Every benchmark reports ns/op (Time) and allocs/op (operator new calls).
+//
+//   ./jni_hot_path_bench --benchmark_filter=TokenEmit
+#include <benchmark/benchmark.h>
+#include "fused_sampler.h"
+#include "jni_marshal.h"
+#include "sampler_reference.h"
+#include "token_text.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+static std::atomic<size_t> g_allocs{0};
+
+void * operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void * p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// Sets the allocs/op counter from the allocations made since construction.
+class alloc_counter {
+public:
+    alloc_counter() : start_(g_allocs.load(std::memory_order_relaxed)) {}
+    void report(benchmark::State & state) const {
+        const double n = (double) (g_allocs.load(std::memory_order_relaxed) - start_);
+        state.counters["allocs/op"] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+    }
+private:
+    size_t start_;
+};
+
+struct fake_object {
+    virtual ~fake_object() = default;
+    bool local = false;   // created for the caller: DeleteLocalRef frees it
+};
+struct fake_string : fake_object {
+    std::string utf8;
+};
+struct fake_map : fake_object {   // Map<String, String>
+    std::vector<std::pair<std::string, fake_string>> entries;
+};
+struct fake_array : fake_object {
+    std::vector<fake_object *> items;
+};
+
+template <typename T, typename J>
+T * unwrap(J ref) {
+    return dynamic_cast<T *>(reinterpret_cast<fake_object *>(ref));
+}
+template <typename J>
+J wrap(fake_object * obj) {
+    return reinterpret_cast<J>(obj);
+}
+
+// Enough of JNIEnv for mapListToJSONString and NewStringUTF. Like ART, strings handed to
+// native code are copies and every returned reference is a new local one.
+struct FakeJvmEnv {
+    fake_object map_class;
+
+    jclass FindClass(const char *) { return wrap<jclass>(&map_class); }
+    jmethodID GetMethodID(jclass, const char * name, const char *) { return (jmethodID) name; }
+    jsize GetArrayLength(jobjectArray array) { return (jsize) unwrap<fake_array>(array)->items.size(); }
+    jobject GetObjectArrayElement(jobjectArray array, jsize i) { return wrap<jobject>(unwrap<fake_array>(array)->items[i]); }
+    jboolean IsInstanceOf(jobject obj, jclass) { return unwrap<fake_map>(obj) ? JNI_TRUE : JNI_FALSE; }
+
+    jstring NewStringUTF(const char * utf8) {
+        auto * s = new fake_string;
+        s->local = true;
+        s->utf8 = utf8;
+        return wrap<jstring>(s);
+    }
+
+    jobject CallObjectMethod(jobject obj, jmethodID, jobject key) {
+        const std::string & k = unwrap<fake_string>(key)->utf8;
+        for (auto & e : unwrap<fake_map>(obj)->entries) {
+            if (e.first == k) {
+                return wrap<jobject>(&e.second);
+            }
+        }
+        return nullptr;
+    }
+
+    const char * GetStringUTFChars(jstring s, jboolean *) {
+        const std::string & utf8 = unwrap<fake_string>(s)->utf8;
+        char * copy = new char[utf8.size() + 1];
+        std::memcpy(copy, utf8.c_str(), utf8.size() + 1);
+        return copy;
+    }
+    void ReleaseStringUTFChars(jstring, const char * chars) { delete[] chars; }
+
+    void DeleteLocalRef(jobject obj) {
+        auto * o = reinterpret_cast<fake_object *>(obj);
+        if (o && o->local) {
+            delete o;
+        }
+    }
+    jboolean ExceptionCheck() { return JNI_FALSE; }
+    void ExceptionDescribe() {}
+    void ExceptionClear() {}
+};
+
+// Chat text with the mix of ASCII, accents, CJK and emoji a real history has.
+std::string chat_text(std::mt19937 & rng, size_t bytes) {
+    static const char * words[] = {
+        "the", "model", "context", "token", "caf\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+        "answer", "\xf0\x9f\x99\x82", "because", "memory", "phone", "na\xc3\xafve", "quickly",
+    };
+    std::string s;
+    while (s.size() < bytes) {
+        s += words[rng() % (sizeof(words) / sizeof(words[0]))];
+        s += rng() % 11 == 0 ? ".\n" : " ";
+    }
+    return s;
+}
+
+struct fake_chat {
+    fake_array            array;
+    std::vector<fake_map> maps;
+
+    explicit fake_chat(size_t n_messages) : maps(n_messages + 1) {
+        std::mt19937 rng(42);
+        maps[0].entries = { { "role", {} }, { "content", {} } };
+        maps[0].entries[0].second.utf8 = "system";
+        maps[0].entries[1].second.utf8 = "You are a helpful assistant running on a phone.";
+        for (size_t i = 1; i <= n_messages; ++i) {
+            maps[i].entries = { { "role", {} }, { "content", {} } };
+            maps[i].entries[0].second.utf8 = i % 2 ? "user" : "assistant";
+            maps[i].entries[1].second.utf8 = chat_text(rng, i % 2 ? 200 : 1200);
+        }
+        for (auto & m : maps) {
+            array.items.push_back(&m);
+        }
+    }
+};
+
+// Pieces of a 32k vocab: 1-6 byte slices of chat text, some cutting a multi-byte
+// character in two so that only consecutive pieces form valid UTF-8.
+std::vector<std::string> fake_vocab() {
+    std::mt19937 rng(7);
+    std::vector<std::string> pieces;
+    const std::string text = chat_text(rng, 200000);
+    for (size_t i = 0; pieces.size() < 32000; i = (i + 1 + rng() % 7) % (text.size() - 8)) {
+        pieces.push_back(text.substr(i, 1 + rng() % 6));
+    }
+    pieces[100] = "<think>";
+    pieces[101] = "</think>";
+    return pieces;
+}
+
+} // namespace
+
+static void BM_MapListToJson(benchmark::State & state) {
+    FakeJvmEnv env;
+    fake_chat chat((size_t) state.range(0));
+    const alloc_counter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(mapListToJSONString(&env, wrap<jobjectArray>(&chat.array)));
+    }
+    allocs.report(state);
+}
+BENCHMARK(BM_MapListToJson)->Arg(8)->Arg(40);
+
+static void BM_Utf8Validate(benchmark::State & state) {
+    std::mt19937 rng(1);
+    const std::string text = chat_text(rng, (size_t) state.range(0));
+    const alloc_counter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(is_valid_utf8(text.c_str()));
+    }
+    allocs.report(state);
+    state.SetBytesProcessed((int64_t) state.iterations() * (int64_t) text.size());
+}
+BENCHMARK(BM_Utf8Validate)->Arg(8)->Arg(4096);
+
+static void BM_StripThinkTags(benchmark::State & state) {
+    std::mt19937 rng(2);
+    const std::string reply = state.range(0)
+            ? "<think>\n" + chat_text(rng, 600) + "\n</think>\n\n" + chat_text(rng, 400)
+            : std::string(" answer");   // the common case: a piece without tags
+    const alloc_counter allocs;
+    for (auto _ : state) {
+        std::string text = reply;
+        strip_think_tags(text);
+        benchmark::DoNotOptimize(has_thinking_markers(text));
+        benchmark::DoNotOptimize(text.data());
+    }
+    allocs.report(state);
+}
+BENCHMARK(BM_StripThinkTags)->Arg(0)->Arg(1);
+
+// What completion_loop does for every generated token after sampling: detokenize the
+// piece, hold back incomplete UTF-8, filter think tags and hand a new jstring to Kotlin.
+// The vocab lookup stands in for llama_token_to_piece, which needs a loaded model.
+static void BM_TokenEmit(benchmark::State & state) {
+    FakeJvmEnv env;
+    const auto vocab = fake_vocab();
+    std::mt19937 rng(3);
+    std::vector<int32_t> ids(4096);
+    for (auto & id : ids) id = (int32_t) (rng() % vocab.size());
+    const bool strip = state.range(0) != 0;
+
+    std::string cached;
+    size_t i = 0;
+    const alloc_counter allocs;
+    for (auto _ : state) {
+        const std::string piece = vocab[ids[i++ % ids.size()]];
+        cached = piece;   // sessions without verbose token logging keep only the latest piece
+        std::string filtered = cached;
+        benchmark::DoNotOptimize(has_thinking_markers(filtered));
+        if (strip) {
+            strip_think_tags(filtered);
+        }
+        const bool valid = is_valid_utf8(filtered.c_str());
+        jstring token = env.NewStringUTF(valid ? filtered.c_str() : "");
+        benchmark::DoNotOptimize(token);
+        env.DeleteLocalRef(token);
+        if (valid) {
+            cached.clear();
+        }
+    }
+    allocs.report(state);
+}
+BENCHMARK(BM_TokenEmit)->Arg(0)->Arg(1);
+
+// Per-token sampling over a Qwen-sized vocabulary: the fused sampler against a copy of the
+// full-vocabulary llama.cpp chain it replaces (Arg 1).
+static void BM_Sample(benchmark::State & state) {
+    const int32_t n_vocab = 151936;
+    fused_sampler_params p;
+    p.top_k = 40; p.top_p = 0.9f; p.temp = 0.7f; p.repeat_penalty = 1.1f; p.repeat_last_n = 64;
+    std::mt19937 gen(3);
+    std::normal_distribution<float> nd(0.0f, 3.0f);
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) l = nd(gen);
+    fused_sampler fused(p);
+    reference_chain chain(p);
+    const bool full_chain = state.range(0) != 0;
+    fused.sample(logits.data(), n_vocab);   // first call sizes the reusable buffers
+
+    const alloc_counter allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(full_chain ? chain.sample(logits.data(), n_vocab)
+                                            : fused.sample(logits.data(), n_vocab));
+    }
+    allocs.report(state);
+}
+BENCHMARK(BM_Sample)->Arg(0)->Arg(1);
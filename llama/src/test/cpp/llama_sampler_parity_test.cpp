@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include "fused_sampler.h"
+#include "sampler_chain.h"
+#include <memory>
+#include <random>
+#include <vector>
+
+// The fused sampler against llama.cpp's own samplers, linked from the llama.cpp submodule:
+// the chain new_sampler_chain builds for the app and the fused sampler get the same logits
+// and seed and must pick the same token at every step.
+
+namespace {
+
+using chain_ptr = std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)>;
+
+std::vector<float> random_logits(std::mt19937 & gen, int32_t n_vocab) {
+    std::normal_distribution<float> nd(0.0f, 3.0f);
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) l = nd(gen);
+    return logits;
+}
+
+// llama_sampler_sample without a context: apply to the full vocabulary, then accept.
+llama_token chain_sample(llama_sampler * chain, const std::vector<float> & logits, std::vector<llama_token_data> & cur) {
+    cur.resize(logits.size());
+    for (size_t i = 0; i < logits.size(); ++i) {
+        cur[i] = { (llama_token) i, logits[i], 0.0f };
+    }
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    llama_sampler_apply(chain, &cur_p);
+    const llama_token id = cur_p.data[cur_p.selected].id;
+    llama_sampler_accept(chain, id);
+    return id;
+}
+
+void expect_parity(const fused_sampler_params & params, int32_t n_vocab, int n_tokens) {
+    std::mt19937 gen(params.seed * 13 + 5);
+    chain_ptr chain(new_sampler_chain(params), llama_sampler_free);
+    fused_sampler fused(params);
+    std::vector<llama_token_data> cur;
+    for (int t = 0; t < n_tokens; ++t) {
+        auto logits = random_logits(gen, n_vocab);
+        const llama_token expected = chain_sample(chain.get(), logits, cur);
+        ASSERT_EQ(fused.sample(logits.data(), n_vocab), expected) << "token " << t;
+    }
+}
+
+} // namespace
+
+TEST(LlamaSamplerParityTest, TopKTopPTemp) {
+    fused_sampler_params p;
+    p.top_k = 40; p.top_p = 0.9f; p.temp = 0.7f; p.repeat_last_n = 0; p.seed = 1234;
+    expect_parity(p, 32000, 200);
+}
+
+TEST(LlamaSamplerParityTest, MinPAndPenalty) {
+    fused_sampler_params p;
+    p.top_k = 64; p.top_p = 0.95f; p.min_p = 0.05f; p.temp = 0.8f;
+    p.repeat_penalty = 1.3f; p.repeat_last_n = 16; p.seed = 42;
+    expect_parity(p, 32000, 300);
+}
+
+TEST(LlamaSamplerParityTest, WithoutTopK) {
+    fused_sampler_params p;
+    p.top_k = 0; p.top_p = 0.8f; p.temp = 1.0f; p.seed = 7;
+    expect_parity(p, 3000, 50);
+}
+
+TEST(LlamaSamplerParityTest, Greedy) {
+    fused_sampler_params p;
+    p.top_k = 10; p.temp = 0.0f; p.repeat_last_n = 0;
+    expect_parity(p, 1000, 20);
+}
+
+TEST(LlamaSamplerParityTest, AppDefaults) {
+    // sampler_params_from_ui with the UI's zero values
+    fused_sampler_params p;
+    p.top_k = 40; p.top_p = 0.9f; p.temp = 0.4f; p.repeat_last_n = 0; p.seed = 1234;
+    expect_parity(p, 151936, 32);
+}
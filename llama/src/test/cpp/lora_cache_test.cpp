@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+#include "lora_cache.h"
+#include <string>
+#include <vector>
+
+namespace {
+
+struct fake_model {};
+struct fake_adapter {
+    std::string path;
+};
+
+struct fixture {
+    std::vector<std::string> freed;
+    int loads = 0;
+    lora_cache<fake_model, fake_adapter> cache{ [this](fake_adapter * a) {
+        freed.push_back(a->path);
+        delete a;
+    } };
+
+    fake_adapter * load(const fake_model * model, const std::string & path) {
+        return cache.acquire(model, path, [&](size_t & bytes) -> fake_adapter * {
+            loads++;
+            if (path.empty()) return nullptr;
+            bytes = path.size() * 1024;
+            return new fake_adapter{ path };
+        });
+    }
+};
+
+} // namespace
+
+TEST(LoraCacheTest, LoadsOncePerModelAndPath) {
+    fixture f;
+    fake_model a, b;
+    fake_adapter * x = f.load(&a, "x.gguf");
+    EXPECT_EQ(f.load(&a, "x.gguf"), x);
+    EXPECT_NE(f.load(&b, "x.gguf"), x);   // adapters patch one base model
+    EXPECT_EQ(f.loads, 2);
+    EXPECT_EQ(f.load(&a, ""), nullptr);
+
+    const auto entries = f.cache.snapshot();
+    ASSERT_EQ(entries.size(), 2u);
+    EXPECT_EQ(entries[0].refs, 2);
+    EXPECT_EQ(entries[0].bytes, 6u * 1024);
+    EXPECT_TRUE(f.cache.owns(&a, x));
+    EXPECT_FALSE(f.cache.owns(&b, x));
+}
+
+TEST(LoraCacheTest, FreesWithLastReferenceOrOwner) {
+    fixture f;
+    fake_model a, b;
+    fake_adapter * x = f.load(&a, "x.gguf");
+    f.load(&a, "x.gguf");
+    f.load(&a, "y.gguf");
+    f.load(&b, "z.gguf");
+    EXPECT_FALSE(f.cache.release(x));
+    EXPECT_TRUE(f.cache.release(x));
+    EXPECT_EQ(f.freed, (std::vector<std::string>{ "x.gguf" }));
+
+    f.cache.forget_owner(&a);
+    EXPECT_EQ(f.freed.back(), "y.gguf");
+    ASSERT_EQ(f.cache.snapshot().size(), 1u);
+    f.cache.forget_owner(&b);
+    EXPECT_TRUE(f.cache.snapshot().empty());
+}
+
+TEST(LoraCacheTest, PinnedAdapterOutlivesLastReference) {
+    fixture f;
+    fake_model a, b;
+    fake_adapter * x = f.load(&a, "x.gguf");
+    const lora_set<fake_adapter> set = { { x, 1.0f } };
+    EXPECT_FALSE(f.cache.pin(&b, set));   // other model: nothing pinned
+    ASSERT_TRUE(f.cache.pin(&a, set));
+    ASSERT_TRUE(f.cache.pin(&a, set));
+
+    EXPECT_FALSE(f.cache.release(x));
+    EXPECT_TRUE(f.freed.empty());
+    EXPECT_TRUE(f.cache.released(x));
+    EXPECT_FALSE(f.cache.owns(&a, x));
+    EXPECT_FALSE(f.cache.pin(&a, set));   // released adapters cannot be attached again
+
+    f.cache.unpin(set);
+    EXPECT_TRUE(f.freed.empty());
+    f.cache.unpin(set);
+    EXPECT_EQ(f.freed, (std::vector<std::string>{ "x.gguf" }));
+    EXPECT_TRUE(f.cache.snapshot().empty());
+}
+
+TEST(LoraCacheTest, ComparesSetsIgnoringOrder) {
+    fake_adapter p, q;
+    lora_set<fake_adapter> s1 = { { &p, 1.0f }, { &q, 0.5f } };
+    lora_set<fake_adapter> s2 = { { &q, 0.5f }, { &p, 1.0f } };
+    lora_set<fake_adapter> s3 = { { &q, 0.25f }, { &p, 1.0f } };
+    EXPECT_TRUE(lora_set_equal(s1, s2));
+    EXPECT_FALSE(lora_set_equal(s1, s3));
+    EXPECT_FALSE(lora_set_equal(s1, lora_set<fake_adapter>{}));
+    EXPECT_TRUE(lora_set_equal(lora_set<fake_adapter>{}, lora_set<fake_adapter>{}));
+}
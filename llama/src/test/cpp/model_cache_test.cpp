@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+#include "model_cache.h"
+#include <atomic>
+#include <thread>
+
+struct FakeModel {
+    size_t bytes;
+};
+
+struct FakeCache {
+    int freed = 0;
+    model_residency_cache<FakeModel> cache;
+
+    explicit FakeCache(size_t budget)
+        : cache([this](FakeModel * m) { freed++; delete m; },
+                [](const FakeModel * m) { return m->bytes; },
+                budget) {}
+};
+
+static model_file_key key(const std::string & path, long long mtime = 1) {
+    model_file_key k;
+    k.path = path;
+    k.size = 100;
+    k.mtime = mtime;
+    return k;
+}
+
+TEST(ModelCacheTest, ReusesResidentModelAfterRelease) {
+    FakeCache fc(1000);
+    int loads = 0;
+    auto loader = [&] { loads++; return new FakeModel{100}; };
+
+    bool hit = true;
+    FakeModel * a = fc.cache.acquire(key("a"), loader, &hit);
+    EXPECT_FALSE(hit);
+    EXPECT_TRUE(fc.cache.release(a));
+
+    FakeModel * again = fc.cache.acquire(key("a"), loader, &hit);
+    EXPECT_TRUE(hit);
+    EXPECT_EQ(a, again);
+    EXPECT_EQ(loads, 1);
+    EXPECT_EQ(fc.freed, 0);
+}
+
+TEST(ModelCacheTest, EvictsLeastRecentlyUsedUnreferencedModel) {
+    FakeCache fc(250);
+    FakeModel * a = fc.cache.acquire(key("a"), [] { return new FakeModel{100}; });
+    FakeModel * b = fc.cache.acquire(key("b"), [] { return new FakeModel{100}; });
+    fc.cache.release(a);
+    fc.cache.release(b);
+
+    // c pushes the total over budget; a is the oldest unreferenced entry
+    FakeModel * c = fc.cache.acquire(key("c"), [] { return new FakeModel{100}; });
+    EXPECT_EQ(fc.freed, 1);
+    EXPECT_FALSE(fc.cache.contains(a));
+    EXPECT_TRUE(fc.cache.contains(b));
+    EXPECT_TRUE(fc.cache.contains(c));
+}
+
+TEST(ModelCacheTest, NeverEvictsReferencedModels) {
+    FakeCache fc(50);
+    FakeModel * a = fc.cache.acquire(key("a"), [] { return new FakeModel{100}; });
+    EXPECT_TRUE(fc.cache.contains(a));
+    EXPECT_EQ(fc.freed, 0);
+    fc.cache.release(a);
+    EXPECT_EQ(fc.freed, 1);
+}
+
+TEST(ModelCacheTest, ChangedFileReplacesStaleEntry) {
+    FakeCache fc(1000);
+    FakeModel * old_model = fc.cache.acquire(key("a", 1), [] { return new FakeModel{100}; });
+    fc.cache.release(old_model);
+    fc.cache.acquire(key("a", 2), [] { return new FakeModel{100}; });
+    EXPECT_EQ(fc.freed, 1);
+    EXPECT_EQ(fc.cache.get_stats().entries, 1u);
+}
+
+TEST(ModelCacheTest, FailedLoadLeavesNoEntry) {
+    FakeCache fc(1000);
+    EXPECT_EQ(fc.cache.acquire(key("a"), [] { return (FakeModel *) nullptr; }), nullptr);
+    EXPECT_EQ(fc.cache.get_stats().entries, 0u);
+    EXPECT_FALSE(fc.cache.release(nullptr));
+}
+
+TEST(ModelCacheTest, ConcurrentAcquiresShareOneLoad) {
+    FakeCache fc(1000);
+    std::atomic<int> loads{0};
+    auto loader = [&] {
+        loads++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return new FakeModel{100};
+    };
+    FakeModel * r1 = nullptr;
+    FakeModel * r2 = nullptr;
+    std::thread t1([&] { r1 = fc.cache.acquire(key("a"), loader); });
+    std::thread t2([&] { r2 = fc.cache.acquire(key("a"), loader); });
+    t1.join();
+    t2.join();
+    EXPECT_EQ(loads.load(), 1);
+    EXPECT_EQ(r1, r2);
+    EXPECT_EQ(fc.cache.get_stats().referenced, 1u);
+}
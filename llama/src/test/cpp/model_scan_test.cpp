@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include "model_scan.h"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <utime.h>
+
+class ModelScanTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char tmpl[] = "/tmp/model_scan_testXXXXXX";
+        ASSERT_NE(mkdtemp(tmpl), nullptr);
+        dir_ = tmpl;
+    }
+    void TearDown() override {
+        for (const auto & f : created_) unlink(f.c_str());
+        rmdir(dir_.c_str());
+    }
+    std::string write_file(const std::string & name, const std::string & data) {
+        const std::string path = dir_ + "/" + name;
+        FILE * f = fopen(path.c_str(), "wb");
+        fwrite(data.data(), 1, data.size(), f);
+        fclose(f);
+        created_.push_back(path);
+        return path;
+    }
+    std::string dir_;
+    std::vector<std::string> created_;
+};
+
+TEST_F(ModelScanTest, CachesUntilFileChanges) {
+    const std::string path = write_file("a.gguf", "abc");
+    model_scan_cache cache;
+    int reads = 0;
+    auto read = [&](const std::string & p) { reads++; return p + ":" + std::to_string(reads); };
+
+    bool hit = true;
+    EXPECT_EQ(cache.get(path, read, &hit), path + ":1");
+    EXPECT_FALSE(hit);
+    EXPECT_EQ(cache.get(path, read, &hit), path + ":1");
+    EXPECT_TRUE(hit);
+
+    write_file("a.gguf", "abcdef");
+    EXPECT_EQ(cache.get(path, read, &hit), path + ":2");
+    EXPECT_FALSE(hit);
+
+    utimbuf times{1000, 1000};
+    ASSERT_EQ(utime(path.c_str(), &times), 0);
+    EXPECT_EQ(cache.get(path, read), path + ":3");
+    EXPECT_EQ(reads, 3);
+}
+
+TEST_F(ModelScanTest, MissingFileIsForgotten) {
+    model_scan_cache cache;
+    const std::string path = write_file("gone.gguf", "x");
+    cache.get(path, [](const std::string &) { return std::string("meta"); });
+    EXPECT_EQ(cache.size(), 1u);
+    unlink(path.c_str());
+    EXPECT_EQ(cache.get(path, [](const std::string &) { return std::string("meta"); }), "");
+    EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST_F(ModelScanTest, ListsOnlyMatchingFilesSorted) {
+    write_file("b.gguf", "1");
+    write_file("a.gguf", "1");
+    write_file("notes.txt", "1");
+    const auto files = model_scan_list_dir(dir_, ".gguf");
+    ASSERT_EQ(files.size(), 2u);
+    EXPECT_EQ(files[0], dir_ + "/a.gguf");
+    EXPECT_EQ(files[1], dir_ + "/b.gguf");
+    EXPECT_TRUE(model_scan_list_dir(dir_ + "/missing", ".gguf").empty());
+}
+
+TEST_F(ModelScanTest, ParallelScanKeepsOrderAndReadsEachFileOnce) {
+    std::vector<std::string> files;
+    for (int i = 0; i < 20; ++i) {
+        files.push_back(write_file("m" + std::to_string(100 + i) + ".gguf", std::string(i + 1, 'x')));
+    }
+    model_scan_cache cache;
+    std::atomic<int> reads{0};
+    auto read = [&](const std::string & p) { reads++; return p; };
+
+    auto results = model_scan_files(cache, files, read, 4);
+    EXPECT_EQ(results, files);
+    EXPECT_EQ(reads.load(), 20);
+
+    results = model_scan_files(cache, files, read, 4);
+    EXPECT_EQ(results, files);
+    EXPECT_EQ(reads.load(), 20);
+    EXPECT_TRUE(model_scan_files(cache, {}, read, 4).empty());
+}
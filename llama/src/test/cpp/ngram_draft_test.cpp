@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+#include "ngram_draft.h"
+#include <vector>
+
+using tokens = std::vector<int>;
+
+TEST(NgramDraftTest, ProposesWhatFollowedTheLastOccurrence) {
+    //           the quick brown fox jumps .  the quick
+    const tokens t = { 1,  2,    3,    4,  5,    6, 1,  2 };
+    ngram_draft_params p;
+    p.max_draft = 3;
+    EXPECT_EQ(ngram_draft(t.data(), t.size(), p), tokens({3, 4, 5}));
+}
+
+TEST(NgramDraftTest, PrefersLongerSuffixesAndRecentMatches) {
+    // suffix (7 8): the older occurrence continues with 9, the newer one with 4;
+    // suffix (6 7 8) only matches the older one
+    const tokens t = { 6, 7, 8, 9, 1, 7, 8, 4, 2, 6, 7, 8 };
+    ngram_draft_params p;
+    p.ngram_max = 3;
+    p.max_draft = 1;
+    EXPECT_EQ(ngram_draft(t.data(), t.size(), p), tokens({9}));
+    p.ngram_max = 2;
+    EXPECT_EQ(ngram_draft(t.data(), t.size(), p), tokens({4}));
+}
+
+TEST(NgramDraftTest, StopsAtTheEndOfTheHistory) {
+    const tokens t = { 5, 6, 7, 5, 6 };
+    EXPECT_EQ(ngram_draft(t.data(), t.size()), tokens({7, 5, 6}));
+}
+
+TEST(NgramDraftTest, EmptyWithoutMatch) {
+    const tokens t = { 1, 2, 3, 4, 5 };
+    EXPECT_TRUE(ngram_draft(t.data(), t.size()).empty());
+    EXPECT_TRUE(ngram_draft(t.data(), 1).empty());
+    ngram_draft_params off;
+    off.max_draft = 0;
+    const tokens r = { 1, 2, 1, 2 };
+    EXPECT_TRUE(ngram_draft(r.data(), r.size(), off).empty());
+}
@@ -0,0 +1,44 @@
+#include <gtest/gtest.h>
+#include "page_cache.h"
+#include <cstdio>
+#include <string>
+
+class PageCacheTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char tmpl[] = "/tmp/page_cache_testXXXXXX";
+        const int fd = mkstemp(tmpl);
+        ASSERT_GE(fd, 0);
+        path_ = tmpl;
+        std::string data(3 * 1024 * 1024 + 123, 'x');
+        ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t) data.size());
+        close(fd);
+    }
+    void TearDown() override { unlink(path_.c_str()); }
+    std::string path_;
+};
+
+TEST_F(PageCacheTest, WarmReadsRequestedRange) {
+    const long long size = page_cache_file_size(path_.c_str());
+    EXPECT_EQ(page_cache_warm(path_.c_str(), 0), size);
+    EXPECT_EQ(page_cache_warm(path_.c_str(), 1000, 4096), 4096);
+    EXPECT_EQ(page_cache_warm(path_.c_str(), (size_t) size + 1), -1);
+}
+
+TEST_F(PageCacheTest, WarmStopsWhenCancelled) {
+    std::atomic<bool> cancel{true};
+    EXPECT_EQ(page_cache_warm(path_.c_str(), 0, 0, &cancel), 0);
+}
+
+TEST_F(PageCacheTest, WarmedFileIsResident) {
+    page_cache_warm(path_.c_str(), 0);
+    const double residency = page_cache_residency(path_.c_str(), 0, 0);
+    EXPECT_GT(residency, 0.9);
+    EXPECT_LE(residency, 1.0);
+}
+
+TEST_F(PageCacheTest, PrefetchAndResidencyRejectMissingFile) {
+    EXPECT_FALSE(page_cache_prefetch("/nonexistent/model.gguf", 0, 0));
+    EXPECT_LT(page_cache_residency("/nonexistent/model.gguf", 0, 0), 0.0);
+    EXPECT_TRUE(page_cache_prefetch(path_.c_str(), 4096, 0));
+}
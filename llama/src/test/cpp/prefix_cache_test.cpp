@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+#include "prefix_cache.h"
+#include <vector>
+
+namespace {
+
+std::vector<int32_t> seq(std::initializer_list<int32_t> t) { return t; }
+
+std::vector<uint8_t> blob(size_t n, uint8_t v) { return std::vector<uint8_t>(n, v); }
+
+} // namespace
+
+TEST(PrefixCacheTest, MatchesKnownPaths) {
+    prefix_cache cache;
+    const auto a = seq({1, 2, 3, 4, 5});
+    const auto b = seq({1, 2, 3, 9});
+    EXPECT_EQ(cache.match_path(a.data(), a.size()), 0u);
+
+    cache.insert_path(a.data(), a.size());
+    EXPECT_EQ(cache.match_path(a.data(), a.size()), 5u);
+    EXPECT_EQ(cache.match_path(b.data(), b.size()), 3u);
+
+    cache.insert_path(b.data(), b.size());   // splits the edge after 3
+    EXPECT_EQ(cache.match_path(a.data(), a.size()), 5u);
+    EXPECT_EQ(cache.match_path(b.data(), b.size()), 4u);
+    EXPECT_EQ(cache.tokens(), 6u);           // 1 2 3 | 4 5 | 9
+}
+
+TEST(PrefixCacheTest, FindsLongestSnapshotWithinLimit) {
+    prefix_cache cache;
+    const auto p = seq({7, 8, 9, 10, 11, 12});
+    EXPECT_TRUE(cache.store(p.data(), 2, blob(10, 2)));
+    EXPECT_TRUE(cache.store(p.data(), 4, blob(10, 4)));
+    EXPECT_EQ(cache.snapshots(), 2u);
+
+    size_t len = 0;
+    const auto * snap = cache.find(p.data(), p.size(), p.size() - 1, &len);
+    ASSERT_NE(snap, nullptr);
+    EXPECT_EQ(len, 4u);
+    EXPECT_EQ((*snap)[0], 4);
+
+    // the caller must keep at least one token to decode
+    snap = cache.find(p.data(), 4, 3, &len);
+    ASSERT_NE(snap, nullptr);
+    EXPECT_EQ(len, 2u);
+
+    const auto other = seq({7, 1});
+    EXPECT_EQ(cache.find(other.data(), other.size(), other.size(), &len), nullptr);
+    EXPECT_EQ(len, 0u);
+    EXPECT_EQ(cache.hits(), 2u);
+    EXPECT_EQ(cache.misses(), 1u);
+}
+
+TEST(PrefixCacheTest, EvictsLeastRecentlyUsedSnapshotsOverBudget) {
+    prefix_cache cache(100);
+    const auto a = seq({1, 2, 3});
+    const auto b = seq({4, 5, 6});
+    const auto c = seq({7, 8, 9});
+    cache.store(a.data(), 3, blob(40, 1));
+    cache.store(b.data(), 3, blob(40, 2));
+    size_t len = 0;
+    EXPECT_NE(cache.find(a.data(), 3, 3, &len), nullptr);   // b is now the oldest
+    cache.store(c.data(), 3, blob(40, 3));
+
+    EXPECT_EQ(cache.bytes(), 80u);
+    EXPECT_EQ(cache.snapshots(), 2u);
+    EXPECT_NE(cache.find(a.data(), 3, 3, &len), nullptr);
+    EXPECT_EQ(cache.find(b.data(), 3, 3, &len), nullptr);
+    EXPECT_NE(cache.find(c.data(), 3, 3, &len), nullptr);
+
+    EXPECT_FALSE(cache.store(a.data(), 2, blob(101, 0)));
+    cache.set_max_bytes(40);
+    EXPECT_EQ(cache.snapshots(), 1u);
+    EXPECT_LE(cache.bytes(), 40u);
+}
+
+TEST(PrefixCacheTest, ReplacingASnapshotKeepsAccounting) {
+    prefix_cache cache(100);
+    const auto a = seq({1, 2, 3});
+    cache.store(a.data(), 3, blob(30, 1));
+    cache.store(a.data(), 3, blob(50, 2));
+    EXPECT_EQ(cache.bytes(), 50u);
+    EXPECT_EQ(cache.snapshots(), 1u);
+}
+
+TEST(PrefixCacheTest, PrunesOldPathsOverTokenBudget) {
+    prefix_cache cache(1000, 8);
+    const auto a = seq({1, 2, 3, 4});
+    const auto b = seq({1, 2, 5, 6});
+    const auto c = seq({9, 9, 9, 9});
+    cache.insert_path(a.data(), a.size());
+    cache.insert_path(b.data(), b.size());
+    cache.store(b.data(), 4, blob(10, 1));
+    EXPECT_EQ(cache.tokens(), 6u);
+
+    cache.insert_path(c.data(), c.size());   // 10 tokens: the oldest leaf (3 4) goes
+    EXPECT_LE(cache.tokens(), 8u);
+    EXPECT_EQ(cache.match_path(a.data(), a.size()), 2u);
+    EXPECT_EQ(cache.match_path(c.data(), c.size()), 4u);
+
+    // the surviving branch was merged back into one edge and kept its snapshot
+    size_t len = 0;
+    EXPECT_NE(cache.find(b.data(), 4, 4, &len), nullptr);
+    EXPECT_EQ(len, 4u);
+}
@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+#include "quant_sweep.h"
+#include <cmath>
+
+static quant_sweep_entry entry(const char * type, long long mib, double tg, double ppl) {
+    quant_sweep_entry e;
+    e.type = type;
+    e.ok = true;
+    e.file_bytes = mib * 1024 * 1024;
+    e.tg_tps = tg;
+    e.perplexity = ppl;
+    return e;
+}
+
+TEST(QuantSweepTest, TokenNllMatchesLogSoftmax) {
+    const float logits[] = { 1.0f, 2.0f, 3.0f };
+    const double denom = std::exp(1.0) + std::exp(2.0) + std::exp(3.0);
+    EXPECT_NEAR(token_nll(logits, 3, 2), -std::log(std::exp(3.0) / denom), 1e-9);
+    EXPECT_NEAR(token_nll(logits, 3, 0), -std::log(std::exp(1.0) / denom), 1e-9);
+}
+
+TEST(QuantSweepTest, TokenNllIsStableForLargeLogits) {
+    const float logits[] = { 1000.0f, 1000.0f };
+    EXPECT_NEAR(token_nll(logits, 2, 0), std::log(2.0), 1e-9);
+}
+
+TEST(QuantSweepTest, MarksDominatedEntries) {
+    std::vector<quant_sweep_entry> entries = {
+        entry("Q4_0",   3800, 10.0, 8.10),
+        entry("Q4_K_M", 4100,  9.0, 7.90),
+        entry("Q5_0",   4500,  8.0, 7.95),   // bigger, slower and worse than Q4_K_M
+        entry("Q8_0",   7600,  6.0, 7.80),
+    };
+    entries.push_back(quant_sweep_entry{});
+    entries.back().type = "IQ1_S";           // failed entries are never on the front
+    mark_pareto_front(entries);
+    EXPECT_TRUE(entries[0].pareto);
+    EXPECT_TRUE(entries[1].pareto);
+    EXPECT_FALSE(entries[2].pareto);
+    EXPECT_TRUE(entries[3].pareto);
+    EXPECT_FALSE(entries[4].pareto);
+}
+
+TEST(QuantSweepTest, IdenticalEntriesDoNotDominateEachOther) {
+    std::vector<quant_sweep_entry> entries = { entry("Q4_K", 4100, 9.0, 7.9), entry("Q4_K_M", 4100, 9.0, 7.9) };
+    mark_pareto_front(entries);
+    EXPECT_TRUE(entries[0].pareto);
+    EXPECT_TRUE(entries[1].pareto);
+}
+
+TEST(QuantSweepTest, TableIsSortedBySizeWithFailuresLast) {
+    std::vector<quant_sweep_entry> entries = { entry("Q8_0", 7600, 6.0, 7.8), entry("Q4_0", 3800, 10.0, 8.1) };
+    quant_sweep_entry failed;
+    failed.type = "IQ2_XS";
+    failed.error = "load failed";
+    entries.insert(entries.begin(), failed);
+    mark_pareto_front(entries);
+
+    const std::string table = quant_sweep_table(entries);
+    const size_t q4 = table.find("| Q4_0 |");
+    const size_t q8 = table.find("| Q8_0 |");
+    const size_t iq = table.find("| IQ2_XS | failed: load failed");
+    ASSERT_NE(q4, std::string::npos);
+    ASSERT_NE(q8, std::string::npos);
+    ASSERT_NE(iq, std::string::npos);
+    EXPECT_LT(q4, q8);
+    EXPECT_LT(q8, iq);
+    EXPECT_NE(table.find("| 7.8000 | +0.0000 | * |"), std::string::npos);
+    EXPECT_NE(table.find("| 8.1000 | +0.3000 | * |"), std::string::npos);
+}
+
+TEST(QuantSweepTest, BundledSampleIsLongEnough) {
+    EXPECT_GT(std::string(QUANT_SWEEP_SAMPLE).size(), 2000u);
+}
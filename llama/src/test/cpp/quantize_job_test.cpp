@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include "quantize_job.h"
+#include <cstdio>
+#include <unistd.h>
+
+TEST(QuantizeJobTest, ParsesPerTensorLogLine) {
+    quantize_log_line line;
+    ASSERT_TRUE(parse_quantize_log_line(
+        "[  12/ 291]                  blk.1.attn_k.weight - [ 4096,  1024,     1,     1], type =    f16, ", line));
+    EXPECT_EQ(line.index, 12);
+    EXPECT_EQ(line.total, 291);
+    EXPECT_EQ(line.tensor, "blk.1.attn_k.weight");
+}
+
+TEST(QuantizeJobTest, IgnoresOtherLogLines) {
+    quantize_log_line line;
+    EXPECT_FALSE(parse_quantize_log_line(nullptr, line));
+    EXPECT_FALSE(parse_quantize_log_line("llama_model_quantize_impl: model size  = 15317.02 MB", line));
+    EXPECT_FALSE(parse_quantize_log_line("[   0/ 291] x", line));
+    EXPECT_FALSE(parse_quantize_log_line("[ 300/ 291] x", line));
+    EXPECT_FALSE(parse_quantize_log_line("[abc]", line));
+}
+
+TEST(QuantizeJobTest, ParsesTensorTypeOverride) {
+    std::string pattern, type;
+    ASSERT_TRUE(parse_tensor_type_override("attn_v=q6_k", pattern, type));
+    EXPECT_EQ(pattern, "attn_v");
+    EXPECT_EQ(type, "q6_k");
+    EXPECT_FALSE(parse_tensor_type_override("attn_v", pattern, type));
+    EXPECT_FALSE(parse_tensor_type_override("=q6_k", pattern, type));
+    EXPECT_FALSE(parse_tensor_type_override("attn_v=", pattern, type));
+}
+
+static void write_i32(FILE * f, int32_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+TEST(QuantizeJobTest, LoadsLegacyImatrixAveragedOverCalls) {
+    char path[] = "/tmp/imatrix_testXXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    FILE * f = fdopen(fd, "wb");
+    write_i32(f, 2);
+    const std::string names[] = { "blk.0.ffn_up.weight", "output.weight" };
+    const float values[] = { 2.0f, 4.0f, 6.0f };
+    for (const auto & name : names) {
+        write_i32(f, (int32_t) name.size());
+        fwrite(name.data(), 1, name.size(), f);
+        write_i32(f, 2);   // ncall
+        write_i32(f, 3);   // nval
+        fwrite(values, sizeof(float), 3, f);
+    }
+    write_i32(f, 10);      // trailing last_call written by newer llama-imatrix
+    fclose(f);
+
+    std::unordered_map<std::string, std::vector<float>> imatrix;
+    std::string error;
+    ASSERT_TRUE(load_legacy_imatrix(path, imatrix, &error)) << error;
+    ASSERT_EQ(imatrix.size(), 2u);
+    EXPECT_EQ(imatrix["output.weight"], (std::vector<float>{ 1.0f, 2.0f, 3.0f }));
+    unlink(path);
+}
+
+TEST(QuantizeJobTest, RejectsTruncatedImatrix) {
+    char path[] = "/tmp/imatrix_testXXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    FILE * f = fdopen(fd, "wb");
+    write_i32(f, 1);
+    write_i32(f, 4);
+    fwrite("abcd", 1, 4, f);
+    write_i32(f, 1);
+    write_i32(f, 8);
+    fclose(f);
+
+    std::unordered_map<std::string, std::vector<float>> imatrix;
+    std::string error;
+    EXPECT_FALSE(load_legacy_imatrix(path, imatrix, &error));
+    EXPECT_FALSE(error.empty());
+    EXPECT_TRUE(imatrix.empty());
+    EXPECT_FALSE(load_legacy_imatrix("/nonexistent/imatrix.dat", imatrix));
+    unlink(path);
+}
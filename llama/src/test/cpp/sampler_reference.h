@@ -0,0 +1,110 @@
+#pragma once
+#include "fused_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <random>
+#include <vector>
+
+// Stage-by-stage copy of the llama.cpp samplers of new_sampler_chain (sampler_chain.h):
+// penalties -> top_k -> top_p -> min_p -> temp -> dist, on a full-vocabulary array, for
+// the tests and benchmarks that build without llama.cpp. Shared by fused_sampler_test and
+// the BM_Sample benchmark in jni_hot_path_bench; llama_sampler_parity_test checks the
+// fused sampler against the real chain.
+class reference_chain {
+public:
+    explicit reference_chain(const fused_sampler_params & p) : p_(p), rng_(p.seed) {}
+
+    int32_t sample(const float * logits, int32_t n_vocab) {
+        std::vector<fused_candidate> cur(n_vocab);
+        for (int32_t i = 0; i < n_vocab; ++i) cur[i] = { i, logits[i], 0.0f };
+        bool sorted = false;
+
+        if (p_.repeat_last_n > 0 && p_.repeat_penalty != 1.0f) {
+            for (auto & c : cur) {
+                auto it = counts_.find(c.id);
+                if (it == counts_.end()) continue;
+                if (c.logit <= 0) c.logit *= p_.repeat_penalty; else c.logit /= p_.repeat_penalty;
+            }
+        }
+        auto desc = [](const fused_candidate & a, const fused_candidate & b) {
+            return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+        };
+        if (p_.top_k > 0) {
+            const size_t k = std::min<size_t>(p_.top_k, cur.size());
+            std::partial_sort(cur.begin(), cur.begin() + k, cur.end(), desc);
+            cur.resize(k);
+        } else {
+            std::sort(cur.begin(), cur.end(), desc);
+        }
+        sorted = true;
+        if (p_.top_p < 1.0f) {
+            softmax(cur);
+            float cum = 0.0f;
+            size_t last = cur.size();
+            for (size_t i = 0; i < cur.size(); ++i) {
+                cum += cur[i].p;
+                if (cum >= p_.top_p && i + 1 >= 1) { last = i + 1; break; }
+            }
+            cur.resize(last);
+        }
+        if (p_.min_p > 0.0f && sorted) {
+            const float min_logit = cur[0].logit + logf(p_.min_p);
+            size_t i = 1;
+            for (; i < cur.size(); ++i) if (cur[i].logit < min_logit) break;
+            cur.resize(i);
+        }
+        if (p_.temp <= 0.0f) {
+            size_t max_i = 0;
+            float max_l = cur[0].logit;
+            for (size_t i = 1; i < cur.size(); ++i) {
+                if (cur[i].logit > max_l) { cur[max_i].logit = -INFINITY; max_i = i; max_l = cur[i].logit; }
+                else cur[i].logit = -INFINITY;
+            }
+        } else {
+            for (auto & c : cur) c.logit /= p_.temp;
+        }
+        const int32_t token = cur[dist(cur)].id;
+
+        if (p_.repeat_last_n > 0) {
+            counts_[token]++;
+            if (prev_.size() >= (size_t) p_.repeat_last_n) {
+                const int32_t old = prev_.front();
+                prev_.pop_front();
+                if (--counts_[old] == 0) counts_.erase(old);
+            }
+            prev_.push_back(token);
+        }
+        return token;
+    }
+
+private:
+    // llama_sampler_dist_apply: inverse CDF over the unnormalized probabilities.
+    size_t dist(std::vector<fused_candidate> & cur) {
+        if (cur.size() == 1) return 0;
+        const float max_l = cur[0].logit;
+        double sum_cum = 0.0;
+        for (auto & c : cur) { c.p = expf(c.logit - max_l); sum_cum += c.p; }
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        const double sum_tgt = sum_cum * u(rng_);
+        double sum_run = 0.0;
+        for (size_t i = 0; i < cur.size(); ++i) {
+            sum_run += cur[i].p;
+            if (sum_run >= sum_tgt) return i;
+        }
+        return cur.size() - 1;
+    }
+
+    static void softmax(std::vector<fused_candidate> & cur) {
+        const float max_l = cur[0].logit;
+        float cum = 0.0f;
+        for (auto & c : cur) { c.p = expf(c.logit - max_l); cum += c.p; }
+        for (auto & c : cur) c.p /= cum;
+    }
+
+    fused_sampler_params p_;
+    std::mt19937 rng_;
+    std::map<int32_t, int> counts_;
+    std::deque<int32_t> prev_;
+};
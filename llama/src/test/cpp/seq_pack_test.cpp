@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include "seq_pack.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+size_t tokens_in(const std::vector<size_t> & batch, const std::vector<size_t> & lengths) {
+    size_t n = 0;
+    for (size_t i : batch) n += lengths[i];
+    return n;
+}
+
+} // namespace
+
+TEST(SeqPackTest, RespectsTokenAndSequenceLimits) {
+    const std::vector<size_t> lengths = { 300, 120, 500, 80, 220, 40, 400, 90 };
+    const auto batches = pack_sequences(lengths, 512, 3);
+
+    std::vector<size_t> seen;
+    for (const auto & batch : batches) {
+        EXPECT_LE(batch.size(), 3u);
+        EXPECT_LE(tokens_in(batch, lengths), 512u);
+        seen.insert(seen.end(), batch.begin(), batch.end());
+    }
+    std::sort(seen.begin(), seen.end());
+    EXPECT_EQ(seen, std::vector<size_t>({0, 1, 2, 3, 4, 5, 6, 7}));
+    // 1750 tokens need at least 4 batches of 512
+    EXPECT_EQ(batches.size(), 4u);
+}
+
+TEST(SeqPackTest, FillsGapsWithShortSequences) {
+    const std::vector<size_t> lengths = { 10, 90, 10, 90 };
+    const auto batches = pack_sequences(lengths, 100, 8);
+    ASSERT_EQ(batches.size(), 2u);
+    EXPECT_EQ(batches[0], std::vector<size_t>({1, 0}));
+    EXPECT_EQ(batches[1], std::vector<size_t>({3, 2}));
+}
+
+TEST(SeqPackTest, OversizedSequenceGetsItsOwnBatch) {
+    const auto batches = pack_sequences({ 700, 20 }, 512, 4);
+    ASSERT_EQ(batches.size(), 2u);
+    EXPECT_EQ(batches[0], std::vector<size_t>({0}));
+    EXPECT_TRUE(pack_sequences({}, 512, 4).empty());
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#include <string>
+#include <sys/stat.h>
+
+// Scratch directory under /tmp for tests that read or write files, removed with all of its
+// contents when the fixture goes away. path() is empty when mkdtemp failed.
+class temp_dir {
+public:
+    explicit temp_dir(const std::string & prefix) {
+        std::string tmpl = "/tmp/" + prefix + "XXXXXX";
+        if (mkdtemp(&tmpl[0])) {
+            path_ = tmpl;
+        }
+    }
+    ~temp_dir() {
+        if (!path_.empty()) {
+            nftw(path_.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+    temp_dir(const temp_dir &) = delete;
+    temp_dir & operator=(const temp_dir &) = delete;
+
+    const std::string & path() const { return path_; }
+
+    // Creates `relative` and any missing parents, like mkdir -p. Returns the full path.
+    std::string make_dirs(const std::string & relative) const {
+        std::string dir = path_;
+        size_t pos = 0;
+        while (pos < relative.size()) {
+            size_t end = relative.find('/', pos);
+            if (end == std::string::npos) end = relative.size();
+            if (end > pos) {
+                dir += "/" + relative.substr(pos, end - pos);
+                mkdir(dir.c_str(), 0700);   // EEXIST is fine; other errors surface in the writes below
+            }
+            pos = end + 1;
+        }
+        return dir;
+    }
+
+private:
+    static int remove_entry(const char * path, const struct stat *, int, struct FTW *) {
+        return std::remove(path);
+    }
+
+    std::string path_;
+};
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+#include "temp_dir.h"
+#include "thermal_governor.h"
+#include <cmath>
+#include <fstream>
+#include <string>
+
+class ThermalGovernorTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_FALSE(tmp_.path().empty());
+        root_ = tmp_.path();
+    }
+
+    void set_temp(int zone, const std::string & value) {
+        const std::string dir = tmp_.make_dirs("class/thermal/thermal_zone" + std::to_string(zone));
+        std::ofstream(dir + "/temp") << value << "\n";
+    }
+    temp_dir    tmp_{"thermal_governor_test"};
+    std::string root_;
+};
+
+TEST_F(ThermalGovernorTest, ReadsHottestZone) {
+    EXPECT_TRUE(std::isnan(thermal_max_temp_c(root_)));
+    set_temp(0, "41000");
+    set_temp(1, "67500");
+    set_temp(2, "0");        // disconnected sensor
+    set_temp(3, "55");       // whole degrees
+    EXPECT_FLOAT_EQ(thermal_max_temp_c(root_), 67.5f);
+}
+
+TEST_F(ThermalGovernorTest, StopsAtFirstMissingZone) {
+    set_temp(0, "40000");
+    set_temp(2, "90000");
+    EXPECT_FLOAT_EQ(thermal_max_temp_c(root_), 40.0f);
+}
+
+namespace {
+
+// Feeds `n` tokens and returns how many level changes they caused.
+int feed(throttle_governor & gov, int n, double ms, float temp) {
+    int changes = 0;
+    for (int i = 0; i < n; ++i) {
+        changes += gov.on_token(ms, temp);
+    }
+    return changes;
+}
+
+} // namespace
+
+TEST(ThrottleGovernorTest, StaysAtFullSpeedWhenStable) {
+    throttle_governor gov(4, 64);
+    EXPECT_EQ(feed(gov, 200, 50.0, 45.0f), 0);
+    EXPECT_EQ(gov.level(), 0);
+    const auto l = gov.limits();
+    EXPECT_EQ(l.n_threads, 4);
+    EXPECT_EQ(l.ubatch, 64);
+    EXPECT_EQ(l.min_token_ms, 0.0);
+}
+
+TEST(ThrottleGovernorTest, StepsDownWhenHotAndRecoversWhenCool) {
+    throttle_governor gov(4, 64);
+    feed(gov, 20, 50.0, 50.0f);
+    EXPECT_EQ(gov.level(), 0);
+
+    feed(gov, 16, 50.0, 75.0f);
+    EXPECT_EQ(gov.level(), 1);
+    EXPECT_EQ(gov.limits().ubatch, 32);
+    feed(gov, 32, 50.0, 75.0f);
+    EXPECT_EQ(gov.level(), 3);
+    const auto l = gov.limits();
+    EXPECT_EQ(l.n_threads, 2);
+    EXPECT_EQ(l.ubatch, 16);
+    EXPECT_NEAR(l.min_token_ms, 80.0, 1e-6);
+
+    // between the thresholds: hold
+    EXPECT_EQ(feed(gov, 100, 50.0, 65.0f), 0);
+    EXPECT_EQ(gov.level(), 3);
+
+    feed(gov, 200, 50.0, 50.0f);
+    EXPECT_EQ(gov.level(), 0);
+}
+
+TEST(ThrottleGovernorTest, StepsDownOnLatencyTrend) {
+    throttle_governor gov(4, 64);
+    feed(gov, 40, 50.0, NAN);
+    EXPECT_EQ(gov.level(), 0);
+    feed(gov, 20, 100.0, NAN);   // the OS clocked the cores down
+    EXPECT_GE(gov.level(), 1);
+}
+
+TEST(ThrottleGovernorTest, FewerThreadsAloneDoNotLookLikeDegradation) {
+    throttle_governor gov(4, 64);
+    feed(gov, 20, 40.0, 50.0f);
+    gov.on_stall();
+    EXPECT_EQ(gov.level(), 3);
+    // half the threads: twice the latency is what level 3 should cost, so it recovers
+    feed(gov, 40, 80.0, 50.0f);
+    EXPECT_LT(gov.level(), 3);
+}
+
+TEST(ThrottleGovernorTest, IgnoresSpikesDuringWarmup) {
+    throttle_governor gov(4, 64);
+    EXPECT_EQ(feed(gov, 8, 500.0, NAN), 0);
+    EXPECT_EQ(gov.level(), 0);
+}
@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+#include "token_logprobs.h"
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace {
+
+std::vector<float> random_logits(int32_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+    std::vector<float> v(n);
+    for (auto & x : v) x = dist(rng);
+    return v;
+}
+
+template <typename T>
+T read_at(const std::vector<uint8_t> & mem, size_t off) {
+    T v;
+    std::memcpy(&v, mem.data() + off, sizeof(T));
+    return v;
+}
+
+} // namespace
+
+TEST(TokenLogprobsTest, LogsumexpMatchesDouble) {
+    for (int32_t n : { 1, 7, 32, 1000 }) {
+        auto logits = random_logits(n, n);
+        logits[0] = 80.0f;   // would overflow expf without the max shift
+        double sum = 0.0;
+        for (float x : logits) sum += std::exp((double) x - 80.0);
+        EXPECT_NEAR(logsumexp(logits.data(), n), 80.0 + std::log(sum), 1e-4) << n;
+    }
+}
+
+TEST(TokenLogprobsTest, SelectsTopLogitsBestFirst) {
+    auto logits = random_logits(5000, 7);
+    logits[10] = logits[20] = 50.0f;   // tie: lower id first
+    std::vector<logprob_entry> top;
+    select_top_logits(logits.data(), (int32_t) logits.size(), 8, top);
+    ASSERT_EQ(top.size(), 8u);
+    EXPECT_EQ(top[0].id, 10);
+    EXPECT_EQ(top[1].id, 20);
+
+    std::vector<int32_t> ids(logits.size());
+    for (size_t i = 0; i < ids.size(); ++i) ids[i] = (int32_t) i;
+    std::partial_sort(ids.begin(), ids.begin() + 8, ids.end(), [&](int32_t a, int32_t b) {
+        return logits[a] > logits[b] || (logits[a] == logits[b] && a < b);
+    });
+    for (size_t i = 0; i < 8; ++i) {
+        EXPECT_EQ(top[i].id, ids[i]);
+        EXPECT_EQ(top[i].logprob, logits[ids[i]]);
+    }
+
+    select_top_logits(logits.data(), 3, 8, top);
+    EXPECT_EQ(top.size(), 3u);
+}
+
+TEST(TokenLogprobsTest, FusedSamplerKeepsTheSameTopIds) {
+    fused_sampler_params p;
+    p.top_k = 40;
+    p.top_p = 0.9f;
+    fused_sampler s(p);
+    s.set_keep_top(5);
+    auto logits = random_logits(32000, 3);
+    s.sample(logits.data(), (int32_t) logits.size());
+
+    std::vector<logprob_entry> top;
+    select_top_logits(logits.data(), (int32_t) logits.size(), 5, top);
+    ASSERT_EQ(s.top_ids().size(), 5u);
+    for (size_t i = 0; i < 5; ++i) {
+        EXPECT_EQ(s.top_ids()[i], top[i].id);
+    }
+}
+
+TEST(TokenLogprobsTest, RingWrapsInPlace) {
+    const uint32_t top_k = 2;
+    std::vector<uint8_t> mem(logprob_ring::bytes_for(3, top_k) + 5);   // spare bytes are ignored
+    logprob_ring ring;
+    EXPECT_FALSE(ring.attach(mem.data(), logprob_ring::HEADER + 4, top_k));
+    ASSERT_TRUE(ring.attach(mem.data(), mem.size(), top_k));
+    EXPECT_EQ(read_at<uint32_t>(mem, 0), logprob_ring::MAGIC);
+    EXPECT_EQ(read_at<uint32_t>(mem, 8), 3u);
+    EXPECT_EQ(read_at<uint32_t>(mem, 12), top_k);
+    EXPECT_EQ(read_at<uint32_t>(mem, 16), 28u);
+
+    const logprob_entry alts[3] = { { 7, -0.5f }, { 8, -1.5f }, { 9, -2.5f } };
+    for (int32_t t = 0; t < 4; ++t) {
+        ring.push(100 + t, -0.25f * t, alts, t == 1 ? 1 : 3);
+    }
+    EXPECT_EQ(read_at<uint64_t>(mem, 24), 4u);
+    const size_t r0 = logprob_ring::HEADER;   // record 3 overwrote slot 0
+    EXPECT_EQ(read_at<int32_t>(mem, r0), 103);
+    EXPECT_EQ(read_at<float>(mem, r0 + 4), -0.75f);
+    EXPECT_EQ(read_at<int32_t>(mem, r0 + 8), 2);   // clamped to top_k
+    EXPECT_EQ(read_at<int32_t>(mem, r0 + 12 + 8), 8);
+    const size_t r1 = r0 + 28;
+    EXPECT_EQ(read_at<int32_t>(mem, r1), 101);
+    EXPECT_EQ(read_at<int32_t>(mem, r1 + 8), 1);
+
+    ring.detach();
+    ring.push(1, 0.0f, alts, 0);
+    EXPECT_EQ(read_at<uint64_t>(mem, 24), 4u);
+}
+
+TEST(TokenLogprobsTest, PendingRecordsReachTheRingOnlyWhenEmitted) {
+    std::vector<uint64_t> mem(logprob_ring::bytes_for(4, 1) / sizeof(uint64_t) + 1);
+    logprob_ring ring;
+    EXPECT_FALSE(ring.attach(reinterpret_cast<uint8_t *>(mem.data()) + 4, mem.size() * sizeof(uint64_t) - 4, 1));   // misaligned
+    ASSERT_TRUE(ring.attach(mem.data(), mem.size() * sizeof(uint64_t), 1));
+
+    // a verification step sampled two accepted drafts and the token after them
+    const logprob_entry alt = { 5, -0.1f };
+    logprob_pending pending;
+    pending.push(10, -0.1f, &alt, 1);
+    pending.push(11, -0.2f, &alt, 1);
+    pending.push(12, -0.3f, &alt, 1);
+    EXPECT_EQ(ring.written(), 0u);
+
+    EXPECT_TRUE(pending.emit(10, ring));
+    EXPECT_TRUE(pending.emit(11, ring));
+    EXPECT_EQ(ring.written(), 2u);   // 12 hit the length limit: never emitted, never recorded
+    EXPECT_EQ(pending.size(), 1u);
+
+    EXPECT_FALSE(pending.emit(13, ring));   // out of step: dropped
+    EXPECT_EQ(pending.size(), 0u);
+    pending.push(13, -0.4f, &alt, 1);
+    EXPECT_TRUE(pending.emit(13, ring));
+    EXPECT_EQ(ring.written(), 3u);
+    const auto * bytes = reinterpret_cast<const uint8_t *>(mem.data());
+    int32_t token;
+    std::memcpy(&token, bytes + logprob_ring::HEADER + 2 * logprob_ring::record_bytes(1), 4);
+    EXPECT_EQ(token, 13);
+}
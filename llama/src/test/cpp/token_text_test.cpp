@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+#include "token_text.h"
+#include <string>
+
+TEST(TokenTextTest, HoldsBackIncompleteUtf8) {
+    EXPECT_TRUE(is_valid_utf8("caf\xc3\xa9 \xf0\x9f\x99\x82"));
+    EXPECT_TRUE(is_valid_utf8(""));
+    EXPECT_TRUE(is_valid_utf8(nullptr));
+    EXPECT_FALSE(is_valid_utf8("caf\xc3"));           // first byte of a two-byte character
+    EXPECT_FALSE(is_valid_utf8("\xf0\x9f\x99"));      // emoji cut short
+    EXPECT_FALSE(is_valid_utf8("\x80"));
+}
+
+TEST(TokenTextTest, StripsThinkBlocksAndStrayTags) {
+    std::string text = "<think>plan</think>Answer<think>more</think>!";
+    strip_think_tags(text);
+    EXPECT_EQ(text, "Answer!");
+
+    text = "a</think>b<think>c";   // unterminated block: only the tags go
+    strip_think_tags(text);
+    EXPECT_EQ(text, "abc");
+
+    EXPECT_TRUE(has_thinking_markers("Step 1"));
+    EXPECT_FALSE(has_thinking_markers(" answer"));
+}